@@ -33,8 +33,11 @@
 
 #include <terminal/terminal-app.h>
 #include <terminal/terminal-private.h>
+#include <terminal/terminal-screen.h>
 
 #include <terminal/terminal-gdbus.h>
+#include <terminal/terminal-socket.h>
+#include <terminal/terminal-spawn-helper.h>
 
 
 
@@ -105,12 +108,17 @@ usage (void)
 
   g_print ("%s:\n"
            "  -h, --help; -V, --version; --disable-server; --color-table;\n"
-           "  --default-display=%s; --default-working-directory=%s\n\n",
+           "  --default-display=%s; --default-working-directory=%s;\n"
+           "  --save-contents=%s; --save-format=%s ('text', 'sgr', 'html')\n\n",
            _("General Options"),
            /* parameter of --default-display */
            _("display"),
            /* parameter of --default-working-directory */
-           _("directory"));
+           _("directory"),
+           /* parameter of --save-contents */
+           _("file"),
+           /* parameter of --save-format */
+           _("format"));
 
   g_print ("%s:\n"
            "  --tab; --window\n\n",
@@ -169,6 +177,9 @@ main (int argc, char **argv)
   gboolean         show_version = FALSE;
   gboolean         show_colors = FALSE;
   gboolean         disable_server = FALSE;
+  gboolean         save_contents = FALSE;
+  gchar           *save_filename = NULL;
+  gchar           *save_format = NULL;
   TerminalApp     *app;
   const gchar     *startup_id;
   const gchar     *display;
@@ -176,7 +187,6 @@ main (int argc, char **argv)
   gchar          **nargv;
   gint             nargc;
   gint             n;
-  const gchar     *msg;
 
   /* install required signal handlers */
   signal (SIGPIPE, SIG_IGN);
@@ -197,7 +207,8 @@ main (int argc, char **argv)
 #endif
 
   /* parse some options we need in main, not the windows attrs */
-  terminal_options_parse (argc, argv, &show_help, &show_version, &show_colors, &disable_server);
+  terminal_options_parse (argc, argv, &show_help, &show_version, &show_colors, &disable_server,
+                          &save_contents, &save_filename, &save_format);
 
   if (G_UNLIKELY (show_version))
     {
@@ -222,6 +233,28 @@ main (int argc, char **argv)
       usage ();
       return EXIT_SUCCESS;
     }
+  else if (G_UNLIKELY (save_contents))
+    {
+      /* write a tab of the running instance, without opening a window */
+      if (save_filename == NULL)
+        {
+          g_printerr ("%s: %s\n", PACKAGE_NAME,
+                      _("Option \"--save-contents\" requires specifying "
+                        "the file to save to as its parameter"));
+          return EXIT_FAILURE;
+        }
+
+      if (!terminal_gdbus_invoke_save (save_filename, save_format, &error))
+        {
+          /* skip the GDBus prefix, if the error came from D-Bus */
+          g_dbus_error_strip_remote_error (error);
+          g_printerr ("%s: %s\n", PACKAGE_NAME, error->message);
+          g_error_free (error);
+          return EXIT_FAILURE;
+        }
+
+      return EXIT_SUCCESS;
+    }
 
   /* create a copy of the standard arguments with our additional stuff */
   nargv = g_new (gchar*, argc + 5); nargc = 0;
@@ -235,6 +268,7 @@ main (int argc, char **argv)
     {
       nargv[nargc++] = g_strdup_printf ("--startup-id=%s", startup_id);
       g_unsetenv ("DESKTOP_STARTUP_ID");
+      terminal_screen_invalidate_environment ();
     }
 
   /* append default display if given */
@@ -256,8 +290,12 @@ main (int argc, char **argv)
 
   if (!disable_server)
     {
-      /* try to connect to an existing Terminal service */
-      if (terminal_gdbus_invoke_launch (nargc, nargv, &error))
+      /* try to connect to an existing Terminal service, the launch
+       * socket saves the session bus round trip if it is there; it
+       * only sets an error once the request was sent, on any other
+       * failure D-Bus is tried */
+      if (terminal_socket_invoke_launch (nargc, nargv, &error)
+          || (error == NULL && terminal_gdbus_invoke_launch (nargc, nargv, &error)))
         {
           return EXIT_SUCCESS;
         }
@@ -277,15 +315,20 @@ main (int argc, char **argv)
             }
           else if (g_error_matches (error, TERMINAL_ERROR, TERMINAL_ERROR_OPTIONS))
             {
-              /* skip the GDBus prefix */
-              msg = strchr (error->message, ' ');
-              if (G_LIKELY (msg != NULL))
-                msg++;
-              else
-                msg = error->message;
+              /* skip the GDBus prefix, if the error came from D-Bus */
+              g_dbus_error_strip_remote_error (error);
 
               /* options were not parsed succesfully, don't try that again below */
-              g_printerr ("%s: %s\n", PACKAGE_NAME, msg);
+              g_printerr ("%s: %s\n", PACKAGE_NAME, error->message);
+              g_error_free (error);
+              g_strfreev (nargv);
+              return EXIT_FAILURE;
+            }
+          else if (g_error_matches (error, TERMINAL_ERROR, TERMINAL_ERROR_NO_REPLY))
+            {
+              /* the service may still open the windows, asking again over
+               * D-Bus or in a new service would open them twice */
+              g_printerr ("%s: %s\n", PACKAGE_NAME, error->message);
               g_error_free (error);
               g_strfreev (nargv);
               return EXIT_FAILURE;
@@ -302,6 +345,19 @@ main (int argc, char **argv)
         }
     }
 
+  if (!disable_server)
+    {
+      /* start the spawn helper while this process is still small, the
+       * server forks its children from there */
+      if (!terminal_spawn_helper_start (&error))
+        {
+#ifdef G_ENABLE_DEBUG
+          g_debug ("%s", error->message);
+#endif
+          g_clear_error (&error);
+        }
+    }
+
   /* initialize Gtk+ */
   gtk_init (&argc, &argv);
 
@@ -317,6 +373,15 @@ main (int argc, char **argv)
           g_printerr (_("Unable to register terminal service: %s\n"), error->message);
           g_clear_error (&error);
         }
+
+      /* the launch socket is optional, D-Bus still works without it */
+      if (!terminal_socket_register_service (app, &error))
+        {
+#ifdef G_ENABLE_DEBUG
+          g_debug ("Unable to register the launch socket: %s", error->message);
+#endif
+          g_clear_error (&error);
+        }
     }
 
   if (!terminal_app_process (app, nargv, nargc, &error))
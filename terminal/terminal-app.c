@@ -46,11 +46,17 @@
 #include <terminal/terminal-config.h>
 #include <terminal/terminal-preferences.h>
 #include <terminal/terminal-private.h>
+#include <terminal/terminal-scrollback-budget.h>
+#include <terminal/terminal-shell-pool.h>
 #include <terminal/terminal-window.h>
 #include <terminal/terminal-window-dropdown.h>
 
 #define ACCEL_MAP_PATH "xfce4/terminal/accels.scm"
 
+/* time spent opening queued windows before giving the main loop
+ * a chance to draw a frame, in microseconds */
+#define PROCESS_BATCH_TIME (G_USEC_PER_SEC / 120)
+
 
 
 static void     terminal_app_finalize                 (GObject            *object);
@@ -74,8 +80,13 @@ static void     terminal_app_window_destroyed         (GtkWidget          *windo
                                                        TerminalApp        *app);
 static void     terminal_app_save_yourself            (XfceSMClient       *client,
                                                        TerminalApp        *app);
+static gboolean terminal_app_defer_tab                (TerminalApp        *app,
+                                                       TerminalWindowAttr *attr,
+                                                       TerminalTabAttr    *tab_attr);
 static void     terminal_app_open_window              (TerminalApp        *app,
                                                        TerminalWindowAttr *attr);
+static gboolean terminal_app_process_idle             (gpointer            user_data);
+static void     terminal_app_process_idle_destroy     (gpointer            user_data);
 
 
 
@@ -88,6 +99,8 @@ struct _TerminalApp
 {
   GObject              parent_instance;
   TerminalPreferences *preferences;
+  TerminalShellPool   *shell_pool;
+  TerminalScrollbackBudget *scrollback_budget;
   XfceSMClient        *session_client;
   gchar               *initial_menu_bar_accel;
   GSList              *windows;
@@ -95,6 +108,10 @@ struct _TerminalApp
   guint                accel_map_load_id;
   guint                accel_map_save_id;
   GtkAccelMap         *accel_map;
+
+  /* window attributes of requests that are not opened yet */
+  GQueue               pending_attrs;
+  guint                process_idle_id;
 };
 
 
@@ -144,6 +161,10 @@ terminal_app_init (TerminalApp *app)
   terminal_app_update_accels (app);
   terminal_app_update_mnemonics (app);
 
+  /* keep the shell pool around for the lifetime of the app */
+  app->shell_pool = terminal_shell_pool_get ();
+  app->scrollback_budget = terminal_scrollback_budget_get ();
+
   /* schedule accel map load and update windows when finished */
   app->accel_map_load_id = g_idle_add_full (G_PRIORITY_LOW, terminal_app_accel_map_load, app,
                                             terminal_app_update_windows_accels);
@@ -157,6 +178,12 @@ terminal_app_finalize (GObject *object)
   TerminalApp *app = TERMINAL_APP (object);
   GSList      *lp;
 
+  /* drop requests that were not processed */
+  if (G_UNLIKELY (app->process_idle_id != 0))
+    g_source_remove (app->process_idle_id);
+  g_queue_foreach (&app->pending_attrs, (GFunc) terminal_window_attr_free, NULL);
+  g_queue_clear (&app->pending_attrs);
+
   /* stop accel map stuff */
   if (G_UNLIKELY (app->accel_map_load_id != 0))
     g_source_remove (app->accel_map_load_id);
@@ -182,6 +209,9 @@ terminal_app_finalize (GObject *object)
   g_signal_handlers_disconnect_by_func (G_OBJECT (app->preferences), G_CALLBACK (terminal_app_update_mnemonics), app);
   g_object_unref (G_OBJECT (app->preferences));
 
+  g_object_unref (G_OBJECT (app->shell_pool));
+  g_object_unref (G_OBJECT (app->scrollback_budget));
+
   if (app->initial_menu_bar_accel != NULL)
     g_free (app->initial_menu_bar_accel);
 
@@ -517,7 +547,8 @@ terminal_app_window_destroyed (GtkWidget   *window,
 
   app->windows = g_slist_remove (app->windows, window);
 
-  if (G_UNLIKELY (app->windows == NULL))
+  /* queued requests will open new windows soon */
+  if (G_UNLIKELY (app->windows == NULL && g_queue_is_empty (&app->pending_attrs)))
     gtk_main_quit ();
 }
 
@@ -672,6 +703,33 @@ terminal_app_find_screen_by_name (const gchar *display_name)
 
 
 
+static gboolean
+terminal_app_defer_tab (TerminalApp        *app,
+                        TerminalWindowAttr *attr,
+                        TerminalTabAttr    *tab_attr)
+{
+  TerminalRestoreTabs restore_tabs;
+
+  if (!attr->session_restore)
+    return FALSE;
+
+  g_object_get (G_OBJECT (app->preferences), "misc-restore-tabs", &restore_tabs, NULL);
+  switch (restore_tabs)
+    {
+    case TERMINAL_RESTORE_TABS_LAZY:
+      return TRUE;
+
+    case TERMINAL_RESTORE_TABS_LAZY_SHELLS:
+      /* commands and held tabs may be expected to run in the background */
+      return tab_attr->command == NULL && !tab_attr->hold;
+
+    default:
+      return FALSE;
+    }
+}
+
+
+
 static void
 terminal_app_open_window (TerminalApp        *app,
                           TerminalWindowAttr *attr)
@@ -681,6 +739,7 @@ terminal_app_open_window (TerminalApp        *app,
   GdkScreen       *screen;
   gchar           *geometry;
   GSList          *lp;
+  GSList          *terminals = NULL;
   gboolean         reuse_window = FALSE;
   GdkDisplay      *attr_display;
   gint             attr_screen_num;
@@ -827,15 +886,22 @@ terminal_app_open_window (TerminalApp        *app,
 #endif
     }
 
-  /* add the tabs */
+  /* add all the tabs first and rebuild the menus once */
+  terminal_window_freeze_tabs_menu (TERMINAL_WINDOW (window));
   for (lp = attr->tabs; lp != NULL; lp = lp->next)
     {
       terminal = terminal_screen_new ((TerminalTabAttr *) lp->data,
                                       width,
                                       height);
       terminal_window_add (TERMINAL_WINDOW (window), terminal);
-      terminal_screen_launch_child (terminal);
+
+      /* tabs of a restored session may start when they are shown */
+      if (terminal_app_defer_tab (app, attr, lp->data))
+        terminal_screen_defer_child (terminal);
+      else
+        terminals = g_slist_prepend (terminals, terminal);
     }
+  terminal_window_thaw_tabs_menu (TERMINAL_WINDOW (window));
 
   if (!attr->drop_down)
     {
@@ -890,6 +956,47 @@ terminal_app_open_window (TerminalApp        *app,
       else
         gtk_widget_show (window);
     }
+
+  /* start the children once the window is shown, spawning is
+   * asynchronous so all tabs start at the same time */
+  terminals = g_slist_reverse (terminals);
+  for (lp = terminals; lp != NULL; lp = lp->next)
+    terminal_screen_launch_child (lp->data);
+  g_slist_free (terminals);
+}
+
+
+
+static gboolean
+terminal_app_process_idle (gpointer user_data)
+{
+  TerminalApp        *app = TERMINAL_APP (user_data);
+  TerminalWindowAttr *attr;
+  gint64              end_time;
+
+  /* open at least one window, then continue until the batch time
+   * is used up and let gtk draw the new windows in between */
+  end_time = g_get_monotonic_time () + PROCESS_BATCH_TIME;
+  do
+    {
+      attr = g_queue_pop_head (&app->pending_attrs);
+      if (G_UNLIKELY (attr == NULL))
+        break;
+
+      terminal_app_open_window (app, attr);
+      terminal_window_attr_free (attr);
+    }
+  while (g_get_monotonic_time () < end_time);
+
+  return !g_queue_is_empty (&app->pending_attrs);
+}
+
+
+
+static void
+terminal_app_process_idle_destroy (gpointer user_data)
+{
+  TERMINAL_APP (user_data)->process_idle_id = 0;
 }
 
 
@@ -914,7 +1021,9 @@ terminal_app_process (TerminalApp  *app,
   TerminalWindowAttr *attr;
   GError             *err = NULL;
 
-  attrs = terminal_window_attr_parse (argc, argv, app->windows != NULL, error);
+  attrs = terminal_window_attr_parse (argc, argv,
+                                      app->windows != NULL || !g_queue_is_empty (&app->pending_attrs),
+                                      error);
   if (G_UNLIKELY (attrs == NULL))
     return FALSE;
 
@@ -931,6 +1040,11 @@ terminal_app_process (TerminalApp  *app,
         }
     }
 
+  /* all windows of the command line belong to the restored session */
+  if (sm_client_id != NULL)
+    for (lp = attrs; lp != NULL; lp = lp->next)
+      ((TerminalWindowAttr *) lp->data)->session_restore = TRUE;
+
   if (G_LIKELY (app->session_client == NULL))
     {
       app->session_client = xfce_sm_client_get_full (XFCE_SM_CLIENT_RESTART_NORMAL,
@@ -953,16 +1067,54 @@ terminal_app_process (TerminalApp  *app,
         }
     }
 
+  /* the options are valid, open the windows from the main loop so
+   * the caller gets an answer right away */
+  terminal_app_open_windows (app, attrs);
+
+  g_free (sm_client_id);
+
+  return TRUE;
+}
+
+
+
+/**
+ * terminal_app_open_windows:
+ * @app   : A #TerminalApp.
+ * @attrs : List of #TerminalWindowAttr, the app takes ownership.
+ *
+ * Queues windows to be opened from the main loop.
+ **/
+void
+terminal_app_open_windows (TerminalApp *app,
+                           GSList      *attrs)
+{
+  GSList *lp;
+
+  terminal_return_if_fail (TERMINAL_IS_APP (app));
+
   for (lp = attrs; lp != NULL; lp = lp->next)
-    {
-      attr = lp->data;
+    g_queue_push_tail (&app->pending_attrs, lp->data);
+  g_slist_free (attrs);
 
-      terminal_app_open_window (app, attr);
-      terminal_window_attr_free (attr);
+  if (app->process_idle_id == 0)
+    {
+      app->process_idle_id = g_idle_add_full (G_PRIORITY_DEFAULT_IDLE, terminal_app_process_idle,
+                                              app, terminal_app_process_idle_destroy);
     }
+}
 
-  g_slist_free (attrs);
-  g_free (sm_client_id);
 
-  return TRUE;
+
+/**
+ * terminal_app_get_windows:
+ * @app : A #TerminalApp.
+ *
+ * Return value : The open windows, owned by @app.
+ **/
+GSList *
+terminal_app_get_windows (TerminalApp *app)
+{
+  terminal_return_val_if_fail (TERMINAL_IS_APP (app), NULL);
+  return app->windows;
 }
@@ -41,6 +41,8 @@ typedef enum
   TERMINAL_ERROR_OPTIONS,
   /* general failure */
   TERMINAL_ERROR_FAILED,
+  /* the service got the request, but did not reply */
+  TERMINAL_ERROR_NO_REPLY,
 } TerminalError;
 
 
@@ -59,6 +61,11 @@ gboolean     terminal_app_process             (TerminalApp        *app,
                                                gint                argc,
                                                GError            **error);
 
+void         terminal_app_open_windows        (TerminalApp        *app,
+                                               GSList             *attrs);
+
+GSList      *terminal_app_get_windows         (TerminalApp        *app);
+
 G_END_DECLS
 
 #endif /* !TERMINAL_APP_H */
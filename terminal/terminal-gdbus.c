@@ -32,6 +32,8 @@
 #include <terminal/terminal-config.h>
 #include <terminal/terminal-gdbus.h>
 #include <terminal/terminal-private.h>
+#include <terminal/terminal-screen.h>
+#include <terminal/terminal-window.h>
 
 
 
@@ -43,12 +45,61 @@ static const gchar terminal_gdbus_introspection_xml[] =
         "<arg type='ay' name='display-name' direction='in'/>"
         "<arg type='aay' name='argv' direction='in'/>"
       "</method>"
+      "<method name='" TERMINAL_DBUS_METHOD_OPEN "'>"
+        "<arg type='u' name='uid' direction='in'/>"
+        "<arg type='ay' name='display-name' direction='in'/>"
+        "<arg type='aa{sv}' name='windows' direction='in'/>"
+      "</method>"
+      "<method name='" TERMINAL_DBUS_METHOD_SAVE "'>"
+        "<arg type='u' name='uid' direction='in'/>"
+        "<arg type='ay' name='display-name' direction='in'/>"
+        "<arg type='u' name='tab' direction='in'/>"
+        "<arg type='s' name='uri' direction='in'/>"
+        "<arg type='s' name='format' direction='in'/>"
+        "<arg type='b' name='compress' direction='in'/>"
+      "</method>"
     "</interface>"
   "</node>";
 
+/* read-only object of each tab below TERMINAL_DBUS_TABS_PATH */
+static const gchar terminal_gdbus_statistics_xml[] =
+  "<node>"
+    "<interface name='" TERMINAL_DBUS_STATISTICS "'>"
+      "<property type='s' name='Title' access='read'/>"
+      "<property type='s' name='WindowRole' access='read'/>"
+      "<property type='t' name='BytesWritten' access='read'/>"
+      "<property type='t' name='ContentsChanged' access='read'/>"
+      "<property type='u' name='ContentsChangedRate' access='read'/>"
+      "<property type='x' name='DrawTime' access='read'/>"
+      "<property type='x' name='DrawTimeMax' access='read'/>"
+      "<property type='x' name='IdleTime' access='read'/>"
+    "</interface>"
+  "</node>";
+
+static GDBusInterfaceInfo *terminal_gdbus_statistics_info = NULL;
+
+/* names of TerminalSaveFormat for SaveContents and --save-format */
+static const gchar *terminal_gdbus_save_formats[] =
+{
+  "text", /* TERMINAL_SAVE_FORMAT_TEXT */
+  "sgr",  /* TERMINAL_SAVE_FORMAT_SGR */
+  "html"  /* TERMINAL_SAVE_FORMAT_HTML */
+};
+
+
 
+static TerminalScreen *terminal_gdbus_find_screen (TerminalApp  *app,
+                                                   guint         session_id,
+                                                   GtkWindow   **window_return);
 
-static gchar *
+
+
+/**
+ * terminal_gdbus_display_name:
+ *
+ * Return value : the DISPLAY without screen number, free with g_free().
+ **/
+gchar *
 terminal_gdbus_display_name (void)
 {
   const gchar *display_name;
@@ -57,7 +108,7 @@ terminal_gdbus_display_name (void)
 
   display_name = g_getenv ("DISPLAY");
   if (G_UNLIKELY (display_name == NULL))
-    return "";
+    return g_strdup ("");
 
   name = g_strdup (display_name);
   period = strrchr (name, '.');
@@ -69,6 +120,178 @@ terminal_gdbus_display_name (void)
 
 
 
+static gboolean
+terminal_gdbus_check_caller (guint32       uid,
+                             const gchar  *display_name,
+                             GError      **error)
+{
+  gchar    *display_name2;
+  gboolean  succeed = FALSE;
+
+  display_name2 = terminal_gdbus_display_name ();
+
+  if (uid != getuid ())
+    {
+      g_set_error_literal (error, TERMINAL_ERROR, TERMINAL_ERROR_USER_MISMATCH,
+                           _("User id mismatch"));
+    }
+  else if (g_strcmp0 (display_name, display_name2) != 0)
+    {
+      g_set_error_literal (error, TERMINAL_ERROR, TERMINAL_ERROR_DISPLAY_MISMATCH,
+                           _("Display mismatch"));
+    }
+  else
+    {
+      succeed = TRUE;
+    }
+
+  g_free (display_name2);
+
+  return succeed;
+}
+
+
+
+/**
+ * terminal_gdbus_process_launch:
+ * @app          : A #TerminalApp.
+ * @uid          : user id of the caller.
+ * @display_name : display name of the caller.
+ * @argv         : arguments of the caller.
+ * @error        : return location for errors or %NULL.
+ *
+ * Handles a Launch request from another instance, no matter how it was
+ * delivered.
+ *
+ * Return value : %TRUE on success, %FALSE with @error set otherwise.
+ **/
+gboolean
+terminal_gdbus_process_launch (TerminalApp  *app,
+                               guint32       uid,
+                               const gchar  *display_name,
+                               gchar       **argv,
+                               GError      **error)
+{
+  GError   *err = NULL;
+  gboolean  succeed = FALSE;
+
+  terminal_return_val_if_fail (TERMINAL_IS_APP (app), FALSE);
+
+  if (!terminal_gdbus_check_caller (uid, display_name, error))
+    {
+      /* not our user or display */
+    }
+  else if (!terminal_app_process (app, argv, g_strv_length (argv), &err))
+    {
+      g_set_error (error, TERMINAL_ERROR, TERMINAL_ERROR_OPTIONS, "%s", err->message);
+      g_error_free (err);
+    }
+  else
+    {
+      /* everything went fine */
+      succeed = TRUE;
+    }
+
+  return succeed;
+}
+
+
+
+static void
+terminal_gdbus_save_contents_done (GObject      *source,
+                                   GAsyncResult *result,
+                                   gpointer      user_data)
+{
+  GDBusMethodInvocation *invocation = G_DBUS_METHOD_INVOCATION (user_data);
+  GError                *error = NULL;
+
+  /* the caller waits until the file is written */
+  if (terminal_screen_save_contents_finish (TERMINAL_SCREEN (source), result, &error))
+    {
+      g_dbus_method_invocation_return_value (invocation, NULL);
+    }
+  else
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      g_error_free (error);
+    }
+}
+
+
+
+static void
+terminal_gdbus_save_contents (TerminalApp           *app,
+                              GVariant              *parameters,
+                              GDBusMethodInvocation *invocation)
+{
+  TerminalScreen *screen = NULL;
+  GSList         *windows, *lp;
+  GFile          *file;
+  GError         *error = NULL;
+  guint32         uid;
+  gchar          *display_name;
+  guint32         tab;
+  const gchar    *uri;
+  const gchar    *format_name;
+  gboolean        compress;
+  guint           format;
+
+  g_variant_get (parameters, "(u^ayu&s&sb)", &uid, &display_name,
+                 &tab, &uri, &format_name, &compress);
+
+  for (format = 0; format < G_N_ELEMENTS (terminal_gdbus_save_formats); format++)
+    if (g_strcmp0 (format_name, terminal_gdbus_save_formats[format]) == 0)
+      break;
+
+  if (!terminal_gdbus_check_caller (uid, display_name, &error))
+    {
+      /* not our user or display */
+    }
+  else if (format >= G_N_ELEMENTS (terminal_gdbus_save_formats))
+    {
+      g_set_error (&error, TERMINAL_ERROR, TERMINAL_ERROR_OPTIONS,
+                   _("Unknown save format \"%s\""), format_name);
+    }
+  else if (tab != 0)
+    {
+      screen = terminal_gdbus_find_screen (app, tab, NULL);
+    }
+  else
+    {
+      /* the active tab of the focused window, or of the last one */
+      windows = terminal_app_get_windows (app);
+      for (lp = windows; lp != NULL; lp = lp->next)
+        if (gtk_window_has_toplevel_focus (GTK_WINDOW (lp->data)))
+          break;
+      if (lp == NULL)
+        lp = windows;
+
+      if (lp != NULL)
+        screen = terminal_window_get_active (lp->data);
+    }
+
+  if (error == NULL && screen == NULL)
+    g_set_error_literal (&error, TERMINAL_ERROR, TERMINAL_ERROR_FAILED, _("No tab to save"));
+
+  if (G_UNLIKELY (error != NULL))
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      g_error_free (error);
+    }
+  else
+    {
+      file = g_file_new_for_uri (uri);
+      terminal_screen_save_contents_async (screen, file, format, compress,
+                                           terminal_gdbus_save_contents_done,
+                                           invocation);
+      g_object_unref (file);
+    }
+
+  g_free (display_name);
+}
+
+
+
 static void
 terminal_gdbus_method_call (GDBusConnection       *connection,
                             const gchar           *sender,
@@ -84,7 +307,8 @@ terminal_gdbus_method_call (GDBusConnection       *connection,
   gchar        *display_name = NULL;
   gchar       **argv = NULL;
   GError       *error = NULL;
-  gchar        *display_name2;
+  GVariant     *windows;
+  GSList       *attrs;
 
   terminal_return_if_fail (TERMINAL_IS_APP (app));
   terminal_return_if_fail (!g_strcmp0 (object_path, TERMINAL_DBUS_PATH));
@@ -95,36 +319,51 @@ terminal_gdbus_method_call (GDBusConnection       *connection,
       /* get paramenters */
       g_variant_get (parameters, "(u^ay^aay)", &uid, &display_name, &argv);
 
-      display_name2 = terminal_gdbus_display_name ();
+      if (!terminal_gdbus_process_launch (app, uid, display_name, argv, &error))
+        {
+          g_dbus_method_invocation_return_gerror (invocation, error);
+          g_error_free (error);
+        }
+      else
+        {
+          /* everything went fine */
+          g_dbus_method_invocation_return_value (invocation, NULL);
+        }
+
+      g_free (display_name);
+      g_strfreev (argv);
+    }
+  else if (g_strcmp0 (method_name, TERMINAL_DBUS_METHOD_OPEN) == 0)
+    {
+      /* structured descriptors, no command line to parse */
+      g_variant_get (parameters, "(u^ay@aa{sv})", &uid, &display_name, &windows);
 
-      if (uid != getuid ())
+      if (terminal_gdbus_check_caller (uid, display_name, &error)
+          && (attrs = terminal_window_attr_parse_variant (windows, &error)) != NULL)
         {
-          g_dbus_method_invocation_return_error (invocation,
-              TERMINAL_ERROR, TERMINAL_ERROR_USER_MISMATCH,
-              _("User id mismatch"));
+          terminal_app_open_windows (app, attrs);
+          g_dbus_method_invocation_return_value (invocation, NULL);
         }
-      else if (g_strcmp0 (display_name, display_name2) != 0)
+      else if (error->domain == TERMINAL_ERROR)
         {
-          g_dbus_method_invocation_return_error (invocation,
-              TERMINAL_ERROR, TERMINAL_ERROR_DISPLAY_MISMATCH,
-              _("Display mismatch"));
+          g_dbus_method_invocation_return_gerror (invocation, error);
+          g_error_free (error);
         }
-      else if (!terminal_app_process (app, argv, g_strv_length (argv), &error))
+      else
         {
+          /* report invalid descriptors like invalid options */
           g_dbus_method_invocation_return_error (invocation,
               TERMINAL_ERROR, TERMINAL_ERROR_OPTIONS,
               "%s", error->message);
           g_error_free (error);
         }
-      else
-        {
-          /* everything went fine */
-          g_dbus_method_invocation_return_value (invocation, NULL);
-        }
 
       g_free (display_name);
-      g_free (display_name2);
-      g_strfreev (argv);
+      g_variant_unref (windows);
+    }
+  else if (g_strcmp0 (method_name, TERMINAL_DBUS_METHOD_SAVE) == 0)
+    {
+      terminal_gdbus_save_contents (app, parameters, invocation);
     }
   else
     {
@@ -145,6 +384,186 @@ static const GDBusInterfaceVTable terminal_gdbus_vtable =
 
 
 
+static TerminalScreen *
+terminal_gdbus_find_screen (TerminalApp  *app,
+                            guint         session_id,
+                            GtkWindow   **window_return)
+{
+  GSList         *lp;
+  GList          *children, *li;
+  TerminalScreen *screen = NULL;
+
+  for (lp = terminal_app_get_windows (app); lp != NULL && screen == NULL; lp = lp->next)
+    {
+      children = gtk_container_get_children (GTK_CONTAINER (terminal_window_get_notebook (lp->data)));
+      for (li = children; li != NULL; li = li->next)
+        if (terminal_screen_get_session_id (li->data) == session_id)
+          {
+            screen = li->data;
+            if (window_return != NULL)
+              *window_return = lp->data;
+            break;
+          }
+      g_list_free (children);
+    }
+
+  return screen;
+}
+
+
+
+static gchar **
+terminal_gdbus_tabs_enumerate (GDBusConnection *connection,
+                               const gchar     *sender,
+                               const gchar     *object_path,
+                               gpointer         user_data)
+{
+  TerminalApp *app = TERMINAL_APP (user_data);
+  GPtrArray   *nodes;
+  GSList      *lp;
+  GList       *children, *li;
+
+  nodes = g_ptr_array_new ();
+
+  /* one node per tab, named after its session id */
+  for (lp = terminal_app_get_windows (app); lp != NULL; lp = lp->next)
+    {
+      children = gtk_container_get_children (GTK_CONTAINER (terminal_window_get_notebook (lp->data)));
+      for (li = children; li != NULL; li = li->next)
+        g_ptr_array_add (nodes, g_strdup_printf ("%u", terminal_screen_get_session_id (li->data)));
+      g_list_free (children);
+    }
+
+  g_ptr_array_add (nodes, NULL);
+
+  return (gchar **) g_ptr_array_free (nodes, FALSE);
+}
+
+
+
+static GDBusInterfaceInfo **
+terminal_gdbus_tabs_introspect (GDBusConnection *connection,
+                                const gchar     *sender,
+                                const gchar     *object_path,
+                                const gchar     *node,
+                                gpointer         user_data)
+{
+  GDBusInterfaceInfo **infos;
+
+  /* the subtree itself has no interfaces */
+  if (node == NULL)
+    return NULL;
+
+  infos = g_new0 (GDBusInterfaceInfo *, 2);
+  infos[0] = g_dbus_interface_info_ref (terminal_gdbus_statistics_info);
+
+  return infos;
+}
+
+
+
+static GVariant *
+terminal_gdbus_tabs_get_property (GDBusConnection  *connection,
+                                  const gchar      *sender,
+                                  const gchar      *object_path,
+                                  const gchar      *interface_name,
+                                  const gchar      *property_name,
+                                  GError          **error,
+                                  gpointer          user_data)
+{
+  TerminalScreen           *screen = NULL;
+  GtkWindow                *window = NULL;
+  TerminalScreenStatistics  stats;
+  const gchar              *role;
+  const gchar              *node;
+  gchar                    *title;
+  gchar                    *end;
+  guint64                   session_id;
+  GVariant                 *result = NULL;
+
+  node = strrchr (object_path, '/') + 1;
+  session_id = g_ascii_strtoull (node, &end, 10);
+  if (end != node && *end == '\0' && session_id <= G_MAXUINT)
+    screen = terminal_gdbus_find_screen (TERMINAL_APP (user_data), session_id, &window);
+
+  if (G_UNLIKELY (screen == NULL))
+    {
+      g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_OBJECT,
+                   "No tab at %s", object_path);
+      return NULL;
+    }
+
+  terminal_screen_get_statistics (screen, &stats);
+
+  if (g_strcmp0 (property_name, "Title") == 0)
+    {
+      title = terminal_screen_get_title (screen);
+      result = g_variant_new_string (title);
+      g_free (title);
+    }
+  else if (g_strcmp0 (property_name, "WindowRole") == 0)
+    {
+      role = gtk_window_get_role (window);
+      result = g_variant_new_string (role != NULL ? role : "");
+    }
+  else if (g_strcmp0 (property_name, "BytesWritten") == 0)
+    result = g_variant_new_uint64 (stats.bytes_written);
+  else if (g_strcmp0 (property_name, "ContentsChanged") == 0)
+    result = g_variant_new_uint64 (stats.contents_changed);
+  else if (g_strcmp0 (property_name, "ContentsChangedRate") == 0)
+    result = g_variant_new_uint32 (stats.contents_changed_rate);
+  else if (g_strcmp0 (property_name, "DrawTime") == 0)
+    result = g_variant_new_int64 (stats.draw_time);
+  else if (g_strcmp0 (property_name, "DrawTimeMax") == 0)
+    result = g_variant_new_int64 (stats.draw_time_max);
+  else if (g_strcmp0 (property_name, "IdleTime") == 0)
+    result = g_variant_new_int64 (stats.last_output > 0 ? g_get_monotonic_time () - stats.last_output : -1);
+  else
+    g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_PROPERTY,
+                 "Unknown property %s", property_name);
+
+  return result;
+}
+
+
+
+static const GDBusInterfaceVTable terminal_gdbus_tabs_vtable =
+{
+  NULL, /* method call */
+  terminal_gdbus_tabs_get_property,
+  NULL  /* set property */
+};
+
+
+
+static const GDBusInterfaceVTable *
+terminal_gdbus_tabs_dispatch (GDBusConnection *connection,
+                              const gchar     *sender,
+                              const gchar     *object_path,
+                              const gchar     *interface_name,
+                              const gchar     *node,
+                              gpointer        *out_user_data,
+                              gpointer         user_data)
+{
+  if (node == NULL || g_strcmp0 (interface_name, TERMINAL_DBUS_STATISTICS) != 0)
+    return NULL;
+
+  *out_user_data = user_data;
+
+  return &terminal_gdbus_tabs_vtable;
+}
+
+
+
+static const GDBusSubtreeVTable terminal_gdbus_tabs_subtree_vtable =
+{
+  terminal_gdbus_tabs_enumerate,
+  terminal_gdbus_tabs_introspect,
+  terminal_gdbus_tabs_dispatch
+};
+
+
+
 static void
 terminal_gdbus_bus_acquired (GDBusConnection *connection,
                              const gchar     *name,
@@ -173,6 +592,27 @@ terminal_gdbus_bus_acquired (GDBusConnection *connection,
     }
 
   g_dbus_node_info_unref (info);
+
+  /* statistics of the tabs */
+  info = g_dbus_node_info_new_for_xml (terminal_gdbus_statistics_xml, NULL);
+  terminal_assert (info != NULL);
+  terminal_assert (*info->interfaces != NULL);
+  terminal_gdbus_statistics_info = g_dbus_interface_info_ref (*info->interfaces);
+  g_dbus_node_info_unref (info);
+
+  register_id = g_dbus_connection_register_subtree (connection,
+                                                    TERMINAL_DBUS_TABS_PATH,
+                                                    &terminal_gdbus_tabs_subtree_vtable,
+                                                    G_DBUS_SUBTREE_FLAGS_NONE,
+                                                    user_data,
+                                                    NULL,
+                                                    &error);
+
+  if (register_id == 0)
+    {
+      g_message ("Failed to register subtree: %s", error->message);
+      g_error_free (error);
+    }
 }
 
 
@@ -248,3 +688,72 @@ terminal_gdbus_invoke_launch (gint     argc,
   return result;
 }
 
+
+
+/**
+ * terminal_gdbus_invoke_save:
+ * @filename : File to write, relative to the current directory.
+ * @format   : Name of a save format or %NULL for plain text.
+ * @error    : return location for errors or %NULL.
+ *
+ * Saves the contents of the active tab of the running instance, gzipped
+ * if @filename ends in ".gz". Returns once the file is written.
+ *
+ * Return value : %TRUE on success, %FALSE with @error set otherwise.
+ **/
+gboolean
+terminal_gdbus_invoke_save (const gchar  *filename,
+                            const gchar  *format,
+                            GError      **error)
+{
+  GVariant        *reply;
+  GDBusConnection *connection;
+  GFile           *file;
+  gchar           *uri;
+  guint32          uid;
+  gchar           *display_name;
+
+  terminal_return_val_if_fail (filename != NULL, FALSE);
+
+  connection = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, error);
+  if (G_UNLIKELY (connection == NULL))
+    return FALSE;
+
+  /* the service has another working directory */
+  file = g_file_new_for_commandline_arg (filename);
+  uri = g_file_get_uri (file);
+  g_object_unref (file);
+
+  uid = getuid ();
+  display_name = terminal_gdbus_display_name ();
+
+  /* large buffers take a while, wait for the file without a timeout */
+  reply = g_dbus_connection_call_sync (connection,
+                                       TERMINAL_DBUS_SERVICE,
+                                       TERMINAL_DBUS_PATH,
+                                       TERMINAL_DBUS_INTERFACE,
+                                       TERMINAL_DBUS_METHOD_SAVE,
+                                       g_variant_new ("(u^ayussb)",
+                                                      uid,
+                                                      display_name,
+                                                      0,
+                                                      uri,
+                                                      format != NULL ? format : "text",
+                                                      g_str_has_suffix (filename, ".gz")),
+                                       NULL,
+                                       G_DBUS_CALL_FLAGS_NO_AUTO_START,
+                                       G_MAXINT,
+                                       NULL,
+                                       error);
+
+  g_object_unref (connection);
+  g_free (display_name);
+  g_free (uri);
+
+  if (G_UNLIKELY (reply == NULL))
+    return FALSE;
+
+  g_variant_unref (reply);
+
+  return TRUE;
+}
@@ -24,11 +24,20 @@
 
 G_BEGIN_DECLS
 
+gchar    *terminal_gdbus_display_name      (void) G_GNUC_MALLOC;
+gboolean  terminal_gdbus_process_launch    (TerminalApp  *app,
+                                            guint32       uid,
+                                            const gchar  *display_name,
+                                            gchar       **argv,
+                                            GError      **error);
 gboolean  terminal_gdbus_register_service  (TerminalApp  *app,
                                             GError      **error);
 gboolean  terminal_gdbus_invoke_launch     (gint          argc,
                                             gchar       **argv,
                                             GError      **error);
+gboolean  terminal_gdbus_invoke_save       (const gchar  *filename,
+                                            const gchar  *format,
+                                            GError      **error);
 
 G_END_DECLS
 
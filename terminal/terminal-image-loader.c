@@ -22,6 +22,10 @@
 #include <config.h>
 #endif
 
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
 #include <terminal/terminal-image-loader.h>
 #include <terminal/terminal-private.h>
 
@@ -31,24 +35,72 @@
 
 
 
-static void terminal_image_loader_finalize (GObject             *object);
-static void terminal_image_loader_check    (TerminalImageLoader *loader);
-static void terminal_image_loader_tile     (TerminalImageLoader *loader,
-                                            GdkPixbuf           *target,
-                                            gint                 width,
-                                            gint                 height);
-static void terminal_image_loader_center   (TerminalImageLoader *loader,
-                                            GdkPixbuf           *target,
-                                            gint                 width,
-                                            gint                 height);
-static void terminal_image_loader_scale    (TerminalImageLoader *loader,
-                                            GdkPixbuf           *target,
-                                            gint                 width,
-                                            gint                 height);
-static void terminal_image_loader_stretch  (TerminalImageLoader *loader,
-                                            GdkPixbuf           *target,
-                                            gint                 width,
-                                            gint                 height);
+typedef struct _TerminalImageLoaderEntry TerminalImageLoaderEntry;
+typedef struct _TerminalImageLoaderJob   TerminalImageLoaderJob;
+
+
+
+enum
+{
+  IMAGE_READY,
+  LAST_SIGNAL
+};
+
+
+
+static void             terminal_image_loader_finalize    (GObject                        *object);
+static guint            terminal_image_loader_entry_hash  (gconstpointer                   key);
+static gboolean         terminal_image_loader_entry_equal (gconstpointer                   a,
+                                                           gconstpointer                   b);
+static void             terminal_image_loader_entry_free  (gpointer                        data);
+static void             terminal_image_loader_invalidate  (TerminalImageLoader            *loader);
+static void             terminal_image_loader_remove      (TerminalImageLoader            *loader,
+                                                           TerminalImageLoaderEntry       *entry);
+static void             terminal_image_loader_evict       (TerminalImageLoader            *loader,
+                                                           TerminalImageLoaderEntry       *keep);
+static void             terminal_image_loader_check       (TerminalImageLoader            *loader);
+static void             terminal_image_loader_insert      (TerminalImageLoader            *loader,
+                                                           const TerminalImageLoaderEntry *key,
+                                                           cairo_surface_t                *surface);
+static void             terminal_image_loader_decode      (GTask                          *task,
+                                                           gpointer                        source_object,
+                                                           gpointer                        task_data,
+                                                           GCancellable                   *cancellable);
+static void             terminal_image_loader_decoded     (GObject                        *object,
+                                                           GAsyncResult                   *result,
+                                                           gpointer                        user_data);
+static void             terminal_image_loader_job_free    (gpointer                        data);
+static void             terminal_image_loader_key_free    (gpointer                        data);
+static void             terminal_image_loader_render_job  (GTask                          *task,
+                                                           gpointer                        source_object,
+                                                           gpointer                        task_data,
+                                                           GCancellable                   *cancellable);
+static void             terminal_image_loader_rendered    (GObject                        *object,
+                                                           GAsyncResult                   *result,
+                                                           gpointer                        user_data);
+static cairo_surface_t *terminal_image_loader_import      (GdkPixbuf                      *pixbuf);
+static cairo_surface_t *terminal_image_loader_render      (cairo_surface_t                *source,
+                                                           TerminalBackgroundStyle         style,
+                                                           const GdkRGBA                  *bgcolor,
+                                                           gint                            width,
+                                                           gint                            height);
+static void             terminal_image_loader_tile        (cairo_surface_t                *source,
+                                                           cairo_surface_t                *target);
+static void             terminal_image_loader_center      (cairo_surface_t                *source,
+                                                           const GdkRGBA                  *bgcolor,
+                                                           cairo_t                        *cr,
+                                                           gint                            width,
+                                                           gint                            height);
+static void             terminal_image_loader_scale       (cairo_surface_t                *source,
+                                                           const GdkRGBA                  *bgcolor,
+                                                           cairo_t                        *cr,
+                                                           gint                            width,
+                                                           gint                            height);
+static void             terminal_image_loader_stretch     (cairo_surface_t                *source,
+                                                           cairo_t                        *cr,
+                                                           gint                            width,
+                                                           gint                            height);
+
 
 
 struct _TerminalImageLoaderClass
@@ -61,15 +113,69 @@ struct _TerminalImageLoader
   GObject                  parent_instance;
   TerminalPreferences     *preferences;
 
-  /* the cached image data */
+  /* the cached image data, valid for preferences generation */
+  guint                    generation;
   gchar                   *path;
-  GSList                  *cache;
-  GSList                  *cache_invalid;
   GdkRGBA                  bgcolor;
-  GdkPixbuf               *pixbuf;
+  cairo_surface_t         *source;
   TerminalBackgroundStyle  style;
+
+  /* pending decode of path, failure is remembered until path changes */
+  GCancellable            *cancellable;
+  guint                    load_failed : 1;
+
+  /* keys of the images rendered in a worker thread, the serial
+   * tells results from before an invalidate apart */
+  GHashTable              *rendering;
+  guint                    rendering_serial;
+
+  /* rendered images, hashed on their key and ordered by last use */
+  GHashTable              *cache;
+  GQueue                   cache_lru;
+  gsize                    cache_bytes;
+  gsize                    cache_budget;
+
+#ifdef G_ENABLE_DEBUG
+  guint                    cache_hits;
+  guint                    cache_misses;
+#endif
 };
 
+struct _TerminalImageLoaderEntry
+{
+  /* the key; tiled images are shared by all sizes and stored
+   * with a width and height of 0 */
+  gint                     width;
+  gint                     height;
+  gint                     scale;
+  TerminalBackgroundStyle  style;
+
+  cairo_surface_t         *surface;
+  gsize                    bytes;
+
+  /* link in the lru queue, head is the most recently used */
+  GList                    lru;
+};
+
+struct _TerminalImageLoaderJob
+{
+  /* input, copied from the loader when the job was started */
+  gchar                    *path;
+  GdkRGBA                   bgcolor;
+  TerminalImageLoaderEntry  key;
+  gint                      width;
+  gint                      height;
+  guint                     serial;
+
+  /* output, the decoded file and the pre-rendered image */
+  cairo_surface_t          *source;
+  cairo_surface_t          *rendered;
+};
+
+
+
+static guint loader_signals[LAST_SIGNAL];
+
 
 
 G_DEFINE_TYPE (TerminalImageLoader, terminal_image_loader, G_TYPE_OBJECT)
@@ -83,6 +189,21 @@ terminal_image_loader_class_init (TerminalImageLoaderClass *klass)
 
   gobject_class = G_OBJECT_CLASS (klass);
   gobject_class->finalize = terminal_image_loader_finalize;
+
+  /**
+   * TerminalImageLoader::image-ready
+   *
+   * Emitted when the background image file has been loaded or an
+   * image was rendered in the background and terminal_image_loader_load()
+   * can return it.
+   **/
+  loader_signals[IMAGE_READY] =
+    g_signal_new (I_("image-ready"),
+                  G_TYPE_FROM_CLASS (gobject_class),
+                  G_SIGNAL_RUN_LAST,
+                  0, NULL, NULL,
+                  g_cclosure_marshal_VOID__VOID,
+                  G_TYPE_NONE, 0);
 }
 
 
@@ -91,6 +212,15 @@ static void
 terminal_image_loader_init (TerminalImageLoader *loader)
 {
   loader->preferences = terminal_preferences_get ();
+  loader->cache = g_hash_table_new_full (terminal_image_loader_entry_hash,
+                                         terminal_image_loader_entry_equal,
+                                         terminal_image_loader_entry_free,
+                                         NULL);
+  g_queue_init (&loader->cache_lru);
+  loader->rendering = g_hash_table_new_full (terminal_image_loader_entry_hash,
+                                             terminal_image_loader_entry_equal,
+                                             terminal_image_loader_key_free,
+                                             NULL);
 }
 
 
@@ -100,13 +230,19 @@ terminal_image_loader_finalize (GObject *object)
 {
   TerminalImageLoader *loader = TERMINAL_IMAGE_LOADER (object);
 
-  g_slist_free_full (loader->cache, g_object_unref);
-  g_slist_free_full (loader->cache_invalid, g_object_unref);
+  if (loader->cancellable != NULL)
+    {
+      g_cancellable_cancel (loader->cancellable);
+      g_object_unref (G_OBJECT (loader->cancellable));
+    }
+
+  g_hash_table_destroy (loader->cache);
+  g_hash_table_destroy (loader->rendering);
 
   g_object_unref (G_OBJECT (loader->preferences));
 
-  if (G_LIKELY (loader->pixbuf != NULL))
-    g_object_unref (G_OBJECT (loader->pixbuf));
+  if (G_LIKELY (loader->source != NULL))
+    cairo_surface_destroy (loader->source);
   g_free (loader->path);
 
   (*G_OBJECT_CLASS (terminal_image_loader_parent_class)->finalize) (object);
@@ -114,55 +250,140 @@ terminal_image_loader_finalize (GObject *object)
 
 
 
+static guint
+terminal_image_loader_entry_hash (gconstpointer key)
+{
+  const TerminalImageLoaderEntry *entry = key;
+  guint                           hash;
+
+  hash = (guint) entry->width;
+  hash = hash * 31 + (guint) entry->height;
+  hash = hash * 31 + (guint) entry->scale;
+  hash = hash * 31 + (guint) entry->style;
+
+  return hash;
+}
+
+
+
+static gboolean
+terminal_image_loader_entry_equal (gconstpointer a,
+                                   gconstpointer b)
+{
+  const TerminalImageLoaderEntry *entry_a = a;
+  const TerminalImageLoaderEntry *entry_b = b;
+
+  return entry_a->width == entry_b->width
+      && entry_a->height == entry_b->height
+      && entry_a->scale == entry_b->scale
+      && entry_a->style == entry_b->style;
+}
+
+
+
+static void
+terminal_image_loader_entry_free (gpointer data)
+{
+  TerminalImageLoaderEntry *entry = data;
+
+  cairo_surface_destroy (entry->surface);
+  g_slice_free (TerminalImageLoaderEntry, entry);
+}
+
+
+
+static void
+terminal_image_loader_invalidate (TerminalImageLoader *loader)
+{
+  /* the links are embedded in the entries, so only reset the queue */
+  g_hash_table_remove_all (loader->cache);
+  g_queue_init (&loader->cache_lru);
+  loader->cache_bytes = 0;
+
+  /* images still being rendered are dropped when they are done */
+  g_hash_table_remove_all (loader->rendering);
+  loader->rendering_serial++;
+}
+
+
+
+static void
+terminal_image_loader_remove (TerminalImageLoader      *loader,
+                              TerminalImageLoaderEntry *entry)
+{
+  g_queue_unlink (&loader->cache_lru, &entry->lru);
+  loader->cache_bytes -= entry->bytes;
+  g_hash_table_remove (loader->cache, entry);
+}
+
+
+
+static void
+terminal_image_loader_evict (TerminalImageLoader      *loader,
+                             TerminalImageLoaderEntry *keep)
+{
+  TerminalImageLoaderEntry *entry;
+
+  /* drop the least recently used images until we fit in the budget,
+   * but never the image that is about to be returned */
+  while (loader->cache_bytes > loader->cache_budget)
+    {
+      entry = g_queue_peek_tail (&loader->cache_lru);
+      if (entry == NULL || entry == keep)
+        break;
+
+      terminal_image_loader_remove (loader, entry);
+    }
+}
+
+
+
 static void
 terminal_image_loader_check (TerminalImageLoader *loader)
 {
-  TerminalBackgroundStyle selected_style;
-  GdkRGBA                 selected_color;
-  gboolean                invalidate = FALSE;
-  gchar                  *selected_color_spec;
-  gchar                  *selected_path;
+  const TerminalPreferencesSnapshot *snapshot;
+  GdkRGBA                            selected_color = { 0, };
+  gboolean                           invalidate = FALSE;
 
   terminal_return_if_fail (TERMINAL_IS_IMAGE_LOADER (loader));
 
-  g_object_get (G_OBJECT (loader->preferences),
-                "background-image-file", &selected_path,
-                "background-image-style", &selected_style,
-                "color-background", &selected_color_spec,
-                NULL);
+  /* nothing to do if the preferences did not change */
+  snapshot = terminal_preferences_get_snapshot (loader->preferences);
+  if (G_LIKELY (snapshot->generation == loader->generation))
+    return;
+  loader->generation = snapshot->generation;
 
-  if (g_strcmp0 (selected_path, loader->path) != 0)
-    {
-      gint width, height;
+  loader->cache_budget = (gsize) snapshot->background_image_cache_size * 1024 * 1024;
 
+  if (g_strcmp0 (snapshot->background_image_file, loader->path) != 0)
+    {
       g_free (loader->path);
-      loader->path = g_strdup (selected_path);
+      loader->path = g_strdup (snapshot->background_image_file);
 
-      if (GDK_IS_PIXBUF (loader->pixbuf))
-        g_object_unref (G_OBJECT (loader->pixbuf));
+      if (loader->source != NULL)
+        cairo_surface_destroy (loader->source);
+      loader->source = NULL;
 
-      if (gdk_pixbuf_get_file_info (loader->path, &width, &height) == NULL)
+      /* abort decoding the previous file, the next load starts over */
+      if (loader->cancellable != NULL)
         {
-          g_warning ("Unable to load background image file \"%s\"", loader->path);
-          loader->pixbuf = NULL;
+          g_cancellable_cancel (loader->cancellable);
+          g_object_unref (G_OBJECT (loader->cancellable));
+          loader->cancellable = NULL;
         }
-      else if (width <= MAX_IMAGE_WIDTH && height <= MAX_IMAGE_HEIGHT)
-        loader->pixbuf = gdk_pixbuf_new_from_file (loader->path, NULL);
-      else
-        loader->pixbuf = gdk_pixbuf_new_from_file_at_size (loader->path,
-                                                           MAX_IMAGE_WIDTH, MAX_IMAGE_WIDTH,
-                                                           NULL);
+      loader->load_failed = FALSE;
 
       invalidate = TRUE;
     }
 
-  if (selected_style != loader->style)
+  if (snapshot->background_image_style != loader->style)
     {
-      loader->style = selected_style;
+      loader->style = snapshot->background_image_style;
       invalidate = TRUE;
     }
 
-  gdk_rgba_parse (&selected_color, selected_color_spec);
+  if (snapshot->has_color_background)
+    selected_color = snapshot->color_background;
   if (!gdk_rgba_equal (&selected_color, &loader->bgcolor))
     {
       loader->bgcolor = selected_color;
@@ -170,113 +391,403 @@ terminal_image_loader_check (TerminalImageLoader *loader)
     }
 
   if (invalidate)
+    terminal_image_loader_invalidate (loader);
+}
+
+
+
+static void
+terminal_image_loader_insert (TerminalImageLoader            *loader,
+                              const TerminalImageLoaderEntry *key,
+                              cairo_surface_t                *surface)
+{
+  TerminalImageLoaderEntry *entry;
+
+  /* replaces a tile that was too small */
+  entry = g_hash_table_lookup (loader->cache, key);
+  if (entry != NULL)
+    terminal_image_loader_remove (loader, entry);
+
+  entry = g_slice_new (TerminalImageLoaderEntry);
+  entry->width = key->width;
+  entry->height = key->height;
+  entry->scale = key->scale;
+  entry->style = key->style;
+  entry->surface = cairo_surface_reference (surface);
+  cairo_surface_set_device_scale (surface, key->scale, key->scale);
+  entry->bytes = (gsize) cairo_image_surface_get_stride (surface)
+                 * cairo_image_surface_get_height (surface);
+  entry->lru.data = entry;
+  entry->lru.prev = entry->lru.next = NULL;
+
+  g_hash_table_add (loader->cache, entry);
+  g_queue_push_head_link (&loader->cache_lru, &entry->lru);
+  loader->cache_bytes += entry->bytes;
+
+  terminal_image_loader_evict (loader, entry);
+}
+
+
+
+static void
+terminal_image_loader_decode (GTask        *task,
+                              gpointer      source_object,
+                              gpointer      task_data,
+                              GCancellable *cancellable)
+{
+  TerminalImageLoaderJob *job = task_data;
+  GError                 *error = NULL;
+  GdkPixbuf              *pixbuf;
+  gint                    width, height;
+
+  /* runs in a worker thread, only touch the job */
+  if (gdk_pixbuf_get_file_info (job->path, &width, &height) == NULL)
     {
-      loader->cache_invalid = g_slist_concat (loader->cache_invalid,
-                                              loader->cache);
-      loader->cache = NULL;
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                               "Unknown image file format");
+      return;
     }
 
-  g_free (selected_color_spec);
-  g_free (selected_path);
+  if (width <= MAX_IMAGE_WIDTH && height <= MAX_IMAGE_HEIGHT)
+    pixbuf = gdk_pixbuf_new_from_file (job->path, &error);
+  else
+    pixbuf = gdk_pixbuf_new_from_file_at_size (job->path,
+                                               MAX_IMAGE_WIDTH, MAX_IMAGE_HEIGHT,
+                                               &error);
+
+  if (G_UNLIKELY (pixbuf == NULL))
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  /* convert once, all rendering is done on cairo image surfaces */
+  job->source = terminal_image_loader_import (pixbuf);
+  g_object_unref (G_OBJECT (pixbuf));
+
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  /* render the size that was asked for, so the first draw is a cache hit */
+  job->rendered = terminal_image_loader_render (job->source, job->key.style, &job->bgcolor,
+                                                job->width, job->height);
+
+  g_task_return_boolean (task, TRUE);
 }
 
 
 
 static void
-terminal_image_loader_tile (TerminalImageLoader *loader,
-                            GdkPixbuf           *target,
-                            gint                 width,
-                            gint                 height)
+terminal_image_loader_decoded (GObject      *object,
+                               GAsyncResult *result,
+                               gpointer      user_data)
+{
+  TerminalImageLoader    *loader = TERMINAL_IMAGE_LOADER (object);
+  TerminalImageLoaderJob *job = g_task_get_task_data (G_TASK (result));
+  GError                 *error = NULL;
+  gboolean                succeed;
+
+  succeed = g_task_propagate_boolean (G_TASK (result), &error);
+
+  /* ignore the result of a job that was replaced by a newer one */
+  if (g_task_get_cancellable (G_TASK (result)) != loader->cancellable)
+    {
+      g_clear_error (&error);
+      return;
+    }
+
+  g_object_unref (G_OBJECT (loader->cancellable));
+  loader->cancellable = NULL;
+
+  if (G_UNLIKELY (!succeed))
+    {
+      g_warning ("Unable to load background image file \"%s\": %s", job->path, error->message);
+      g_error_free (error);
+      loader->load_failed = TRUE;
+      return;
+    }
+
+  loader->source = cairo_surface_reference (job->source);
+
+  /* only keep the pre-rendered image if the settings did not change meanwhile */
+  if (job->key.style == loader->style && gdk_rgba_equal (&job->bgcolor, &loader->bgcolor))
+    terminal_image_loader_insert (loader, &job->key, job->rendered);
+
+  g_signal_emit (G_OBJECT (loader), loader_signals[IMAGE_READY], 0);
+}
+
+
+
+static void
+terminal_image_loader_job_free (gpointer data)
 {
-  GdkRectangle area;
-  gint         source_width;
-  gint         source_height;
-  gint         i;
-  gint         j;
-
-  source_width = gdk_pixbuf_get_width (loader->pixbuf);
-  source_height = gdk_pixbuf_get_height (loader->pixbuf);
-
-  for (i = 0; (i * source_width) < width; ++i)
-    for (j = 0; (j * source_height) < height; ++j)
-      {
-        area.x = i * source_width;
-        area.y = j * source_height;
-        area.width = source_width;
-        area.height = source_height;
-
-        if (area.x + area.width > width)
-          area.width = width - area.x;
-        if (area.y + area.height > height)
-          area.height = height - area.y;
-
-        gdk_pixbuf_copy_area (loader->pixbuf, 0, 0,
-                              area.width, area.height,
-                              target, area.x, area.y);
-      }
+  TerminalImageLoaderJob *job = data;
+
+  if (job->source != NULL)
+    cairo_surface_destroy (job->source);
+  if (job->rendered != NULL)
+    cairo_surface_destroy (job->rendered);
+  g_free (job->path);
+  g_slice_free (TerminalImageLoaderJob, job);
 }
 
 
 
 static void
-terminal_image_loader_center (TerminalImageLoader *loader,
-                              GdkPixbuf           *target,
-                              gint                 width,
-                              gint                 height)
+terminal_image_loader_key_free (gpointer data)
 {
-  guint32 rgba;
-  gint    source_width;
-  gint    source_height;
-  gint    dx;
-  gint    dy;
-  gint    x0;
-  gint    y0;
+  g_slice_free (TerminalImageLoaderEntry, data);
+}
+
+
+
+static void
+terminal_image_loader_render_job (GTask        *task,
+                                  gpointer      source_object,
+                                  gpointer      task_data,
+                                  GCancellable *cancellable)
+{
+  TerminalImageLoaderJob *job = task_data;
+
+  /* runs in a worker thread, only touch the job */
+  job->rendered = terminal_image_loader_render (job->source, job->key.style, &job->bgcolor,
+                                                job->width, job->height);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+
+
+static void
+terminal_image_loader_rendered (GObject      *object,
+                                GAsyncResult *result,
+                                gpointer      user_data)
+{
+  TerminalImageLoader    *loader = TERMINAL_IMAGE_LOADER (object);
+  TerminalImageLoaderJob *job = g_task_get_task_data (G_TASK (result));
+
+  /* drop images of settings that changed meanwhile */
+  if (job->serial != loader->rendering_serial)
+    return;
+
+  g_hash_table_remove (loader->rendering, &job->key);
+  terminal_image_loader_insert (loader, &job->key, job->rendered);
+
+  g_signal_emit (G_OBJECT (loader), loader_signals[IMAGE_READY], 0);
+}
+
+
+
+static cairo_surface_t*
+terminal_image_loader_import (GdkPixbuf *pixbuf)
+{
+  cairo_surface_t *surface;
+  const guchar    *src_row, *src;
+  guchar          *dst_row;
+  guint32         *dst;
+  gint             src_stride, dst_stride;
+  gint             n_channels;
+  gint             width, height;
+  gint             x, y;
+  guint            a, t;
+
+  width = gdk_pixbuf_get_width (pixbuf);
+  height = gdk_pixbuf_get_height (pixbuf);
+  n_channels = gdk_pixbuf_get_n_channels (pixbuf);
+  src_row = gdk_pixbuf_get_pixels (pixbuf);
+  src_stride = gdk_pixbuf_get_rowstride (pixbuf);
+
+  surface = cairo_image_surface_create (n_channels == 4 ? CAIRO_FORMAT_ARGB32 : CAIRO_FORMAT_RGB24,
+                                        width, height);
+  cairo_surface_flush (surface);
+  dst_row = cairo_image_surface_get_data (surface);
+  dst_stride = cairo_image_surface_get_stride (surface);
+
+/* premultiply with correct rounding, (c * a) / 255 */
+#define MULT(c,a) ((t) = (c) * (a) + 0x80, ((((t) >> 8) + (t)) >> 8))
+
+  /* convert from rgb(a) bytes to native endian, premultiplied argb words */
+  for (y = 0; y < height; y++)
+    {
+      src = src_row;
+      dst = (guint32 *) dst_row;
+
+      if (n_channels == 4)
+        {
+          for (x = 0; x < width; x++, src += 4)
+            {
+              a = src[3];
+              if (a == 0xff)
+                dst[x] = 0xff000000 | (src[0] << 16) | (src[1] << 8) | src[2];
+              else if (a == 0)
+                dst[x] = 0;
+              else
+                dst[x] = (a << 24) | (MULT (src[0], a) << 16)
+                         | (MULT (src[1], a) << 8) | MULT (src[2], a);
+            }
+        }
+      else
+        {
+          for (x = 0; x < width; x++, src += n_channels)
+            dst[x] = 0xff000000 | (src[0] << 16) | (src[1] << 8) | src[2];
+        }
+
+      src_row += src_stride;
+      dst_row += dst_stride;
+    }
+
+#undef MULT
+
+  cairo_surface_mark_dirty (surface);
+
+  return surface;
+}
+
+
+
+static cairo_surface_t*
+terminal_image_loader_render (cairo_surface_t         *source,
+                              TerminalBackgroundStyle  style,
+                              const GdkRGBA           *bgcolor,
+                              gint                     width,
+                              gint                     height)
+{
+  cairo_surface_t *surface;
+  cairo_t         *cr;
+
+  surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, width, height);
+
+  if (style == TERMINAL_BACKGROUND_STYLE_TILED)
+    {
+      terminal_image_loader_tile (source, surface);
+      return surface;
+    }
+
+  cr = cairo_create (surface);
+
+  switch (style)
+    {
+    case TERMINAL_BACKGROUND_STYLE_CENTERED:
+      terminal_image_loader_center (source, bgcolor, cr, width, height);
+      break;
+
+    case TERMINAL_BACKGROUND_STYLE_SCALED:
+      terminal_image_loader_scale (source, bgcolor, cr, width, height);
+      break;
+
+    case TERMINAL_BACKGROUND_STYLE_STRETCHED:
+      terminal_image_loader_stretch (source, cr, width, height);
+      break;
+
+    default:
+      terminal_assert_not_reached ();
+    }
+
+  cairo_destroy (cr);
+
+  return surface;
+}
+
+
+
+static void
+terminal_image_loader_tile (cairo_surface_t *source,
+                            cairo_surface_t *target)
+{
+  const guchar *src_data;
+  guchar       *dst_data;
+  guchar       *dst;
+  gint          src_stride, dst_stride;
+  gint          source_width, source_height;
+  gint          width, height;
+  gint          row_bytes, done, n;
+  gint          y;
+
+  source_width = cairo_image_surface_get_width (source);
+  source_height = cairo_image_surface_get_height (source);
+  src_data = cairo_image_surface_get_data (source);
+  src_stride = cairo_image_surface_get_stride (source);
+
+  width = cairo_image_surface_get_width (target);
+  height = cairo_image_surface_get_height (target);
+  cairo_surface_flush (target);
+  dst_data = cairo_image_surface_get_data (target);
+  dst_stride = cairo_image_surface_get_stride (target);
+
+  /* both surfaces use 4 bytes per pixel and the unused byte of a RGB24
+   * source is set to 0xff on import, so rows can be copied as is; fill the first band of rows by
+   * copying each source row once and doubling what is already in the
+   * target row, so a row takes log2 (width / source_width) copies */
+  row_bytes = width * 4;
+  for (y = 0; y < MIN (height, source_height); y++)
+    {
+      dst = dst_data + y * dst_stride;
+
+      done = MIN (source_width, width) * 4;
+      memcpy (dst, src_data + y * src_stride, done);
+      while (done < row_bytes)
+        {
+          n = MIN (done, row_bytes - done);
+          memcpy (dst + done, dst, n);
+          done += n;
+        }
+    }
+
+  /* the remaining bands are copies of the rows above */
+  for (; y < height; y++)
+    memcpy (dst_data + y * dst_stride, dst_data + (y - source_height) * dst_stride, row_bytes);
+
+  cairo_surface_mark_dirty (target);
+}
+
+
+
+static void
+terminal_image_loader_center (cairo_surface_t *source,
+                              const GdkRGBA   *bgcolor,
+                              cairo_t         *cr,
+                              gint             width,
+                              gint             height)
+{
+  gint source_width;
+  gint source_height;
 
   /* fill with background color */
-  rgba = ((((guint)(loader->bgcolor.red * 65535) & 0xff00) << 8)
-        | (((guint)(loader->bgcolor.green * 65535) & 0xff00))
-        | (((guint)(loader->bgcolor.blue * 65535) & 0xff00) >> 8)) << 8;
-  gdk_pixbuf_fill (target, rgba);
-
-  source_width = gdk_pixbuf_get_width (loader->pixbuf);
-  source_height = gdk_pixbuf_get_height (loader->pixbuf);
-
-  dx = MAX ((width - source_width) / 2, 0);
-  dy = MAX ((height - source_height) / 2, 0);
-  x0 = MIN ((width - source_width) / 2, dx);
-  y0 = MIN ((height - source_height) / 2, dy);
-
-  gdk_pixbuf_composite (loader->pixbuf, target, dx, dy,
-                        MIN (width, source_width),
-                        MIN (height, source_height),
-                        x0, y0, 1.0, 1.0,
-                        GDK_INTERP_BILINEAR, 255);
+  cairo_set_source_rgb (cr, bgcolor->red, bgcolor->green, bgcolor->blue);
+  cairo_paint (cr);
+
+  source_width = cairo_image_surface_get_width (source);
+  source_height = cairo_image_surface_get_height (source);
+
+  /* integer offsets keep this a plain blit, larger images are cropped */
+  cairo_set_source_surface (cr, source,
+                            (width - source_width) / 2,
+                            (height - source_height) / 2);
+  cairo_paint (cr);
 }
 
 
 
 static void
-terminal_image_loader_scale (TerminalImageLoader *loader,
-                             GdkPixbuf           *target,
-                             gint                 width,
-                             gint                 height)
+terminal_image_loader_scale (cairo_surface_t *source,
+                             const GdkRGBA   *bgcolor,
+                             cairo_t         *cr,
+                             gint             width,
+                             gint             height)
 {
   gdouble xscale;
   gdouble yscale;
-  guint32 rgba;
   gint    source_width;
   gint    source_height;
   gint    x;
   gint    y;
 
   /* fill with background color */
-  rgba = ((((guint)(loader->bgcolor.red * 65535) & 0xff00) << 8)
-        | (((guint)(loader->bgcolor.green * 65535) & 0xff00))
-        | (((guint)(loader->bgcolor.blue * 65535) & 0xff00) >> 8)) << 8;
-  gdk_pixbuf_fill (target, rgba);
+  cairo_set_source_rgb (cr, bgcolor->red, bgcolor->green, bgcolor->blue);
+  cairo_paint (cr);
 
-  source_width = gdk_pixbuf_get_width (loader->pixbuf);
-  source_height = gdk_pixbuf_get_height (loader->pixbuf);
+  source_width = cairo_image_surface_get_width (source);
+  source_height = cairo_image_surface_get_height (source);
 
   xscale = (gdouble) width / source_width;
   yscale = (gdouble) height / source_height;
@@ -294,36 +805,35 @@ terminal_image_loader_scale (TerminalImageLoader *loader,
       y = 0;
     }
 
-  gdk_pixbuf_composite (loader->pixbuf, target, x, y,
-                        source_width * xscale,
-                        source_height * yscale,
-                        x, y, xscale, yscale,
-                        GDK_INTERP_BILINEAR, 255);
+  cairo_translate (cr, x, y);
+  cairo_scale (cr, xscale, yscale);
+  cairo_rectangle (cr, 0, 0, source_width, source_height);
+  cairo_set_source_surface (cr, source, 0, 0);
+  cairo_pattern_set_extend (cairo_get_source (cr), CAIRO_EXTEND_PAD);
+  cairo_pattern_set_filter (cairo_get_source (cr), CAIRO_FILTER_GOOD);
+  cairo_fill (cr);
 }
 
 
 
 static void
-terminal_image_loader_stretch (TerminalImageLoader *loader,
-                               GdkPixbuf           *target,
-                               gint                 width,
-                               gint                 height)
+terminal_image_loader_stretch (cairo_surface_t *source,
+                               cairo_t         *cr,
+                               gint             width,
+                               gint             height)
 {
-  gdouble xscale;
-  gdouble yscale;
-  gint    source_width;
-  gint    source_height;
-
-  source_width = gdk_pixbuf_get_width (loader->pixbuf);
-  source_height = gdk_pixbuf_get_height (loader->pixbuf);
-
-  xscale = (gdouble) width / source_width;
-  yscale = (gdouble) height / source_height;
-
-  gdk_pixbuf_composite (loader->pixbuf, target,
-                        0, 0, width, height,
-                        0, 0, xscale, yscale,
-                        GDK_INTERP_BILINEAR, 255);
+  gint source_width;
+  gint source_height;
+
+  source_width = cairo_image_surface_get_width (source);
+  source_height = cairo_image_surface_get_height (source);
+
+  cairo_scale (cr, (gdouble) width / source_width, (gdouble) height / source_height);
+  cairo_set_source_surface (cr, source, 0, 0);
+  cairo_pattern_set_extend (cairo_get_source (cr), CAIRO_EXTEND_PAD);
+  cairo_pattern_set_filter (cairo_get_source (cr), CAIRO_FILTER_GOOD);
+  cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+  cairo_paint (cr);
 }
 
 
@@ -362,81 +872,133 @@ terminal_image_loader_get (void)
  * @loader      : A #TerminalImageLoader.
  * @width       : The image width.
  * @height      : The image height.
+ * @scale       : The scale factor of the widget.
+ *
+ * The returned surface is a premultiplied ARGB32 image surface that
+ * can be used as cairo source directly, its device scale is set to
+ * the scale it was rendered for. Call cairo_surface_destroy() if you
+ * don't need it any longer.
  *
- * Return value : The image in the given @width and @height drawn with
- *                the configured style or %NULL on error.
+ * Return value : The image in the given @width and @height, multiplied
+ *                by @scale for the stretched and scaled styles, drawn
+ *                with the configured style or %NULL on
+ *                error or when the image is not loaded or rendered yet;
+ *                "image-ready" is emitted once it is.
  **/
-GdkPixbuf*
+cairo_surface_t*
 terminal_image_loader_load (TerminalImageLoader *loader,
                             gint                 width,
-                            gint                 height)
+                            gint                 height,
+                            gint                 scale)
 {
-  GdkPixbuf *pixbuf;
-  GSList    *lp;
+  TerminalImageLoaderEntry  key;
+  TerminalImageLoaderEntry *entry;
+  TerminalImageLoaderJob   *job;
+  GTask                    *task;
 
   terminal_return_val_if_fail (TERMINAL_IS_IMAGE_LOADER (loader), NULL);
   terminal_return_val_if_fail (width > 0, NULL);
   terminal_return_val_if_fail (height > 0, NULL);
+  terminal_return_val_if_fail (scale > 0, NULL);
 
   terminal_image_loader_check (loader);
 
-  if (G_UNLIKELY (loader->pixbuf == NULL || width <= 1 || height <= 1))
+  if (G_UNLIKELY (width <= 1 || height <= 1))
     return NULL;
 
-#ifdef G_ENABLE_DEBUG
-  g_debug ("Image Loader Memory Status: %d images in valid "
-           "cache, %d in invalid cache",
-           g_slist_length (loader->cache),
-           g_slist_length (loader->cache_invalid));
-#endif
+  /* centered and tiled images are shown at their natural size, one
+   * image pixel per logical pixel; only stretched and scaled images
+   * are rendered for the device pixels */
+  if (loader->style == TERMINAL_BACKGROUND_STYLE_CENTERED
+      || loader->style == TERMINAL_BACKGROUND_STYLE_TILED)
+    scale = 1;
 
-  /* check for a cached version */
-  for (lp = loader->cache; lp != NULL; lp = lp->next)
+  width *= scale;
+  height *= scale;
+
+  /* a tiled image can be cut to any smaller size, so there is only
+   * one of them */
+  key.scale = scale;
+  key.style = loader->style;
+  key.width = loader->style == TERMINAL_BACKGROUND_STYLE_TILED ? 0 : width;
+  key.height = loader->style == TERMINAL_BACKGROUND_STYLE_TILED ? 0 : height;
+
+  if (G_UNLIKELY (loader->source == NULL))
     {
-      pixbuf = GDK_PIXBUF (lp->data);
-      if (gdk_pixbuf_get_height (pixbuf) == height
-          && gdk_pixbuf_get_width (pixbuf) == width)
+      /* decode the file in a worker thread, "image-ready" is emitted when
+       * the image is available */
+      if (loader->cancellable == NULL && !loader->load_failed && IS_STRING (loader->path))
         {
-          return g_object_ref (G_OBJECT (pixbuf));
+          job = g_slice_new0 (TerminalImageLoaderJob);
+          job->path = g_strdup (loader->path);
+          job->bgcolor = loader->bgcolor;
+          job->key = key;
+          job->width = width;
+          job->height = height;
+
+          loader->cancellable = g_cancellable_new ();
+
+          task = g_task_new (loader, loader->cancellable, terminal_image_loader_decoded, NULL);
+          g_task_set_task_data (task, job, terminal_image_loader_job_free);
+          g_task_run_in_thread (task, terminal_image_loader_decode);
+          g_object_unref (G_OBJECT (task));
         }
-      else if (gdk_pixbuf_get_height (pixbuf) >= height
-            && gdk_pixbuf_get_width (pixbuf) >= width
-            && loader->style == TERMINAL_BACKGROUND_STYLE_TILED)
-        {
-          return g_object_ref (G_OBJECT (pixbuf));
-        }
-    }
 
-  pixbuf = gdk_pixbuf_new (gdk_pixbuf_get_colorspace (loader->pixbuf),
-                           gdk_pixbuf_get_has_alpha (loader->pixbuf),
-                           gdk_pixbuf_get_bits_per_sample (loader->pixbuf),
-                           width, height);
+      return NULL;
+    }
 
-  switch (loader->style)
+  /* check for a cached version */
+  entry = g_hash_table_lookup (loader->cache, &key);
+  if (entry != NULL)
     {
-    case TERMINAL_BACKGROUND_STYLE_TILED:
-      terminal_image_loader_tile (loader, pixbuf, width, height);
-      break;
-
-    case TERMINAL_BACKGROUND_STYLE_CENTERED:
-      terminal_image_loader_center (loader, pixbuf, width, height);
-      break;
+      if (cairo_image_surface_get_width (entry->surface) >= width
+          && cairo_image_surface_get_height (entry->surface) >= height)
+        {
+          /* move to the head of the lru queue */
+          g_queue_unlink (&loader->cache_lru, &entry->lru);
+          g_queue_push_head_link (&loader->cache_lru, &entry->lru);
 
-    case TERMINAL_BACKGROUND_STYLE_SCALED:
-      terminal_image_loader_scale (loader, pixbuf, width, height);
-      break;
+#ifdef G_ENABLE_DEBUG
+          loader->cache_hits++;
+#endif
 
-    case TERMINAL_BACKGROUND_STYLE_STRETCHED:
-      terminal_image_loader_stretch (loader, pixbuf, width, height);
-      break;
+          return cairo_surface_reference (entry->surface);
+        }
 
-    default:
-      terminal_assert_not_reached ();
+      /* tile too small, replace it with one that covers both sizes */
+      width = MAX (width, cairo_image_surface_get_width (entry->surface));
+      height = MAX (height, cairo_image_surface_get_height (entry->surface));
     }
 
-  loader->cache = g_slist_prepend (loader->cache, pixbuf);
+  /* already being rendered, "image-ready" follows */
+  if (g_hash_table_contains (loader->rendering, &key))
+    return NULL;
 
-  return g_object_ref (G_OBJECT (pixbuf));
-}
+  /* render in a worker thread, like the first image */
+  job = g_slice_new0 (TerminalImageLoaderJob);
+  job->source = cairo_surface_reference (loader->source);
+  job->bgcolor = loader->bgcolor;
+  job->key = key;
+  job->width = width;
+  job->height = height;
+  job->serial = loader->rendering_serial;
 
+  g_hash_table_add (loader->rendering, g_slice_dup (TerminalImageLoaderEntry, &key));
 
+  task = g_task_new (loader, NULL, terminal_image_loader_rendered, NULL);
+  g_task_set_task_data (task, job, terminal_image_loader_job_free);
+  g_task_run_in_thread (task, terminal_image_loader_render_job);
+  g_object_unref (G_OBJECT (task));
+
+#ifdef G_ENABLE_DEBUG
+  loader->cache_misses++;
+  g_debug ("Image Loader Memory Status: %u images using %" G_GSIZE_FORMAT " of %"
+           G_GSIZE_FORMAT " bytes, %u hits, %u misses (%.1f%% hit rate)",
+           g_queue_get_length (&loader->cache_lru),
+           loader->cache_bytes, loader->cache_budget,
+           loader->cache_hits, loader->cache_misses,
+           100.0 * loader->cache_hits / (loader->cache_hits + loader->cache_misses));
+#endif
+
+  return NULL;
+}
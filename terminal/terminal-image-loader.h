@@ -38,9 +38,10 @@ GType                terminal_image_loader_get_type (void) G_GNUC_CONST;
 
 TerminalImageLoader *terminal_image_loader_get      (void);
 
-GdkPixbuf           *terminal_image_loader_load     (TerminalImageLoader *loader,
+cairo_surface_t     *terminal_image_loader_load     (TerminalImageLoader *loader,
                                                      gint                 width,
-                                                     gint                 height);
+                                                     gint                 height,
+                                                     gint                 scale);
 
 G_END_DECLS
 
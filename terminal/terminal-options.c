@@ -137,6 +137,7 @@ terminal_tab_attr_free (TerminalTabAttr *attr)
   g_free (attr->directory);
   g_free (attr->title);
   g_free (attr->initial_title);
+  g_strfreev (attr->environment);
   g_slice_free (TerminalTabAttr, attr);
 }
 
@@ -148,9 +149,13 @@ terminal_options_parse (gint       argc,
                         gboolean  *show_help,
                         gboolean  *show_version,
                         gboolean  *show_colors,
-                        gboolean  *disable_server)
+                        gboolean  *disable_server,
+                        gboolean  *save_contents,
+                        gchar    **save_filename,
+                        gchar    **save_format)
 {
   gint   n;
+  gchar *s;
 
   for (n = 1; n < argc; ++n)
     {
@@ -170,6 +175,14 @@ terminal_options_parse (gint       argc,
         *disable_server = TRUE;
       else if (terminal_option_cmp ("color-table", 0, argc, argv, &n, NULL))
         *show_colors = TRUE;
+      else if (terminal_option_cmp ("save-contents", 0, argc, argv, &n, &s))
+        {
+          /* checked in main, the filename is optional here */
+          *save_contents = TRUE;
+          *save_filename = s;
+        }
+      else if (terminal_option_cmp ("save-format", 0, argc, argv, &n, &s))
+        *save_format = s;
     }
 }
 
@@ -588,6 +601,189 @@ failed:
 
 
 
+static gboolean
+terminal_tab_attr_parse_variant (TerminalTabAttr  *tab_attr,
+                                 GVariant         *dict,
+                                 GError          **error)
+{
+  GVariant    *command;
+  const gchar *s;
+  gboolean     hold;
+
+  command = g_variant_lookup_value (dict, "command", NULL);
+  if (command != NULL)
+    {
+      g_strfreev (tab_attr->command);
+      tab_attr->command = NULL;
+
+      if (g_variant_is_of_type (command, G_VARIANT_TYPE_STRING_ARRAY))
+        {
+          /* argument vector, nothing to parse */
+          tab_attr->command = g_variant_dup_strv (command, NULL);
+        }
+      else if (!g_variant_is_of_type (command, G_VARIANT_TYPE_STRING))
+        {
+          g_set_error_literal (error, G_SHELL_ERROR, G_SHELL_ERROR_FAILED,
+                               _("The \"command\" of a tab must be a string or a string array"));
+        }
+      else if (!g_shell_parse_argv (g_variant_get_string (command, NULL), NULL, &tab_attr->command, error))
+        {
+          /* same as --command */
+          tab_attr->command = NULL;
+        }
+
+      g_variant_unref (command);
+
+      if (tab_attr->command == NULL)
+        return FALSE;
+    }
+
+  if (g_variant_lookup (dict, "cwd", "&s", &s))
+    {
+      g_free (tab_attr->directory);
+      tab_attr->directory = g_strdup (s);
+    }
+
+  if (g_variant_lookup (dict, "title", "&s", &s))
+    {
+      g_free (tab_attr->title);
+      tab_attr->title = g_strdup (s);
+    }
+
+  /* KEY=VALUE to set or KEY to unset a variable of the child */
+  if (g_variant_lookup (dict, "env", "as", NULL))
+    {
+      g_strfreev (tab_attr->environment);
+      g_variant_lookup (dict, "env", "^as", &tab_attr->environment);
+    }
+
+  if (g_variant_lookup (dict, "hold", "b", &hold))
+    tab_attr->hold = hold;
+
+  return TRUE;
+}
+
+
+
+/**
+ * terminal_window_attr_parse_variant:
+ * @windows : A #GVariant of type aa{sv}, one dictionary per window.
+ * @error   : Return location for errors or %NULL.
+ *
+ * Builds window attributes from structured descriptors instead of a
+ * command line. Each window dictionary can have "display", "geometry",
+ * "role", "icon", "font", "startup-id", "fullscreen", "maximize" and
+ * "minimize", plus a "tabs" array of dictionaries with "command",
+ * "cwd", "title", "env" and "hold". Without "tabs" the tab keys of
+ * the window dictionary describe its only tab.
+ *
+ * Return value: %NULL on failure.
+ **/
+GSList *
+terminal_window_attr_parse_variant (GVariant  *windows,
+                                    GError   **error)
+{
+  TerminalWindowAttr *win_attr;
+  TerminalTabAttr    *tab_attr;
+  GVariantIter        iter, tab_iter;
+  GVariant           *dict, *tab_dict, *tabs;
+  GSList             *attrs = NULL, *lp;
+  const gchar        *s;
+  gboolean            b;
+
+  terminal_return_val_if_fail (g_variant_is_of_type (windows, G_VARIANT_TYPE ("aa{sv}")), NULL);
+
+  g_variant_iter_init (&iter, windows);
+  while ((dict = g_variant_iter_next_value (&iter)) != NULL)
+    {
+      win_attr = terminal_window_attr_new ();
+      attrs = g_slist_prepend (attrs, win_attr);
+
+      if (g_variant_lookup (dict, "display", "&s", &s))
+        win_attr->display = g_strdup (s);
+      if (g_variant_lookup (dict, "geometry", "&s", &s))
+        win_attr->geometry = g_strdup (s);
+      if (g_variant_lookup (dict, "role", "&s", &s))
+        win_attr->role = g_strdup (s);
+      if (g_variant_lookup (dict, "icon", "&s", &s))
+        win_attr->icon = g_strdup (s);
+      if (g_variant_lookup (dict, "font", "&s", &s))
+        win_attr->font = g_strdup (s);
+      if (g_variant_lookup (dict, "startup-id", "&s", &s))
+        win_attr->startup_id = g_strdup (s);
+      if (g_variant_lookup (dict, "fullscreen", "b", &b))
+        win_attr->fullscreen = b;
+      if (g_variant_lookup (dict, "maximize", "b", &b))
+        win_attr->maximize = b;
+      if (g_variant_lookup (dict, "minimize", "b", &b))
+        win_attr->minimize = b;
+
+      tabs = g_variant_lookup_value (dict, "tabs", G_VARIANT_TYPE ("aa{sv}"));
+      if (tabs == NULL)
+        {
+          /* single tab window */
+          if (!terminal_tab_attr_parse_variant (win_attr->tabs->data, dict, error))
+            goto failed;
+        }
+      else
+        {
+          /* replace the default tab */
+          g_slist_foreach (win_attr->tabs, (GFunc) terminal_tab_attr_free, NULL);
+          g_slist_free (win_attr->tabs);
+          win_attr->tabs = NULL;
+
+          g_variant_iter_init (&tab_iter, tabs);
+          while ((tab_dict = g_variant_iter_next_value (&tab_iter)) != NULL)
+            {
+              tab_attr = g_slice_new0 (TerminalTabAttr);
+              tab_attr->dynamic_title_mode = TERMINAL_TITLE_DEFAULT;
+              win_attr->tabs = g_slist_prepend (win_attr->tabs, tab_attr);
+
+              if (!terminal_tab_attr_parse_variant (tab_attr, tab_dict, error))
+                {
+                  g_variant_unref (tab_dict);
+                  g_variant_unref (tabs);
+                  goto failed;
+                }
+
+              g_variant_unref (tab_dict);
+            }
+
+          g_variant_unref (tabs);
+          win_attr->tabs = g_slist_reverse (win_attr->tabs);
+
+          if (win_attr->tabs == NULL)
+            {
+              g_set_error_literal (error, G_SHELL_ERROR, G_SHELL_ERROR_FAILED,
+                                   _("A window needs at least one tab"));
+              goto failed;
+            }
+        }
+
+      g_variant_unref (dict);
+    }
+
+  if (G_UNLIKELY (attrs == NULL))
+    {
+      g_set_error_literal (error, G_SHELL_ERROR, G_SHELL_ERROR_FAILED,
+                           _("No windows to open"));
+    }
+
+  return g_slist_reverse (attrs);
+
+failed:
+
+  g_variant_unref (dict);
+
+  for (lp = attrs; lp != NULL; lp = lp->next)
+    terminal_window_attr_free (lp->data);
+  g_slist_free (attrs);
+
+  return NULL;
+}
+
+
+
 /**
  **/
 TerminalWindowAttr*
@@ -58,6 +58,7 @@ typedef struct
   gchar        *directory;
   gchar        *title;
   gchar        *initial_title;
+  gchar       **environment;
   TerminalTitle dynamic_title_mode;
   guint         hold : 1;
 } TerminalTabAttr;
@@ -77,6 +78,7 @@ typedef struct
   guint                maximize : 1;
   guint                minimize : 1;
   guint                reuse_last_window : 1;
+  guint                session_restore : 1;
   TerminalVisibility   menubar;
   TerminalVisibility   borders;
   TerminalVisibility   toolbar;
@@ -84,21 +86,27 @@ typedef struct
   TerminalZoomLevel    zoom;
 } TerminalWindowAttr;
 
-void                terminal_options_parse     (gint                 argc,
-                                                gchar              **argv,
-                                                gboolean            *show_help,
-                                                gboolean            *show_version,
-                                                gboolean            *show_colors,
-                                                gboolean            *disable_server);
+void                terminal_options_parse             (gint                 argc,
+                                                        gchar              **argv,
+                                                        gboolean            *show_help,
+                                                        gboolean            *show_version,
+                                                        gboolean            *show_colors,
+                                                        gboolean            *disable_server,
+                                                        gboolean            *save_contents,
+                                                        gchar              **save_filename,
+                                                        gchar              **save_format);
 
-GSList             *terminal_window_attr_parse (gint                 argc,
-                                                gchar              **argv,
-                                                gboolean             can_reuse_tab,
-                                                GError             **error);
+GSList             *terminal_window_attr_parse         (gint                 argc,
+                                                        gchar              **argv,
+                                                        gboolean             can_reuse_tab,
+                                                        GError             **error);
 
-TerminalWindowAttr *terminal_window_attr_new   (void);
+GSList             *terminal_window_attr_parse_variant (GVariant            *windows,
+                                                        GError             **error);
 
-void                terminal_window_attr_free  (TerminalWindowAttr  *attr);
+TerminalWindowAttr *terminal_window_attr_new           (void);
+
+void                terminal_window_attr_free          (TerminalWindowAttr  *attr);
 
 G_END_DECLS
 
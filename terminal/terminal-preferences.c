@@ -36,8 +36,10 @@
 #include <terminal/terminal-preferences.h>
 #include <terminal/terminal-private.h>
 
-#define TERMINALRC     "xfce4/terminal/terminalrc"
-#define TERMINALRC_OLD "Terminal/terminalrc"
+#define TERMINALRC            "xfce4/terminal/terminalrc"
+#define TERMINALRC_OLD        "Terminal/terminalrc"
+#define TERMINALRC_CACHE      "xfce4/terminal/terminalrc.cache"
+#define TERMINALRC_CACHE_TYPE "(ssstua(sv)s)"
 
 
 enum
@@ -48,6 +50,7 @@ enum
   PROP_BACKGROUND_IMAGE_STYLE,
   PROP_BACKGROUND_DARKNESS,
   PROP_BACKGROUND_IMAGE_SHADING,
+  PROP_BACKGROUND_IMAGE_CACHE_SIZE,
   PROP_BINDING_BACKSPACE,
   PROP_BINDING_DELETE,
   PROP_BINDING_AMBIGUOUS_WIDTH,
@@ -110,6 +113,10 @@ enum
   PROP_MISC_USE_SHIFT_ARROWS_TO_SCROLL,
   PROP_MISC_SLIM_TABS,
   PROP_MISC_NEW_TAB_ADJACENT,
+  PROP_MISC_RESTORE_TABS,
+  PROP_MISC_SHELL_POOL_SIZE,
+  PROP_MISC_SHOW_STATISTICS,
+  PROP_MISC_SCROLLBACK_BUDGET,
   PROP_SCROLLING_BAR,
   PROP_SCROLLING_LINES,
   PROP_SCROLLING_ON_OUTPUT,
@@ -139,10 +146,28 @@ struct _TerminalPreferences
 
   GFile        *file;
   GFileMonitor *monitor;
-  guint64       last_mtime;
+  gchar        *last_etag;
 
   guint         store_idle_id;
+  guint         reload_idle_id;
   guint         loading_in_progress : 1;
+  guint         store_in_progress : 1;
+  guint         store_pending : 1;
+
+  /* serialized rc lines, only rebuilt for changed properties */
+  gchar        *entries[N_PROPERTIES];
+  gboolean      entries_dirty[N_PROPERTIES];
+  gchar        *unknown_entries;
+
+  /* contents of the rc file as last loaded or written */
+  gchar        *stored_contents;
+  guint         stored_contents_unread : 1;
+
+  TerminalPreferencesSnapshot snapshot;
+  guint                       snapshot_dirty : 1;
+
+  /* created on demand, dropped when a color-* property changes */
+  TerminalColorScheme        *color_scheme;
 };
 
 
@@ -158,7 +183,15 @@ static void     terminal_preferences_set_property       (GObject             *ob
                                                          const GValue        *value,
                                                          GParamSpec          *pspec);
 static void     terminal_preferences_load               (TerminalPreferences *preferences);
+static gboolean terminal_preferences_apply_value        (TerminalPreferences *preferences,
+                                                         guint                prop_id,
+                                                         const GValue        *value);
 static void     terminal_preferences_schedule_store     (TerminalPreferences *preferences);
+static void     terminal_preferences_store              (TerminalPreferences *preferences,
+                                                         gboolean             synchronous);
+static void     terminal_preferences_store_finished     (GObject             *source,
+                                                         GAsyncResult        *result,
+                                                         gpointer             user_data);
 static gboolean terminal_preferences_store_idle         (gpointer             user_data);
 static void     terminal_preferences_store_idle_destroy (gpointer             user_data);
 static void     terminal_preferences_monitor_changed    (GFileMonitor        *monitor,
@@ -166,10 +199,15 @@ static void     terminal_preferences_monitor_changed    (GFileMonitor        *mo
                                                          GFile               *other_file,
                                                          GFileMonitorEvent    event_type,
                                                          TerminalPreferences *preferences);
+static gboolean terminal_preferences_reload_idle        (gpointer             user_data);
+static void     terminal_preferences_reload_destroy     (gpointer             user_data);
 static void     terminal_preferences_monitor_disconnect (TerminalPreferences *preferences);
 static void     terminal_preferences_monitor_connect    (TerminalPreferences *preferences,
-                                                         const gchar         *filename,
-                                                         gboolean             update_mtime);
+                                                         const gchar         *filename);
+static void     terminal_preferences_snapshot_update    (TerminalPreferences *preferences);
+static void     terminal_preferences_value_changed      (TerminalPreferences *preferences,
+                                                         guint                prop_id);
+static void     terminal_preferences_update_colors      (TerminalPreferences *preferences);
 
 
 
@@ -359,6 +397,20 @@ terminal_preferences_class_init (TerminalPreferencesClass *klass)
                            0.0, 1.0, 0.5,
                            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
 
+  /**
+   * TerminalPreferences:background-image-cache-size:
+   *
+   * Maximum amount of memory, in megabytes, the scaled versions of the
+   * background image are allowed to use. Least recently used images are
+   * dropped when the limit is exceeded. Hidden option.
+   **/
+  preferences_props[PROP_BACKGROUND_IMAGE_CACHE_SIZE] =
+      g_param_spec_uint ("background-image-cache-size",
+                         NULL,
+                         "BackgroundImageCacheSize",
+                         1u, 1024u, 64u,
+                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
   /**
    * TerminalPreferences:binding-backspace:
    **/
@@ -1022,6 +1074,64 @@ terminal_preferences_class_init (TerminalPreferencesClass *klass)
                             FALSE,
                             G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
 
+  /**
+   * TerminalPreferences:misc-restore-tabs:
+   *
+   * When the children of the tabs of a restored session are started.
+   * Lazy tabs only start their child when they are shown for the first
+   * time. Hidden option.
+   **/
+  preferences_props[PROP_MISC_RESTORE_TABS] =
+      g_param_spec_enum ("misc-restore-tabs",
+                         NULL,
+                         "MiscRestoreTabs",
+                         TERMINAL_TYPE_RESTORE_TABS,
+                         TERMINAL_RESTORE_TABS_LAZY_SHELLS,
+                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * TerminalPreferences:misc-shell-pool-size:
+   *
+   * Number of default shells that are spawned ahead of time, so
+   * a new tab can take over a running shell instead of forking
+   * one. The shells are started before their window exists, so
+   * they do not get WINDOWID. Zero disables the pool. Hidden
+   * option.
+   **/
+  preferences_props[PROP_MISC_SHELL_POOL_SIZE] =
+      g_param_spec_uint ("misc-shell-pool-size",
+                         NULL,
+                         "MiscShellPoolSize",
+                         0u, 8u, 0u,
+                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * TerminalPreferences:misc-show-statistics:
+   *
+   * Show the output counters and draw time of each tab on top
+   * of the terminal. Hidden option.
+   **/
+  preferences_props[PROP_MISC_SHOW_STATISTICS] =
+      g_param_spec_boolean ("misc-show-statistics",
+                            NULL,
+                            "MiscShowStatistics",
+                            FALSE,
+                            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * TerminalPreferences:misc-scrollback-budget:
+   *
+   * Scrollback lines of all tabs together. Visible and recently used
+   * tabs get a larger share, idle background tabs are trimmed. Zero
+   * leaves the scrollback of each tab alone. Hidden option.
+   **/
+  preferences_props[PROP_MISC_SCROLLBACK_BUDGET] =
+      g_param_spec_uint ("misc-scrollback-budget",
+                         NULL,
+                         "MiscScrollbackBudget",
+                         0u, G_MAXINT, 0u,
+                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
   /**
    * TerminalPreferences:scrolling-bar:
    **/
@@ -1147,6 +1257,14 @@ terminal_preferences_class_init (TerminalPreferencesClass *klass)
 static void
 terminal_preferences_init (TerminalPreferences *preferences)
 {
+  guint n;
+
+  preferences->snapshot_dirty = TRUE;
+
+  /* serialize all the entries on the first store */
+  for (n = PROP_0 + 1; n < N_PROPERTIES; ++n)
+    preferences->entries_dirty[n] = TRUE;
+
   /* load settings */
   terminal_preferences_load (preferences);
 }
@@ -1161,11 +1279,19 @@ terminal_preferences_dispose (GObject *object)
   /* stop file monitoring */
   terminal_preferences_monitor_disconnect (preferences);
 
-  /* flush preferences */
+  if (G_UNLIKELY (preferences->reload_idle_id != 0))
+    g_source_remove (preferences->reload_idle_id);
+
+  /* flush preferences; a write that is still running finishes first,
+   * so it cannot rename an older version over the one written here,
+   * and queues the changes made during it in a new store idle */
+  while (G_UNLIKELY (preferences->store_in_progress))
+    g_main_context_iteration (NULL, TRUE);
+
   if (G_UNLIKELY (preferences->store_idle_id != 0))
     {
       g_source_remove (preferences->store_idle_id);
-      terminal_preferences_store_idle (preferences);
+      terminal_preferences_store (preferences, TRUE);
     }
 
   (*G_OBJECT_CLASS (terminal_preferences_parent_class)->dispose) (object);
@@ -1180,8 +1306,21 @@ terminal_preferences_finalize (GObject *object)
   guint                n;
 
   for (n = 1; n < N_PROPERTIES; ++n)
-    if (G_IS_VALUE (preferences->values + n))
-      g_value_unset (preferences->values + n);
+    {
+      if (G_IS_VALUE (preferences->values + n))
+        g_value_unset (preferences->values + n);
+      g_free (preferences->entries[n]);
+    }
+
+  g_free (preferences->unknown_entries);
+  g_free (preferences->stored_contents);
+  g_free (preferences->last_etag);
+
+  g_free (preferences->snapshot.background_image_file);
+  g_free (preferences->snapshot.title_initial);
+
+  if (preferences->color_scheme != NULL)
+    terminal_color_scheme_unref (preferences->color_scheme);
 
   (*G_OBJECT_CLASS (terminal_preferences_parent_class)->finalize) (object);
 }
@@ -1238,6 +1377,8 @@ terminal_preferences_set_property (GObject      *object,
     {
       g_value_copy (value, dst);
 
+      terminal_preferences_value_changed (preferences, prop_id);
+
       /* don't schedule a store if loading */
       if (!preferences->loading_in_progress)
         {
@@ -1292,43 +1433,295 @@ terminal_preferences_check_blurb (GParamSpec *spec)
 
 
 
+static guint
+terminal_preferences_find_blurb (const gchar *blurb)
+{
+  guint n;
+
+  for (n = PROP_0 + 1; n < N_PROPERTIES; ++n)
+    if (strcmp (g_param_spec_get_blurb (preferences_props[n]), blurb) == 0)
+      return n;
+
+  return PROP_0;
+}
+
+
+
 static void
-terminal_preferences_load (TerminalPreferences *preferences)
+terminal_preferences_append_entry (GString     *contents,
+                                   const gchar *key,
+                                   const gchar *value)
 {
-  gchar        *filename;
-  const gchar  *string, *name;
+  const gchar *p, *end;
+
+  if (G_UNLIKELY (value == NULL))
+    return;
+
+  g_string_append (contents, key);
+  g_string_append_c (contents, '=');
+
+  /* escape the value the same way xfce_rc_flush() does, so the
+   * file can still be read with xfce_rc_simple_open() */
+  end = value + strlen (value);
+  while (end > value && end[-1] == ' ')
+    end--;
+  for (p = value; p < end && *p == ' '; p++)
+    g_string_append (contents, "\\ ");
+
+  for (; p < end; p++)
+    {
+      switch (*p)
+        {
+        case '\n': g_string_append (contents, "\\n"); break;
+        case '\t': g_string_append (contents, "\\t"); break;
+        case '\r': g_string_append (contents, "\\r"); break;
+        case '\\': g_string_append (contents, "\\\\"); break;
+        default: g_string_append_c (contents, *p); break;
+        }
+    }
+
+  for (; *p != '\0'; p++)
+    g_string_append (contents, "\\ ");
+
+  g_string_append_c (contents, '\n');
+}
+
+
+
+static GVariant *
+terminal_preferences_value_to_variant (const GValue *value)
+{
+  switch (G_TYPE_FUNDAMENTAL (G_VALUE_TYPE (value)))
+    {
+    case G_TYPE_BOOLEAN:
+      return g_variant_new_boolean (g_value_get_boolean (value));
+
+    case G_TYPE_UINT:
+      return g_variant_new_uint32 (g_value_get_uint (value));
+
+    case G_TYPE_DOUBLE:
+      return g_variant_new_double (g_value_get_double (value));
+
+    case G_TYPE_ENUM:
+      return g_variant_new_int32 (g_value_get_enum (value));
+
+    case G_TYPE_STRING:
+      if (G_LIKELY (g_value_get_string (value) != NULL))
+        return g_variant_new_string (g_value_get_string (value));
+      return NULL;
+
+    default:
+      terminal_assert_not_reached ();
+      return NULL;
+    }
+}
+
+
+
+static gboolean
+terminal_preferences_variant_to_value (GVariant *variant,
+                                       GValue   *value)
+{
+  switch (G_TYPE_FUNDAMENTAL (G_VALUE_TYPE (value)))
+    {
+    case G_TYPE_BOOLEAN:
+      if (!g_variant_is_of_type (variant, G_VARIANT_TYPE_BOOLEAN))
+        return FALSE;
+      g_value_set_boolean (value, g_variant_get_boolean (variant));
+      return TRUE;
+
+    case G_TYPE_UINT:
+      if (!g_variant_is_of_type (variant, G_VARIANT_TYPE_UINT32))
+        return FALSE;
+      g_value_set_uint (value, g_variant_get_uint32 (variant));
+      return TRUE;
+
+    case G_TYPE_DOUBLE:
+      if (!g_variant_is_of_type (variant, G_VARIANT_TYPE_DOUBLE))
+        return FALSE;
+      g_value_set_double (value, g_variant_get_double (variant));
+      return TRUE;
+
+    case G_TYPE_ENUM:
+      if (!g_variant_is_of_type (variant, G_VARIANT_TYPE_INT32))
+        return FALSE;
+      g_value_set_enum (value, g_variant_get_int32 (variant));
+      return TRUE;
+
+    case G_TYPE_STRING:
+      if (!g_variant_is_of_type (variant, G_VARIANT_TYPE_STRING))
+        return FALSE;
+      g_value_set_string (value, g_variant_get_string (variant, NULL));
+      return TRUE;
+
+    default:
+      return FALSE;
+    }
+}
+
+
+
+static gboolean
+terminal_preferences_load_cache (TerminalPreferences *preferences,
+                                 const gchar         *filename,
+                                 const gchar         *etag,
+                                 goffset              size,
+                                 GValue              *values)
+{
+  gchar        *cachename;
+  GMappedFile  *mapped;
+  GBytes       *bytes;
+  GVariant     *cache, *array, *variant;
+  GVariantIter  iter;
   GParamSpec   *pspec;
-  XfceRc       *rc;
-  GValue        dst = { 0, };
-  GValue        src = { 0, };
-  GValue       *value;
-  guint         n;
-  gboolean      migrate_colors = FALSE;
-  gchar         color_name[16];
-  GString      *array;
+  const gchar  *version, *source, *cache_etag, *unknown, *name;
+  guint64       cache_size;
+  guint32       n_properties;
+  guint         prop_id;
+  gboolean      valid = FALSE;
+
+  cachename = xfce_resource_lookup (XFCE_RESOURCE_CONFIG, TERMINALRC_CACHE);
+  if (G_UNLIKELY (cachename == NULL))
+    return FALSE;
+
+  mapped = g_mapped_file_new (cachename, FALSE, NULL);
+  g_free (cachename);
+  if (G_UNLIKELY (mapped == NULL))
+    return FALSE;
+
+  /* the file is not trusted, gvariant validates it while reading */
+  bytes = g_mapped_file_get_bytes (mapped);
+  cache = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (TERMINALRC_CACHE_TYPE), bytes, FALSE));
+  g_bytes_unref (bytes);
+  g_mapped_file_unref (mapped);
+
+  g_variant_get (cache, "(&s&s&stu@a(sv)&s)", &version, &source, &cache_etag,
+                 &cache_size, &n_properties, &array, &unknown);
+
+  /* values are stored by property name, so a reordered property enum
+   * does not mix them up; the type of a property can still change
+   * between builds, a value of the wrong type is dropped below */
+  if (strcmp (version, PACKAGE_VERSION) == 0
+      && n_properties == N_PROPERTIES
+      && strcmp (source, filename) == 0
+      && strcmp (cache_etag, etag) == 0
+      && cache_size == (guint64) size)
+    {
+      valid = TRUE;
 
-  filename = xfce_resource_lookup (XFCE_RESOURCE_CONFIG, TERMINALRC);
-  if (G_UNLIKELY (filename == NULL))
+      g_variant_iter_init (&iter, array);
+      while (g_variant_iter_next (&iter, "(&sv)", &name, &variant))
+        {
+          pspec = g_object_class_find_property (G_OBJECT_GET_CLASS (preferences), name);
+          prop_id = pspec != NULL ? pspec->param_id : PROP_0;
+          if (G_LIKELY (prop_id > PROP_0 && prop_id < N_PROPERTIES
+                        && preferences_props[prop_id] == pspec
+                        && !G_IS_VALUE (values + prop_id)))
+            {
+              g_value_init (values + prop_id, G_PARAM_SPEC_VALUE_TYPE (preferences_props[prop_id]));
+              if (terminal_preferences_variant_to_value (variant, values + prop_id))
+                g_param_value_validate (preferences_props[prop_id], values + prop_id);
+              else
+                g_value_unset (values + prop_id);
+            }
+
+          g_variant_unref (variant);
+        }
+
+      g_free (preferences->unknown_entries);
+      preferences->unknown_entries = *unknown != '\0' ? g_strdup (unknown) : NULL;
+    }
+
+  g_variant_unref (array);
+  g_variant_unref (cache);
+
+  return valid;
+}
+
+
+
+static void
+terminal_preferences_save_cache_finished (GObject      *source,
+                                          GAsyncResult *result,
+                                          gpointer      user_data)
+{
+  /* the cache is an optimization, failing to write it is not an error */
+  g_file_replace_contents_finish (G_FILE (source), result, NULL, NULL);
+}
+
+
+
+static void
+terminal_preferences_save_cache (TerminalPreferences *preferences,
+                                 const GValue        *values,
+                                 const gchar         *filename,
+                                 const gchar         *etag,
+                                 goffset              size)
+{
+  GVariantBuilder  builder;
+  GVariant        *cache, *variant;
+  GBytes          *bytes;
+  GFile           *file;
+  gchar           *cachename;
+  guint            n;
+
+  cachename = xfce_resource_save_location (XFCE_RESOURCE_CONFIG, TERMINALRC_CACHE, TRUE);
+  if (G_UNLIKELY (cachename == NULL))
+    return;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sv)"));
+  for (n = PROP_0 + 1; n < N_PROPERTIES; ++n)
     {
-      /* old location of the Terminal days */
-      filename = xfce_resource_lookup (XFCE_RESOURCE_CONFIG, TERMINALRC_OLD);
-      migrate_colors = TRUE;
-      if (G_UNLIKELY (filename == NULL))
-        return;
+      if (!G_IS_VALUE (values + n))
+        continue;
+
+      variant = terminal_preferences_value_to_variant (values + n);
+      if (G_LIKELY (variant != NULL))
+        g_variant_builder_add (&builder, "(sv)", g_param_spec_get_name (preferences_props[n]), variant);
     }
 
-  rc = xfce_rc_simple_open (filename, TRUE);
-  if (G_UNLIKELY (rc == NULL))
-    goto connect_monitor;
+  cache = g_variant_ref_sink (g_variant_new (TERMINALRC_CACHE_TYPE, PACKAGE_VERSION,
+                                             filename, etag, (guint64) size,
+                                             (guint32) N_PROPERTIES, &builder,
+                                             preferences->unknown_entries != NULL
+                                             ? preferences->unknown_entries : ""));
+
+  /* written from a gio worker thread, like the rc file itself */
+  bytes = g_variant_get_data_as_bytes (cache);
+  file = g_file_new_for_path (cachename);
+  g_file_replace_contents_bytes_async (file, bytes, NULL, FALSE,
+                                       G_FILE_CREATE_NONE, NULL,
+                                       terminal_preferences_save_cache_finished,
+                                       NULL);
+
+  g_object_unref (G_OBJECT (file));
+  g_bytes_unref (bytes);
+  g_variant_unref (cache);
+  g_free (cachename);
+}
 
-  preferences->loading_in_progress = TRUE;
 
-  g_object_freeze_notify (G_OBJECT (preferences));
+
+static void
+terminal_preferences_load_rc (TerminalPreferences *preferences,
+                              XfceRc              *rc,
+                              GValue              *values,
+                              gboolean             migrate_colors)
+{
+  const gchar  *string, *name;
+  GParamSpec   *pspec;
+  GValue        src = { 0, };
+  guint         n;
+  gchar         color_name[16];
+  GString      *array;
+  gchar       **keys;
 
   xfce_rc_set_group (rc, "Configuration");
 
   g_value_init (&src, G_TYPE_STRING);
 
+  /* parse the file into a scratch array first, so we can compare
+   * the result with the current values afterwards */
   for (n = PROP_0 + 1; n < N_PROPERTIES; ++n)
     {
       pspec = preferences_props[n];
@@ -1341,33 +1734,19 @@ terminal_preferences_load (TerminalPreferences *preferences)
 
       string = xfce_rc_read_entry (rc, g_param_spec_get_blurb (pspec), NULL);
       if (G_UNLIKELY (string == NULL))
+        continue;
+
+      g_value_set_static_string (&src, string);
+      g_value_init (values + n, G_PARAM_SPEC_VALUE_TYPE (pspec));
+
+      if (G_LIKELY (g_value_transform (&src, values + n)))
         {
-          /* check if we need to reset to the default value */
-          value = preferences->values + n;
-          if (G_IS_VALUE (value))
-            {
-              g_value_unset (value);
-              g_object_notify_by_pspec (G_OBJECT (preferences), pspec);
-            }
+          g_param_value_validate (pspec, values + n);
         }
       else
         {
-          g_value_set_static_string (&src, string);
-
-          if (G_PARAM_SPEC_VALUE_TYPE (pspec) == G_TYPE_STRING)
-            {
-              /* set the string property */
-              g_object_set_property (G_OBJECT (preferences), name, &src);
-            }
-          else
-            {
-              g_value_init (&dst, G_PARAM_SPEC_VALUE_TYPE (pspec));
-              if (G_LIKELY (g_value_transform (&src, &dst)))
-                g_object_set_property (G_OBJECT (preferences), name, &dst);
-              else
-                g_warning ("Unable to load property \"%s\"", name);
-              g_value_unset (&dst);
-            }
+          g_warning ("Unable to load property \"%s\"", name);
+          g_value_unset (values + n);
         }
     }
 
@@ -1390,27 +1769,285 @@ terminal_preferences_load (TerminalPreferences *preferences)
 
       /* set property if 16 colors were found */
       if (n >= 16)
-        g_object_set (G_OBJECT (preferences), "color-palette", array->str, NULL);
+        {
+          if (!G_IS_VALUE (values + PROP_COLOR_PALETTE))
+            g_value_init (values + PROP_COLOR_PALETTE, G_TYPE_STRING);
+          g_value_set_string (values + PROP_COLOR_PALETTE, array->str);
+        }
       g_string_free (array, TRUE);
     }
 
   g_value_unset (&src);
 
-  xfce_rc_close (rc);
+  /* keep entries we don't know about (newer versions, hand edits) so
+   * they survive our next store, the old rc is not carried over */
+  g_free (preferences->unknown_entries);
+  preferences->unknown_entries = NULL;
+
+  keys = migrate_colors ? NULL : xfce_rc_get_entries (rc, "Configuration");
+  if (keys != NULL)
+    {
+      array = g_string_new (NULL);
+      for (n = 0; keys[n] != NULL; n++)
+        if (terminal_preferences_find_blurb (keys[n]) == PROP_0)
+          terminal_preferences_append_entry (array, keys[n], xfce_rc_read_entry (rc, keys[n], NULL));
+      preferences->unknown_entries = g_string_free (array, array->len == 0);
+      g_strfreev (keys);
+    }
+}
+
+
+
+static void
+terminal_preferences_load (TerminalPreferences *preferences)
+{
+  gchar        *filename;
+  XfceRc       *rc;
+  GValue        values[N_PROPERTIES] = { { 0, }, };
+  GFile        *file;
+  GFileInfo    *info = NULL;
+  const gchar  *etag = NULL;
+  goffset       size = 0;
+  guint         n;
+  gboolean      migrate_colors = FALSE;
+
+  filename = xfce_resource_lookup (XFCE_RESOURCE_CONFIG, TERMINALRC);
+  if (G_UNLIKELY (filename == NULL))
+    {
+      /* old location of the Terminal days */
+      filename = xfce_resource_lookup (XFCE_RESOURCE_CONFIG, TERMINALRC_OLD);
+      migrate_colors = TRUE;
+      if (G_UNLIKELY (filename == NULL))
+        return;
+    }
+
+  preferences->loading_in_progress = TRUE;
+
+  /* the compiled cache is valid as long as the rc file is unchanged */
+  if (G_LIKELY (!migrate_colors))
+    {
+      file = g_file_new_for_path (filename);
+      info = g_file_query_info (file, G_FILE_ATTRIBUTE_ETAG_VALUE ","
+                                G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                                G_FILE_QUERY_INFO_NONE, NULL, NULL);
+      if (G_LIKELY (info != NULL))
+        {
+          etag = g_file_info_get_etag (info);
+          size = g_file_info_get_size (info);
+        }
+      g_object_unref (G_OBJECT (file));
+    }
+
+  if (etag == NULL
+      || !terminal_preferences_load_cache (preferences, filename, etag, size, values))
+    {
+      rc = xfce_rc_simple_open (filename, TRUE);
+      if (G_UNLIKELY (rc == NULL))
+        goto connect_monitor;
+
+      terminal_preferences_load_rc (preferences, rc, values, migrate_colors);
+
+      xfce_rc_close (rc);
+
+      /* compile the cache for the next startup */
+      if (etag != NULL)
+        terminal_preferences_save_cache (preferences, values, filename, etag, size);
+    }
+
+  /* this is the version of the file we know about now */
+  if (etag != NULL)
+    {
+      g_free (preferences->last_etag);
+      preferences->last_etag = g_strdup (etag);
+    }
+
+  /* apply the differences, only changed properties are notified */
+  g_object_freeze_notify (G_OBJECT (preferences));
+
+  for (n = PROP_0 + 1; n < N_PROPERTIES; ++n)
+    {
+      if (terminal_preferences_apply_value (preferences, n, values + n))
+        g_object_notify_by_pspec (G_OBJECT (preferences), preferences_props[n]);
+
+      if (G_IS_VALUE (values + n))
+        g_value_unset (values + n);
+    }
 
   g_object_thaw_notify (G_OBJECT (preferences));
 
+  /* what is on disk is read on the first store, so an unchanged
+   * store is a no-op without reading the rc on each startup */
+  g_free (preferences->stored_contents);
+  preferences->stored_contents = NULL;
+  preferences->stored_contents_unread = !migrate_colors;
+
 connect_monitor:
   /* startup file monitoring */
-  terminal_preferences_monitor_connect (preferences, filename, FALSE);
+  terminal_preferences_monitor_connect (preferences, filename);
 
   preferences->loading_in_progress = FALSE;
 
+  if (info != NULL)
+    g_object_unref (G_OBJECT (info));
   g_free (filename);
 }
 
 
 
+static gboolean
+terminal_preferences_apply_value (TerminalPreferences *preferences,
+                                  guint                prop_id,
+                                  const GValue        *value)
+{
+  GParamSpec *pspec = preferences_props[prop_id];
+  GValue     *dst = preferences->values + prop_id;
+  gboolean    changed;
+
+  if (!G_IS_VALUE (value))
+    {
+      /* the property was removed from the file, reset to the default */
+      if (!G_IS_VALUE (dst))
+        return FALSE;
+
+      changed = !g_param_value_defaults (pspec, dst);
+      g_value_unset (dst);
+    }
+  else
+    {
+      if (G_IS_VALUE (dst))
+        changed = g_param_values_cmp (pspec, value, dst) != 0;
+      else
+        changed = !g_param_value_defaults (pspec, (GValue *) value);
+
+      if (!changed)
+        return FALSE;
+
+      if (!G_IS_VALUE (dst))
+        g_value_init (dst, G_PARAM_SPEC_VALUE_TYPE (pspec));
+      g_value_copy (value, dst);
+    }
+
+  if (changed)
+    terminal_preferences_value_changed (preferences, prop_id);
+
+  return changed;
+}
+
+
+
+static void
+terminal_preferences_value_changed (TerminalPreferences *preferences,
+                                    guint                prop_id)
+{
+  /* rebuild the snapshot on the next request */
+  preferences->snapshot_dirty = TRUE;
+
+  /* reserialize the rc entry on the next store */
+  preferences->entries_dirty[prop_id] = TRUE;
+
+  /* the color properties are grouped in the enum */
+  if (prop_id >= PROP_COLOR_FOREGROUND && prop_id <= PROP_COLOR_PALETTE
+      && preferences->color_scheme != NULL)
+    {
+      terminal_color_scheme_unref (preferences->color_scheme);
+      preferences->color_scheme = NULL;
+    }
+}
+
+
+
+static void
+terminal_preferences_update_colors (TerminalPreferences *preferences)
+{
+  TerminalColorScheme  *scheme;
+  gchar                *palette_str;
+  gchar               **colors;
+  guint                 n = 0;
+
+  if (preferences->color_scheme != NULL)
+    terminal_color_scheme_unref (preferences->color_scheme);
+
+  scheme = g_slice_new0 (TerminalColorScheme);
+  scheme->ref_count = 1;
+  preferences->color_scheme = scheme;
+
+  g_object_get (G_OBJECT (preferences),
+                "color-palette", &palette_str,
+                "color-cursor-use-default", &scheme->cursor_use_default,
+                "color-selection-use-default", &scheme->selection_use_default,
+                "color-bold-use-default", &scheme->bold_use_default,
+                "color-background-vary", &scheme->background_vary,
+                NULL);
+
+  if (G_LIKELY (palette_str != NULL))
+    {
+      colors = g_strsplit (palette_str, ";", -1);
+      g_free (palette_str);
+
+      if (colors != NULL)
+        for (; n < 16 && colors[n] != NULL; n++)
+          if (!gdk_rgba_parse (scheme->palette + n, colors[n]))
+            {
+              g_warning ("Unable to parse color \"%s\".", colors[n]);
+              break;
+            }
+
+      g_strfreev (colors);
+      scheme->has_palette = (n == 16);
+    }
+
+  scheme->has_foreground = terminal_preferences_get_color (preferences, "color-foreground", &scheme->foreground);
+  scheme->has_background = terminal_preferences_get_color (preferences, "color-background", &scheme->background);
+  if (scheme->has_background)
+    {
+      gtk_rgb_to_hsv (scheme->background.red, scheme->background.green, scheme->background.blue,
+                      NULL, &scheme->background_saturation, &scheme->background_value);
+    }
+
+  scheme->has_cursor_foreground = terminal_preferences_get_color (preferences, "color-cursor-foreground", &scheme->cursor_foreground);
+  scheme->has_cursor = terminal_preferences_get_color (preferences, "color-cursor", &scheme->cursor);
+  scheme->has_selection = terminal_preferences_get_color (preferences, "color-selection", &scheme->selection);
+  scheme->has_selection_background = terminal_preferences_get_color (preferences, "color-selection-background", &scheme->selection_background);
+  scheme->has_bold = terminal_preferences_get_color (preferences, "color-bold", &scheme->bold);
+}
+
+
+
+static void
+terminal_preferences_snapshot_update (TerminalPreferences *preferences)
+{
+  TerminalPreferencesSnapshot *snapshot = &preferences->snapshot;
+
+  g_free (snapshot->background_image_file);
+  g_free (snapshot->title_initial);
+
+  g_object_get (G_OBJECT (preferences),
+                "background-mode", &snapshot->background_mode,
+                "background-image-file", &snapshot->background_image_file,
+                "background-image-style", &snapshot->background_image_style,
+                "background-image-cache-size", &snapshot->background_image_cache_size,
+                "background-darkness", &snapshot->background_darkness,
+                "background-image-shading", &snapshot->background_image_shading,
+                "misc-middle-click-opens-uri", &snapshot->misc_middle_click_opens_uri,
+                "misc-use-shift-arrows-to-scroll", &snapshot->misc_use_shift_arrows_to_scroll,
+                "misc-show-statistics", &snapshot->misc_show_statistics,
+                "shortcuts-no-menukey", &snapshot->shortcuts_no_menukey,
+                "title-initial", &snapshot->title_initial,
+                "title-mode", &snapshot->title_mode,
+                "tab-activity-timeout", &snapshot->tab_activity_timeout,
+                NULL);
+
+  snapshot->has_color_background =
+      terminal_preferences_get_color (preferences, "color-background", &snapshot->color_background);
+  snapshot->has_tab_activity_color =
+      terminal_preferences_get_color (preferences, "tab-activity-color", &snapshot->tab_activity_color);
+
+  snapshot->generation++;
+  preferences->snapshot_dirty = FALSE;
+}
+
+
+
 static void
 terminal_preferences_schedule_store (TerminalPreferences *preferences)
 {
@@ -1427,7 +2064,7 @@ terminal_preferences_schedule_store (TerminalPreferences *preferences)
 static void
 terminal_preferences_store_value (const GValue *value,
                                   const gchar  *property,
-                                  XfceRc       *rc)
+                                  GString      *contents)
 {
   GValue       dst = { 0, };
   const gchar *string;
@@ -1439,7 +2076,7 @@ terminal_preferences_store_value (const GValue *value,
       /* write */
       string = g_value_get_string (value);
       if (G_LIKELY (string != NULL))
-        xfce_rc_write_entry (rc, property, string);
+        terminal_preferences_append_entry (contents, property, string);
     }
   else
     {
@@ -1451,7 +2088,7 @@ terminal_preferences_store_value (const GValue *value,
       /* write */
       string = g_value_get_string (&dst);
       if (G_LIKELY (string != NULL))
-        xfce_rc_write_entry (rc, property, string);
+        terminal_preferences_append_entry (contents, property, string);
 
       /* cleanup */
       g_value_unset (&dst);
@@ -1460,79 +2097,208 @@ terminal_preferences_store_value (const GValue *value,
 
 
 
-static gboolean
-terminal_preferences_store_idle (gpointer user_data)
+static gchar *
+terminal_preferences_store_entry (TerminalPreferences *preferences,
+                                  guint                prop_id)
 {
-  TerminalPreferences  *preferences = TERMINAL_PREFERENCES (user_data);
-  const gchar          *blurb;
-  GParamSpec           *pspec;
-  XfceRc               *rc = NULL;
-  GValue               *value;
-  GValue                src = { 0, };
-  guint                 n;
-  gchar                *filename;
+  GParamSpec  *pspec = preferences_props[prop_id];
+  GValue      *value = preferences->values + prop_id;
+  GValue       src = { 0, };
+  const gchar *blurb;
+  GString     *entry;
 
-  /* try again later if we're loading */
-  if (G_UNLIKELY (preferences->loading_in_progress))
-    return TRUE;
+  blurb = g_param_spec_get_blurb (pspec);
+  entry = g_string_new (NULL);
 
-  filename = xfce_resource_save_location (XFCE_RESOURCE_CONFIG, TERMINALRC, TRUE);
-  if (G_UNLIKELY (filename == NULL))
-    goto error;
+  if (G_IS_VALUE (value)
+      && !g_param_value_defaults (pspec, value))
+    {
+      /* always save non-default values */
+      terminal_preferences_store_value (value, blurb, entry);
+    }
+  else if (g_str_has_prefix (blurb, "Misc"))
+    {
+      /* store the hidden-properties' default value */
+      g_value_init (&src, G_PARAM_SPEC_VALUE_TYPE (pspec));
+      g_param_value_set_default (pspec, &src);
+      terminal_preferences_store_value (&src, blurb, entry);
+      g_value_unset (&src);
+    }
 
-  rc = xfce_rc_simple_open (filename, FALSE);
-  if (G_UNLIKELY (rc == NULL))
-    goto error;
+  /* NULL removes the property from the configuration */
+  return g_string_free (entry, entry->len == 0);
+}
 
-  xfce_rc_set_group (rc, "Configuration");
 
-  for (n = PROP_0 + 1; n < N_PROPERTIES; ++n)
+
+static void
+terminal_preferences_store (TerminalPreferences *preferences,
+                            gboolean             synchronous)
+{
+  GString *contents;
+  GError  *error = NULL;
+  GFile   *file;
+  GBytes  *bytes;
+  gchar   *filename;
+  guint    n;
+
+  /* never run two writes at once, the older one could win the rename */
+  if (!synchronous && preferences->store_in_progress)
     {
-      pspec = preferences_props[n];
-      value = preferences->values + n;
-      blurb = g_param_spec_get_blurb (pspec);
+      preferences->store_pending = TRUE;
+      return;
+    }
 
-      if (G_IS_VALUE (value)
-          && !g_param_value_defaults (pspec, value))
-        {
-          /* always save non-default values */
-          terminal_preferences_store_value (value, blurb, rc);
-          continue;
-        }
+  contents = g_string_sized_new (4096);
+  g_string_append (contents, "[Configuration]\n");
 
-      if (g_str_has_prefix (blurb, "Misc"))
-        {
-          /* store the hidden-properties' default value */
-          g_value_init (&src, G_PARAM_SPEC_VALUE_TYPE (pspec));
-          g_param_value_set_default (pspec, &src);
-          terminal_preferences_store_value (&src, blurb, rc);
-          g_value_unset (&src);
-        }
-      else
+  for (n = PROP_0 + 1; n < N_PROPERTIES; ++n)
+    {
+      /* only serialize the properties that changed since the last store */
+      if (preferences->entries_dirty[n])
         {
-          /* remove from the configuration */
-          xfce_rc_delete_entry (rc, blurb, FALSE);
+          g_free (preferences->entries[n]);
+          preferences->entries[n] = terminal_preferences_store_entry (preferences, n);
+          preferences->entries_dirty[n] = FALSE;
         }
+
+      if (preferences->entries[n] != NULL)
+        g_string_append (contents, preferences->entries[n]);
     }
 
-  /* check if verything has been written */
-  xfce_rc_flush (rc);
-  if (xfce_rc_is_dirty (rc))
-    goto error;
+  if (preferences->unknown_entries != NULL)
+    g_string_append (contents, preferences->unknown_entries);
+
+  if (G_UNLIKELY (preferences->stored_contents_unread))
+    {
+      preferences->stored_contents_unread = FALSE;
+      filename = xfce_resource_lookup (XFCE_RESOURCE_CONFIG, TERMINALRC);
+      if (G_LIKELY (filename != NULL))
+        g_file_get_contents (filename, &preferences->stored_contents, NULL, NULL);
+      g_free (filename);
+    }
+
+  /* nothing to do if the file already looks like this */
+  if (g_strcmp0 (contents->str, preferences->stored_contents) == 0)
+    {
+      g_string_free (contents, TRUE);
+      return;
+    }
+
+  g_free (preferences->stored_contents);
+  preferences->stored_contents = g_string_free (contents, FALSE);
+
+  filename = xfce_resource_save_location (XFCE_RESOURCE_CONFIG, TERMINALRC, TRUE);
+  if (G_UNLIKELY (filename == NULL))
+    {
+      g_warning ("Unable to store terminal preferences to \"%s\".", TERMINALRC);
+      g_free (preferences->stored_contents);
+      preferences->stored_contents = NULL;
+      return;
+    }
 
   /* check if we need to update the monitor */
-  terminal_preferences_monitor_connect (preferences, filename, TRUE);
+  terminal_preferences_monitor_connect (preferences, filename);
 
-  if (G_LIKELY (FALSE))
+  /* for local files gio writes to a temporary file and renames it over
+   * the rc, so readers never see a half-written configuration */
+  file = g_file_new_for_path (filename);
+  if (synchronous)
+    {
+      g_free (preferences->last_etag);
+      preferences->last_etag = NULL;
+
+      if (!g_file_replace_contents (file, preferences->stored_contents,
+                                    strlen (preferences->stored_contents),
+                                    NULL, FALSE, G_FILE_CREATE_NONE,
+                                    &preferences->last_etag, NULL, &error))
+        {
+          g_warning ("Unable to store terminal preferences to \"%s\": %s",
+                     filename, error->message);
+          g_error_free (error);
+        }
+    }
+  else
     {
-error:
-      g_warning ("Unable to store terminal preferences to \"%s\".", filename);
+      /* the file is written from a gio worker thread, dispose waits
+       * for it, so the callback does not need a reference */
+      bytes = g_bytes_new (preferences->stored_contents,
+                           strlen (preferences->stored_contents));
+      preferences->store_in_progress = TRUE;
+      g_file_replace_contents_bytes_async (file, bytes, NULL, FALSE,
+                                           G_FILE_CREATE_NONE, NULL,
+                                           terminal_preferences_store_finished,
+                                           preferences);
+      g_bytes_unref (bytes);
     }
 
-  /* cleanup */
+  g_object_unref (G_OBJECT (file));
   g_free (filename);
-  if (G_LIKELY (rc != NULL))
-    xfce_rc_close (rc);
+}
+
+
+
+static void
+terminal_preferences_store_finished (GObject      *source,
+                                     GAsyncResult *result,
+                                     gpointer      user_data)
+{
+  TerminalPreferences *preferences = TERMINAL_PREFERENCES (user_data);
+  GError              *error = NULL;
+  gchar               *etag = NULL;
+  gchar               *filename;
+
+  preferences->store_in_progress = FALSE;
+
+  if (g_file_replace_contents_finish (G_FILE (source), result, &etag, &error))
+    {
+      /* tag our own write, so the monitor does not reload it */
+      g_free (preferences->last_etag);
+      preferences->last_etag = etag;
+
+      /* unless something changed during the write, the values in the
+       * file are the current ones and the cache can be updated */
+      if (etag != NULL && !preferences->store_pending)
+        {
+          filename = g_file_get_path (G_FILE (source));
+          terminal_preferences_save_cache (preferences, preferences->values, filename,
+                                           etag, strlen (preferences->stored_contents));
+          g_free (filename);
+        }
+    }
+  else
+    {
+      filename = g_file_get_parse_name (G_FILE (source));
+      g_warning ("Unable to store terminal preferences to \"%s\": %s",
+                 filename, error->message);
+      g_error_free (error);
+      g_free (filename);
+
+      /* make sure the next store tries again */
+      g_free (preferences->stored_contents);
+      preferences->stored_contents = NULL;
+    }
+
+  /* changes made while we were writing */
+  if (preferences->store_pending)
+    {
+      preferences->store_pending = FALSE;
+      terminal_preferences_schedule_store (preferences);
+    }
+}
+
+
+
+static gboolean
+terminal_preferences_store_idle (gpointer user_data)
+{
+  TerminalPreferences *preferences = TERMINAL_PREFERENCES (user_data);
+
+  /* try again later if we're loading */
+  if (G_UNLIKELY (preferences->loading_in_progress))
+    return TRUE;
+
+  terminal_preferences_store (preferences, FALSE);
 
   return FALSE;
 }
@@ -1554,35 +2320,70 @@ terminal_preferences_monitor_changed (GFileMonitor        *monitor,
                                       GFileMonitorEvent    event_type,
                                       TerminalPreferences *preferences)
 {
-  GFileInfo *info;
-  guint64    mtime = 0;
-
   terminal_return_if_fail (G_IS_FILE_MONITOR (monitor));
   terminal_return_if_fail (TERMINAL_IS_PREFERENCES (preferences));
   terminal_return_if_fail (G_IS_FILE (file));
 
-  /* xfce rc rewrites the file, so skip other events */
+  /* skip the events of our own load; events during our own store are
+   * not skipped, the reload waits for the write and compares the etag
+   * with the one of our write, so only changes by others are loaded */
   if (G_UNLIKELY (preferences->loading_in_progress))
     return;
 
-  /* get the last modified timestamp from the file */
-  info = g_file_query_info (file, G_FILE_ATTRIBUTE_TIME_MODIFIED,
+  /* editors often write, rename and chmod in a row; restart the
+   * timeout on each event so the sequence results in one reload */
+  if (preferences->reload_idle_id != 0)
+    g_source_remove (preferences->reload_idle_id);
+
+  preferences->reload_idle_id =
+      g_timeout_add_full (G_PRIORITY_LOW, 250, terminal_preferences_reload_idle,
+                          preferences, terminal_preferences_reload_destroy);
+}
+
+
+
+static gboolean
+terminal_preferences_reload_idle (gpointer user_data)
+{
+  TerminalPreferences *preferences = TERMINAL_PREFERENCES (user_data);
+  GFileInfo           *info;
+  const gchar         *etag = NULL;
+
+  /* wait for our own write to finish */
+  if (G_UNLIKELY (preferences->store_in_progress))
+    return TRUE;
+
+  if (G_UNLIKELY (preferences->file == NULL))
+    return FALSE;
+
+  /* get the entity tag of the file, it changes with each write */
+  info = g_file_query_info (preferences->file, G_FILE_ATTRIBUTE_ETAG_VALUE,
                             G_FILE_QUERY_INFO_NONE, NULL, NULL);
   if (G_LIKELY (info != NULL))
-    {
-      mtime = g_file_info_get_attribute_uint64 (info,
-          G_FILE_ATTRIBUTE_TIME_MODIFIED);
-      g_object_unref (G_OBJECT (info));
-    }
+    etag = g_file_info_get_etag (info);
 
-  /* reload the preferences if the new mtime is newer */
-  if (G_UNLIKELY (mtime > preferences->last_mtime))
+  /* reload the preferences if this is not the version we know */
+  if (etag != NULL
+      && g_strcmp0 (etag, preferences->last_etag) != 0)
     {
-      terminal_preferences_load (preferences);
+      g_free (preferences->last_etag);
+      preferences->last_etag = g_strdup (etag);
 
-      /* set new mtime */
-      preferences->last_mtime = mtime;
+      terminal_preferences_load (preferences);
     }
+
+  if (G_LIKELY (info != NULL))
+    g_object_unref (G_OBJECT (info));
+
+  return FALSE;
+}
+
+
+
+static void
+terminal_preferences_reload_destroy (gpointer user_data)
+{
+  TERMINAL_PREFERENCES (user_data)->reload_idle_id = 0;
 }
 
 
@@ -1609,11 +2410,9 @@ terminal_preferences_monitor_disconnect (TerminalPreferences *preferences)
 
 static void
 terminal_preferences_monitor_connect (TerminalPreferences *preferences,
-                                      const gchar         *filename,
-                                      gboolean             update_mtime)
+                                      const gchar         *filename)
 {
   GError    *error = NULL;
-  GFileInfo *info;
   GFile     *new_file;
 
   /* get new file location */
@@ -1652,22 +2451,6 @@ terminal_preferences_monitor_connect (TerminalPreferences *preferences,
     }
 
   g_object_unref (new_file);
-
-  preferences->last_mtime = 0;
-
-  /* store the last known mtime */
-  if (preferences->file != NULL
-      && update_mtime)
-    {
-      info = g_file_query_info (preferences->file, G_FILE_ATTRIBUTE_TIME_MODIFIED,
-                                G_FILE_QUERY_INFO_NONE, NULL, NULL);
-      if (G_LIKELY (info != NULL))
-        {
-          preferences->last_mtime = g_file_info_get_attribute_uint64 (info,
-              G_FILE_ATTRIBUTE_TIME_MODIFIED);
-          g_object_unref (G_OBJECT (info));
-        }
-    }
 }
 
 
@@ -1715,3 +2498,75 @@ terminal_preferences_get_color (TerminalPreferences *preferences,
 
   return succeed;
 }
+
+
+
+/**
+ * terminal_preferences_get_snapshot:
+ * @preferences : A #TerminalPreferences.
+ *
+ * Returns the decoded values of the frequently used preferences. The
+ * snapshot is owned by @preferences and stays valid until the next
+ * call of this function; use the generation counter to find out if
+ * values derived from it are outdated.
+ *
+ * Return value : The #TerminalPreferencesSnapshot of @preferences.
+ **/
+const TerminalPreferencesSnapshot*
+terminal_preferences_get_snapshot (TerminalPreferences *preferences)
+{
+  terminal_return_val_if_fail (TERMINAL_IS_PREFERENCES (preferences), NULL);
+
+  if (G_UNLIKELY (preferences->snapshot_dirty))
+    terminal_preferences_snapshot_update (preferences);
+
+  return &preferences->snapshot;
+}
+
+
+
+/**
+ * terminal_preferences_get_color_scheme:
+ * @preferences : A #TerminalPreferences.
+ *
+ * Returns the parsed color preferences. The scheme is shared between
+ * all callers until one of the color-* properties changes. Release it
+ * with terminal_color_scheme_unref().
+ *
+ * Return value : A new reference on the current #TerminalColorScheme.
+ **/
+TerminalColorScheme*
+terminal_preferences_get_color_scheme (TerminalPreferences *preferences)
+{
+  terminal_return_val_if_fail (TERMINAL_IS_PREFERENCES (preferences), NULL);
+
+  if (G_UNLIKELY (preferences->color_scheme == NULL))
+    terminal_preferences_update_colors (preferences);
+
+  return terminal_color_scheme_ref (preferences->color_scheme);
+}
+
+
+
+TerminalColorScheme*
+terminal_color_scheme_ref (TerminalColorScheme *scheme)
+{
+  terminal_return_val_if_fail (scheme != NULL, NULL);
+  terminal_return_val_if_fail (scheme->ref_count > 0, NULL);
+
+  g_atomic_int_inc (&scheme->ref_count);
+
+  return scheme;
+}
+
+
+
+void
+terminal_color_scheme_unref (TerminalColorScheme *scheme)
+{
+  terminal_return_if_fail (scheme != NULL);
+  terminal_return_if_fail (scheme->ref_count > 0);
+
+  if (g_atomic_int_dec_and_test (&scheme->ref_count))
+    g_slice_free (TerminalColorScheme, scheme);
+}
@@ -33,6 +33,7 @@ G_BEGIN_DECLS
 
 typedef struct _TerminalPreferencesClass TerminalPreferencesClass;
 typedef struct _TerminalPreferences      TerminalPreferences;
+typedef struct _TerminalColorScheme      TerminalColorScheme;
 
 typedef enum /*< enum,prefix=TERMINAL_SCROLLBAR >*/
 {
@@ -87,13 +88,105 @@ typedef enum /*< enum,prefix=TERMINAL_CURSOR_SHAPE >*/
   TERMINAL_CURSOR_SHAPE_UNDERLINE
 } TerminalCursorShape;
 
-GType                terminal_preferences_get_type  (void) G_GNUC_CONST;
+typedef enum /*< enum,prefix=TERMINAL_RESTORE_TABS >*/
+{
+  TERMINAL_RESTORE_TABS_EAGER,       /* start all tabs right away */
+  TERMINAL_RESTORE_TABS_LAZY_SHELLS, /* start shells when shown, commands right away */
+  TERMINAL_RESTORE_TABS_LAZY         /* start all tabs when shown */
+} TerminalRestoreTabs;
+
+/**
+ * TerminalPreferencesSnapshot:
+ *
+ * Decoded copy of the preferences that are read in hot paths (drawing,
+ * key presses, terminal output), so these don't have to go through
+ * g_object_get(). The snapshot is read-only and rebuilt on the first
+ * request after a preference changed, which also bumps @generation.
+ **/
+typedef struct
+{
+  guint                    generation;
+
+  TerminalBackground       background_mode;
+  gchar                   *background_image_file;
+  TerminalBackgroundStyle  background_image_style;
+  guint                    background_image_cache_size;
+  gdouble                  background_darkness;
+  gdouble                  background_image_shading;
+
+  GdkRGBA                  color_background;
+  gboolean                 has_color_background;
+
+  gboolean                 misc_middle_click_opens_uri;
+  gboolean                 misc_use_shift_arrows_to_scroll;
+  gboolean                 misc_show_statistics;
+  gboolean                 shortcuts_no_menukey;
+
+  gchar                   *title_initial;
+  TerminalTitle            title_mode;
+
+  guint                    tab_activity_timeout;
+  GdkRGBA                  tab_activity_color;
+  gboolean                 has_tab_activity_color;
+} TerminalPreferencesSnapshot;
+
+/**
+ * TerminalColorScheme:
+ *
+ * The color-* preferences parsed once and shared by all screens. A
+ * scheme is immutable, a new one is created when a color changes.
+ **/
+struct _TerminalColorScheme
+{
+  /*< private >*/
+  gint     ref_count;
+
+  /*< public >*/
+  GdkRGBA  palette[16];
+  gboolean has_palette;
+
+  GdkRGBA  foreground;
+  gboolean has_foreground;
+  GdkRGBA  background;
+  gboolean has_background;
+
+  /* saturation and value of the background, to pick a random hue */
+  gboolean background_vary;
+  gdouble  background_saturation;
+  gdouble  background_value;
+
+  GdkRGBA  cursor_foreground;
+  gboolean has_cursor_foreground;
+  GdkRGBA  cursor;
+  gboolean has_cursor;
+  gboolean cursor_use_default;
+
+  GdkRGBA  selection;
+  gboolean has_selection;
+  GdkRGBA  selection_background;
+  gboolean has_selection_background;
+  gboolean selection_use_default;
+
+  GdkRGBA  bold;
+  gboolean has_bold;
+  gboolean bold_use_default;
+};
+
+GType                              terminal_preferences_get_type         (void) G_GNUC_CONST;
+
+TerminalPreferences               *terminal_preferences_get              (void);
+
+gboolean                           terminal_preferences_get_color        (TerminalPreferences *preferences,
+                                                                          const gchar         *property,
+                                                                          GdkRGBA             *color_return);
+
+const TerminalPreferencesSnapshot *terminal_preferences_get_snapshot     (TerminalPreferences *preferences);
+
+TerminalColorScheme               *terminal_preferences_get_color_scheme (TerminalPreferences *preferences);
 
-TerminalPreferences *terminal_preferences_get       (void);
+TerminalColorScheme               *terminal_color_scheme_ref             (TerminalColorScheme *scheme);
 
-gboolean             terminal_preferences_get_color (TerminalPreferences *preferences,
-                                                     const gchar         *property,
-                                                     GdkRGBA             *color_return);
+void                               terminal_color_scheme_unref           (TerminalColorScheme *scheme);
 
 
 G_END_DECLS
@@ -50,6 +50,11 @@
 #include <terminal/terminal-image-loader.h>
 #include <terminal/terminal-marshal.h>
 #include <terminal/terminal-screen.h>
+#include <terminal/terminal-scrollback-budget.h>
+#include <terminal/terminal-search-index.h>
+#include <terminal/terminal-shell-pool.h>
+#include <terminal/terminal-spawn-helper.h>
+#include <terminal/terminal-timer-wheel.h>
 #include <terminal/terminal-widget.h>
 #include <terminal/terminal-window.h>
 
@@ -58,9 +63,36 @@
 #endif
 #include <glib/gstdio.h>
 
+extern gchar **environ;
+
 /* offset of saturation random value */
 #define SATURATION_WINDOW 0.20
 
+/* the TERM value vte sets for the children it spawns */
+#define TERMINAL_CHILD_TERM "xterm-256color"
+
+/* a working directory query that takes longer hangs (e.g. on a dead nfs
+ * mount), it is not waited for, but no other query is started either */
+#define CWD_QUERY_TIMEOUT (2 * G_USEC_PER_SEC)
+
+/* how long terminal_screen_resolve_working_directory() waits for a query */
+#define CWD_QUERY_WAIT (250 * G_TIME_SPAN_MILLISECOND)
+
+/* a finished working directory query is reused for this long */
+#define CWD_QUERY_INTERVAL (G_USEC_PER_SEC)
+
+/* title updates of hidden tabs are merged over this many ms, about a frame */
+#define TITLE_UPDATE_INTERVAL (16)
+
+/* rows taken from vte per main loop iteration when saving the contents */
+#define SAVE_CHUNK_ROWS (1000)
+
+/* scrollback rows added to the search index per idle iteration */
+#define SEARCH_INDEX_ROWS (2000)
+
+/* time the search match counter may take per idle iteration */
+#define SEARCH_COUNT_TIME (5 * G_TIME_SPAN_MILLISECOND)
+
 
 enum
 {
@@ -74,9 +106,20 @@ enum
   GET_CONTEXT_MENU,
   SELECTION_CHANGED,
   CLOSE_TAB,
+  SEARCH_CHANGED,
   LAST_SIGNAL
 };
 
+/* a copy of the filtered server environment, the variables of the
+ * template point into it; freed when it is neither the current one
+ * nor used by an environment that was handed out */
+typedef struct
+{
+  gchar *data;
+  gsize  size;
+  guint  users;
+} TerminalEnvBlock;
+
 enum
 {
   HSV_HUE,
@@ -85,8 +128,119 @@ enum
   N_HSV
 };
 
+/* looks up the working directory of the child in a thread,
+ * shared by the thread and the screen that started it */
+typedef struct
+{
+  gint            ref_count;
+  TerminalScreen *screen;
+  GPid            pid;
+  gint64          started;
+
+  GMutex          lock;
+  GCond           cond;
+  gboolean        done;
+  gchar          *directory;
+} TerminalCwdQuery;
+
+/* parts of a compiled title template */
+typedef enum
+{
+  TITLE_TOKEN_TEXT,
+  TITLE_TOKEN_SESSION_ID,     /* %# */
+  TITLE_TOKEN_DIRECTORY,      /* %D */
+  TITLE_TOKEN_DIRECTORY_NAME, /* %d */
+  TITLE_TOKEN_VTE_TITLE       /* %w */
+} TerminalTitleTokenType;
+
+typedef struct
+{
+  TerminalTitleTokenType  type;
+  gchar                  *text;
+} TerminalTitleToken;
 
+typedef struct
+{
+  /* the template the tokens were compiled from */
+  gchar  *source;
+  GArray *tokens;
+} TerminalTitleTemplate;
 
+/* colors (8 bit rgb) and attributes of a run of saved cells */
+typedef struct
+{
+  guint8   fore[3];
+  guint8   back[3];
+  gboolean has_back;
+  gboolean underline;
+  gboolean strikethrough;
+} TerminalSaveStyle;
+
+/* state of terminal_screen_save_contents_async(), the task data */
+typedef struct
+{
+  GOutputStream      *file_stream;
+  GOutputStream      *stream;
+  TerminalSaveFormat  format;
+  gboolean            compress;
+
+  /* rows still to save, [row, end_row) */
+  glong               first_row;
+  glong               row;
+  glong               end_row;
+  glong               columns;
+
+  /* text of the current chunk and how much of it is written */
+  GString            *buffer;
+  gsize               written;
+  gboolean            finished;
+
+  guint8              default_back[3];
+  TerminalSaveStyle   style;
+  gboolean            has_style;
+} TerminalSaveJob;
+
+/* a match of the search expression, in cells, and the number of
+ * characters before it in the row text */
+typedef struct
+{
+  glong row;
+  glong column;
+  glong width;
+  glong offset;
+} TerminalSearchMatch;
+
+/* updates triggered by preference changes, merged per screen */
+typedef enum
+{
+  UPDATE_BACKGROUND               = 1 << 0,
+  UPDATE_BACKGROUND_SURFACE       = 1 << 1,
+  UPDATE_BINDING_BACKSPACE        = 1 << 2,
+  UPDATE_BINDING_DELETE           = 1 << 3,
+  UPDATE_BINDING_AMBIGUOUS_WIDTH  = 1 << 4,
+  UPDATE_COLORS                   = 1 << 5,
+  UPDATE_FONT                     = 1 << 6,
+  UPDATE_MISC_BELL                = 1 << 7,
+  UPDATE_MISC_CURSOR_BLINKS       = 1 << 8,
+  UPDATE_MISC_CURSOR_SHAPE        = 1 << 9,
+  UPDATE_MISC_MOUSE_AUTOHIDE      = 1 << 10,
+  UPDATE_MISC_REWRAP_ON_RESIZE    = 1 << 11,
+  UPDATE_SCROLLING_BAR            = 1 << 12,
+  UPDATE_SCROLLING_LINES          = 1 << 13,
+  UPDATE_SCROLLING_ON_OUTPUT      = 1 << 14,
+  UPDATE_SCROLLING_ON_KEYSTROKE   = 1 << 15,
+  UPDATE_TITLE                    = 1 << 16,
+  UPDATE_WORD_CHARS               = 1 << 17,
+  UPDATE_LABEL_ORIENTATION        = 1 << 18,
+  UPDATE_MISC_SHOW_STATISTICS     = 1 << 19,
+
+  /* updates that change the geometry and can wait until the screen is mapped */
+  UPDATE_DEFERRABLE               = UPDATE_FONT
+} TerminalScreenUpdate;
+
+
+
+static void       terminal_screen_dispose                       (GObject               *object);
 static void       terminal_screen_finalize                      (GObject               *object);
 static void       terminal_screen_get_property                  (GObject               *object,
                                                                  guint                  prop_id,
@@ -98,19 +252,63 @@ static void       terminal_screen_set_property                  (GObject
                                                                  GParamSpec            *pspec);
 static void       terminal_screen_realize                       (GtkWidget             *widget);
 static void       terminal_screen_unrealize                     (GtkWidget             *widget);
+static void       terminal_screen_map                           (GtkWidget             *widget);
+static gboolean   terminal_screen_draw_start                    (GtkWidget             *widget,
+                                                                 cairo_t               *cr,
+                                                                 TerminalScreen        *screen);
+#if VTE_CHECK_VERSION (0, 52, 0)
+static gboolean   terminal_screen_draw_background               (GtkWidget             *widget,
+                                                                 cairo_t               *cr,
+                                                                 TerminalScreen        *screen);
+#else
+static gboolean   terminal_screen_draw_opaque                   (GtkWidget             *widget,
+                                                                 cairo_t               *cr,
+                                                                 TerminalScreen        *screen);
+#endif
+static gboolean   terminal_screen_draw_statistics               (GtkWidget             *widget,
+                                                                 cairo_t               *cr,
+                                                                 TerminalScreen        *screen);
+static gboolean   terminal_screen_draw_search                   (GtkWidget             *widget,
+                                                                 cairo_t               *cr,
+                                                                 TerminalScreen        *screen);
+static gboolean   terminal_screen_search_index_idle             (gpointer               user_data);
+static void       terminal_screen_vte_commit                    (VteTerminal           *terminal,
+                                                                 const gchar           *text,
+                                                                 guint                  size,
+                                                                 TerminalScreen        *screen);
+#if !VTE_CHECK_VERSION (0, 52, 0)
 static gboolean   terminal_screen_draw                          (GtkWidget             *widget,
                                                                  cairo_t               *cr,
                                                                  gpointer               user_data);
+#endif
+static void       terminal_screen_clear_background_surface      (TerminalScreen        *screen);
 static void       terminal_screen_preferences_changed           (TerminalPreferences   *preferences,
                                                                  GParamSpec            *pspec,
                                                                  TerminalScreen        *screen);
+static gboolean   terminal_screen_updates_idle                  (gpointer               user_data);
+static void       terminal_screen_updates_idle_destroy          (gpointer               user_data);
+static void       terminal_screen_apply_updates                 (TerminalScreen        *screen,
+                                                                 guint                  updates);
 static gboolean   terminal_screen_get_child_command             (TerminalScreen        *screen,
                                                                  gchar                **command,
                                                                  gchar               ***argv,
                                                                  GError               **error);
 static gchar     *terminal_screen_parse_title                   (TerminalScreen        *screen,
+                                                                 TerminalTitleTemplate *template,
                                                                  const gchar           *title);
+static void       terminal_screen_title_template_clear          (TerminalTitleTemplate *template);
+static gboolean   terminal_screen_title_refresh                 (TerminalScreen        *screen);
+static gboolean   terminal_screen_environment_skip              (const gchar           *variable);
+static void       terminal_screen_environment_update            (void);
+static gchar    **terminal_screen_build_environment             (const gchar           *working_directory,
+                                                                 const gchar           *windowid,
+                                                                 const gchar           *display_name,
+                                                                 gchar                **custom_environment);
 static gchar    **terminal_screen_get_child_environment         (TerminalScreen        *screen);
+static void       terminal_screen_cwd_query_unref               (gpointer               data);
+static void       terminal_screen_cwd_query_detach              (TerminalScreen        *screen);
+static gboolean   terminal_screen_cwd_query_idle                (gpointer               data);
+static gboolean   terminal_screen_update_working_directory_uri  (TerminalScreen        *screen);
 static void       terminal_screen_update_background             (TerminalScreen        *screen);
 static void       terminal_screen_update_binding_backspace      (TerminalScreen        *screen);
 static void       terminal_screen_update_binding_delete         (TerminalScreen        *screen);
@@ -122,6 +320,8 @@ static void       terminal_screen_update_misc_cursor_blinks     (TerminalScreen
 static void       terminal_screen_update_misc_cursor_shape      (TerminalScreen        *screen);
 static void       terminal_screen_update_misc_mouse_autohide    (TerminalScreen        *screen);
 static void       terminal_screen_update_misc_rewrap_on_resize  (TerminalScreen        *screen);
+static void       terminal_screen_update_misc_show_statistics   (TerminalScreen        *screen);
+static void       terminal_screen_apply_scrollback_lines        (TerminalScreen        *screen);
 static void       terminal_screen_update_scrolling_lines        (TerminalScreen        *screen);
 static void       terminal_screen_update_scrolling_on_output    (TerminalScreen        *screen);
 static void       terminal_screen_update_scrolling_on_keystroke (TerminalScreen        *screen);
@@ -130,6 +330,15 @@ static void       terminal_screen_update_word_chars             (TerminalScreen
 static void       terminal_screen_vte_child_exited              (VteTerminal           *terminal,
                                                                  gint                   status,
                                                                  TerminalScreen        *screen);
+static void       terminal_screen_helper_child_exited           (GPid                   pid,
+                                                                 gint                   status,
+                                                                 gpointer               user_data);
+static void       terminal_screen_spawn_failed                  (TerminalScreen        *screen,
+                                                                 const GError          *error);
+static void       terminal_screen_spawn_finished                (VteTerminal           *terminal,
+                                                                 GPid                   pid,
+                                                                 GError                *error,
+                                                                 gpointer               user_data);
 static void       terminal_screen_vte_eof                       (VteTerminal           *terminal,
                                                                  TerminalScreen        *screen);
 static GtkWidget *terminal_screen_vte_get_context_menu          (TerminalWidget        *widget,
@@ -138,6 +347,8 @@ static void       terminal_screen_vte_selection_changed         (VteTerminal
                                                                  TerminalScreen        *screen);
 static void       terminal_screen_vte_window_title_changed      (VteTerminal           *terminal,
                                                                  TerminalScreen        *screen);
+static void       terminal_screen_vte_directory_changed         (VteTerminal           *terminal,
+                                                                 TerminalScreen        *screen);
 static void       terminal_screen_vte_resize_window             (VteTerminal           *terminal,
                                                                  guint                  width,
                                                                  guint                  height,
@@ -152,6 +363,9 @@ static void       terminal_screen_urgent_bell                   (TerminalWidget
                                                                  TerminalScreen        *screen);
 static void       terminal_screen_set_custom_command            (TerminalScreen        *screen,
                                                                  gchar                **command);
+static void       terminal_screen_save_step                     (GTask                 *task);
+static void       terminal_screen_save_return                   (GTask                 *task,
+                                                                 GError                *error);
 
 
 
@@ -171,29 +385,160 @@ struct _TerminalScreen
 
   GdkRGBA              background_color;
 
+  /* background image, pre-rendered for the current allocation */
+  cairo_surface_t     *background_surface;
+  gint                 background_width;
+  gint                 background_height;
+#if !VTE_CHECK_VERSION (0, 52, 0)
+  /* offscreen copy of the exposed area for windows without alpha,
+   * kept across frames and only grown */
+  cairo_surface_t     *opaque_surface;
+  gint                 opaque_width;
+  gint                 opaque_height;
+#endif
+
   guint                session_id;
 
   GPid                 pid;
+
+  /* last known working directory of the child */
   gchar               *working_directory;
+  TerminalCwdQuery    *cwd_query;
+  gint64               cwd_query_time;
+
+  /* set while the child is being spawned */
+  GCancellable        *spawn_cancellable;
+
+  /* the child is started when the tab is shown for the first time */
+  guint                deferred : 1;
 
   gchar              **custom_command;
+  gchar              **custom_environment;
   gchar               *custom_title;
   gchar               *initial_title;
 
+  /* compiled title templates and the titles last propagated */
+  TerminalTitleTemplate custom_template;
+  TerminalTitleTemplate initial_template;
+  gchar               *title;
+  gchar               *window_title;
+  guint                title_tick_id;
+  guint                title_timeout_id;
+
   TerminalTitle        dynamic_title_mode;
   guint                hold : 1;
 #if !VTE_CHECK_VERSION (0, 52, 0)
   guint                scroll_on_output : 1;
 #endif
 
-  guint                activity_timeout_id;
-  time_t               activity_resize_time;
+  /* tab activity: set on the first change, later changes only move
+   * activity_time, the timer checks it when it expires */
+  guint                activity : 1;
+  gint64               activity_time;
+  gint64               activity_resize_time;
+  TerminalTimerWheelEntry activity_timer;
+
+  /* counters of terminal_screen_get_statistics(), only touched from
+   * the signal handlers in the main thread, so no locking */
+  TerminalScreenStatistics stats;
+  gint64               stats_second;
+  guint                stats_second_events;
+  gint64               draw_start;
+  TerminalTimerWheelEntry stats_timer;
+
+  /* scrollback lines of the preferences and of the app wide budget,
+   * -1 for unlimited; vte gets the smaller one */
+  TerminalScrollbackBudget *scrollback;
+  glong                scrollback_lines;
+  glong                scrollback_budget;
+  glong                scrollback_applied;
+
+  /* running terminal_screen_save_contents_async() and its progress in the tab */
+  GTask               *save_task;
+  GtkWidget           *save_box;
+  GtkWidget           *save_progress;
+
+  /* search: the trigram index of the scrollback rows (only built once
+   * the tab was searched), the candidate blocks of the expression, the
+   * row of every match counted in the indexed rows so far, the current
+   * match (row -1 if none) and the matches in view for highlighting */
+  GRegex              *search_regex;
+  guint                search_wrap_around : 1;
+  guint                search_highlight : 1;
+  guint                search_blocks_valid : 1;
+  guint                search_visible_valid : 1;
+  guint                search_indexed : 1;
+  TerminalSearchIndex *search_index;
+  glong                search_index_columns;
+  guint                search_index_id;
+  GArray              *search_blocks;
+  glong                search_blocks_end;
+  GArray              *search_rows;
+  glong                search_count_row;
+  guint                search_count_id;
+  TerminalSearchMatch  search_current;
+  GArray              *search_visible;
+  glong                search_visible_row;
+  guint64              search_visible_changes;
+
+  /* TerminalScreenUpdate flags waiting for the idle or for the screen to be mapped */
+  guint                pending_updates;
+  guint                deferred_updates;
+  guint                updates_idle_id;
+};
+
+
+
+/* maps a preference name (or prefix) to the updates it requires,
+ * the first match wins */
+static const struct
+{
+  const gchar *name;
+  gboolean     prefix;
+  guint        updates;
+}
+screen_update_rules[] =
+{
+  { "background-", TRUE, UPDATE_BACKGROUND },
+  { "binding-backspace", FALSE, UPDATE_BINDING_BACKSPACE },
+  { "binding-delete", FALSE, UPDATE_BINDING_DELETE },
+  { "binding-ambiguous-width", FALSE, UPDATE_BINDING_AMBIGUOUS_WIDTH },
+  /* the image loader fills uncovered areas with the background color */
+  { "color-background", FALSE, UPDATE_COLORS | UPDATE_BACKGROUND_SURFACE },
+  { "color-", TRUE, UPDATE_COLORS },
+  { "font-", TRUE, UPDATE_FONT },
+  { "misc-bell", TRUE, UPDATE_MISC_BELL },
+  { "misc-cursor-blinks", FALSE, UPDATE_MISC_CURSOR_BLINKS },
+  { "misc-cursor-shape", FALSE, UPDATE_MISC_CURSOR_SHAPE },
+  { "misc-mouse-autohide", FALSE, UPDATE_MISC_MOUSE_AUTOHIDE },
+  { "misc-rewrap-on-resize", FALSE, UPDATE_MISC_REWRAP_ON_RESIZE },
+  { "misc-show-statistics", FALSE, UPDATE_MISC_SHOW_STATISTICS },
+  { "misc-tab-position", FALSE, UPDATE_LABEL_ORIENTATION },
+  { "scrolling-bar", FALSE, UPDATE_SCROLLING_BAR },
+  { "scrolling-lines", FALSE, UPDATE_SCROLLING_LINES },
+  { "scrolling-unlimited", FALSE, UPDATE_SCROLLING_LINES },
+  { "scrolling-on-output", FALSE, UPDATE_SCROLLING_ON_OUTPUT },
+  { "scrolling-on-keystroke", FALSE, UPDATE_SCROLLING_ON_KEYSTROKE },
+  { "title-", TRUE, UPDATE_TITLE },
+  { "word-chars", FALSE, UPDATE_WORD_CHARS },
 };
 
 
 
-static guint screen_signals[LAST_SIGNAL];
-static guint screen_last_session_id = 0;
+static guint  screen_signals[LAST_SIGNAL];
+static guint  screen_last_session_id = 0;
+
+/* TerminalScreenUpdate flags, indexed by the param_id of the preferences */
+static guint *screen_pspec_updates = NULL;
+static guint  screen_n_pspec_updates = 0;
+
+/* the filtered server environment, shared by the environments of all children */
+static gchar   **screen_env_template = NULL;
+static guint     screen_env_n_template = 0;
+static gboolean  screen_env_has_pwd = FALSE;
+static GSList   *screen_env_blocks = NULL;
+static guint     screen_env_generation = 1;
+static guint     screen_env_template_generation = 0;
 
 
 
@@ -204,10 +549,16 @@ G_DEFINE_TYPE (TerminalScreen, terminal_screen, GTK_TYPE_BOX)
 static void
 terminal_screen_class_init (TerminalScreenClass *klass)
 {
-  GtkWidgetClass *gtkwidget_class;
-  GObjectClass   *gobject_class;
+  GtkWidgetClass  *gtkwidget_class;
+  GObjectClass    *gobject_class;
+  GObjectClass    *preferences_class;
+  GParamSpec     **pspecs;
+  const gchar     *name;
+  guint            n_pspecs;
+  guint            n, i;
 
   gobject_class = G_OBJECT_CLASS (klass);
+  gobject_class->dispose = terminal_screen_dispose;
   gobject_class->finalize = terminal_screen_finalize;
   gobject_class->get_property = terminal_screen_get_property;
   gobject_class->set_property = terminal_screen_set_property;
@@ -215,6 +566,31 @@ terminal_screen_class_init (TerminalScreenClass *klass)
   gtkwidget_class = GTK_WIDGET_CLASS (klass);
   gtkwidget_class->realize = terminal_screen_realize;
   gtkwidget_class->unrealize = terminal_screen_unrealize;
+  gtkwidget_class->map = terminal_screen_map;
+
+  /* resolve the update rules once for each preference, so a notify
+   * is handled with a lookup on the param id */
+  preferences_class = g_type_class_ref (TERMINAL_TYPE_PREFERENCES);
+  pspecs = g_object_class_list_properties (preferences_class, &n_pspecs);
+  for (n = 0; n < n_pspecs; n++)
+    screen_n_pspec_updates = MAX (screen_n_pspec_updates, pspecs[n]->param_id + 1);
+  screen_pspec_updates = g_new0 (guint, screen_n_pspec_updates);
+  for (n = 0; n < n_pspecs; n++)
+    {
+      name = g_param_spec_get_name (pspecs[n]);
+      for (i = 0; i < G_N_ELEMENTS (screen_update_rules); i++)
+        {
+          if (screen_update_rules[i].prefix
+              ? g_str_has_prefix (name, screen_update_rules[i].name)
+              : strcmp (name, screen_update_rules[i].name) == 0)
+            {
+              screen_pspec_updates[pspecs[n]->param_id] = screen_update_rules[i].updates;
+              break;
+            }
+        }
+    }
+  g_free (pspecs);
+  g_type_class_unref (preferences_class);
 
   /**
    * TerminalScreen:custom-title:
@@ -270,6 +646,19 @@ terminal_screen_class_init (TerminalScreenClass *klass)
                   0, NULL, NULL,
                   g_cclosure_marshal_VOID__VOID,
                   G_TYPE_NONE, 0);
+
+  /**
+   * TerminalScreen::search-changed
+   *
+   * Emitted when the current search match or the match count changed.
+   **/
+  screen_signals[SEARCH_CHANGED] =
+    g_signal_new (I_("search-changed"),
+                  G_TYPE_FROM_CLASS (gobject_class),
+                  G_SIGNAL_RUN_LAST,
+                  0, NULL, NULL,
+                  g_cclosure_marshal_VOID__VOID,
+                  G_TYPE_NONE, 0);
 }
 
 
@@ -281,6 +670,12 @@ terminal_screen_init (TerminalScreen *screen)
   screen->working_directory = g_get_current_dir ();
   screen->dynamic_title_mode = TERMINAL_TITLE_DEFAULT;
   screen->session_id = ++screen_last_session_id;
+  screen->scrollback_budget = -1;
+  screen->scrollback_applied = G_MINLONG;
+  screen->search_index = terminal_search_index_new ();
+  screen->search_rows = g_array_new (FALSE, FALSE, sizeof (glong));
+  screen->search_visible = g_array_new (FALSE, FALSE, sizeof (TerminalSearchMatch));
+  screen->search_current.row = -1;
 
   screen->terminal = g_object_new (TERMINAL_TYPE_WIDGET, NULL);
   g_signal_connect (G_OBJECT (screen->terminal), "child-exited",
@@ -293,10 +688,27 @@ terminal_screen_init (TerminalScreen *screen)
       G_CALLBACK (terminal_screen_vte_selection_changed), screen);
   g_signal_connect (G_OBJECT (screen->terminal), "window-title-changed",
       G_CALLBACK (terminal_screen_vte_window_title_changed), screen);
+  g_signal_connect (G_OBJECT (screen->terminal), "current-directory-uri-changed",
+      G_CALLBACK (terminal_screen_vte_directory_changed), screen);
   g_signal_connect (G_OBJECT (screen->terminal), "resize-window",
       G_CALLBACK (terminal_screen_vte_resize_window), screen);
   g_signal_connect (G_OBJECT (screen->terminal), "draw",
+      G_CALLBACK (terminal_screen_draw_start), screen);
+#if VTE_CHECK_VERSION (0, 52, 0)
+  g_signal_connect (G_OBJECT (screen->terminal), "draw",
+      G_CALLBACK (terminal_screen_draw_background), screen);
+#else
+  g_signal_connect (G_OBJECT (screen->terminal), "draw",
+      G_CALLBACK (terminal_screen_draw_opaque), screen);
+  g_signal_connect_after (G_OBJECT (screen->terminal), "draw",
       G_CALLBACK (terminal_screen_draw), screen);
+#endif
+  g_signal_connect_after (G_OBJECT (screen->terminal), "draw",
+      G_CALLBACK (terminal_screen_draw_search), screen);
+  g_signal_connect_after (G_OBJECT (screen->terminal), "draw",
+      G_CALLBACK (terminal_screen_draw_statistics), screen);
+  g_signal_connect (G_OBJECT (screen->terminal), "commit",
+      G_CALLBACK (terminal_screen_vte_commit), screen);
   gtk_box_pack_start (GTK_BOX (screen), screen->terminal, TRUE, TRUE, 0);
 
   screen->scrollbar = gtk_scrollbar_new (GTK_ORIENTATION_VERTICAL,
@@ -320,6 +732,7 @@ terminal_screen_init (TerminalScreen *screen)
   terminal_screen_update_misc_cursor_shape (screen);
   terminal_screen_update_misc_mouse_autohide (screen);
   terminal_screen_update_misc_rewrap_on_resize (screen);
+  terminal_screen_update_misc_show_statistics (screen);
   terminal_screen_update_scrolling_bar (screen);
   terminal_screen_update_scrolling_lines (screen);
   terminal_screen_update_scrolling_on_output (screen);
@@ -328,6 +741,10 @@ terminal_screen_init (TerminalScreen *screen)
   terminal_screen_update_background (screen);
   terminal_screen_update_colors (screen);
 
+  /* share the scrollback with the other tabs */
+  screen->scrollback = terminal_scrollback_budget_get ();
+  terminal_scrollback_budget_add (screen->scrollback, screen);
+
   /* last, connect contents-changed to avoid a race with updates above */
   g_signal_connect_swapped (G_OBJECT (screen->terminal), "contents-changed",
       G_CALLBACK (terminal_screen_vte_window_contents_changed), screen);
@@ -340,13 +757,70 @@ terminal_screen_init (TerminalScreen *screen)
 
 
 
+static void
+terminal_screen_dispose (GObject *object)
+{
+  TerminalScreen *screen = TERMINAL_SCREEN (object);
+
+  /* the tab is closed, do not finish a pending spawn */
+  if (screen->spawn_cancellable != NULL)
+    g_cancellable_cancel (screen->spawn_cancellable);
+
+  /* drop the result of a working directory query */
+  if (screen->cwd_query != NULL)
+    terminal_screen_cwd_query_detach (screen);
+
+  /* pending spawns or saves keep the screen alive after the terminal
+   * is destroyed, nothing may touch it from now on */
+  terminal_spawn_helper_unwatch (screen->pid, screen);
+  terminal_timer_wheel_cancel (&screen->activity_timer);
+  terminal_timer_wheel_cancel (&screen->stats_timer);
+
+  if (screen->title_tick_id != 0)
+    {
+      gtk_widget_remove_tick_callback (GTK_WIDGET (screen), screen->title_tick_id);
+      screen->title_tick_id = 0;
+    }
+  if (screen->title_timeout_id != 0)
+    {
+      g_source_remove (screen->title_timeout_id);
+      screen->title_timeout_id = 0;
+    }
+
+  /* the contents are gone, stop saving them */
+  if (screen->save_task != NULL)
+    terminal_screen_save_contents_cancel (screen);
+
+  if (screen->search_index_id != 0)
+    {
+      g_source_remove (screen->search_index_id);
+      screen->search_index_id = 0;
+    }
+  if (screen->search_count_id != 0)
+    {
+      g_source_remove (screen->search_count_id);
+      screen->search_count_id = 0;
+    }
+
+  if (screen->scrollback != NULL)
+    {
+      terminal_scrollback_budget_remove (screen->scrollback, screen);
+      g_object_unref (G_OBJECT (screen->scrollback));
+      screen->scrollback = NULL;
+    }
+
+  (*G_OBJECT_CLASS (terminal_screen_parent_class)->dispose) (object);
+}
+
+
+
 static void
 terminal_screen_finalize (GObject *object)
 {
   TerminalScreen *screen = TERMINAL_SCREEN (object);
 
-  if (screen->activity_timeout_id != 0)
-    g_source_remove (screen->activity_timeout_id);
+  if (screen->updates_idle_id != 0)
+    g_source_remove (screen->updates_idle_id);
 
   /* detach from preferences */
   g_signal_handlers_disconnect_by_func (screen->preferences,
@@ -354,12 +828,31 @@ terminal_screen_finalize (GObject *object)
   g_object_unref (G_OBJECT (screen->preferences));
 
   if (screen->loader != NULL)
-    g_object_unref (G_OBJECT (screen->loader));
+    {
+      g_signal_handlers_disconnect_by_func (G_OBJECT (screen->loader),
+          G_CALLBACK (gtk_widget_queue_draw), screen->terminal);
+      g_object_unref (G_OBJECT (screen->loader));
+    }
+
+  terminal_screen_clear_background_surface (screen);
 
   g_strfreev (screen->custom_command);
+  g_strfreev (screen->custom_environment);
   g_free (screen->working_directory);
   g_free (screen->custom_title);
   g_free (screen->initial_title);
+  g_free (screen->title);
+  g_free (screen->window_title);
+  terminal_screen_title_template_clear (&screen->custom_template);
+  terminal_screen_title_template_clear (&screen->initial_template);
+
+  if (screen->search_regex != NULL)
+    g_regex_unref (screen->search_regex);
+  if (screen->search_blocks != NULL)
+    g_array_free (screen->search_blocks, TRUE);
+  g_array_free (screen->search_rows, TRUE);
+  g_array_free (screen->search_visible, TRUE);
+  terminal_search_index_free (screen->search_index);
 
   (*G_OBJECT_CLASS (terminal_screen_parent_class)->finalize) (object);
 }
@@ -373,11 +866,6 @@ terminal_screen_get_property (GObject    *object,
                               GParamSpec *pspec)
 {
   TerminalScreen *screen = TERMINAL_SCREEN (object);
-  const gchar    *title = NULL;
-  TerminalTitle   mode;
-  gchar          *initial;
-  gchar          *parsed_title = NULL;
-  gchar          *custom_title;
 
   switch (prop_id)
     {
@@ -389,43 +877,10 @@ terminal_screen_get_property (GObject    *object,
       break;
 
     case PROP_TITLE:
-      if (G_UNLIKELY (screen->custom_title != NULL))
-        {
-          custom_title = terminal_screen_parse_title (screen, screen->custom_title);
-          g_value_take_string (value, custom_title);
-        }
-      else
-        {
-          if (G_UNLIKELY (screen->dynamic_title_mode != TERMINAL_TITLE_DEFAULT))
-            mode = screen->dynamic_title_mode;
-          else
-            g_object_get (G_OBJECT (screen->preferences), "title-mode", &mode, NULL);
-
-          if (G_UNLIKELY (mode == TERMINAL_TITLE_HIDE))
-            {
-              /* show the initial title if the dynamic title is set to hidden */
-              if (G_UNLIKELY (screen->initial_title != NULL))
-                initial = g_strdup (screen->initial_title);
-              else
-                g_object_get (G_OBJECT (screen->preferences), "title-initial", &initial, NULL);
-              parsed_title = terminal_screen_parse_title (screen, initial);
-              title = parsed_title;
-              g_free (initial);
-            }
-          else if (G_LIKELY (screen->terminal != NULL))
-            {
-              title = vte_terminal_get_window_title (VTE_TERMINAL (screen->terminal));
-            }
-
-          /* TRANSLATORS: title for the tab/window used when all other
-           * possible titles were empty strings */
-          if (title == NULL || *title == '\0')
-            title = _("Untitled");
-
-          g_value_set_string (value, title);
-
-          g_free (parsed_title);
-        }
+      /* the title last propagated, see terminal_screen_update_title() */
+      if (G_UNLIKELY (screen->title == NULL))
+        terminal_screen_title_refresh (screen);
+      g_value_set_string (value, screen->title);
       break;
 
     default:
@@ -488,255 +943,518 @@ terminal_screen_unrealize (GtkWidget *widget)
   screen = gtk_widget_get_screen (widget);
   g_signal_handlers_disconnect_by_func (G_OBJECT (screen), terminal_screen_update_background, widget);
 
+  /* the cached surfaces are bound to the window we lose */
+  terminal_screen_clear_background_surface (TERMINAL_SCREEN (widget));
+#if !VTE_CHECK_VERSION (0, 52, 0)
+  if (TERMINAL_SCREEN (widget)->opaque_surface != NULL)
+    {
+      cairo_surface_destroy (TERMINAL_SCREEN (widget)->opaque_surface);
+      TERMINAL_SCREEN (widget)->opaque_surface = NULL;
+      TERMINAL_SCREEN (widget)->opaque_width = 0;
+      TERMINAL_SCREEN (widget)->opaque_height = 0;
+    }
+#endif
+
   (*GTK_WIDGET_CLASS (terminal_screen_parent_class)->unrealize) (widget);
 }
 
 
 
-static gboolean
-terminal_screen_draw (GtkWidget *widget,
-                      cairo_t   *cr,
-                      gpointer   user_data)
+static void
+terminal_screen_map (GtkWidget *widget)
 {
-  TerminalScreen     *screen = TERMINAL_SCREEN (user_data);
-  TerminalBackground  background_mode;
-  GdkPixbuf          *image;
-  gint                width, height;
-  cairo_surface_t    *surface;
-  cairo_t            *ctx;
+  TerminalScreen *screen = TERMINAL_SCREEN (widget);
+  guint           updates;
 
-  terminal_return_val_if_fail (TERMINAL_IS_SCREEN (screen), FALSE);
-  terminal_return_val_if_fail (VTE_IS_TERMINAL (screen->terminal), FALSE);
+  (*GTK_WIDGET_CLASS (terminal_screen_parent_class)->map) (widget);
 
-  g_object_get (G_OBJECT (screen->preferences), "background-mode", &background_mode, NULL);
+  /* apply the updates that were postponed while the tab was hidden */
+  if (G_UNLIKELY (screen->deferred_updates != 0))
+    {
+      updates = screen->deferred_updates;
+      screen->deferred_updates = 0;
+      terminal_screen_apply_updates (screen, updates);
+    }
 
-  if (G_LIKELY (background_mode != TERMINAL_BACKGROUND_IMAGE))
-    return FALSE;
+  /* first time a deferred tab is shown */
+  if (G_UNLIKELY (screen->deferred))
+    {
+      screen->deferred = FALSE;
+      if (screen->tab_label != NULL)
+        gtk_label_set_attributes (GTK_LABEL (screen->tab_label), NULL);
+      terminal_screen_launch_child (screen);
+    }
+}
 
-  width = gtk_widget_get_allocated_width (screen->terminal);
-  height = gtk_widget_get_allocated_height (screen->terminal);
 
-  if (screen->loader == NULL)
-    screen->loader = terminal_image_loader_get ();
-  image = terminal_image_loader_load (screen->loader, width, height);
 
-  if (G_UNLIKELY (image == NULL))
-    return FALSE;
+static gboolean
+terminal_screen_draw_start (GtkWidget      *widget,
+                            cairo_t        *cr,
+                            TerminalScreen *screen)
+{
+  screen->draw_start = g_get_monotonic_time ();
+  return FALSE;
+}
 
-  g_signal_handlers_disconnect_by_func (G_OBJECT (screen->terminal),
-      G_CALLBACK (terminal_screen_draw), screen);
 
-  cairo_save (cr);
 
-  /* draw background image; cairo_set_operator() allows PNG transparency */
-  gdk_cairo_set_source_pixbuf (cr, image, 0, 0);
-  cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
-  cairo_paint (cr);
-  g_object_unref (G_OBJECT (image));
-
-  /* draw vte terminal */
-  surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, width, height);
-  ctx = cairo_create (surface);
-  gtk_widget_draw (screen->terminal, ctx);
-  cairo_set_source_surface (cr, surface, 0, 0);
-  cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
-  cairo_paint (cr);
-  cairo_destroy (ctx);
-  cairo_surface_destroy (surface);
+static gboolean
+terminal_screen_draw_statistics (GtkWidget      *widget,
+                                 cairo_t        *cr,
+                                 TerminalScreen *screen)
+{
+  TerminalScreenStatistics  stats;
+  PangoLayout              *layout;
+  gchar                    *written;
+  gchar                    *text;
+  gint                      width, height;
+  gint64                    now;
+
+  now = g_get_monotonic_time ();
+  screen->stats.draw_time = now - screen->draw_start;
+  if (screen->stats.draw_time > screen->stats.draw_time_max)
+    screen->stats.draw_time_max = screen->stats.draw_time;
+
+  if (G_LIKELY (!terminal_preferences_get_snapshot (screen->preferences)->misc_show_statistics))
+    return FALSE;
+
+  terminal_screen_get_statistics (screen, &stats);
+
+  written = g_format_size (stats.bytes_written);
+  if (stats.last_output > 0)
+    text = g_strdup_printf (_("%u updates/s (%" G_GUINT64_FORMAT " total)\n"
+                              "Draw %.1f ms (max %.1f ms)\n"
+                              "Input %s\nLast output %.0f s ago"),
+                            stats.contents_changed_rate, stats.contents_changed,
+                            stats.draw_time / 1000.0, stats.draw_time_max / 1000.0,
+                            written, (now - stats.last_output) / (gdouble) G_USEC_PER_SEC);
+  else
+    text = g_strdup_printf (_("%u updates/s (%" G_GUINT64_FORMAT " total)\n"
+                              "Draw %.1f ms (max %.1f ms)\n"
+                              "Input %s\nNo output"),
+                            stats.contents_changed_rate, stats.contents_changed,
+                            stats.draw_time / 1000.0, stats.draw_time_max / 1000.0,
+                            written);
+  g_free (written);
+
+  /* top right corner, on a dark box */
+  layout = gtk_widget_create_pango_layout (widget, text);
+  pango_layout_get_pixel_size (layout, &width, &height);
 
+  cairo_save (cr);
+  cairo_translate (cr, gtk_widget_get_allocated_width (widget) - width - 12, 6);
+  cairo_set_source_rgba (cr, 0.0, 0.0, 0.0, 0.7);
+  cairo_rectangle (cr, -6, -3, width + 12, height + 6);
+  cairo_fill (cr);
+  cairo_set_source_rgb (cr, 1.0, 1.0, 1.0);
+  pango_cairo_show_layout (cr, layout);
   cairo_restore (cr);
 
-  g_signal_connect (G_OBJECT (screen->terminal), "draw",
-      G_CALLBACK (terminal_screen_draw), screen);
+  g_object_unref (layout);
+  g_free (text);
 
-  return TRUE;
+  return FALSE;
 }
 
 
 
-static void
-terminal_screen_preferences_changed (TerminalPreferences *preferences,
-                                     GParamSpec          *pspec,
-                                     TerminalScreen      *screen)
+static cairo_surface_t *
+terminal_screen_get_background_surface (TerminalScreen *screen,
+                                        GtkWidget      *widget)
 {
-  const gchar *name;
-
-  terminal_return_if_fail (TERMINAL_IS_SCREEN (screen));
-  terminal_return_if_fail (TERMINAL_IS_PREFERENCES (preferences));
-  terminal_return_if_fail (screen->preferences == preferences);
+  cairo_surface_t *image;
+  gint             width, height;
+  cairo_t         *ctx;
+
+  width = gtk_widget_get_allocated_width (widget);
+  height = gtk_widget_get_allocated_height (widget);
+
+  /* (re)build the background surface when the size changed, the image
+   * is rendered once in the native format of the window */
+  if (G_UNLIKELY (screen->background_surface == NULL
+                  || screen->background_width != width
+                  || screen->background_height != height))
+    {
+      terminal_screen_clear_background_surface (screen);
 
-  /* get name */
-  name = g_param_spec_get_name (pspec);
-  terminal_assert (name != NULL);
+      if (screen->loader == NULL)
+        {
+          screen->loader = terminal_image_loader_get ();
+          g_signal_connect_swapped (G_OBJECT (screen->loader), "image-ready",
+              G_CALLBACK (gtk_widget_queue_draw), screen->terminal);
+        }
+      image = terminal_image_loader_load (screen->loader, width, height,
+                                          gtk_widget_get_scale_factor (widget));
+
+      /* the image is still loading or rendering, or failed to load;
+       * the caller uses the plain background color until "image-ready"
+       * is emitted */
+      if (G_UNLIKELY (image == NULL))
+        return NULL;
+
+      screen->background_surface = gdk_window_create_similar_surface (gtk_widget_get_window (widget),
+                                                                      CAIRO_CONTENT_COLOR_ALPHA,
+                                                                      width, height);
+      screen->background_width = width;
+      screen->background_height = height;
+
+      /* the device scale of the image maps it to logical pixels;
+       * cairo_set_operator() allows PNG transparency */
+      ctx = cairo_create (screen->background_surface);
+      cairo_set_source_surface (ctx, image, 0, 0);
+      cairo_set_operator (ctx, CAIRO_OPERATOR_SOURCE);
+      cairo_paint (ctx);
+      cairo_destroy (ctx);
+
+      cairo_surface_destroy (image);
+    }
 
-  if (strncmp ("background-", name, strlen ("background-")) == 0)
-    terminal_screen_update_background (screen);
-  else if (strcmp ("binding-backspace", name) == 0)
-    terminal_screen_update_binding_backspace (screen);
-  else if (strcmp ("binding-delete", name) == 0)
-    terminal_screen_update_binding_delete (screen);
-  else if (strcmp ("binding-ambiguous-width", name) == 0)
-    terminal_screen_update_binding_ambiguous_width (screen);
-  else if (strncmp ("color-", name, strlen ("color-")) == 0)
-    terminal_screen_update_colors (screen);
-  else if (strncmp ("font-", name, strlen ("font-")) == 0)
-    terminal_screen_update_font (screen);
-  else if (strncmp ("misc-bell", name, strlen ("misc-bell")) == 0)
-    terminal_screen_update_misc_bell (screen);
-  else if (strcmp ("misc-cursor-blinks", name) == 0)
-    terminal_screen_update_misc_cursor_blinks (screen);
-  else if (strcmp ("misc-cursor-shape", name) == 0)
-    terminal_screen_update_misc_cursor_shape (screen);
-  else if (strcmp ("misc-mouse-autohide", name) == 0)
-    terminal_screen_update_misc_mouse_autohide (screen);
-  else if (strcmp ("misc-rewrap-on-resize", name) == 0)
-    terminal_screen_update_misc_rewrap_on_resize (screen);
-  else if (strcmp ("scrolling-bar", name) == 0)
-    terminal_screen_update_scrolling_bar (screen);
-  else if (strcmp ("scrolling-lines", name) == 0 || strcmp ("scrolling-unlimited", name) == 0)
-    terminal_screen_update_scrolling_lines (screen);
-  else if (strcmp ("scrolling-on-output", name) == 0)
-    terminal_screen_update_scrolling_on_output (screen);
-  else if (strcmp ("scrolling-on-keystroke", name) == 0)
-    terminal_screen_update_scrolling_on_keystroke (screen);
-  else if (strncmp ("title-", name, strlen ("title-")) == 0)
-    terminal_screen_update_title (screen);
-  else if (strcmp ("word-chars", name) == 0)
-    terminal_screen_update_word_chars (screen);
-  else if (strcmp ("misc-tab-position", name) == 0)
-    terminal_screen_update_label_orientation (screen);
+  return screen->background_surface;
 }
 
 
 
+#if VTE_CHECK_VERSION (0, 52, 0)
 static gboolean
-terminal_screen_get_child_command (TerminalScreen   *screen,
-                                   gchar           **command,
-                                   gchar          ***argv,
-                                   GError          **error)
+terminal_screen_draw_background (GtkWidget      *widget,
+                                 cairo_t        *cr,
+                                 TerminalScreen *screen)
 {
-  struct passwd *pw;
-  const gchar   *shell_name;
-  const gchar   *shell_fullpath = NULL;
-  gchar         *custom_command = NULL;
-  gboolean       command_login_shell;
-  gboolean       run_custom_command;
-  guint          i;
-  const gchar   *shells[] = { "/bin/sh",
-                              "/bin/bash", "/usr/bin/bash",
-                              "/bin/dash", "/usr/bin/dash",
-                              "/bin/zsh",  "/usr/bin/zsh",
-                              "/bin/tcsh", "/usr/bin/tcsh",
-                              "/bin/csh",  "/usr/bin/csh",
-                              "/bin/ksh",  "/usr/bin/ksh" };
+  cairo_surface_t *surface;
 
-  if (screen->custom_command != NULL)
+  if (G_LIKELY (terminal_preferences_get_snapshot (screen->preferences)->background_mode != TERMINAL_BACKGROUND_IMAGE))
+    return FALSE;
+
+  /* vte does not clear its background in image mode (see
+   * terminal_screen_update_background()), so paint the image and the
+   * shading here and let vte draw the text on top; cairo limits this
+   * to the clip of this expose */
+  surface = terminal_screen_get_background_surface (screen, widget);
+
+  cairo_save (cr);
+  cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+  if (G_LIKELY (surface != NULL))
     {
-      *command = g_strdup (screen->custom_command[0]);
-      *argv    = g_strdupv (screen->custom_command);
+      cairo_set_source_surface (cr, surface, 0, 0);
+      cairo_paint (cr);
+      cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
+      gdk_cairo_set_source_rgba (cr, &screen->background_color);
     }
   else
     {
-      g_object_get (G_OBJECT (screen->preferences),
-                    "command-login-shell", &command_login_shell,
-                    "run-custom-command", &run_custom_command,
-                    NULL);
+      cairo_set_source_rgb (cr, screen->background_color.red,
+                            screen->background_color.green,
+                            screen->background_color.blue);
+    }
+  cairo_paint (cr);
+  cairo_restore (cr);
 
-      if (run_custom_command)
-        {
-          /* use custom command specified in preferences */
-          g_object_get (G_OBJECT (screen->preferences),
-                        "custom-command", &custom_command,
-                        NULL);
-          shell_fullpath = custom_command;
-        }
-      else
-        {
-          /* use the SHELL environement variable if we're in
-          * non-setuid mode and the path is executable */
-          if (geteuid () == getuid ()
-              && getegid () == getgid ())
-            {
-              shell_fullpath = g_getenv ("SHELL");
-              if (shell_fullpath != NULL
-                  && g_access (shell_fullpath, X_OK) != 0)
-                shell_fullpath = NULL;
-            }
+  return FALSE;
+}
+#else
+static gboolean
+terminal_screen_draw_opaque (GtkWidget      *widget,
+                             cairo_t        *cr,
+                             TerminalScreen *screen)
+{
+  GdkRectangle  clip;
+  cairo_t      *ctx;
 
-          if (shell_fullpath == NULL)
-            {
-              pw = getpwuid (getuid ());
-              if (pw != NULL
-                  && pw->pw_shell != NULL
-                  && g_access (pw->pw_shell, X_OK) == 0)
-                {
-                  /* set the shell from the password database */
-                  shell_fullpath = pw->pw_shell;
-                }
-              else
-                {
-                  /* lookup a good fallback */
-                  for (i = 0; i < G_N_ELEMENTS (shells); i++)
-                    {
-                      if (access (shells [i], X_OK) == 0)
-                        {
-                          shell_fullpath = shells [i];
-                          break;
-                        }
-                    }
+  if (G_LIKELY (terminal_preferences_get_snapshot (screen->preferences)->background_mode != TERMINAL_BACKGROUND_IMAGE)
+      || (cairo_surface_get_content (cairo_get_target (cr)) & CAIRO_CONTENT_ALPHA) != 0
+      || !gdk_cairo_get_clip_rectangle (cr, &clip))
+    return FALSE;
 
-                  if (G_UNLIKELY (shell_fullpath == NULL))
-                    {
-                      /* the system is truly broken */
-                      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
-                                   _("Unable to determine your login shell."));
-                      return FALSE;
-                    }
-                 }
-            }
-        }
+  /* without an alpha channel in the window (no compositing or rgba
+   * visual), terminal_screen_draw() cannot put the image behind what
+   * vte painted; this vte always clears its background, so draw the
+   * exposed area on a surface with alpha and copy that */
+  if (screen->opaque_surface == NULL
+      || screen->opaque_width < clip.width
+      || screen->opaque_height < clip.height)
+    {
+      if (screen->opaque_surface != NULL)
+        cairo_surface_destroy (screen->opaque_surface);
+
+      screen->opaque_width = MAX (screen->opaque_width, clip.width);
+      screen->opaque_height = MAX (screen->opaque_height, clip.height);
+      screen->opaque_surface = gdk_window_create_similar_surface (gtk_widget_get_window (widget),
+                                                                  CAIRO_CONTENT_COLOR_ALPHA,
+                                                                  screen->opaque_width,
+                                                                  screen->opaque_height);
+    }
 
-      terminal_assert (shell_fullpath != NULL);
-      shell_name = strrchr (shell_fullpath, '/');
-      if (shell_name != NULL)
-        ++shell_name;
-      else
-        shell_name = shell_fullpath;
-      *command = g_strdup (shell_fullpath);
+  ctx = cairo_create (screen->opaque_surface);
+  cairo_translate (ctx, -clip.x, -clip.y);
+  gdk_cairo_rectangle (ctx, &clip);
+  cairo_clip (ctx);
+
+  /* the surface is reused, drop the previous frame */
+  cairo_save (ctx);
+  cairo_set_operator (ctx, CAIRO_OPERATOR_CLEAR);
+  cairo_paint (ctx);
+  cairo_restore (ctx);
+
+  /* the class handler draws vte, not a new emission, so the "draw"
+   * handlers do not run twice for this frame */
+  GTK_WIDGET_GET_CLASS (widget)->draw (widget, ctx);
+  terminal_screen_draw (widget, ctx, screen);
+  cairo_destroy (ctx);
 
-      *argv = g_new (gchar *, 2);
-      if (command_login_shell)
-        (*argv)[0] = g_strconcat ("-", shell_name, NULL);
-      else
-        (*argv)[0] = g_strdup (shell_name);
-      (*argv)[1] = NULL;
+  cairo_save (cr);
+  cairo_set_source_surface (cr, screen->opaque_surface, clip.x, clip.y);
+  cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+  gdk_cairo_rectangle (cr, &clip);
+  cairo_fill (cr);
+  cairo_restore (cr);
 
-      if (custom_command != NULL)
-        g_free (custom_command);
-    }
+  /* this stops the emission, run the overlays on the window */
+  terminal_screen_draw_search (widget, cr, screen);
+  terminal_screen_draw_statistics (widget, cr, screen);
 
   return TRUE;
 }
 
 
 
-static gchar *
-terminal_screen_parse_title (TerminalScreen *screen,
-                             const gchar    *title)
+static gboolean
+terminal_screen_draw (GtkWidget *widget,
+                      cairo_t   *cr,
+                      gpointer   user_data)
+{
+  TerminalScreen  *screen = TERMINAL_SCREEN (user_data);
+  cairo_surface_t *surface;
+
+  terminal_return_val_if_fail (TERMINAL_IS_SCREEN (screen), FALSE);
+  terminal_return_val_if_fail (VTE_IS_TERMINAL (screen->terminal), FALSE);
+
+  if (G_LIKELY (terminal_preferences_get_snapshot (screen->preferences)->background_mode != TERMINAL_BACKGROUND_IMAGE))
+    return FALSE;
+
+  /* vte already painted its (shaded) background and the text, put the
+   * image behind that; cairo limits this to the clip of this expose */
+  surface = terminal_screen_get_background_surface (screen, widget);
+
+  cairo_save (cr);
+  if (G_LIKELY (surface != NULL))
+    cairo_set_source_surface (cr, surface, 0, 0);
+  else
+    cairo_set_source_rgb (cr, screen->background_color.red,
+                          screen->background_color.green,
+                          screen->background_color.blue);
+  cairo_set_operator (cr, CAIRO_OPERATOR_DEST_OVER);
+  cairo_paint (cr);
+  cairo_restore (cr);
+
+  return FALSE;
+}
+#endif
+
+
+
+static void
+terminal_screen_clear_background_surface (TerminalScreen *screen)
+{
+  if (screen->background_surface != NULL)
+    {
+      cairo_surface_destroy (screen->background_surface);
+      screen->background_surface = NULL;
+    }
+}
+
+
+
+static void
+terminal_screen_preferences_changed (TerminalPreferences *preferences,
+                                     GParamSpec          *pspec,
+                                     TerminalScreen      *screen)
+{
+  guint updates;
+
+  terminal_return_if_fail (TERMINAL_IS_SCREEN (screen));
+  terminal_return_if_fail (TERMINAL_IS_PREFERENCES (preferences));
+  terminal_return_if_fail (screen->preferences == preferences);
+
+  if (G_UNLIKELY (pspec->param_id >= screen_n_pspec_updates))
+    return;
+
+  updates = screen_pspec_updates[pspec->param_id];
+  if (updates == 0)
+    return;
+
+  /* merge the changes, they are applied once in the idle */
+  screen->pending_updates |= updates;
+  if (screen->updates_idle_id == 0)
+    {
+      screen->updates_idle_id = g_idle_add_full (G_PRIORITY_HIGH_IDLE, terminal_screen_updates_idle,
+                                                 screen, terminal_screen_updates_idle_destroy);
+    }
+}
+
+
+
+static gboolean
+terminal_screen_updates_idle (gpointer user_data)
+{
+  TerminalScreen *screen = TERMINAL_SCREEN (user_data);
+  guint           updates;
+
+  updates = screen->pending_updates;
+  screen->pending_updates = 0;
+
+  /* geometry changes of hidden tabs are applied when they are mapped */
+  if (!gtk_widget_get_mapped (GTK_WIDGET (screen)))
+    {
+      screen->deferred_updates |= (updates & UPDATE_DEFERRABLE);
+      updates &= ~UPDATE_DEFERRABLE;
+    }
+  else
+    {
+      updates |= screen->deferred_updates;
+      screen->deferred_updates = 0;
+    }
+
+  terminal_screen_apply_updates (screen, updates);
+
+  return FALSE;
+}
+
+
+
+static void
+terminal_screen_updates_idle_destroy (gpointer user_data)
+{
+  TERMINAL_SCREEN (user_data)->updates_idle_id = 0;
+}
+
+
+
+static void
+terminal_screen_apply_updates (TerminalScreen *screen,
+                               guint           updates)
+{
+  if ((updates & UPDATE_BACKGROUND) != 0)
+    terminal_screen_update_background (screen);
+  if ((updates & UPDATE_BACKGROUND_SURFACE) != 0)
+    terminal_screen_clear_background_surface (screen);
+  if ((updates & UPDATE_BINDING_BACKSPACE) != 0)
+    terminal_screen_update_binding_backspace (screen);
+  if ((updates & UPDATE_BINDING_DELETE) != 0)
+    terminal_screen_update_binding_delete (screen);
+  if ((updates & UPDATE_BINDING_AMBIGUOUS_WIDTH) != 0)
+    terminal_screen_update_binding_ambiguous_width (screen);
+  if ((updates & UPDATE_COLORS) != 0)
+    terminal_screen_update_colors (screen);
+  if ((updates & UPDATE_FONT) != 0)
+    terminal_screen_update_font (screen);
+  if ((updates & UPDATE_MISC_BELL) != 0)
+    terminal_screen_update_misc_bell (screen);
+  if ((updates & UPDATE_MISC_CURSOR_BLINKS) != 0)
+    terminal_screen_update_misc_cursor_blinks (screen);
+  if ((updates & UPDATE_MISC_CURSOR_SHAPE) != 0)
+    terminal_screen_update_misc_cursor_shape (screen);
+  if ((updates & UPDATE_MISC_MOUSE_AUTOHIDE) != 0)
+    terminal_screen_update_misc_mouse_autohide (screen);
+  if ((updates & UPDATE_MISC_REWRAP_ON_RESIZE) != 0)
+    terminal_screen_update_misc_rewrap_on_resize (screen);
+  if ((updates & UPDATE_MISC_SHOW_STATISTICS) != 0)
+    terminal_screen_update_misc_show_statistics (screen);
+  if ((updates & UPDATE_SCROLLING_BAR) != 0)
+    terminal_screen_update_scrolling_bar (screen);
+  if ((updates & UPDATE_SCROLLING_LINES) != 0)
+    terminal_screen_update_scrolling_lines (screen);
+  if ((updates & UPDATE_SCROLLING_ON_OUTPUT) != 0)
+    terminal_screen_update_scrolling_on_output (screen);
+  if ((updates & UPDATE_SCROLLING_ON_KEYSTROKE) != 0)
+    terminal_screen_update_scrolling_on_keystroke (screen);
+  if ((updates & UPDATE_TITLE) != 0)
+    terminal_screen_update_title (screen);
+  if ((updates & UPDATE_WORD_CHARS) != 0)
+    terminal_screen_update_word_chars (screen);
+  if ((updates & UPDATE_LABEL_ORIENTATION) != 0)
+    terminal_screen_update_label_orientation (screen);
+}
+
+
+
+static gboolean
+terminal_screen_get_child_command (TerminalScreen   *screen,
+                                   gchar           **command,
+                                   gchar          ***argv,
+                                   GError          **error)
+{
+  if (screen->custom_command != NULL)
+    {
+      *command = g_strdup (screen->custom_command[0]);
+      *argv    = g_strdupv (screen->custom_command);
+      return TRUE;
+    }
+
+  return terminal_screen_get_shell_command (screen->preferences, command, argv, error);
+}
+
+
+
+static void
+terminal_screen_title_template_clear (TerminalTitleTemplate *template)
+{
+  guint n;
+
+  if (template->tokens != NULL)
+    {
+      for (n = 0; n < template->tokens->len; n++)
+        g_free (g_array_index (template->tokens, TerminalTitleToken, n).text);
+      g_array_free (template->tokens, TRUE);
+      template->tokens = NULL;
+    }
+
+  g_free (template->source);
+  template->source = NULL;
+}
+
+
+
+static void
+terminal_screen_title_template_add (TerminalTitleTemplate  *template,
+                                    GString                *text,
+                                    TerminalTitleTokenType  type)
+{
+  TerminalTitleToken token;
+
+  /* flush the characters collected so far */
+  if (text->len > 0)
+    {
+      token.type = TITLE_TOKEN_TEXT;
+      token.text = g_strndup (text->str, text->len);
+      g_array_append_val (template->tokens, token);
+      g_string_truncate (text, 0);
+    }
+
+  if (type != TITLE_TOKEN_TEXT)
+    {
+      token.type = type;
+      token.text = NULL;
+      g_array_append_val (template->tokens, token);
+    }
+}
+
+
+
+static void
+terminal_screen_title_template_compile (TerminalTitleTemplate *template,
+                                        const gchar           *title)
 {
-  GString     *string;
+  GString     *text;
   const gchar *remainder;
   const gchar *percent;
-  const gchar *directory = NULL;
-  gchar       *base_name;
-  const gchar *vte_title;
 
-  terminal_return_val_if_fail (TERMINAL_IS_SCREEN (screen), NULL);
+  terminal_screen_title_template_clear (template);
 
-  if (G_UNLIKELY (title == NULL))
-    return g_strdup ("");
+  template->source = g_strdup (title);
+  template->tokens = g_array_new (FALSE, FALSE, sizeof (TerminalTitleToken));
 
-  string = g_string_new (NULL);
+  text = g_string_new (NULL);
   remainder = title;
 
   /* walk from % character to % character */
@@ -747,29 +1465,99 @@ terminal_screen_parse_title (TerminalScreen *screen,
       if (percent == NULL)
         {
           /* we parsed the whole string */
-          g_string_append (string, remainder);
+          g_string_append (text, remainder);
           break;
         }
 
       /* append the characters in between */
-      g_string_append_len (string, remainder, percent - remainder);
+      g_string_append_len (text, remainder, percent - remainder);
       remainder = percent + 1;
 
       /* handle the "%" character */
       switch (*remainder)
         {
         case '#':
-          g_string_append_printf (string, "%u", screen->session_id);
+          terminal_screen_title_template_add (template, text, TITLE_TOKEN_SESSION_ID);
           break;
 
         case 'd':
+          terminal_screen_title_template_add (template, text, TITLE_TOKEN_DIRECTORY_NAME);
+          break;
+
         case 'D':
+          terminal_screen_title_template_add (template, text, TITLE_TOKEN_DIRECTORY);
+          break;
+
+        case 'w':
+          terminal_screen_title_template_add (template, text, TITLE_TOKEN_VTE_TITLE);
+          break;
+
+        default:
+          g_string_append_c (text, '%');
+          continue;
+        }
+
+      remainder++;
+    }
+
+  terminal_screen_title_template_add (template, text, TITLE_TOKEN_TEXT);
+  g_string_free (text, TRUE);
+}
+
+
+
+static gchar *
+terminal_screen_parse_title (TerminalScreen        *screen,
+                             TerminalTitleTemplate *template,
+                             const gchar           *title)
+{
+  GString            *string;
+  TerminalTitleToken *token;
+  const gchar        *directory = NULL;
+  gchar              *base_name;
+  const gchar        *vte_title;
+  guint               n;
+
+  terminal_return_val_if_fail (TERMINAL_IS_SCREEN (screen), NULL);
+
+  if (G_UNLIKELY (title == NULL))
+    return g_strdup ("");
+
+  /* the template is only compiled again when it changed */
+  if (template->tokens == NULL || strcmp (template->source, title) != 0)
+    terminal_screen_title_template_compile (template, title);
+
+  /* a template without escapes */
+  if (template->tokens->len == 0)
+    return g_strdup ("");
+  token = &g_array_index (template->tokens, TerminalTitleToken, 0);
+  if (template->tokens->len == 1 && token->type == TITLE_TOKEN_TEXT)
+    return g_strdup (token->text);
+
+  string = g_string_sized_new (64);
+
+  for (n = 0; n < template->tokens->len; n++)
+    {
+      token = &g_array_index (template->tokens, TerminalTitleToken, n);
+      switch (token->type)
+        {
+        case TITLE_TOKEN_TEXT:
+          g_string_append (string, token->text);
+          break;
+
+        case TITLE_TOKEN_SESSION_ID:
+          g_string_append_printf (string, "%u", screen->session_id);
+          break;
+
+        case TITLE_TOKEN_DIRECTORY:
+        case TITLE_TOKEN_DIRECTORY_NAME:
+          /* the last known directory, this does not block */
           if (directory == NULL)
             directory = terminal_screen_get_working_directory (screen);
 
           if (G_LIKELY (directory != NULL))
             {
-              if (*remainder == 'D')
+              if (token->type == TITLE_TOKEN_DIRECTORY)
                 {
                   /* long directory name */
                   g_string_append (string, directory);
@@ -784,20 +1572,14 @@ terminal_screen_parse_title (TerminalScreen *screen,
             }
           break;
 
-        case 'w':
+        case TITLE_TOKEN_VTE_TITLE:
           /* window title from vte */
           vte_title = vte_terminal_get_window_title (VTE_TERMINAL (screen->terminal));
           if (G_UNLIKELY (vte_title == NULL))
             vte_title = _("Untitled");
           g_string_append (string, vte_title);
           break;
-
-        default:
-          g_string_append_c (string, '%');
-          continue;
         }
-
-      remainder++;
     }
 
   return g_string_free (string, FALSE);
@@ -805,69 +1587,213 @@ terminal_screen_parse_title (TerminalScreen *screen,
 
 
 
-static gchar**
-terminal_screen_get_child_environment (TerminalScreen *screen)
+static gboolean
+terminal_screen_environment_skip (const gchar *variable)
 {
-  GtkWidget     *toplevel;
-  const gchar   *display_name;
-  gchar        **result;
-  gchar        **p;
-  guint          n;
-  gchar        **env;
-  const gchar   *value;
-
-  /* get all the environ variables */
-  env = g_listenv ();
-
-  n = g_strv_length (env);
-  result = g_new (gchar *, n + 4);
-
-  for (n = 0, p = env; *p != NULL; ++p)
-    {
-      /* do not copy the following variables */
-      if (strcmp (*p, "COLUMNS") == 0
-          || strcmp (*p, "LINES") == 0
-          || strcmp (*p, "WINDOWID") == 0
-          || strcmp (*p, "GNOME_DESKTOP_ICON") == 0
-          || strcmp (*p, "COLORTERM") == 0
-          || strcmp (*p, "DISPLAY") == 0
-          || strcmp (*p, "TERM") == 0)
-        continue;
+  static const gchar *names[] =
+  {
+    /* set for each child */
+    "PWD", "COLORTERM", "TERM", "VTE_VERSION", "WINDOWID", "DISPLAY",
+    /* do not copy the following variables */
+    "COLUMNS", "LINES", "GNOME_DESKTOP_ICON"
+  };
+  const gchar *equals;
+  guint        n;
+
+  equals = strchr (variable, '=');
+  if (G_UNLIKELY (equals == NULL))
+    return TRUE;
+
+  for (n = 0; n < G_N_ELEMENTS (names); n++)
+    if (strncmp (variable, names[n], equals - variable) == 0
+        && names[n][equals - variable] == '\0')
+      return TRUE;
+
+  return FALSE;
+}
+
+
+
+/* the block @variable points into, %NULL if it is not shared */
+static TerminalEnvBlock *
+terminal_screen_environment_block (const gchar *variable)
+{
+  TerminalEnvBlock *block;
+  GSList           *lp;
+
+  for (lp = screen_env_blocks; lp != NULL; lp = lp->next)
+    {
+      block = lp->data;
+      if (variable >= block->data && variable < block->data + block->size)
+        return block;
+    }
+
+  return NULL;
+}
+
+
+
+static void
+terminal_screen_environment_update (void)
+{
+  TerminalEnvBlock *block;
+  gsize             size = 0;
+  gsize             len;
+  guint             n, i;
+  guint             n_environ;
+  gchar            *p;
+
+  if (screen_env_template_generation == screen_env_generation)
+    return;
+  screen_env_template_generation = screen_env_generation;
 
-      /* copy working directory to $PWD, to preserve symlinks
-       * see https://bugzilla.gnome.org/show_bug.cgi?id=758452 */
-      if (strcmp (*p, "PWD") == 0)
+  /* the current block is released once no environment uses it */
+  if (screen_env_blocks != NULL)
+    {
+      block = screen_env_blocks->data;
+      if (block->users == 0)
+        {
+          screen_env_blocks = g_slist_delete_link (screen_env_blocks, screen_env_blocks);
+          g_free (block->data);
+          g_slice_free (TerminalEnvBlock, block);
+        }
+    }
+
+  /* copy the variables we pass on into one block, the variables that
+   * are set for each child are left out */
+  for (n_environ = 0; environ[n_environ] != NULL; n_environ++)
+    if (!terminal_screen_environment_skip (environ[n_environ]))
+      size += strlen (environ[n_environ]) + 1;
+
+  block = g_slice_new0 (TerminalEnvBlock);
+  block->size = MAX (size, 1);
+  block->data = g_malloc (block->size);
+
+  g_free (screen_env_template);
+  screen_env_template = g_new (gchar *, n_environ + 1);
+  screen_env_has_pwd = FALSE;
+
+  for (n = 0, i = 0, p = block->data; n < n_environ; n++)
+    {
+      if (terminal_screen_environment_skip (environ[n]))
         {
-          result[n++] = g_strconcat (*p, "=", screen->working_directory, NULL);
+          if (strncmp (environ[n], "PWD=", 4) == 0)
+            screen_env_has_pwd = TRUE;
           continue;
         }
 
-      /* copy the variable */
-      value = g_getenv (*p);
-      if (G_LIKELY (value != NULL))
-        result[n++] = g_strconcat (*p, "=", value, NULL);
+      len = strlen (environ[n]) + 1;
+      memcpy (p, environ[n], len);
+      screen_env_template[i++] = p;
+      p += len;
     }
+  screen_env_template[i] = NULL;
+  screen_env_n_template = i;
+
+  screen_env_blocks = g_slist_prepend (screen_env_blocks, block);
+}
+
+
+
+static gchar **
+terminal_screen_build_environment (const gchar  *working_directory,
+                                   const gchar  *windowid,
+                                   const gchar  *display_name,
+                                   gchar       **custom_environment)
+{
+  gchar       **result;
+  gchar       **copy;
+  gchar       **p;
+  guint         n;
+  const gchar  *value;
+  gchar        *name;
+
+  terminal_screen_environment_update ();
 
-  g_strfreev (env);
+  /* the variables of this child in front of the shared template */
+  result = g_new (gchar *, screen_env_n_template + 7);
+  n = 0;
+
+  /* copy working directory to $PWD, to preserve symlinks
+   * see https://bugzilla.gnome.org/show_bug.cgi?id=758452 */
+  if (screen_env_has_pwd && working_directory != NULL)
+    result[n++] = g_strconcat ("PWD=", working_directory, NULL);
 
   result[n++] = g_strdup_printf ("COLORTERM=%s", PACKAGE_NAME);
 
+  /* what vte_terminal_spawn_sync() sets, for children spawned without it */
+  result[n++] = g_strdup ("TERM=" TERMINAL_CHILD_TERM);
+  result[n++] = g_strdup_printf ("VTE_VERSION=%u", VTE_MAJOR_VERSION * 10000 + VTE_MINOR_VERSION * 100 + VTE_MICRO_VERSION);
+
+  if (windowid != NULL)
+    result[n++] = g_strconcat ("WINDOWID=", windowid, NULL);
+  if (display_name != NULL)
+    result[n++] = g_strconcat ("DISPLAY=", display_name, NULL);
+
+  memcpy (result + n, screen_env_template, (screen_env_n_template + 1) * sizeof (gchar *));
+
+  /* released in terminal_screen_free_environment() */
+  if (screen_env_n_template > 0 && custom_environment == NULL)
+    ((TerminalEnvBlock *) screen_env_blocks->data)->users++;
+
+  /* overrides of the tab, "KEY=VALUE" sets and "KEY" unsets; these
+   * may replace shared variables, so work on a private copy */
+  if (G_UNLIKELY (custom_environment != NULL))
+    {
+      copy = g_new (gchar *, n + screen_env_n_template + 1);
+      memcpy (copy, result, n * sizeof (gchar *));
+      for (p = screen_env_template; *p != NULL; p++)
+        copy[n++] = g_strdup (*p);
+      copy[n] = NULL;
+      g_free (result);
+      result = copy;
+
+      for (p = custom_environment; *p != NULL; ++p)
+        {
+          value = strchr (*p, '=');
+          if (value != NULL)
+            {
+              name = g_strndup (*p, value - *p);
+              result = g_environ_setenv (result, name, value + 1, TRUE);
+              g_free (name);
+            }
+          else
+            {
+              result = g_environ_unsetenv (result, *p);
+            }
+        }
+    }
+
+  return result;
+}
+
+
+
+static gchar**
+terminal_screen_get_child_environment (TerminalScreen *screen)
+{
+  GtkWidget     *toplevel;
+  const gchar   *display_name = NULL;
+  gchar          windowid[32];
+  gboolean       has_windowid = FALSE;
+
 #ifdef GDK_WINDOWING_X11
   /* determine the toplevel widget */
   toplevel = gtk_widget_get_toplevel (GTK_WIDGET (screen));
   if (toplevel != NULL && gtk_widget_get_realized (toplevel) && GDK_IS_X11_WINDOW (gtk_widget_get_window (toplevel)))
     {
-      result[n++] = g_strdup_printf ("WINDOWID=%ld", (glong) gdk_x11_window_get_xid (gtk_widget_get_window (toplevel)));
+      g_snprintf (windowid, sizeof (windowid), "%ld", (glong) gdk_x11_window_get_xid (gtk_widget_get_window (toplevel)));
+      has_windowid = TRUE;
 
       /* determine the DISPLAY value for the command */
       display_name = gdk_display_get_name (gdk_screen_get_display (gtk_widget_get_screen (toplevel)));
-      result[n++] = g_strdup_printf ("DISPLAY=%s", display_name);
     }
 #endif
 
-  result[n] = NULL;
-
-  return result;
+  return terminal_screen_build_environment (screen->working_directory,
+                                            has_windowid ? windowid : NULL,
+                                            display_name,
+                                            screen->custom_environment);
 }
 
 
@@ -893,6 +1819,15 @@ terminal_screen_update_background (TerminalScreen *screen)
   screen->background_color.alpha = background_alpha;
   vte_terminal_set_color_background (VTE_TERMINAL (screen->terminal), &screen->background_color);
 
+#if VTE_CHECK_VERSION (0, 52, 0)
+  /* terminal_screen_draw_background() paints the image and the shading */
+  vte_terminal_set_clear_background (VTE_TERMINAL (screen->terminal),
+                                     background_mode != TERMINAL_BACKGROUND_IMAGE);
+#endif
+
+  /* image or style might have changed */
+  terminal_screen_clear_background_surface (screen);
+
   gtk_widget_queue_draw (GTK_WIDGET (screen));
 }
 
@@ -978,58 +1913,20 @@ terminal_screen_update_encoding (TerminalScreen *screen)
 static void
 terminal_screen_update_colors (TerminalScreen *screen)
 {
-  GdkRGBA    palette[16];
-  GdkRGBA    bg;
-  GdkRGBA    fg;
-  GdkRGBA    cursor;
-  GdkRGBA    selection;
-  GdkRGBA    bold;
-  gboolean   cursor_use_default;
-  gboolean   selection_use_default;
-  gboolean   bold_use_default;
-  guint      n = 0;
-  gboolean   has_bg;
-  gboolean   has_fg;
-  gboolean   valid_palette = FALSE;
-  gchar     *palette_str;
-  gchar    **colors;
-  gboolean   vary_bg;
-  gdouble    hsv[N_HSV];
-  gdouble    sat_min, sat_max;
-
-  g_object_get (screen->preferences,
-                "color-palette", &palette_str,
-                "color-cursor-use-default", &cursor_use_default,
-                "color-selection-use-default", &selection_use_default,
-                "color-bold-use-default", &bold_use_default,
-                "color-background-vary", &vary_bg,
-                NULL);
+  TerminalColorScheme *scheme;
+  GdkRGBA              bg;
+  gdouble              hsv[N_HSV];
+  gdouble              sat_min, sat_max;
 
-  if (G_LIKELY (palette_str != NULL))
-    {
-      colors = g_strsplit (palette_str, ";", -1);
-      g_free (palette_str);
-
-      if (colors != NULL)
-        for (; n < 16 && colors[n] != NULL; n++)
-          if (!gdk_rgba_parse (palette + n, colors[n]))
-            {
-              g_warning ("Unable to parse color \"%s\".", colors[n]);
-              break;
-            }
-
-      g_strfreev (colors);
-      valid_palette = (n == 16);
-    }
-
-  has_bg = terminal_preferences_get_color (screen->preferences, "color-background", &bg);
-  has_fg = terminal_preferences_get_color (screen->preferences, "color-foreground", &fg);
+  /* parsed once for all screens */
+  scheme = terminal_preferences_get_color_scheme (screen->preferences);
+  bg = scheme->background;
 
   /* we pick a random hue value to keep readability */
-  if (vary_bg && has_bg)
+  if (scheme->background_vary && scheme->has_background)
     {
-      gtk_rgb_to_hsv (bg.red, bg.green, bg.blue,
-                      NULL, &hsv[HSV_SATURATION], &hsv[HSV_VALUE]);
+      hsv[HSV_SATURATION] = scheme->background_saturation;
+      hsv[HSV_VALUE] = scheme->background_value;
 
       /* pick random hue */
       hsv[HSV_HUE] = g_random_double_range (0.00, 1.00);
@@ -1058,16 +1955,16 @@ terminal_screen_update_colors (TerminalScreen *screen)
                       &bg.red, &bg.green, &bg.blue);
     }
 
-  if (G_LIKELY (valid_palette))
+  if (G_LIKELY (scheme->has_palette))
     {
       screen->background_color.red = bg.red;
       screen->background_color.green = bg.green;
       screen->background_color.blue = bg.blue;
 
       vte_terminal_set_colors (VTE_TERMINAL (screen->terminal),
-                               has_fg ? &fg : NULL,
-                               has_bg ? &screen->background_color : NULL,
-                               palette, 16);
+                               scheme->has_foreground ? &scheme->foreground : NULL,
+                               scheme->has_background ? &screen->background_color : NULL,
+                               scheme->palette, 16);
     }
   else
     {
@@ -1077,30 +1974,32 @@ terminal_screen_update_colors (TerminalScreen *screen)
     }
 
   /* cursor color */
-  if (!cursor_use_default)
+  if (!scheme->cursor_use_default)
     {
-      cursor_use_default = !terminal_preferences_get_color (screen->preferences, "color-cursor-foreground", &cursor);
 #if VTE_CHECK_VERSION (0, 44, 0)
-      vte_terminal_set_color_cursor_foreground (VTE_TERMINAL (screen->terminal), cursor_use_default ? NULL : &cursor);
+      vte_terminal_set_color_cursor_foreground (VTE_TERMINAL (screen->terminal),
+                                                scheme->has_cursor_foreground ? &scheme->cursor_foreground : NULL);
 #endif
-      cursor_use_default = !terminal_preferences_get_color (screen->preferences, "color-cursor", &cursor);
-      vte_terminal_set_color_cursor (VTE_TERMINAL (screen->terminal), cursor_use_default ? NULL : &cursor);
+      vte_terminal_set_color_cursor (VTE_TERMINAL (screen->terminal),
+                                     scheme->has_cursor ? &scheme->cursor : NULL);
     }
 
   /* selection color */
-  if (!selection_use_default)
+  if (!scheme->selection_use_default)
     {
-      selection_use_default = !terminal_preferences_get_color (screen->preferences, "color-selection", &selection);
-      vte_terminal_set_color_highlight_foreground (VTE_TERMINAL (screen->terminal), selection_use_default ? NULL : &selection);
-      selection_use_default = !terminal_preferences_get_color (screen->preferences, "color-selection-background", &selection);
-      vte_terminal_set_color_highlight (VTE_TERMINAL (screen->terminal), selection_use_default ? NULL : &selection);
+      vte_terminal_set_color_highlight_foreground (VTE_TERMINAL (screen->terminal),
+                                                   scheme->has_selection ? &scheme->selection : NULL);
+      vte_terminal_set_color_highlight (VTE_TERMINAL (screen->terminal),
+                                        scheme->has_selection_background ? &scheme->selection_background : NULL);
     }
 
   /* bold color */
-  if (!bold_use_default)
-    bold_use_default = !terminal_preferences_get_color (screen->preferences, "color-bold", &bold);
-  if (!bold_use_default || has_fg)
-    vte_terminal_set_color_bold (VTE_TERMINAL (screen->terminal), bold_use_default ? &fg : &bold);
+  if (!scheme->bold_use_default && scheme->has_bold)
+    vte_terminal_set_color_bold (VTE_TERMINAL (screen->terminal), &scheme->bold);
+  else if (scheme->has_foreground)
+    vte_terminal_set_color_bold (VTE_TERMINAL (screen->terminal), &scheme->foreground);
+
+  terminal_color_scheme_unref (scheme);
 }
 
 
@@ -1176,6 +2075,56 @@ terminal_screen_update_misc_rewrap_on_resize (TerminalScreen *screen)
 
 
 
+static void
+terminal_screen_statistics_timeout (TerminalTimerWheelEntry *entry,
+                                    gpointer                 user_data)
+{
+  TerminalScreen *screen = TERMINAL_SCREEN (user_data);
+
+  /* redraw the overlay once a second, the idle time keeps changing */
+  gtk_widget_queue_draw (screen->terminal);
+  terminal_timer_wheel_schedule (entry, 1, terminal_screen_statistics_timeout, screen);
+}
+
+
+
+static void
+terminal_screen_update_misc_show_statistics (TerminalScreen *screen)
+{
+  if (terminal_preferences_get_snapshot (screen->preferences)->misc_show_statistics)
+    {
+      if (!terminal_timer_wheel_is_scheduled (&screen->stats_timer))
+        terminal_timer_wheel_schedule (&screen->stats_timer, 1, terminal_screen_statistics_timeout, screen);
+    }
+  else
+    {
+      terminal_timer_wheel_cancel (&screen->stats_timer);
+    }
+
+  gtk_widget_queue_draw (screen->terminal);
+}
+
+
+
+static void
+terminal_screen_apply_scrollback_lines (TerminalScreen *screen)
+{
+  glong lines = screen->scrollback_lines;
+
+  if (screen->scrollback_budget >= 0
+      && (lines < 0 || screen->scrollback_budget < lines))
+    lines = screen->scrollback_budget;
+
+  /* shrinking drops lines, so only touch vte on a real change */
+  if (lines != screen->scrollback_applied)
+    {
+      screen->scrollback_applied = lines;
+      vte_terminal_set_scrollback_lines (VTE_TERMINAL (screen->terminal), lines);
+    }
+}
+
+
+
 static void
 terminal_screen_update_scrolling_lines (TerminalScreen *screen)
 {
@@ -1185,8 +2134,12 @@ terminal_screen_update_scrolling_lines (TerminalScreen *screen)
                 "scrolling-lines", &lines,
                 "scrolling-unlimited", &unlimited,
                 NULL);
-  vte_terminal_set_scrollback_lines (VTE_TERMINAL (screen->terminal),
-                                     unlimited ? -1 : (glong) lines);
+  screen->scrollback_lines = unlimited ? -1 : (glong) lines;
+  terminal_screen_apply_scrollback_lines (screen);
+
+  /* the shares of the other tabs depend on it */
+  if (screen->scrollback != NULL)
+    terminal_scrollback_budget_schedule (screen->scrollback);
 }
 
 
@@ -1211,10 +2164,55 @@ terminal_screen_update_scrolling_on_keystroke (TerminalScreen *screen)
 
 
 
+static gboolean
+terminal_screen_title_tick (GtkWidget     *widget,
+                            GdkFrameClock *frame_clock,
+                            gpointer       user_data)
+{
+  TerminalScreen *screen = TERMINAL_SCREEN (widget);
+
+  screen->title_tick_id = 0;
+
+  /* the labels, tooltip, menu and window title only follow real changes */
+  if (terminal_screen_title_refresh (screen))
+    g_object_notify (G_OBJECT (screen), "title");
+
+  return G_SOURCE_REMOVE;
+}
+
+
+
+static gboolean
+terminal_screen_title_timeout (gpointer user_data)
+{
+  TerminalScreen *screen = TERMINAL_SCREEN (user_data);
+
+  screen->title_timeout_id = 0;
+
+  if (terminal_screen_title_refresh (screen))
+    g_object_notify (G_OBJECT (screen), "title");
+
+  return FALSE;
+}
+
+
+
 static void
 terminal_screen_update_title (TerminalScreen *screen)
 {
-  g_object_notify (G_OBJECT (screen), "title");
+  if (screen->title_tick_id != 0 || screen->title_timeout_id != 0)
+    return;
+
+  /* programs may set the title many times per frame, only the
+   * last one is propagated on the next frame; hidden tabs have
+   * no frame clock, they use a timeout of about one frame */
+  if (gtk_widget_get_mapped (GTK_WIDGET (screen)))
+    screen->title_tick_id = gtk_widget_add_tick_callback (GTK_WIDGET (screen),
+                                                          terminal_screen_title_tick,
+                                                          NULL, NULL);
+  else
+    screen->title_timeout_id = g_timeout_add (TITLE_UPDATE_INTERVAL,
+                                              terminal_screen_title_timeout, screen);
 }
 
 
@@ -1292,6 +2290,20 @@ terminal_screen_vte_child_exited (VteTerminal    *terminal,
 
 
 
+static void
+terminal_screen_helper_child_exited (GPid     pid,
+                                     gint     status,
+                                     gpointer user_data)
+{
+  TerminalScreen *screen = TERMINAL_SCREEN (user_data);
+
+  /* vte does not know the child of the spawn helper, so handle
+   * the exit like vte would */
+  g_signal_emit_by_name (G_OBJECT (screen->terminal), "child-exited", status);
+}
+
+
+
 static void
 terminal_screen_vte_eof (VteTerminal    *terminal,
                          TerminalScreen *screen)
@@ -1348,6 +2360,32 @@ terminal_screen_vte_window_title_changed (VteTerminal    *terminal,
 
 
 
+static void
+terminal_screen_vte_commit (VteTerminal    *terminal,
+                            const gchar    *text,
+                            guint           size,
+                            TerminalScreen *screen)
+{
+  /* input sent to the child */
+  screen->stats.bytes_written += size;
+}
+
+
+
+static void
+terminal_screen_vte_directory_changed (VteTerminal    *terminal,
+                                       TerminalScreen *screen)
+{
+  terminal_return_if_fail (VTE_IS_TERMINAL (terminal));
+  terminal_return_if_fail (TERMINAL_IS_SCREEN (screen));
+
+  /* the shell reported its directory (OSC 7) */
+  if (terminal_screen_update_working_directory_uri (screen))
+    terminal_screen_update_title (screen);
+}
+
+
+
 static void
 terminal_screen_vte_resize_window (VteTerminal    *terminal,
                                    guint           width,
@@ -1374,23 +2412,70 @@ terminal_screen_vte_resize_window (VteTerminal    *terminal,
 
 
 
-static gboolean
-terminal_screen_reset_activity_timeout (gpointer user_data)
+static PangoAttrList *
+terminal_screen_activity_attrs (const TerminalPreferencesSnapshot *snapshot)
 {
-  TerminalScreen *screen = TERMINAL_SCREEN (user_data);
-  GdkRGBA         active_color;
-  GdkRGBA         fg_color;
+  static PangoAttrList *attrs = NULL;
+  static guint          generation = 0;
+
+  /* shared by all tabs, rebuilt when the preferences changed */
+  if (attrs == NULL || generation != snapshot->generation)
+    {
+      if (attrs != NULL)
+        pango_attr_list_unref (attrs);
+      attrs = pango_attr_list_new ();
+      if (G_LIKELY (snapshot->has_tab_activity_color))
+        {
+          pango_attr_list_insert (attrs, pango_attr_foreground_new ((guint16)(snapshot->tab_activity_color.red*65535),
+                                                                    (guint16)(snapshot->tab_activity_color.green*65535),
+                                                                    (guint16)(snapshot->tab_activity_color.blue*65535)));
+        }
+      generation = snapshot->generation;
+    }
+
+  return attrs;
+}
+
+
+
+static void
+terminal_screen_reset_activity_timeout (TerminalTimerWheelEntry *entry,
+                                        gpointer                 user_data)
+{
+  TerminalScreen                    *screen = TERMINAL_SCREEN (user_data);
+  const TerminalPreferencesSnapshot *snapshot;
+  GdkRGBA                            active_color;
+  GdkRGBA                            fg_color;
   PangoAttrList  *attrs;
   PangoAttribute *foreground;
+  gint64          idle;
+  gint64          timeout;
 
   if (G_UNLIKELY (screen->tab_label == NULL))
-    return FALSE;
+    return;
+
+  snapshot = terminal_preferences_get_snapshot (screen->preferences);
+
+  /* the tab had output after it was marked, wait for the rest */
+  idle = g_get_monotonic_time () - screen->activity_time;
+  timeout = (gint64) snapshot->tab_activity_timeout * G_USEC_PER_SEC;
+  if (idle < timeout)
+    {
+      terminal_timer_wheel_schedule (&screen->activity_timer,
+                                     (timeout - idle + G_USEC_PER_SEC - 1) / G_USEC_PER_SEC,
+                                     terminal_screen_reset_activity_timeout, screen);
+      return;
+    }
+
+  screen->activity = FALSE;
 
   /* unset */
   gtk_label_set_attributes (GTK_LABEL (screen->tab_label), NULL);
 
-  if (terminal_preferences_get_color (screen->preferences, "tab-activity-color", &active_color))
+  if (snapshot->has_tab_activity_color)
     {
+      active_color = snapshot->tab_activity_color;
+
       /* calculate color between fg and active color */
       gtk_style_context_get_color (gtk_widget_get_style_context (screen->tab_label),
                                    gtk_widget_get_state_flags (screen->tab_label),
@@ -1407,69 +2492,68 @@ terminal_screen_reset_activity_timeout (gpointer user_data)
       gtk_label_set_attributes (GTK_LABEL (screen->tab_label), attrs);
       pango_attr_list_unref (attrs);
     }
-
-  return FALSE;
 }
 
 
 
 static void
-terminal_screen_reset_activity_destroyed (gpointer user_data)
+terminal_screen_vte_window_contents_changed (TerminalScreen *screen)
 {
-  TERMINAL_SCREEN (user_data)->activity_timeout_id = 0;
-}
+  const TerminalPreferencesSnapshot *snapshot;
+  gint64                             now;
+  gint64                             second;
 
+  terminal_return_if_fail (TERMINAL_IS_SCREEN (screen));
 
+  now = g_get_monotonic_time ();
 
-static void
-terminal_screen_vte_window_contents_changed (TerminalScreen *screen)
-{
-  guint           timeout;
-  GdkRGBA         color;
-  gboolean        has_color;
-  PangoAttrList  *attrs;
-  PangoAttribute *foreground;
+  /* statistics, the rate is counted per second of the clock */
+  second = now / G_USEC_PER_SEC;
+  if (G_UNLIKELY (second != screen->stats_second))
+    {
+      screen->stats.contents_changed_rate =
+          (second == screen->stats_second + 1) ? screen->stats_second_events : 0;
+      screen->stats_second = second;
+      screen->stats_second_events = 0;
+    }
+  screen->stats_second_events++;
+  screen->stats.contents_changed++;
+  screen->stats.last_output = now;
 
-  terminal_return_if_fail (TERMINAL_IS_SCREEN (screen));
-  terminal_return_if_fail (GTK_IS_LABEL (screen->tab_label));
-  terminal_return_if_fail (TERMINAL_IS_PREFERENCES (screen->preferences));
+  /* index the rows that scrolled off when the terminal is idle */
+  if (screen->search_indexed && screen->search_index_id == 0)
+    screen->search_index_id = g_idle_add_full (G_PRIORITY_LOW, terminal_screen_search_index_idle,
+                                               screen, NULL);
+
+  /* the tab is already marked, the timer looks at the time */
+  if (G_LIKELY (screen->activity))
+    {
+      screen->activity_time = now;
+      return;
+    }
 
   /* leave if we should not start an update */
   if (screen->tab_label == NULL
       || !gtk_window_is_active (GTK_WINDOW (gtk_widget_get_toplevel (GTK_WIDGET (screen))))
       || (gtk_widget_get_state_flags (screen->terminal) & GTK_STATE_FLAG_FOCUSED) != 0
-      || time (NULL) - screen->activity_resize_time <= 1)
+      || now - screen->activity_resize_time <= G_USEC_PER_SEC)
     return;
 
   /* get the reset time, leave if this feature is disabled */
-  g_object_get (G_OBJECT (screen->preferences), "tab-activity-timeout", &timeout, NULL);
-  if (timeout < 1)
+  snapshot = terminal_preferences_get_snapshot (screen->preferences);
+  if (snapshot->tab_activity_timeout < 1)
     return;
 
   /* set label color */
-  has_color = terminal_preferences_get_color (screen->preferences, "tab-activity-color", &color);
-  if (G_LIKELY (has_color))
-    {
-      attrs = pango_attr_list_new ();
-      foreground = pango_attr_foreground_new ((guint16)(color.red*65535),
-                                              (guint16)(color.green*65535),
-                                              (guint16)(color.blue*65535));
-      pango_attr_list_insert (attrs, foreground);
-      gtk_label_set_attributes (GTK_LABEL (screen->tab_label), attrs);
-      pango_attr_list_unref (attrs);
-    }
-  else
-      gtk_label_set_attributes (GTK_LABEL (screen->tab_label), NULL);
+  gtk_label_set_attributes (GTK_LABEL (screen->tab_label),
+                            terminal_screen_activity_attrs (snapshot));
 
-  /* stop running reset timeout */
-  if (screen->activity_timeout_id != 0)
-    g_source_remove (screen->activity_timeout_id);
+  screen->activity = TRUE;
+  screen->activity_time = now;
 
-  /* start new timeout to unset the activity */
-  screen->activity_timeout_id =
-      gdk_threads_add_timeout_seconds_full (G_PRIORITY_DEFAULT, timeout,
-                                            terminal_screen_reset_activity_timeout,
-                                            screen, terminal_screen_reset_activity_destroyed);
+  /* start the timeout to unset the activity */
+  terminal_timer_wheel_schedule (&screen->activity_timer, snapshot->tab_activity_timeout,
+                                 terminal_screen_reset_activity_timeout, screen);
 }
 
 
@@ -1478,7 +2562,7 @@ static void
 terminal_screen_vte_window_contents_resized (TerminalScreen *screen)
 {
   /* avoid a content changed when the window is resized */
-  screen->activity_resize_time = time (NULL);
+  screen->activity_resize_time = g_get_monotonic_time ();
 }
 
 
@@ -1637,6 +2721,8 @@ terminal_screen_new (TerminalTabAttr *attr,
 
   if (attr->command != NULL)
     terminal_screen_set_custom_command (screen, attr->command);
+  if (attr->environment != NULL)
+    screen->custom_environment = g_strdupv (attr->environment);
   if (attr->directory != NULL)
     terminal_screen_set_working_directory (screen, attr->directory);
   if (attr->title != NULL)
@@ -1652,100 +2738,507 @@ terminal_screen_new (TerminalTabAttr *attr,
 
 
 
-/**
- * terminal_screen_launch_child:
- * @screen  : A #TerminalScreen.
- *
- * Starts the terminal child process.
- **/
-void
-terminal_screen_launch_child (TerminalScreen *screen)
-{
-  GError       *error = NULL;
-  gchar        *command;
-  gchar       **argv;
-  gchar       **env;
-  gchar       **argv2;
-  guint         i;
-  VtePtyFlags   pty_flags = VTE_PTY_DEFAULT;
-  GSpawnFlags   spawn_flags = G_SPAWN_CHILD_INHERITS_STDIN | G_SPAWN_SEARCH_PATH;
 #ifdef HAVE_LIBUTEMPTER
-  gboolean      update_records;
-#endif
+static void
+terminal_screen_add_record_thread (GTask        *task,
+                                   gpointer      source_object,
+                                   gpointer      task_data,
+                                   GCancellable *cancellable)
+{
+  /* this runs the setgid utempter helper and waits for it */
+  utempter_add_record (vte_pty_get_fd (VTE_PTY (task_data)), NULL);
+}
 
-  terminal_return_if_fail (TERMINAL_IS_SCREEN (screen));
 
-#ifdef G_ENABLE_DEBUG
-  if (!gtk_widget_get_realized (GTK_WIDGET (screen)))
-    g_error ("Tried to launch command in a TerminalScreen that is not realized");
+
+static void
+terminal_screen_add_record (TerminalScreen *screen)
+{
+  GTask    *task;
+  VtePty   *pty;
+  gboolean  update_records;
+
+  g_object_get (G_OBJECT (screen->preferences), "command-update-records", &update_records, NULL);
+  if (!update_records)
+    return;
+
+  pty = vte_terminal_get_pty (VTE_TERMINAL (screen->terminal));
+  if (G_UNLIKELY (pty == NULL))
+    return;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  g_task_set_task_data (task, g_object_ref (G_OBJECT (pty)), g_object_unref);
+  g_task_run_in_thread (task, terminal_screen_add_record_thread);
+  g_object_unref (G_OBJECT (task));
+}
 #endif
 
-  if (!terminal_screen_get_child_command (screen, &command, &argv, &error))
+
+
+static void
+terminal_screen_spawn_failed (TerminalScreen *screen,
+                              const GError   *error)
+{
+  gchar **lines;
+  gchar  *message;
+  gchar  *text;
+
+  /* print the error in the tab instead of blocking the other tabs
+   * of the window with a dialog */
+  lines = g_strsplit (error->message, "\n", -1);
+  message = g_strjoinv ("\r\n", lines);
+  text = g_strdup_printf ("\033[1;31m%s:\033[0m %s\r\n", _("Failed to execute child"), message);
+  vte_terminal_feed (VTE_TERMINAL (screen->terminal), text, -1);
+  g_free (text);
+  g_free (message);
+  g_strfreev (lines);
+}
+
+
+
+static void
+terminal_screen_spawn_finished (VteTerminal *terminal,
+                                GPid         pid,
+                                GError      *error,
+                                gpointer     user_data)
+{
+  TerminalScreen *screen = TERMINAL_SCREEN (user_data);
+
+  if (g_cancellable_is_cancelled (screen->spawn_cancellable))
     {
-      /* tell the user that we were unable to execute the command */
-      xfce_dialog_show_error (GTK_WINDOW (gtk_widget_get_toplevel (GTK_WIDGET (screen))),
-                              error, _("Failed to execute child"));
-      g_error_free (error);
+      /* the tab was closed in the meantime, the child gets a hangup
+       * when the pty is closed */
+      if (pid > 0)
+        terminal_spawn_helper_unwatch (pid, screen);
+    }
+  else if (pid == -1)
+    {
+      terminal_screen_spawn_failed (screen, error);
     }
   else
     {
-      env = terminal_screen_get_child_environment (screen);
+      screen->pid = pid;
 
-      argv2 = g_new0 (gchar *, g_strv_length (argv) + 2);
-      argv2[0] = command;
+#ifdef HAVE_LIBUTEMPTER
+      terminal_screen_add_record (screen);
+#endif
+    }
 
-      if (argv != NULL)
-        {
-          for (i = 0; argv[i] != NULL; i++)
-            argv2[i + 1] = argv[i];
+  g_clear_object (&screen->spawn_cancellable);
+  g_object_unref (G_OBJECT (screen));
+}
 
-          spawn_flags |= G_SPAWN_FILE_AND_ARGV_ZERO;
+
+
+/**
+ * terminal_screen_get_shell_command:
+ * @preferences : The #TerminalPreferences.
+ * @command     : Return location for the command path.
+ * @argv        : Return location for the argument vector.
+ * @error       : Return location for errors or %NULL.
+ *
+ * Determines the shell that is started in a tab without a
+ * custom command, as configured in @preferences.
+ *
+ * Return value: %TRUE on success, %FALSE if no usable shell
+ *               was found.
+ **/
+gboolean
+terminal_screen_get_shell_command (TerminalPreferences *preferences,
+                                   gchar              **command,
+                                   gchar             ***argv,
+                                   GError             **error)
+{
+  struct passwd *pw;
+  const gchar   *shell_name;
+  const gchar   *shell_fullpath = NULL;
+  gchar         *custom_command = NULL;
+  gboolean       command_login_shell;
+  gboolean       run_custom_command;
+  guint          i;
+  const gchar   *shells[] = { "/bin/sh",
+                              "/bin/bash", "/usr/bin/bash",
+                              "/bin/dash", "/usr/bin/dash",
+                              "/bin/zsh",  "/usr/bin/zsh",
+                              "/bin/tcsh", "/usr/bin/tcsh",
+                              "/bin/csh",  "/usr/bin/csh",
+                              "/bin/ksh",  "/usr/bin/ksh" };
+
+  terminal_return_val_if_fail (TERMINAL_IS_PREFERENCES (preferences), FALSE);
+
+  g_object_get (G_OBJECT (preferences),
+                "command-login-shell", &command_login_shell,
+                "run-custom-command", &run_custom_command,
+                NULL);
+
+  if (run_custom_command)
+    {
+      /* use custom command specified in preferences */
+      g_object_get (G_OBJECT (preferences),
+                    "custom-command", &custom_command,
+                    NULL);
+      shell_fullpath = custom_command;
+    }
+  else
+    {
+      /* use the SHELL environement variable if we're in
+      * non-setuid mode and the path is executable */
+      if (geteuid () == getuid ()
+          && getegid () == getgid ())
+        {
+          shell_fullpath = g_getenv ("SHELL");
+          if (shell_fullpath != NULL
+              && g_access (shell_fullpath, X_OK) != 0)
+            shell_fullpath = NULL;
         }
 
-      if (!vte_terminal_spawn_sync (VTE_TERMINAL (screen->terminal),
-                                           pty_flags,
-                                           screen->working_directory, argv2, env,
-                                           spawn_flags,
-                                           NULL, NULL,
-                                           &screen->pid, NULL, &error))
+      if (shell_fullpath == NULL)
         {
-          xfce_dialog_show_error (GTK_WINDOW (gtk_widget_get_toplevel (GTK_WIDGET (screen))),
-                                  error, _("Failed to execute child"));
-          g_error_free (error);
+          pw = getpwuid (getuid ());
+          if (pw != NULL
+              && pw->pw_shell != NULL
+              && g_access (pw->pw_shell, X_OK) == 0)
+            {
+              /* set the shell from the password database */
+              shell_fullpath = pw->pw_shell;
+            }
+          else
+            {
+              /* lookup a good fallback */
+              for (i = 0; i < G_N_ELEMENTS (shells); i++)
+                {
+                  if (access (shells [i], X_OK) == 0)
+                    {
+                      shell_fullpath = shells [i];
+                      break;
+                    }
+                }
+
+              if (G_UNLIKELY (shell_fullpath == NULL))
+                {
+                  /* the system is truly broken */
+                  g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                               _("Unable to determine your login shell."));
+                  return FALSE;
+                }
+             }
         }
+    }
 
-#ifdef HAVE_LIBUTEMPTER
-      g_object_get (G_OBJECT (screen->preferences), "command-update-records", &update_records, NULL);
-      if (update_records)
-        utempter_add_record (vte_pty_get_fd (vte_terminal_get_pty (VTE_TERMINAL (screen->terminal))), NULL);
-#endif
+  terminal_assert (shell_fullpath != NULL);
+  shell_name = strrchr (shell_fullpath, '/');
+  if (shell_name != NULL)
+    ++shell_name;
+  else
+    shell_name = shell_fullpath;
+  *command = g_strdup (shell_fullpath);
 
-      g_free (argv2);
+  *argv = g_new (gchar *, 2);
+  if (command_login_shell)
+    (*argv)[0] = g_strconcat ("-", shell_name, NULL);
+  else
+    (*argv)[0] = g_strdup (shell_name);
+  (*argv)[1] = NULL;
 
-      g_strfreev (argv);
-      g_strfreev (env);
-      g_free (command);
-    }
+  if (custom_command != NULL)
+    g_free (custom_command);
+
+  return TRUE;
 }
 
 
 
 /**
- * terminal_screen_get_custom_title:
- * @screen  : A #TerminalScreen.
+ * terminal_screen_get_shell_environment:
+ * @working_directory : The directory the child starts in.
+ *
+ * Builds the environment for a child process that does not
+ * depend on a particular window, i.e. without WINDOWID and with
+ * the DISPLAY of the default display. It includes the TERM and
+ * VTE_VERSION variables, so it is usable for children that are
+ * not started by vte.
+ *
+ * Return value: A %NULL-terminated environment, free with
+ *               terminal_screen_free_environment().
  **/
-const gchar *
-terminal_screen_get_custom_title (TerminalScreen *screen)
+gchar **
+terminal_screen_get_shell_environment (const gchar *working_directory)
 {
-  terminal_return_val_if_fail (TERMINAL_IS_SCREEN (screen), NULL);
+  const gchar *display_name = NULL;
 
-  return screen->custom_title;
+#ifdef GDK_WINDOWING_X11
+  if (GDK_IS_X11_DISPLAY (gdk_display_get_default ()))
+    display_name = gdk_display_get_name (gdk_display_get_default ());
+#endif
+
+  return terminal_screen_build_environment (working_directory, NULL, display_name, NULL);
 }
 
 
 
 /**
- * terminal_screen_set_custom_title:
+ * terminal_screen_free_environment:
+ * @envp : An environment of terminal_screen_get_shell_environment().
+ *
+ * Frees the variables that were added for the child, the others
+ * belong to the shared environment template.
+ **/
+void
+terminal_screen_free_environment (gchar **envp)
+{
+  TerminalEnvBlock  *block = NULL;
+  gchar            **p;
+
+  if (envp == NULL)
+    return;
+
+  for (p = envp; *p != NULL; p++)
+    {
+      block = terminal_screen_environment_block (*p);
+      if (block != NULL)
+        break;
+      g_free (*p);
+    }
+  g_free (envp);
+
+  /* the last user of an outdated template */
+  if (block != NULL
+      && --block->users == 0
+      && block != screen_env_blocks->data)
+    {
+      screen_env_blocks = g_slist_remove (screen_env_blocks, block);
+      g_free (block->data);
+      g_slice_free (TerminalEnvBlock, block);
+    }
+}
+
+
+
+/**
+ * terminal_screen_invalidate_environment:
+ *
+ * Makes the next child environment copy the server environment
+ * again. Call this after changing the environment of the process
+ * with g_setenv() or g_unsetenv(); the copy is only taken for the
+ * first child and then reused.
+ **/
+void
+terminal_screen_invalidate_environment (void)
+{
+  screen_env_generation++;
+}
+
+
+
+/**
+ * terminal_screen_launch_child:
+ * @screen  : A #TerminalScreen.
+ *
+ * Starts the terminal child process.
+ **/
+void
+terminal_screen_launch_child (TerminalScreen *screen)
+{
+  GError       *error = NULL;
+  gchar        *command;
+  gchar       **argv;
+  gchar       **env;
+  gchar       **argv2;
+  guint         i;
+  VtePtyFlags   pty_flags = VTE_PTY_DEFAULT;
+  GSpawnFlags   spawn_flags = G_SPAWN_CHILD_INHERITS_STDIN | G_SPAWN_SEARCH_PATH;
+  gboolean      started;
+#if !VTE_CHECK_VERSION (0, 48, 0)
+  GPid          pid = -1;
+#endif
+
+  terminal_return_if_fail (TERMINAL_IS_SCREEN (screen));
+  terminal_return_if_fail (screen->spawn_cancellable == NULL);
+
+#ifdef G_ENABLE_DEBUG
+  if (!gtk_widget_get_realized (GTK_WIDGET (screen)))
+    g_error ("Tried to launch command in a TerminalScreen that is not realized");
+#endif
+
+  if (!terminal_screen_get_child_command (screen, &command, &argv, &error))
+    {
+      /* tell the user that we were unable to execute the command */
+      terminal_screen_spawn_failed (screen, error);
+      g_error_free (error);
+      return;
+    }
+
+  env = terminal_screen_get_child_environment (screen);
+
+  argv2 = g_new0 (gchar *, g_strv_length (argv) + 2);
+  argv2[0] = command;
+
+  if (argv != NULL)
+    {
+      for (i = 0; argv[i] != NULL; i++)
+        argv2[i + 1] = argv[i];
+
+      spawn_flags |= G_SPAWN_FILE_AND_ARGV_ZERO;
+    }
+
+  /* the reference is released in terminal_screen_spawn_finished(),
+   * the spawn is cancelled when the tab is closed before that */
+  g_object_ref (G_OBJECT (screen));
+  screen->spawn_cancellable = g_cancellable_new ();
+
+  /* fork from the spawn helper if it runs, vte forks the server
+   * itself and that gets slower with every line of scrollback */
+  started = argv != NULL
+            && terminal_spawn_helper_spawn_async (VTE_TERMINAL (screen->terminal),
+                                                  pty_flags, screen->working_directory,
+                                                  command, argv, env,
+                                                  terminal_screen_helper_child_exited,
+                                                  terminal_screen_spawn_finished, screen,
+                                                  &error);
+
+  if (!started && error == NULL)
+    {
+#if VTE_CHECK_VERSION (0, 48, 0)
+      vte_terminal_spawn_async (VTE_TERMINAL (screen->terminal),
+                                pty_flags,
+                                screen->working_directory, argv2, env,
+                                spawn_flags,
+                                NULL, NULL, NULL,
+                                -1, screen->spawn_cancellable,
+                                terminal_screen_spawn_finished, screen);
+#else
+      if (!vte_terminal_spawn_sync (VTE_TERMINAL (screen->terminal),
+                                    pty_flags,
+                                    screen->working_directory, argv2, env,
+                                    spawn_flags,
+                                    NULL, NULL,
+                                    &pid, NULL, &error))
+        pid = -1;
+
+      terminal_screen_spawn_finished (VTE_TERMINAL (screen->terminal), pid, error, screen);
+      g_clear_error (&error);
+#endif
+    }
+  else if (!started)
+    {
+      terminal_screen_spawn_finished (VTE_TERMINAL (screen->terminal), -1, error, screen);
+      g_error_free (error);
+    }
+
+  g_free (argv2);
+
+  g_strfreev (argv);
+  terminal_screen_free_environment (env);
+  g_free (command);
+}
+
+
+
+/**
+ * terminal_screen_defer_child:
+ * @screen  : A #TerminalScreen.
+ *
+ * Postpones terminal_screen_launch_child() until @screen is shown
+ * for the first time, the tab label is in italics until then. Used
+ * for background tabs of a restored session. The working directory,
+ * title and command of the tab are kept, so a deferred tab is saved
+ * in the session like any other tab.
+ **/
+void
+terminal_screen_defer_child (TerminalScreen *screen)
+{
+  PangoAttrList *attrs;
+
+  terminal_return_if_fail (TERMINAL_IS_SCREEN (screen));
+
+  if (gtk_widget_get_mapped (GTK_WIDGET (screen)))
+    {
+      terminal_screen_launch_child (screen);
+      return;
+    }
+
+  screen->deferred = TRUE;
+
+  if (screen->tab_label != NULL)
+    {
+      attrs = pango_attr_list_new ();
+      pango_attr_list_insert (attrs, pango_attr_style_new (PANGO_STYLE_ITALIC));
+      gtk_label_set_attributes (GTK_LABEL (screen->tab_label), attrs);
+      pango_attr_list_unref (attrs);
+    }
+}
+
+
+
+/**
+ * terminal_screen_launch_pooled_child:
+ * @screen  : A #TerminalScreen.
+ *
+ * Attaches a pre-spawned shell from the #TerminalShellPool to
+ * @screen, if the pool has one for the working directory of
+ * @screen. Tabs with a custom command or environment, or on
+ * another display than the default one, never use the pool.
+ * The shell has no WINDOWID in its environment, it was started
+ * before the window of @screen existed.
+ *
+ * Return value: %TRUE if a pooled shell was adopted, %FALSE
+ *               if the caller should use
+ *               terminal_screen_launch_child().
+ **/
+gboolean
+terminal_screen_launch_pooled_child (TerminalScreen *screen)
+{
+  TerminalShellPool *pool;
+  VtePty            *pty;
+  GPid               pid;
+  gboolean           adopted;
+
+  terminal_return_val_if_fail (TERMINAL_IS_SCREEN (screen), FALSE);
+
+  if (screen->custom_command != NULL
+      || screen->custom_environment != NULL
+      || gtk_widget_get_display (GTK_WIDGET (screen)) != gdk_display_get_default ())
+    return FALSE;
+
+  pool = terminal_shell_pool_get ();
+  adopted = terminal_shell_pool_take (pool, screen->working_directory, &pty, &pid);
+  g_object_unref (G_OBJECT (pool));
+
+  if (!adopted)
+    return FALSE;
+
+  /* vte resizes the pty, the shell is a child of the spawn helper */
+  vte_terminal_set_pty (VTE_TERMINAL (screen->terminal), pty);
+  terminal_spawn_helper_watch (pid, terminal_screen_helper_child_exited, screen);
+  screen->pid = pid;
+
+  g_object_unref (G_OBJECT (pty));
+
+#ifdef HAVE_LIBUTEMPTER
+  terminal_screen_add_record (screen);
+#endif
+
+  return TRUE;
+}
+
+
+
+/**
+ * terminal_screen_get_custom_title:
+ * @screen  : A #TerminalScreen.
+ **/
+const gchar *
+terminal_screen_get_custom_title (TerminalScreen *screen)
+{
+  terminal_return_val_if_fail (TERMINAL_IS_SCREEN (screen), NULL);
+
+  return screen->custom_title;
+}
+
+
+
+/**
+ * terminal_screen_set_custom_title:
  * @screen  : A #TerminalScreen.
  * @title   : Title string.
  **/
@@ -1960,44 +3453,78 @@ terminal_screen_force_resize_window (TerminalScreen *screen,
 
 
 
-/**
- * terminal_screen_get_title:
- * @screen      : A #TerminalScreen.
- *
- * Return value : The title to set for this terminal screen.
- *                The returned string should be freed when
- *                no longer needed.
- **/
-gchar*
-terminal_screen_get_title (TerminalScreen *screen)
+static gchar *
+terminal_screen_get_initial_title (TerminalScreen *screen)
 {
-  TerminalTitle  mode;
-  const gchar   *vte_title;
-  gchar         *initial, *tmp;
-  gchar         *title;
+  const gchar *initial;
 
-  terminal_return_val_if_fail (TERMINAL_IS_SCREEN (screen), NULL);
+  if (G_UNLIKELY (screen->initial_title != NULL))
+    initial = screen->initial_title;
+  else
+    initial = terminal_preferences_get_snapshot (screen->preferences)->title_initial;
+
+  return terminal_screen_parse_title (screen, &screen->initial_template, initial);
+}
+
+
+
+static TerminalTitle
+terminal_screen_get_title_mode (TerminalScreen *screen)
+{
+  if (G_UNLIKELY (screen->dynamic_title_mode != TERMINAL_TITLE_DEFAULT))
+    return screen->dynamic_title_mode;
+
+  return terminal_preferences_get_snapshot (screen->preferences)->title_mode;
+}
+
+
+
+static gchar *
+terminal_screen_build_title (TerminalScreen *screen)
+{
+  const gchar *vte_title = NULL;
+  gchar       *title = NULL;
 
   if (G_UNLIKELY (screen->custom_title != NULL))
-    return terminal_screen_parse_title (screen, screen->custom_title);
+    return terminal_screen_parse_title (screen, &screen->custom_template, screen->custom_title);
 
-  vte_title = vte_terminal_get_window_title (VTE_TERMINAL (screen->terminal));
+  if (G_UNLIKELY (terminal_screen_get_title_mode (screen) == TERMINAL_TITLE_HIDE))
+    {
+      /* show the initial title if the dynamic title is set to hidden */
+      title = terminal_screen_get_initial_title (screen);
+    }
+  else if (G_LIKELY (screen->terminal != NULL))
+    {
+      vte_title = vte_terminal_get_window_title (VTE_TERMINAL (screen->terminal));
+    }
 
-  if (G_UNLIKELY (screen->initial_title != NULL))
-    initial = terminal_screen_parse_title (screen, screen->initial_title);
-  else
+  /* TRANSLATORS: title for the tab/window used when all other
+   * possible titles were empty strings */
+  if (title == NULL || *title == '\0')
     {
-      g_object_get (G_OBJECT (screen->preferences), "title-initial", &tmp, NULL);
-      initial = terminal_screen_parse_title (screen, tmp);
-      g_free (tmp);
+      g_free (title);
+      title = g_strdup ((vte_title == NULL || *vte_title == '\0') ? _("Untitled") : vte_title);
     }
 
-  if (G_UNLIKELY (screen->dynamic_title_mode != TERMINAL_TITLE_DEFAULT))
-    mode = screen->dynamic_title_mode;
-  else
-    g_object_get (G_OBJECT (screen->preferences), "title-mode", &mode, NULL);
+  return title;
+}
+
+
+
+static gchar *
+terminal_screen_build_window_title (TerminalScreen *screen)
+{
+  const gchar   *vte_title;
+  gchar         *initial;
+  gchar         *title;
+
+  if (G_UNLIKELY (screen->custom_title != NULL))
+    return terminal_screen_parse_title (screen, &screen->custom_template, screen->custom_title);
 
-  switch (mode)
+  vte_title = vte_terminal_get_window_title (VTE_TERMINAL (screen->terminal));
+  initial = terminal_screen_get_initial_title (screen);
+
+  switch (terminal_screen_get_title_mode (screen))
     {
     case TERMINAL_TITLE_REPLACE:
       if (G_LIKELY (vte_title != NULL))
@@ -2038,100 +3565,362 @@ terminal_screen_get_title (TerminalScreen *screen)
 
 
 
-/**
- * terminal_screen_get_working_directory:
- * @screen      : A #TerminalScreen.
- *
- * Determinies the working directory using various OS-specific mechanisms.
- *
- * Return value : The current working directory of @screen.
- **/
-const gchar*
-terminal_screen_get_working_directory (TerminalScreen *screen)
+static gboolean
+terminal_screen_title_refresh (TerminalScreen *screen)
 {
-  gchar        buffer[4096 + 1];
-  gchar       *file;
-  gchar       *cwd;
-  const gchar *uri;
-  gint         length;
-
-  terminal_return_val_if_fail (TERMINAL_IS_SCREEN (screen), NULL);
+  gchar    *title;
+  gchar    *window_title;
+  gboolean  changed = FALSE;
 
-  /* try to use vte functionality first: see bug #13902 */
-  uri = vte_terminal_get_current_directory_uri (VTE_TERMINAL (screen->terminal));
-  if (uri != NULL)
+  title = terminal_screen_build_title (screen);
+  if (g_strcmp0 (title, screen->title) != 0)
     {
-      g_free (screen->working_directory);
-      screen->working_directory = g_filename_from_uri (uri, NULL, NULL);
+      g_free (screen->title);
+      screen->title = title;
+      changed = TRUE;
     }
-  else if (screen->pid >= 0)
-    {
-      /* make sure that we use linprocfs on all systems */
-#if defined(__FreeBSD__)
-      file = g_strdup_printf ("/compat/linux/proc/%d/cwd", screen->pid);
-#elif defined(__NetBSD__) || defined(__OpenBSD__)
-      file = g_strdup_printf ("/emul/linux/proc/%d/cwd", screen->pid);
-#else
-      file = g_strdup_printf ("/proc/%d/cwd", screen->pid);
-#endif
-
-      length = readlink (file, buffer, sizeof (buffer) - 1);
-      if (length > 0 && *buffer == '/')
-        {
-          buffer[length] = '\0';
-          g_free (screen->working_directory);
-          screen->working_directory = g_strdup (buffer);
-        }
-      else if (length == 0)
-        {
-          cwd = g_get_current_dir ();
-          if (G_LIKELY (cwd != NULL))
-            {
-              if (chdir (file) == 0)
-                {
-                  g_free (screen->working_directory);
-                  screen->working_directory = g_get_current_dir ();
-                  if (chdir (cwd) == 0) {};
-                }
-
-              g_free (cwd);
-            }
-        }
+  else
+    g_free (title);
 
-      g_free (file);
+  window_title = terminal_screen_build_window_title (screen);
+  if (g_strcmp0 (window_title, screen->window_title) != 0)
+    {
+      g_free (screen->window_title);
+      screen->window_title = window_title;
+      changed = TRUE;
     }
+  else
+    g_free (window_title);
 
-  return screen->working_directory;
+  return changed;
 }
 
 
 
 /**
- * terminal_screen_set_working_directory:
- * @screen    : A #TerminalScreen.
- * @directory :
+ * terminal_screen_get_title:
+ * @screen      : A #TerminalScreen.
+ *
+ * Return value : The title to set for this terminal screen.
+ *                The returned string should be freed when
+ *                no longer needed.
  **/
-void
-terminal_screen_set_working_directory (TerminalScreen *screen,
-                                       const gchar    *directory)
+gchar*
+terminal_screen_get_title (TerminalScreen *screen)
 {
-  terminal_return_if_fail (TERMINAL_IS_SCREEN (screen));
-  terminal_return_if_fail (directory != NULL);
+  terminal_return_val_if_fail (TERMINAL_IS_SCREEN (screen), NULL);
 
-  g_free (screen->working_directory);
-  screen->working_directory = g_strdup (directory);
+  /* the title last propagated, see terminal_screen_update_title() */
+  if (G_UNLIKELY (screen->window_title == NULL))
+    terminal_screen_title_refresh (screen);
+
+  return g_strdup (screen->window_title);
 }
 
 
 
-/**
- * terminal_screen_has_selection:
- * @screen      : A #TerminalScreen.
- *
- * Checks if the terminal currently contains selected text. Note that this is different from
- * determining if the terminal is the owner of any GtkClipboard items.
- *
- * Return value : %TRUE if part of the text in the terminal is selected.
+static TerminalCwdQuery *
+terminal_screen_cwd_query_ref (TerminalCwdQuery *query)
+{
+  g_atomic_int_inc (&query->ref_count);
+  return query;
+}
+
+
+
+static void
+terminal_screen_cwd_query_unref (gpointer data)
+{
+  TerminalCwdQuery *query = data;
+
+  if (g_atomic_int_dec_and_test (&query->ref_count))
+    {
+      g_mutex_clear (&query->lock);
+      g_cond_clear (&query->cond);
+      g_free (query->directory);
+      g_slice_free (TerminalCwdQuery, query);
+    }
+}
+
+
+
+static gpointer
+terminal_screen_cwd_query_thread (gpointer data)
+{
+  TerminalCwdQuery *query = data;
+  gchar             buffer[4096 + 1];
+  gchar            *file;
+  gchar            *directory = NULL;
+  gint              length;
+
+  /* make sure that we use linprocfs on all systems */
+#if defined(__FreeBSD__)
+  file = g_strdup_printf ("/compat/linux/proc/%d/cwd", query->pid);
+#elif defined(__NetBSD__) || defined(__OpenBSD__)
+  file = g_strdup_printf ("/emul/linux/proc/%d/cwd", query->pid);
+#else
+  file = g_strdup_printf ("/proc/%d/cwd", query->pid);
+#endif
+
+  length = readlink (file, buffer, sizeof (buffer) - 1);
+  if (length > 0 && *buffer == '/')
+    {
+      buffer[length] = '\0';
+      directory = g_strdup (buffer);
+    }
+
+  g_free (file);
+
+  g_mutex_lock (&query->lock);
+  query->directory = directory;
+  query->done = TRUE;
+  g_cond_broadcast (&query->cond);
+  g_mutex_unlock (&query->lock);
+
+  /* hand the result to the screen, this takes over our reference */
+  g_idle_add_full (G_PRIORITY_DEFAULT_IDLE, terminal_screen_cwd_query_idle,
+                   query, terminal_screen_cwd_query_unref);
+
+  return NULL;
+}
+
+
+
+static void
+terminal_screen_cwd_query_detach (TerminalScreen *screen)
+{
+  TerminalCwdQuery *query = screen->cwd_query;
+
+  terminal_return_if_fail (query != NULL);
+
+  g_object_remove_weak_pointer (G_OBJECT (screen), (gpointer *) &query->screen);
+  query->screen = NULL;
+  screen->cwd_query = NULL;
+
+  terminal_screen_cwd_query_unref (query);
+}
+
+
+
+static void
+terminal_screen_cwd_query_finish (TerminalScreen   *screen,
+                                  TerminalCwdQuery *query)
+{
+  gchar *directory;
+
+  terminal_return_if_fail (screen->cwd_query == query);
+
+  directory = query->directory;
+  query->directory = NULL;
+  terminal_screen_cwd_query_detach (screen);
+
+  screen->cwd_query_time = g_get_monotonic_time ();
+
+  /* the shell may have reported its directory in the meantime */
+  if (directory == NULL
+      || vte_terminal_get_current_directory_uri (VTE_TERMINAL (screen->terminal)) != NULL
+      || g_strcmp0 (directory, screen->working_directory) == 0)
+    {
+      g_free (directory);
+      return;
+    }
+
+  g_free (screen->working_directory);
+  screen->working_directory = directory;
+
+  /* titles with %d or %D used the old directory */
+  terminal_screen_update_title (screen);
+}
+
+
+
+static gboolean
+terminal_screen_cwd_query_idle (gpointer data)
+{
+  TerminalCwdQuery *query = data;
+
+  /* NULL if the query was abandoned or the tab is gone */
+  if (query->screen != NULL)
+    terminal_screen_cwd_query_finish (query->screen, query);
+
+  return FALSE;
+}
+
+
+
+static void
+terminal_screen_cwd_query_start (TerminalScreen *screen)
+{
+  TerminalCwdQuery *query;
+  GThread          *thread;
+  gint64            now;
+
+  if (screen->pid <= 0)
+    return;
+
+  /* one query per screen, a hanging one would leak a thread per
+   * attempt, the last known directory is used until it finishes */
+  if (screen->cwd_query != NULL)
+    return;
+
+  /* title updates ask often, the last result is recent enough */
+  now = g_get_monotonic_time ();
+  if (screen->cwd_query_time != 0
+      && now - screen->cwd_query_time < CWD_QUERY_INTERVAL)
+    return;
+
+  query = g_slice_new0 (TerminalCwdQuery);
+  query->ref_count = 1;
+  query->pid = screen->pid;
+  query->started = now;
+  g_mutex_init (&query->lock);
+  g_cond_init (&query->cond);
+
+  query->screen = screen;
+  g_object_add_weak_pointer (G_OBJECT (screen), (gpointer *) &query->screen);
+  screen->cwd_query = query;
+
+  thread = g_thread_try_new ("cwd-query", terminal_screen_cwd_query_thread,
+                             terminal_screen_cwd_query_ref (query), NULL);
+  if (G_UNLIKELY (thread == NULL))
+    {
+      terminal_screen_cwd_query_unref (query);
+      terminal_screen_cwd_query_detach (screen);
+      return;
+    }
+
+  g_thread_unref (thread);
+}
+
+
+
+static gboolean
+terminal_screen_update_working_directory_uri (TerminalScreen *screen)
+{
+  const gchar *uri;
+  gchar       *directory;
+
+  /* try to use vte functionality first: see bug #13902 */
+  uri = vte_terminal_get_current_directory_uri (VTE_TERMINAL (screen->terminal));
+  if (uri == NULL)
+    return FALSE;
+
+  directory = g_filename_from_uri (uri, NULL, NULL);
+  if (directory == NULL || g_strcmp0 (directory, screen->working_directory) == 0)
+    {
+      g_free (directory);
+      return FALSE;
+    }
+
+  g_free (screen->working_directory);
+  screen->working_directory = directory;
+
+  return TRUE;
+}
+
+
+
+/**
+ * terminal_screen_get_working_directory:
+ * @screen      : A #TerminalScreen.
+ *
+ * Returns the last known working directory of @screen without
+ * blocking. If the shell does not report its directory, a lookup
+ * is started in a thread, at most once a second, and the title is
+ * updated when it finds a different directory.
+ *
+ * Return value : The current working directory of @screen.
+ **/
+const gchar*
+terminal_screen_get_working_directory (TerminalScreen *screen)
+{
+  terminal_return_val_if_fail (TERMINAL_IS_SCREEN (screen), NULL);
+
+  if (vte_terminal_get_current_directory_uri (VTE_TERMINAL (screen->terminal)) != NULL)
+    terminal_screen_update_working_directory_uri (screen);
+  else
+    terminal_screen_cwd_query_start (screen);
+
+  return screen->working_directory;
+}
+
+
+
+/**
+ * terminal_screen_resolve_working_directory:
+ * @screen      : A #TerminalScreen.
+ *
+ * Like terminal_screen_get_working_directory(), but waits a short
+ * while for the lookup, for actions that start in the directory.
+ * Do not use this for many tabs at once, e.g. the session.
+ *
+ * Return value : The current working directory of @screen.
+ **/
+const gchar*
+terminal_screen_resolve_working_directory (TerminalScreen *screen)
+{
+  TerminalCwdQuery *query;
+  gint64            end_time;
+  gboolean          done;
+
+  terminal_return_val_if_fail (TERMINAL_IS_SCREEN (screen), NULL);
+
+  /* the new tab or command should not start in an outdated directory */
+  screen->cwd_query_time = 0;
+  terminal_screen_get_working_directory (screen);
+
+  query = screen->cwd_query;
+  if (query == NULL)
+    return screen->working_directory;
+
+  /* do not block on a query that hangs */
+  end_time = g_get_monotonic_time ();
+  if (end_time - query->started >= CWD_QUERY_TIMEOUT)
+    return screen->working_directory;
+  end_time += CWD_QUERY_WAIT;
+
+  g_mutex_lock (&query->lock);
+  while (!query->done)
+    if (!g_cond_wait_until (&query->cond, &query->lock, end_time))
+      break;
+  done = query->done;
+  g_mutex_unlock (&query->lock);
+
+  /* otherwise the last known directory is used */
+  if (done)
+    terminal_screen_cwd_query_finish (screen, query);
+
+  return screen->working_directory;
+}
+
+
+
+/**
+ * terminal_screen_set_working_directory:
+ * @screen    : A #TerminalScreen.
+ * @directory :
+ **/
+void
+terminal_screen_set_working_directory (TerminalScreen *screen,
+                                       const gchar    *directory)
+{
+  terminal_return_if_fail (TERMINAL_IS_SCREEN (screen));
+  terminal_return_if_fail (directory != NULL);
+
+  g_free (screen->working_directory);
+  screen->working_directory = g_strdup (directory);
+}
+
+
+
+/**
+ * terminal_screen_has_selection:
+ * @screen      : A #TerminalScreen.
+ *
+ * Checks if the terminal currently contains selected text. Note that this is different from
+ * determining if the terminal is the owner of any GtkClipboard items.
+ *
+ * Return value : %TRUE if part of the text in the terminal is selected.
  **/
 gboolean
 terminal_screen_has_selection (TerminalScreen *screen)
@@ -2244,7 +4033,7 @@ terminal_screen_reset (TerminalScreen *screen,
   vte_terminal_reset (VTE_TERMINAL (screen->terminal), TRUE, clear);
 
   if (clear)
-    vte_terminal_search_set_gregex (VTE_TERMINAL (screen->terminal), NULL, 0);
+    terminal_screen_search_set_gregex (screen, NULL, FALSE);
 }
 
 
@@ -2275,6 +4064,7 @@ terminal_screen_get_restart_command (TerminalScreen *screen)
       result = g_slist_prepend (result, g_strdup (screen->custom_title));
     }
 
+  /* the last known directory, waiting for every tab would block */
   directory = terminal_screen_get_working_directory (screen);
   if (G_LIKELY (directory != NULL))
     {
@@ -2295,8 +4085,8 @@ terminal_screen_reset_activity (TerminalScreen *screen)
 {
   terminal_return_if_fail (TERMINAL_IS_SCREEN (screen));
 
-  if (screen->activity_timeout_id != 0)
-    g_source_remove (screen->activity_timeout_id);
+  terminal_timer_wheel_cancel (&screen->activity_timer);
+  screen->activity = FALSE;
 
   if (screen->tab_label != NULL)
     gtk_label_set_attributes (GTK_LABEL (screen->tab_label), NULL);
@@ -2304,6 +4094,111 @@ terminal_screen_reset_activity (TerminalScreen *screen)
 
 
 
+/**
+ * terminal_screen_get_scrollback_lines:
+ * @screen : A #TerminalScreen.
+ *
+ * Return value : The scrollback lines of the preferences, -1 for unlimited.
+ **/
+glong
+terminal_screen_get_scrollback_lines (TerminalScreen *screen)
+{
+  terminal_return_val_if_fail (TERMINAL_IS_SCREEN (screen), -1);
+  return screen->scrollback_lines;
+}
+
+
+
+/**
+ * terminal_screen_get_scrollback_used:
+ * @screen : A #TerminalScreen.
+ *
+ * Return value : The number of lines in the scrollback of @screen.
+ **/
+glong
+terminal_screen_get_scrollback_used (TerminalScreen *screen)
+{
+  GtkAdjustment *adjustment;
+  gdouble        used;
+
+  terminal_return_val_if_fail (TERMINAL_IS_SCREEN (screen), 0);
+
+  /* vte keeps the rows of the buffer in its vertical adjustment */
+  adjustment = gtk_scrollable_get_vadjustment (GTK_SCROLLABLE (screen->terminal));
+  used = gtk_adjustment_get_upper (adjustment)
+         - gtk_adjustment_get_lower (adjustment)
+         - gtk_adjustment_get_page_size (adjustment);
+
+  return MAX ((glong) used, 0);
+}
+
+
+
+/**
+ * terminal_screen_set_scrollback_budget:
+ * @screen : A #TerminalScreen.
+ * @lines  : Most scrollback lines @screen may keep, -1 for no limit.
+ *
+ * Limits the scrollback below the preferences, used by the
+ * #TerminalScrollbackBudget of the application.
+ **/
+void
+terminal_screen_set_scrollback_budget (TerminalScreen *screen,
+                                       glong           lines)
+{
+  terminal_return_if_fail (TERMINAL_IS_SCREEN (screen));
+
+  screen->scrollback_budget = lines;
+  terminal_screen_apply_scrollback_lines (screen);
+}
+
+
+
+/**
+ * terminal_screen_get_session_id:
+ * @screen : A #TerminalScreen.
+ *
+ * Return value : Number of the tab, unique in this instance.
+ **/
+guint
+terminal_screen_get_session_id (TerminalScreen *screen)
+{
+  terminal_return_val_if_fail (TERMINAL_IS_SCREEN (screen), 0);
+  return screen->session_id;
+}
+
+
+
+/**
+ * terminal_screen_get_statistics:
+ * @screen : A #TerminalScreen.
+ * @stats  : Return location for the counters.
+ *
+ * Copies the counters of @screen. The rate of contents changes is
+ * the number of changes in the last complete second.
+ **/
+void
+terminal_screen_get_statistics (TerminalScreen           *screen,
+                                TerminalScreenStatistics *stats)
+{
+  gint64 second;
+
+  terminal_return_if_fail (TERMINAL_IS_SCREEN (screen));
+  terminal_return_if_fail (stats != NULL);
+
+  *stats = screen->stats;
+
+  /* the counters are only updated on output, correct for the
+   * seconds the tab was quiet */
+  second = g_get_monotonic_time () / G_USEC_PER_SEC;
+  if (second == screen->stats_second + 1)
+    stats->contents_changed_rate = screen->stats_second_events;
+  else if (second > screen->stats_second + 1)
+    stats->contents_changed_rate = 0;
+}
+
+
+
 static void
 terminal_screen_close_tab_cb (TerminalScreen *screen)
 {
@@ -2334,6 +4229,34 @@ terminal_screen_get_tab_label (TerminalScreen *screen)
                           G_BINDING_SYNC_CREATE);
   gtk_widget_set_has_tooltip (screen->tab_label, TRUE);
 
+  /* progress of saving the contents, only shown while it runs */
+  if (screen->save_box != NULL)
+    g_object_remove_weak_pointer (G_OBJECT (screen->save_box), (gpointer) &screen->save_box);
+  if (screen->save_progress != NULL)
+    g_object_remove_weak_pointer (G_OBJECT (screen->save_progress), (gpointer) &screen->save_progress);
+
+  screen->save_box = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, 2);
+  gtk_widget_set_no_show_all (screen->save_box, TRUE);
+  gtk_box_pack_start (GTK_BOX (hbox), screen->save_box, FALSE, FALSE, 0);
+  g_object_add_weak_pointer (G_OBJECT (screen->save_box), (gpointer) &screen->save_box);
+
+  screen->save_progress = gtk_progress_bar_new ();
+  gtk_widget_set_size_request (screen->save_progress, 40, -1);
+  gtk_widget_set_valign (screen->save_progress, GTK_ALIGN_CENTER);
+  gtk_box_pack_start (GTK_BOX (screen->save_box), screen->save_progress, FALSE, FALSE, 0);
+  gtk_widget_show (screen->save_progress);
+  g_object_add_weak_pointer (G_OBJECT (screen->save_progress), (gpointer) &screen->save_progress);
+
+  button = gtk_button_new_from_icon_name ("process-stop-symbolic", GTK_ICON_SIZE_MENU);
+  gtk_button_set_relief (GTK_BUTTON (button), GTK_RELIEF_NONE);
+  gtk_widget_set_can_focus (button, FALSE);
+  gtk_widget_set_tooltip_text (button, _("Stop saving the contents"));
+  gtk_widget_set_valign (button, GTK_ALIGN_CENTER);
+  gtk_box_pack_start (GTK_BOX (screen->save_box), button, FALSE, FALSE, 0);
+  gtk_widget_show (button);
+  g_signal_connect_swapped (G_OBJECT (button), "clicked",
+                            G_CALLBACK (terminal_screen_save_contents_cancel), screen);
+
   button = gtk_button_new ();
 #if GTK_CHECK_VERSION (3,20,0)
   gtk_widget_set_focus_on_click (button, FALSE);
@@ -2360,6 +4283,10 @@ terminal_screen_get_tab_label (TerminalScreen *screen)
   /* update orientation */
   terminal_screen_update_label_orientation (screen);
 
+  /* the tab may be recreated while saving */
+  if (screen->save_task != NULL)
+    gtk_widget_show (screen->save_box);
+
   /* respect the show/hide buttons option */
   g_object_bind_property (G_OBJECT (screen->preferences), "misc-tab-close-buttons",
                           G_OBJECT (button), "visible",
@@ -2370,72 +4297,741 @@ terminal_screen_get_tab_label (TerminalScreen *screen)
 
 
 
-void
-terminal_screen_focus (TerminalScreen *screen)
+void
+terminal_screen_focus (TerminalScreen *screen)
+{
+  terminal_return_if_fail (TERMINAL_IS_SCREEN (screen));
+  gtk_widget_grab_focus (GTK_WIDGET (screen->terminal));
+}
+
+
+
+const gchar *
+terminal_screen_get_encoding (TerminalScreen *screen)
+{
+  terminal_return_val_if_fail (TERMINAL_IS_SCREEN (screen), NULL);
+  return vte_terminal_get_encoding (VTE_TERMINAL (screen->terminal));
+}
+
+
+
+void
+terminal_screen_set_encoding (TerminalScreen *screen,
+                              const gchar    *charset)
+{
+  terminal_return_if_fail (TERMINAL_IS_SCREEN (screen));
+  if (charset == NULL)
+    g_get_charset (&charset);
+  if (!vte_terminal_set_encoding (VTE_TERMINAL (screen->terminal), charset, NULL))
+    g_printerr (_("Failed to set encoding %s\n"), charset);
+}
+
+
+
+/* the number of cells @text takes, @length in bytes */
+static glong
+terminal_screen_search_cells (const gchar *text,
+                              gssize       length)
+{
+  const gchar *p;
+  const gchar *end = text + length;
+  gunichar     c;
+  glong        cells = 0;
+
+  for (p = text; p < end; p = g_utf8_next_char (p))
+    {
+      c = g_utf8_get_char (p);
+      if (!g_unichar_iszerowidth (c))
+        cells += g_unichar_iswide (c) ? 2 : 1;
+    }
+
+  return cells;
+}
+
+
+
+/* the text of @row, the matches are found per row */
+static gchar *
+terminal_screen_search_row_text (TerminalScreen *screen,
+                                 glong           row)
+{
+  VteTerminal *terminal = VTE_TERMINAL (screen->terminal);
+  gchar       *text;
+
+G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+  text = vte_terminal_get_text_range (terminal, row, 0, row,
+                                      vte_terminal_get_column_count (terminal),
+                                      NULL, NULL, NULL);
+G_GNUC_END_IGNORE_DEPRECATIONS
+
+  return text;
+}
+
+
+
+/* runs the expression on @row, appends the matches to @matches if
+ * not %NULL and returns their number */
+static guint
+terminal_screen_search_match_row (TerminalScreen *screen,
+                                  glong           row,
+                                  GArray         *matches)
+{
+  TerminalSearchMatch  match;
+  GMatchInfo          *info;
+  gchar               *text;
+  gint                 start, end;
+  guint                n = 0;
+
+  text = terminal_screen_search_row_text (screen, row);
+  if (G_UNLIKELY (text == NULL))
+    return 0;
+
+  g_regex_match (screen->search_regex, text, 0, &info);
+  for (; g_match_info_matches (info); g_match_info_next (info, NULL))
+    {
+      /* empty matches cannot be shown */
+      if (!g_match_info_fetch_pos (info, 0, &start, &end) || start == end)
+        continue;
+
+      if (matches != NULL)
+        {
+          match.row = row;
+          match.column = terminal_screen_search_cells (text, start);
+          match.width = terminal_screen_search_cells (text + start, end - start);
+          match.offset = g_utf8_strlen (text, start);
+          g_array_append_val (matches, match);
+        }
+
+      n++;
+    }
+  g_match_info_free (info);
+  g_free (text);
+
+  return n;
+}
+
+
+
+/* looks up the candidate blocks again if the index grew since */
+static void
+terminal_screen_search_update_blocks (TerminalScreen *screen)
+{
+  glong end_row;
+
+  end_row = terminal_search_index_get_end_row (screen->search_index);
+  if (screen->search_blocks_valid && screen->search_blocks_end == end_row)
+    return;
+
+  if (screen->search_blocks != NULL)
+    g_array_free (screen->search_blocks, TRUE);
+  screen->search_blocks = terminal_search_index_lookup (screen->search_index,
+                                                        g_regex_get_pattern (screen->search_regex));
+  screen->search_blocks_end = end_row;
+  screen->search_blocks_valid = TRUE;
+}
+
+
+
+/* the next row after @row, or before it if @backward, that can contain
+ * a match; rows the index does not cover are always candidates */
+static glong
+terminal_screen_search_next_row (TerminalScreen *screen,
+                                 glong           row,
+                                 gboolean        backward)
+{
+  GArray  *blocks = screen->search_blocks;
+  glong    first_row;
+  guint32  block;
+  guint    low, high, mid;
+
+  row += backward ? -1 : 1;
+
+  first_row = terminal_search_index_get_first_row (screen->search_index);
+  if (blocks == NULL || row < first_row || row >= screen->search_blocks_end)
+    return row;
+
+  /* the first candidate block not before the block of the row */
+  block = row / TERMINAL_SEARCH_INDEX_BLOCK_ROWS;
+  for (low = 0, high = blocks->len; low < high;)
+    {
+      mid = (low + high) / 2;
+      if (g_array_index (blocks, guint32, mid) < block)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+
+  if (!backward)
+    {
+      if (low == blocks->len)
+        return screen->search_blocks_end;
+      return MAX (row, (glong) g_array_index (blocks, guint32, low) * TERMINAL_SEARCH_INDEX_BLOCK_ROWS);
+    }
+
+  if (low < blocks->len && g_array_index (blocks, guint32, low) == block)
+    return row;
+  if (low == 0)
+    return first_row - 1;
+  return ((glong) g_array_index (blocks, guint32, low - 1) + 1) * TERMINAL_SEARCH_INDEX_BLOCK_ROWS - 1;
+}
+
+
+
+static gboolean
+terminal_screen_search_count_idle (gpointer user_data)
+{
+  TerminalScreen *screen = TERMINAL_SCREEN (user_data);
+  gint64          end_time;
+  glong           end_row;
+  glong           row;
+  guint           n;
+
+  end_time = g_get_monotonic_time () + SEARCH_COUNT_TIME;
+
+  terminal_screen_search_update_blocks (screen);
+  end_row = terminal_search_index_get_end_row (screen->search_index);
+
+  /* count the matches in the indexed rows, a slice per iteration */
+  row = terminal_screen_search_next_row (screen, screen->search_count_row - 1, FALSE);
+  for (; row < end_row; row = terminal_screen_search_next_row (screen, row, FALSE))
+    {
+      if (g_get_monotonic_time () >= end_time)
+        {
+          screen->search_count_row = row;
+          return TRUE;
+        }
+
+      for (n = terminal_screen_search_match_row (screen, row, NULL); n > 0; n--)
+        g_array_append_val (screen->search_rows, row);
+    }
+  screen->search_count_row = end_row;
+
+  screen->search_count_id = 0;
+  g_signal_emit (G_OBJECT (screen), screen_signals[SEARCH_CHANGED], 0);
+
+  return FALSE;
+}
+
+
+
+static void
+terminal_screen_search_count (TerminalScreen *screen)
+{
+  if (screen->search_regex != NULL
+      && screen->search_count_id == 0
+      && screen->search_count_row < terminal_search_index_get_end_row (screen->search_index))
+    {
+      screen->search_count_id = g_idle_add_full (G_PRIORITY_LOW, terminal_screen_search_count_idle,
+                                                 screen, NULL);
+    }
+}
+
+
+
+/* forgets the indexed rows and the matches counted in them */
+static void
+terminal_screen_search_reset_index (TerminalScreen *screen,
+                                    glong           row)
+{
+  terminal_search_index_reset (screen->search_index, row);
+  screen->search_blocks_valid = FALSE;
+
+  g_array_set_size (screen->search_rows, 0);
+  screen->search_count_row = row;
+  if (screen->search_count_id != 0)
+    {
+      g_source_remove (screen->search_count_id);
+      screen->search_count_id = 0;
+    }
+}
+
+
+
+static gboolean
+terminal_screen_search_index_idle (gpointer user_data)
+{
+  TerminalScreen *screen = TERMINAL_SCREEN (user_data);
+  GtkAdjustment  *adjustment;
+  gchar          *text;
+  glong           lower, upper;
+  glong           columns;
+  glong           end_row;
+  glong           stop_row;
+  glong           row;
+  guint           n;
+
+  adjustment = gtk_scrollable_get_vadjustment (GTK_SCROLLABLE (screen->terminal));
+  lower = gtk_adjustment_get_lower (adjustment);
+  upper = gtk_adjustment_get_upper (adjustment);
+  columns = vte_terminal_get_column_count (VTE_TERMINAL (screen->terminal));
+
+  /* rows in the scrollback only change when they are rewrapped or
+   * cleared, start over then; otherwise forget the rows vte dropped */
+  if (columns != screen->search_index_columns
+      || lower < terminal_search_index_get_first_row (screen->search_index)
+      || upper < terminal_search_index_get_end_row (screen->search_index))
+    {
+      screen->search_index_columns = columns;
+      terminal_screen_search_reset_index (screen, lower);
+    }
+  else if (lower > terminal_search_index_get_first_row (screen->search_index))
+    {
+      terminal_search_index_trim (screen->search_index, lower);
+
+      for (n = 0; n < screen->search_rows->len; n++)
+        if (g_array_index (screen->search_rows, glong, n) >= lower)
+          break;
+      g_array_remove_range (screen->search_rows, 0, n);
+      screen->search_count_row = MAX (screen->search_count_row, lower);
+    }
+
+  /* index the rows that scrolled off the visible page */
+  end_row = upper - vte_terminal_get_row_count (VTE_TERMINAL (screen->terminal));
+  stop_row = MIN (end_row, terminal_search_index_get_end_row (screen->search_index) + SEARCH_INDEX_ROWS);
+  for (row = terminal_search_index_get_end_row (screen->search_index); row < stop_row; row++)
+    {
+      text = terminal_screen_search_row_text (screen, row);
+      terminal_search_index_add_row (screen->search_index, text != NULL ? text : "");
+      g_free (text);
+    }
+
+  terminal_screen_search_count (screen);
+
+  if (stop_row < end_row)
+    return TRUE;
+
+  screen->search_index_id = 0;
+  return FALSE;
+}
+
+
+
+static gboolean
+terminal_screen_draw_search (GtkWidget      *widget,
+                             cairo_t        *cr,
+                             TerminalScreen *screen)
+{
+  TerminalSearchMatch *match;
+  GtkAdjustment       *adjustment;
+  GtkBorder            padding;
+  glong                char_width, char_height;
+  gdouble              value;
+  glong                first_row, last_row;
+  glong                row;
+  guint                n;
+
+  if (G_LIKELY (screen->search_regex == NULL))
+    return FALSE;
+
+  adjustment = gtk_scrollable_get_vadjustment (GTK_SCROLLABLE (screen->terminal));
+  value = gtk_adjustment_get_value (adjustment);
+  first_row = value;
+  last_row = first_row + vte_terminal_get_row_count (VTE_TERMINAL (screen->terminal));
+
+  char_width = vte_terminal_get_char_width (VTE_TERMINAL (screen->terminal));
+  char_height = vte_terminal_get_char_height (VTE_TERMINAL (screen->terminal));
+  gtk_style_context_get_padding (gtk_widget_get_style_context (widget),
+                                 gtk_widget_get_state_flags (widget),
+                                 &padding);
+
+  cairo_save (cr);
+  cairo_translate (cr, padding.left, padding.top - value * char_height);
+
+  if (screen->search_highlight)
+    {
+      /* the matches in view, only searched again when it scrolled or changed */
+      if (!screen->search_visible_valid
+          || screen->search_visible_row != first_row
+          || screen->search_visible_changes != screen->stats.contents_changed)
+        {
+          g_array_set_size (screen->search_visible, 0);
+          for (row = first_row; row < last_row; row++)
+            terminal_screen_search_match_row (screen, row, screen->search_visible);
+
+          screen->search_visible_row = first_row;
+          screen->search_visible_changes = screen->stats.contents_changed;
+          screen->search_visible_valid = TRUE;
+        }
+
+      cairo_set_source_rgba (cr, 1.0, 0.85, 0.0, 0.35);
+      for (n = 0; n < screen->search_visible->len; n++)
+        {
+          match = &g_array_index (screen->search_visible, TerminalSearchMatch, n);
+          cairo_rectangle (cr, match->column * char_width, match->row * char_height,
+                           match->width * char_width, char_height);
+        }
+      cairo_fill (cr);
+    }
+
+  /* the current match on top */
+  match = &screen->search_current;
+  if (match->row >= first_row && match->row < last_row)
+    {
+      cairo_set_source_rgba (cr, 1.0, 0.5, 0.0, 0.6);
+      cairo_rectangle (cr, match->column * char_width, match->row * char_height,
+                       match->width * char_width, char_height);
+      cairo_fill (cr);
+    }
+
+  cairo_restore (cr);
+
+  return FALSE;
+}
+
+
+
+/* selects @match like vte_terminal_search_find_next() did: vte starts
+ * at the top row of the view, or at the bottom one if @backward, so the
+ * view is moved to the row of the match for a moment and vte searches
+ * with the expression anchored at its column */
+static void
+terminal_screen_search_select (TerminalScreen            *screen,
+                               const TerminalSearchMatch *match,
+                               gboolean                   backward)
+{
+  VteTerminal   *terminal = VTE_TERMINAL (screen->terminal);
+  GtkAdjustment *adjustment;
+  GRegex        *regex;
+  gchar         *pattern;
+  gchar         *text;
+  glong          rows;
+  glong          first_row, last_row;
+  glong          row;
+  guint          n = 0;
+
+  pattern = g_strdup_printf ("\\A.{%ld}\\K(?:%s)", match->offset,
+                             g_regex_get_pattern (screen->search_regex));
+  regex = g_regex_new (pattern, g_regex_get_compile_flags (screen->search_regex), 0, NULL);
+  g_free (pattern);
+  if (G_UNLIKELY (regex == NULL))
+    return;
+
+  adjustment = gtk_scrollable_get_vadjustment (GTK_SCROLLABLE (terminal));
+  rows = vte_terminal_get_row_count (terminal);
+  gtk_adjustment_set_value (adjustment, backward ? match->row - rows + 1 : match->row);
+
+  /* near the ends of the buffer the view stops before the row, vte
+   * finds the rows between it and the match first then */
+  first_row = gtk_adjustment_get_value (adjustment);
+  last_row = first_row + rows;
+  for (row = backward ? match->row + 1 : first_row;
+       row < (backward ? last_row : match->row);
+       row++)
+    {
+      text = terminal_screen_search_row_text (screen, row);
+      if (text != NULL && g_regex_match (regex, text, 0, NULL))
+        n++;
+      g_free (text);
+    }
+
+  vte_terminal_unselect_all (terminal);
+  vte_terminal_search_set_wrap_around (terminal, FALSE);
+
+G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+  vte_terminal_search_set_gregex (terminal, regex, 0);
+  do
+    {
+      if (backward)
+        vte_terminal_search_find_previous (terminal);
+      else
+        vte_terminal_search_find_next (terminal);
+    }
+  while (n-- > 0);
+  vte_terminal_search_set_gregex (terminal, NULL, 0);
+G_GNUC_END_IGNORE_DEPRECATIONS
+
+  g_regex_unref (regex);
+}
+
+
+
+static void
+terminal_screen_search_find (TerminalScreen *screen,
+                             gboolean        backward)
+{
+  TerminalSearchMatch  current = screen->search_current;
+  TerminalSearchMatch *match = NULL;
+  TerminalSearchMatch *candidate;
+  GtkAdjustment       *adjustment;
+  GArray              *matches;
+  gdouble              value, page_size;
+  glong                lower, upper;
+  glong                start_row;
+  glong                row;
+  gboolean             wrapped = FALSE;
+  guint                n;
+
+  if (screen->search_regex == NULL)
+    return;
+
+  adjustment = gtk_scrollable_get_vadjustment (GTK_SCROLLABLE (screen->terminal));
+  value = gtk_adjustment_get_value (adjustment);
+  page_size = gtk_adjustment_get_page_size (adjustment);
+  lower = gtk_adjustment_get_lower (adjustment);
+  upper = gtk_adjustment_get_upper (adjustment);
+
+  /* continue at the current match, or start at the edge of the view */
+  if (current.row < lower || current.row >= upper)
+    {
+      current.row = backward ? (glong) (value + page_size) - 1 : (glong) value;
+      current.column = backward ? G_MAXLONG : -1;
+    }
+  start_row = current.row;
+
+  terminal_screen_search_update_blocks (screen);
+
+  matches = g_array_new (FALSE, FALSE, sizeof (TerminalSearchMatch));
+  for (row = start_row;; row = terminal_screen_search_next_row (screen, row, backward))
+    {
+      if (row < lower || row >= upper)
+        {
+          if (!screen->search_wrap_around || wrapped)
+            break;
+          wrapped = TRUE;
+          row = terminal_screen_search_next_row (screen, backward ? upper : lower - 1, backward);
+        }
+
+      /* once around, the start row was searched entirely */
+      if (wrapped && (backward ? row < start_row : row > start_row))
+        break;
+
+      g_array_set_size (matches, 0);
+      if (terminal_screen_search_match_row (screen, row, matches) == 0)
+        continue;
+
+      for (n = 0; n < matches->len; n++)
+        {
+          candidate = &g_array_index (matches, TerminalSearchMatch,
+                                      backward ? matches->len - n - 1 : n);
+          if (row != current.row
+              || (wrapped && row == start_row)
+              || (backward ? candidate->column < current.column : candidate->column > current.column))
+            {
+              match = candidate;
+              break;
+            }
+        }
+
+      if (match != NULL)
+        break;
+    }
+
+  if (match != NULL)
+    {
+      screen->search_current = *match;
+      terminal_screen_search_select (screen, match, backward);
+
+      /* scroll it to the middle of the view if not visible */
+      if (match->row < value || match->row >= value + page_size)
+        value = CLAMP (match->row - (glong) page_size / 2, lower, upper - page_size);
+      gtk_adjustment_set_value (adjustment, value);
+    }
+  else
+    {
+      screen->search_current.row = -1;
+      gtk_widget_error_bell (screen->terminal);
+    }
+  g_array_free (matches, TRUE);
+
+  gtk_widget_queue_draw (screen->terminal);
+  g_signal_emit (G_OBJECT (screen), screen_signals[SEARCH_CHANGED], 0);
+}
+
+
+
+/**
+ * terminal_screen_search_set_gregex:
+ * @screen      : A #TerminalScreen.
+ * @regex       : The expression to search for or %NULL.
+ * @wrap_around : Whether to continue at the other end.
+ *
+ * Sets the expression for terminal_screen_search_find_next() and
+ * terminal_screen_search_find_previous(). The candidate rows are
+ * narrowed down with the index of the scrollback, which is built
+ * from the first search in @screen on, the matches in it are
+ * counted in the background.
+ **/
+void
+terminal_screen_search_set_gregex (TerminalScreen *screen,
+                                   GRegex         *regex,
+                                   gboolean        wrap_around)
+{
+  terminal_return_if_fail (TERMINAL_IS_SCREEN (screen));
+
+  screen->search_wrap_around = !!wrap_around;
+
+  /* the same expression again, keep the current match and the counts */
+  if (regex != NULL
+      && screen->search_regex != NULL
+      && g_regex_get_compile_flags (regex) == g_regex_get_compile_flags (screen->search_regex)
+      && g_strcmp0 (g_regex_get_pattern (regex), g_regex_get_pattern (screen->search_regex)) == 0)
+    return;
+
+  if (regex != NULL)
+    g_regex_ref (regex);
+  if (screen->search_regex != NULL)
+    g_regex_unref (screen->search_regex);
+  screen->search_regex = regex;
+
+  screen->search_current.row = -1;
+  screen->search_blocks_valid = FALSE;
+  screen->search_visible_valid = FALSE;
+
+  /* tabs that are never searched do without the index */
+  if (regex != NULL && !screen->search_indexed)
+    {
+      screen->search_indexed = TRUE;
+      if (screen->search_index_id == 0)
+        screen->search_index_id = g_idle_add_full (G_PRIORITY_LOW, terminal_screen_search_index_idle,
+                                                   screen, NULL);
+    }
+
+  /* count again from the first indexed row */
+  g_array_set_size (screen->search_rows, 0);
+  screen->search_count_row = terminal_search_index_get_first_row (screen->search_index);
+  if (screen->search_count_id != 0)
+    {
+      g_source_remove (screen->search_count_id);
+      screen->search_count_id = 0;
+    }
+  terminal_screen_search_count (screen);
+
+  gtk_widget_queue_draw (screen->terminal);
+  g_signal_emit (G_OBJECT (screen), screen_signals[SEARCH_CHANGED], 0);
+}
+
+
+
+gboolean
+terminal_screen_search_has_gregex (TerminalScreen *screen)
 {
-  terminal_return_if_fail (TERMINAL_IS_SCREEN (screen));
-  gtk_widget_grab_focus (GTK_WIDGET (screen->terminal));
+  terminal_return_val_if_fail (TERMINAL_IS_SCREEN (screen), FALSE);
+  return screen->search_regex != NULL;
 }
 
 
 
-const gchar *
-terminal_screen_get_encoding (TerminalScreen *screen)
+void
+terminal_screen_search_find_next (TerminalScreen *screen)
 {
-  terminal_return_val_if_fail (TERMINAL_IS_SCREEN (screen), NULL);
-  return vte_terminal_get_encoding (VTE_TERMINAL (screen->terminal));
+  terminal_return_if_fail (TERMINAL_IS_SCREEN (screen));
+  terminal_screen_search_find (screen, FALSE);
 }
 
 
 
 void
-terminal_screen_set_encoding (TerminalScreen *screen,
-                              const gchar    *charset)
+terminal_screen_search_find_previous (TerminalScreen *screen)
 {
   terminal_return_if_fail (TERMINAL_IS_SCREEN (screen));
-  if (charset == NULL)
-    g_get_charset (&charset);
-  if (!vte_terminal_set_encoding (VTE_TERMINAL (screen->terminal), charset, NULL))
-    g_printerr (_("Failed to set encoding %s\n"), charset);
+  terminal_screen_search_find (screen, TRUE);
 }
 
 
 
+/**
+ * terminal_screen_search_set_highlight_all:
+ * @screen    : A #TerminalScreen.
+ * @highlight : Whether to highlight all visible matches.
+ **/
 void
-terminal_screen_search_set_gregex (TerminalScreen *screen,
-                                   GRegex         *regex,
-                                   gboolean        wrap_around)
+terminal_screen_search_set_highlight_all (TerminalScreen *screen,
+                                          gboolean        highlight)
 {
   terminal_return_if_fail (TERMINAL_IS_SCREEN (screen));
-  vte_terminal_search_set_gregex (VTE_TERMINAL (screen->terminal), regex, 0);
-  vte_terminal_search_set_wrap_around (VTE_TERMINAL (screen->terminal), wrap_around);
+
+  if (screen->search_highlight == !!highlight)
+    return;
+
+  screen->search_highlight = !!highlight;
+  screen->search_visible_valid = FALSE;
+  gtk_widget_queue_draw (screen->terminal);
 }
 
 
 
+/**
+ * terminal_screen_search_get_count:
+ * @screen  : A #TerminalScreen.
+ * @current : Return location for the position of the current match,
+ *            counted from 1, 0 if there is none.
+ * @total   : Return location for the number of matches.
+ *
+ * The matches in the indexed rows are counted in the background,
+ * the few rows after them are searched here.
+ *
+ * Return value : %FALSE while the matches are still being counted.
+ **/
 gboolean
-terminal_screen_search_has_gregex (TerminalScreen *screen)
+terminal_screen_search_get_count (TerminalScreen *screen,
+                                  guint          *current,
+                                  guint          *total)
 {
+  TerminalSearchMatch *match = &screen->search_current;
+  GtkAdjustment       *adjustment;
+  GArray              *matches;
+  glong                upper;
+  glong                row;
+  guint                low, high, mid;
+  guint                n, count;
+
   terminal_return_val_if_fail (TERMINAL_IS_SCREEN (screen), FALSE);
-  return vte_terminal_search_get_gregex (VTE_TERMINAL (screen->terminal)) != NULL;
-}
 
+  *current = *total = 0;
 
+  if (screen->search_regex == NULL)
+    return TRUE;
 
-void
-terminal_screen_search_find_next (TerminalScreen *screen)
-{
-  terminal_return_if_fail (TERMINAL_IS_SCREEN (screen));
-  vte_terminal_search_find_next (VTE_TERMINAL (screen->terminal));
-}
+  /* wait for the counter, and for the index if it is far behind */
+  adjustment = gtk_scrollable_get_vadjustment (GTK_SCROLLABLE (screen->terminal));
+  upper = gtk_adjustment_get_upper (adjustment);
+  if (screen->search_count_id != 0
+      || screen->search_count_row < terminal_search_index_get_end_row (screen->search_index)
+      || upper - screen->search_count_row > vte_terminal_get_row_count (VTE_TERMINAL (screen->terminal)) + SEARCH_INDEX_ROWS)
+    return FALSE;
+
+  /* the counted matches before the current row */
+  if (match->row >= 0 && match->row < screen->search_count_row)
+    {
+      for (low = 0, high = screen->search_rows->len; low < high;)
+        {
+          mid = (low + high) / 2;
+          if (g_array_index (screen->search_rows, glong, mid) < match->row)
+            low = mid + 1;
+          else
+            high = mid;
+        }
+      *current = low;
+    }
 
+  /* the rows nobody counted yet */
+  count = screen->search_rows->len;
+  matches = g_array_new (FALSE, FALSE, sizeof (TerminalSearchMatch));
+  for (row = screen->search_count_row; row < upper; row++)
+    {
+      if (row == match->row)
+        *current = count;
+      count += terminal_screen_search_match_row (screen, row, row == match->row ? matches : NULL);
+    }
+  *total = count;
 
+  /* the position of the current match in its row */
+  if (match->row >= 0 && match->row < upper)
+    {
+      if (match->row < screen->search_count_row)
+        terminal_screen_search_match_row (screen, match->row, matches);
+      for (n = 0; n < matches->len; n++)
+        if (g_array_index (matches, TerminalSearchMatch, n).column == match->column)
+          {
+            *current += n + 1;
+            break;
+          }
+      if (n == matches->len)
+        *current = 0;
+    }
+  g_array_free (matches, TRUE);
 
-void
-terminal_screen_search_find_previous (TerminalScreen *screen)
-{
-  terminal_return_if_fail (TERMINAL_IS_SCREEN (screen));
-  vte_terminal_search_find_previous (VTE_TERMINAL (screen->terminal));
+  return TRUE;
 }
 
 
@@ -2599,14 +5195,498 @@ terminal_screen_set_scroll_on_output (TerminalScreen *screen,
 
 
 
+static void
+terminal_screen_save_job_free (gpointer data)
+{
+  TerminalSaveJob *job = data;
+
+  if (job->stream != NULL)
+    g_object_unref (G_OBJECT (job->stream));
+  if (job->file_stream != NULL)
+    g_object_unref (G_OBJECT (job->file_stream));
+  g_string_free (job->buffer, TRUE);
+  g_slice_free (TerminalSaveJob, job);
+}
+
+
+
+static void
+terminal_screen_save_update_progress (TerminalScreen *screen)
+{
+  TerminalSaveJob *job;
+
+  if (screen->save_box == NULL)
+    return;
+
+  if (screen->save_task == NULL)
+    {
+      gtk_widget_hide (screen->save_box);
+      return;
+    }
+
+  job = g_task_get_task_data (screen->save_task);
+  if (screen->save_progress != NULL && job->end_row > job->first_row)
+    {
+      gtk_progress_bar_set_fraction (GTK_PROGRESS_BAR (screen->save_progress),
+                                     (gdouble) (job->row - job->first_row)
+                                     / (job->end_row - job->first_row));
+    }
+
+  gtk_widget_show (screen->save_box);
+}
+
+
+
+static void
+terminal_screen_save_style_from_attr (TerminalSaveJob         *job,
+                                      const VteCharAttributes *attr,
+                                      TerminalSaveStyle       *style)
+{
+  memset (style, 0, sizeof (*style));
+
+  style->fore[0] = attr->fore.red >> 8;
+  style->fore[1] = attr->fore.green >> 8;
+  style->fore[2] = attr->fore.blue >> 8;
+
+  /* leave the default background to the reader */
+  style->back[0] = attr->back.red >> 8;
+  style->back[1] = attr->back.green >> 8;
+  style->back[2] = attr->back.blue >> 8;
+  style->has_back = memcmp (style->back, job->default_back, sizeof (style->back)) != 0;
+
+  style->underline = attr->underline;
+  style->strikethrough = attr->strikethrough;
+}
+
+
+
+static void
+terminal_screen_save_style_begin (TerminalSaveJob         *job,
+                                  const TerminalSaveStyle *style)
+{
+  if (job->has_style && memcmp (style, &job->style, sizeof (*style)) == 0)
+    return;
+
+  if (job->format == TERMINAL_SAVE_FORMAT_SGR)
+    {
+      g_string_append_printf (job->buffer, "\033[0;38;2;%u;%u;%u",
+                              style->fore[0], style->fore[1], style->fore[2]);
+      if (style->has_back)
+        g_string_append_printf (job->buffer, ";48;2;%u;%u;%u",
+                                style->back[0], style->back[1], style->back[2]);
+      if (style->underline)
+        g_string_append (job->buffer, ";4");
+      if (style->strikethrough)
+        g_string_append (job->buffer, ";9");
+      g_string_append_c (job->buffer, 'm');
+    }
+  else
+    {
+      if (job->has_style)
+        g_string_append (job->buffer, "</span>");
+
+      g_string_append_printf (job->buffer, "<span style=\"color:#%02x%02x%02x",
+                              style->fore[0], style->fore[1], style->fore[2]);
+      if (style->has_back)
+        g_string_append_printf (job->buffer, ";background-color:#%02x%02x%02x",
+                                style->back[0], style->back[1], style->back[2]);
+      if (style->underline || style->strikethrough)
+        g_string_append_printf (job->buffer, ";text-decoration:%s%s",
+                                style->underline ? " underline" : "",
+                                style->strikethrough ? " line-through" : "");
+      g_string_append (job->buffer, "\">");
+    }
+
+  job->style = *style;
+  job->has_style = TRUE;
+}
+
+
+
+static void
+terminal_screen_save_rows (TerminalScreen  *screen,
+                           TerminalSaveJob *job,
+                           glong            last_row)
+{
+  GArray            *attrs = NULL;
+  TerminalSaveStyle  style;
+  gchar             *text;
+  gchar             *escaped;
+  const gchar       *p, *run;
+  guint              n;
+
+  if (job->format != TERMINAL_SAVE_FORMAT_TEXT)
+    attrs = g_array_new (FALSE, TRUE, sizeof (VteCharAttributes));
+
+G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+  text = vte_terminal_get_text_range (VTE_TERMINAL (screen->terminal),
+                                      job->row, 0, last_row, job->columns,
+                                      NULL, NULL, attrs);
+G_GNUC_END_IGNORE_DEPRECATIONS
+
+  if (G_UNLIKELY (text == NULL))
+    {
+      /* nothing in these rows */
+    }
+  else if (attrs == NULL)
+    {
+      g_string_append (job->buffer, text);
+    }
+  else
+    {
+      /* vte returns one attribute per byte of the text, emit a new
+       * style only where it changes and copy the runs in between */
+      for (p = text; *p != '\0';)
+        {
+          n = p - text;
+          if (n < attrs->len)
+            {
+              terminal_screen_save_style_from_attr (job, &g_array_index (attrs, VteCharAttributes, n), &style);
+              terminal_screen_save_style_begin (job, &style);
+            }
+
+          for (run = p; *p != '\0';)
+            {
+              p = g_utf8_next_char (p);
+              n = p - text;
+              if (*p != '\0' && n < attrs->len)
+                {
+                  terminal_screen_save_style_from_attr (job, &g_array_index (attrs, VteCharAttributes, n), &style);
+                  if (memcmp (&style, &job->style, sizeof (style)) != 0)
+                    break;
+                }
+            }
+
+          if (job->format == TERMINAL_SAVE_FORMAT_HTML)
+            {
+              escaped = g_markup_escape_text (run, p - run);
+              g_string_append (job->buffer, escaped);
+              g_free (escaped);
+            }
+          else
+            {
+              g_string_append_len (job->buffer, run, p - run);
+            }
+        }
+    }
+
+  if (attrs != NULL)
+    g_array_free (attrs, TRUE);
+  g_free (text);
+}
+
+
+
+static void
+terminal_screen_save_written (GObject      *source,
+                              GAsyncResult *result,
+                              gpointer      user_data)
+{
+  GTask           *task = G_TASK (user_data);
+  TerminalSaveJob *job = g_task_get_task_data (task);
+  GError          *error = NULL;
+  gssize           written;
+
+  written = g_output_stream_write_finish (G_OUTPUT_STREAM (source), result, &error);
+  if (G_UNLIKELY (written < 0))
+    {
+      terminal_screen_save_return (task, error);
+      return;
+    }
+
+  job->written += written;
+  if (job->written < job->buffer->len)
+    {
+      /* short write, send the rest of the chunk */
+      g_output_stream_write_async (job->stream,
+                                   job->buffer->str + job->written,
+                                   job->buffer->len - job->written,
+                                   G_PRIORITY_DEFAULT,
+                                   g_task_get_cancellable (task),
+                                   terminal_screen_save_written, task);
+      return;
+    }
+
+  g_string_truncate (job->buffer, 0);
+  job->written = 0;
+
+  terminal_screen_save_step (task);
+}
+
+
+
+static void
+terminal_screen_save_closed (GObject      *source,
+                             GAsyncResult *result,
+                             gpointer      user_data)
+{
+  GError *error = NULL;
+
+  g_output_stream_close_finish (G_OUTPUT_STREAM (source), result, &error);
+  terminal_screen_save_return (G_TASK (user_data), error);
+}
+
+
+
+static void
+terminal_screen_save_step (GTask *task)
+{
+  TerminalScreen  *screen = g_task_get_source_object (task);
+  TerminalSaveJob *job = g_task_get_task_data (task);
+  GtkAdjustment   *adjustment;
+  GError          *error = NULL;
+  glong            last_row;
+
+  /* the tab may be gone, do not touch vte then */
+  if (g_cancellable_set_error_if_cancelled (g_task_get_cancellable (task), &error))
+    {
+      terminal_screen_save_return (task, error);
+      return;
+    }
+
+  /* take rows until there is something to write, one chunk per
+   * main loop iteration so the windows stay responsive */
+  while (job->buffer->len == 0 && !job->finished)
+    {
+      if (job->row < job->end_row)
+        {
+          /* rows that scrolled out of the buffer in the meantime are lost */
+          adjustment = gtk_scrollable_get_vadjustment (GTK_SCROLLABLE (screen->terminal));
+          job->row = MAX (job->row, (glong) gtk_adjustment_get_lower (adjustment));
+        }
+
+      if (job->row < job->end_row)
+        {
+          last_row = MIN (job->row + SAVE_CHUNK_ROWS, job->end_row) - 1;
+          terminal_screen_save_rows (screen, job, last_row);
+          job->row = last_row + 1;
+
+          terminal_screen_save_update_progress (screen);
+        }
+      else
+        {
+          if (job->has_style)
+            g_string_append (job->buffer, job->format == TERMINAL_SAVE_FORMAT_SGR ? "\033[0m" : "</span>");
+          if (job->format == TERMINAL_SAVE_FORMAT_HTML)
+            g_string_append (job->buffer, "</pre>\n</body>\n</html>\n");
+
+          job->finished = TRUE;
+        }
+    }
+
+  if (job->buffer->len > 0)
+    {
+      g_output_stream_write_async (job->stream,
+                                   job->buffer->str, job->buffer->len,
+                                   G_PRIORITY_DEFAULT,
+                                   g_task_get_cancellable (task),
+                                   terminal_screen_save_written, task);
+    }
+  else
+    {
+      /* also writes the gzip trailer */
+      g_output_stream_close_async (job->stream, G_PRIORITY_DEFAULT,
+                                   g_task_get_cancellable (task),
+                                   terminal_screen_save_closed, task);
+    }
+}
+
+
+
+static void
+terminal_screen_save_opened (GObject      *source,
+                             GAsyncResult *result,
+                             gpointer      user_data)
+{
+  GTask           *task = G_TASK (user_data);
+  TerminalSaveJob *job = g_task_get_task_data (task);
+  GConverter      *compressor;
+  GError          *error = NULL;
+
+  job->file_stream = G_OUTPUT_STREAM (g_file_replace_finish (G_FILE (source), result, &error));
+  if (G_UNLIKELY (job->file_stream == NULL))
+    {
+      terminal_screen_save_return (task, error);
+      return;
+    }
+
+  if (job->compress)
+    {
+      compressor = G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1));
+      job->stream = g_converter_output_stream_new (job->file_stream, compressor);
+      g_object_unref (G_OBJECT (compressor));
+    }
+  else
+    {
+      job->stream = g_object_ref (G_OBJECT (job->file_stream));
+    }
+
+  terminal_screen_save_step (task);
+}
+
+
+
+static void
+terminal_screen_save_return (GTask  *task,
+                             GError *error)
+{
+  TerminalScreen  *screen = g_task_get_source_object (task);
+  TerminalSaveJob *job = g_task_get_task_data (task);
+  GCancellable    *cancelled;
+
+  if (screen->save_task == task)
+    {
+      screen->save_task = NULL;
+      terminal_screen_save_update_progress (screen);
+    }
+
+  if (G_LIKELY (error == NULL))
+    {
+      g_task_return_boolean (task, TRUE);
+    }
+  else
+    {
+      /* closing with a cancelled cancellable keeps the file that
+       * was about to be replaced */
+      if (job->file_stream != NULL && !g_output_stream_is_closed (job->file_stream))
+        {
+          cancelled = g_cancellable_new ();
+          g_cancellable_cancel (cancelled);
+          g_output_stream_close (job->file_stream, cancelled, NULL);
+          g_object_unref (G_OBJECT (cancelled));
+        }
+
+      g_task_return_error (task, error);
+    }
+
+  g_object_unref (G_OBJECT (task));
+}
+
+
+
+/**
+ * terminal_screen_save_contents_async:
+ * @screen    : A #TerminalScreen.
+ * @file      : The file to write.
+ * @format    : A #TerminalSaveFormat.
+ * @compress  : Whether to gzip the contents.
+ * @callback  : Called when the contents are saved.
+ * @user_data : Data for @callback.
+ *
+ * Saves the scrollback and the visible rows of @screen to @file. The
+ * rows are taken from vte in chunks from the main loop and written
+ * asynchronously, so large buffers do not block the windows. Output
+ * that arrives after the call is not saved. The tab shows the progress
+ * and can stop the export, see terminal_screen_save_contents_cancel().
+ **/
+void
+terminal_screen_save_contents_async (TerminalScreen     *screen,
+                                     GFile              *file,
+                                     TerminalSaveFormat  format,
+                                     gboolean            compress,
+                                     GAsyncReadyCallback callback,
+                                     gpointer            user_data)
+{
+  GTask           *task;
+  GCancellable    *cancellable;
+  TerminalSaveJob *job;
+  GtkAdjustment   *adjustment;
+  gchar           *title;
+  gchar           *escaped;
+
+  terminal_return_if_fail (TERMINAL_IS_SCREEN (screen));
+  terminal_return_if_fail (G_IS_FILE (file));
+
+  if (G_UNLIKELY (screen->save_task != NULL))
+    {
+      g_task_report_new_error (screen, callback, user_data,
+                               terminal_screen_save_contents_async,
+                               G_IO_ERROR, G_IO_ERROR_BUSY,
+                               _("The contents of this tab are already being saved"));
+      return;
+    }
+
+  cancellable = g_cancellable_new ();
+  task = g_task_new (screen, cancellable, callback, user_data);
+  g_task_set_source_tag (task, terminal_screen_save_contents_async);
+  g_object_unref (G_OBJECT (cancellable));
+
+  job = g_slice_new0 (TerminalSaveJob);
+  job->format = format;
+  job->compress = compress;
+  job->buffer = g_string_sized_new (SAVE_CHUNK_ROWS * 128);
+  g_task_set_task_data (task, job, terminal_screen_save_job_free);
+
+  /* the rows in the buffer now, from the top of the scrollback */
+  adjustment = gtk_scrollable_get_vadjustment (GTK_SCROLLABLE (screen->terminal));
+  job->first_row = job->row = gtk_adjustment_get_lower (adjustment);
+  job->end_row = gtk_adjustment_get_upper (adjustment);
+  job->columns = vte_terminal_get_column_count (VTE_TERMINAL (screen->terminal));
+
+  job->default_back[0] = screen->background_color.red * 255 + 0.5;
+  job->default_back[1] = screen->background_color.green * 255 + 0.5;
+  job->default_back[2] = screen->background_color.blue * 255 + 0.5;
+
+  if (format == TERMINAL_SAVE_FORMAT_HTML)
+    {
+      title = terminal_screen_get_title (screen);
+      escaped = g_markup_escape_text (title, -1);
+      g_string_append_printf (job->buffer,
+                              "<!DOCTYPE html>\n<html>\n<head>\n"
+                              "<meta charset=\"utf-8\">\n<title>%s</title>\n"
+                              "</head>\n<body style=\"background-color:#%02x%02x%02x\">\n<pre>",
+                              escaped, job->default_back[0],
+                              job->default_back[1], job->default_back[2]);
+      g_free (escaped);
+      g_free (title);
+    }
+
+  /* the task holds a reference until it returns */
+  screen->save_task = task;
+  terminal_screen_save_update_progress (screen);
+
+  g_file_replace_async (file, NULL, FALSE, G_FILE_CREATE_NONE,
+                        G_PRIORITY_DEFAULT, cancellable,
+                        terminal_screen_save_opened, task);
+}
+
+
+
+/**
+ * terminal_screen_save_contents_finish:
+ * @screen : A #TerminalScreen.
+ * @result : The #GAsyncResult of the callback.
+ * @error  : Return location for errors or %NULL.
+ *
+ * Return value : %TRUE if the contents were saved.
+ **/
+gboolean
+terminal_screen_save_contents_finish (TerminalScreen  *screen,
+                                      GAsyncResult    *result,
+                                      GError         **error)
+{
+  terminal_return_val_if_fail (TERMINAL_IS_SCREEN (screen), FALSE);
+  terminal_return_val_if_fail (g_task_is_valid (result, screen), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+
+
+/**
+ * terminal_screen_save_contents_cancel:
+ * @screen : A #TerminalScreen.
+ *
+ * Stops saving the contents of @screen, the callback gets a
+ * %G_IO_ERROR_CANCELLED error.
+ **/
 void
-terminal_screen_save_contents (TerminalScreen *screen,
-                               GOutputStream  *stream,
-                               GError         *error)
+terminal_screen_save_contents_cancel (TerminalScreen *screen)
 {
   terminal_return_if_fail (TERMINAL_IS_SCREEN (screen));
-  vte_terminal_write_contents_sync (VTE_TERMINAL (screen->terminal),
-                                    stream, VTE_WRITE_DEFAULT, NULL, &error);
+
+  if (screen->save_task != NULL)
+    g_cancellable_cancel (g_task_get_cancellable (screen->save_task));
 }
 
 
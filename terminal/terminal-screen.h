@@ -23,6 +23,7 @@
 #include <gtk/gtk.h>
 #include <terminal/terminal-private.h>
 #include <terminal/terminal-options.h>
+#include <terminal/terminal-preferences.h>
 
 G_BEGIN_DECLS
 
@@ -36,6 +37,34 @@ G_BEGIN_DECLS
 typedef struct _TerminalScreenClass TerminalScreenClass;
 typedef struct _TerminalScreen      TerminalScreen;
 
+/**
+ * TerminalScreenStatistics:
+ *
+ * Counters of a tab, see terminal_screen_get_statistics(). Times are
+ * in microseconds, @last_output is on the g_get_monotonic_time() clock.
+ **/
+typedef struct
+{
+  guint64 bytes_written;
+  guint64 contents_changed;
+  guint   contents_changed_rate;
+  gint64  draw_time;
+  gint64  draw_time_max;
+  gint64  last_output;
+} TerminalScreenStatistics;
+
+/**
+ * TerminalSaveFormat:
+ *
+ * Formats of terminal_screen_save_contents_async().
+ **/
+typedef enum
+{
+  TERMINAL_SAVE_FORMAT_TEXT, /* plain text */
+  TERMINAL_SAVE_FORMAT_SGR,  /* text with SGR escapes for colors and attributes */
+  TERMINAL_SAVE_FORMAT_HTML  /* HTML document */
+} TerminalSaveFormat;
+
 GType           terminal_screen_get_type                  (void) G_GNUC_CONST;
 
 TerminalScreen *terminal_screen_new                       (TerminalTabAttr *attr,
@@ -43,6 +72,16 @@ TerminalScreen *terminal_screen_new                       (TerminalTabAttr *attr
                                                            glong            rows);
 
 void            terminal_screen_launch_child              (TerminalScreen *screen);
+gboolean        terminal_screen_launch_pooled_child       (TerminalScreen *screen);
+void            terminal_screen_defer_child               (TerminalScreen *screen);
+
+gboolean        terminal_screen_get_shell_command         (TerminalPreferences *preferences,
+                                                           gchar              **command,
+                                                           gchar             ***argv,
+                                                           GError             **error);
+gchar         **terminal_screen_get_shell_environment     (const gchar    *working_directory);
+void            terminal_screen_free_environment          (gchar         **envp);
+void            terminal_screen_invalidate_environment    (void);
 
 const gchar    *terminal_screen_get_custom_title          (TerminalScreen *screen);
 void            terminal_screen_set_custom_title          (TerminalScreen *screen,
@@ -72,6 +111,7 @@ void            terminal_screen_force_resize_window       (TerminalScreen *scree
 gchar          *terminal_screen_get_title                 (TerminalScreen *screen);
 
 const gchar    *terminal_screen_get_working_directory     (TerminalScreen *screen);
+const gchar    *terminal_screen_resolve_working_directory (TerminalScreen *screen);
 void            terminal_screen_set_working_directory     (TerminalScreen *screen,
                                                            const gchar    *directory);
 
@@ -93,6 +133,15 @@ GSList         *terminal_screen_get_restart_command       (TerminalScreen *scree
 
 void            terminal_screen_reset_activity            (TerminalScreen *screen);
 
+glong           terminal_screen_get_scrollback_lines      (TerminalScreen *screen);
+glong           terminal_screen_get_scrollback_used       (TerminalScreen *screen);
+void            terminal_screen_set_scrollback_budget     (TerminalScreen *screen,
+                                                           glong           lines);
+
+guint           terminal_screen_get_session_id            (TerminalScreen *screen);
+void            terminal_screen_get_statistics            (TerminalScreen *screen,
+                                                           TerminalScreenStatistics *stats);
+
 GtkWidget      *terminal_screen_get_tab_label             (TerminalScreen *screen);
 
 void            terminal_screen_focus                     (TerminalScreen *screen);
@@ -109,6 +158,12 @@ gboolean        terminal_screen_search_has_gregex         (TerminalScreen *scree
 void            terminal_screen_search_find_next          (TerminalScreen *screen);
 void            terminal_screen_search_find_previous      (TerminalScreen *screen);
 
+void            terminal_screen_search_set_highlight_all  (TerminalScreen *screen,
+                                                           gboolean        highlight);
+gboolean        terminal_screen_search_get_count          (TerminalScreen *screen,
+                                                           guint          *current,
+                                                           guint          *total);
+
 void            terminal_screen_update_scrolling_bar      (TerminalScreen *screen);
 
 void            terminal_screen_update_font               (TerminalScreen *screen);
@@ -121,9 +176,16 @@ gboolean        terminal_screen_get_scroll_on_output      (TerminalScreen *scree
 void            terminal_screen_set_scroll_on_output      (TerminalScreen *screen,
                                                            gboolean        enabled);
 
-void            terminal_screen_save_contents             (TerminalScreen *screen,
-                                                           GOutputStream  *stream,
-                                                           GError         *error);
+void            terminal_screen_save_contents_async       (TerminalScreen     *screen,
+                                                           GFile              *file,
+                                                           TerminalSaveFormat  format,
+                                                           gboolean            compress,
+                                                           GAsyncReadyCallback callback,
+                                                           gpointer            user_data);
+gboolean        terminal_screen_save_contents_finish      (TerminalScreen     *screen,
+                                                           GAsyncResult       *result,
+                                                           GError            **error);
+void            terminal_screen_save_contents_cancel      (TerminalScreen     *screen);
 
 gboolean        terminal_screen_has_foreground_process    (TerminalScreen *screen);
 
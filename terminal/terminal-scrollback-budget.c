@@ -0,0 +1,480 @@
+/*-
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include <gio/gio.h>
+
+#include <terminal/terminal-scrollback-budget.h>
+#include <terminal/terminal-preferences.h>
+#include <terminal/terminal-timer-wheel.h>
+#include <terminal/terminal-private.h>
+
+/* scrollback every tab keeps, whatever the budget */
+#define MIN_LINES (1000)
+
+/* background tabs seen this recently get a larger share */
+#define RECENT_TIME (10 * 60 * G_USEC_PER_SEC)
+
+/* background tabs without output for this long are trimmed */
+#define IDLE_TIME (5 * 60 * G_USEC_PER_SEC)
+
+/* seconds a low memory warning is honoured */
+#define PRESSURE_TIME (60)
+
+/* seconds between checks for tabs that became idle */
+#define CHECK_INTERVAL (60)
+
+
+
+typedef struct _TerminalScrollbackTab TerminalScrollbackTab;
+
+typedef enum
+{
+  PRESSURE_NONE,
+  PRESSURE_LOW,      /* trim idle background tabs */
+  PRESSURE_MEDIUM,   /* trim all background tabs */
+  PRESSURE_CRITICAL  /* trim visible tabs too */
+} TerminalScrollbackPressure;
+
+
+
+static void     terminal_scrollback_budget_finalize       (GObject                  *object);
+static void     terminal_scrollback_budget_notify         (TerminalScrollbackBudget *budget,
+                                                           GParamSpec               *pspec);
+static void     terminal_scrollback_budget_rebalance      (TerminalScrollbackBudget *budget);
+static gboolean terminal_scrollback_budget_idle           (gpointer                  user_data);
+static void     terminal_scrollback_budget_check          (TerminalTimerWheelEntry  *entry,
+                                                           gpointer                  user_data);
+static void     terminal_scrollback_budget_pressure_ended (TerminalTimerWheelEntry  *entry,
+                                                           gpointer                  user_data);
+#if GLIB_CHECK_VERSION (2, 64, 0)
+static void     terminal_scrollback_budget_low_memory     (GMemoryMonitor           *monitor,
+                                                           GMemoryMonitorWarningLevel level,
+                                                           TerminalScrollbackBudget *budget);
+#endif
+
+
+
+struct _TerminalScrollbackBudgetClass
+{
+  GObjectClass parent_class;
+};
+
+struct _TerminalScrollbackBudget
+{
+  GObject                     parent_instance;
+  TerminalPreferences        *preferences;
+
+  /* the registered tabs */
+  GSList                     *tabs;
+
+  /* total scrollback lines of all tabs, 0 for no budget */
+  guint                       lines;
+
+  TerminalScrollbackPressure  pressure;
+#if GLIB_CHECK_VERSION (2, 64, 0)
+  GMemoryMonitor             *monitor;
+#endif
+
+  guint                       rebalance_id;
+  TerminalTimerWheelEntry     check_timer;
+  TerminalTimerWheelEntry     pressure_timer;
+};
+
+struct _TerminalScrollbackTab
+{
+  TerminalScreen *screen;
+  gint64          last_seen;
+
+  /* used while rebalancing */
+  glong           cap;
+  guint           weight;
+  glong           limit;
+  guint           done : 1;
+};
+
+
+
+G_DEFINE_TYPE (TerminalScrollbackBudget, terminal_scrollback_budget, G_TYPE_OBJECT)
+
+
+
+static void
+terminal_scrollback_budget_class_init (TerminalScrollbackBudgetClass *klass)
+{
+  GObjectClass *gobject_class;
+
+  gobject_class = G_OBJECT_CLASS (klass);
+  gobject_class->finalize = terminal_scrollback_budget_finalize;
+}
+
+
+
+static void
+terminal_scrollback_budget_init (TerminalScrollbackBudget *budget)
+{
+  budget->preferences = terminal_preferences_get ();
+  g_object_get (G_OBJECT (budget->preferences), "misc-scrollback-budget", &budget->lines, NULL);
+  g_signal_connect_swapped (G_OBJECT (budget->preferences), "notify::misc-scrollback-budget",
+                            G_CALLBACK (terminal_scrollback_budget_notify), budget);
+
+#if GLIB_CHECK_VERSION (2, 64, 0)
+  budget->monitor = g_memory_monitor_dup_default ();
+  if (G_LIKELY (budget->monitor != NULL))
+    g_signal_connect (G_OBJECT (budget->monitor), "low-memory-warning",
+                      G_CALLBACK (terminal_scrollback_budget_low_memory), budget);
+#endif
+}
+
+
+
+static void
+terminal_scrollback_budget_finalize (GObject *object)
+{
+  TerminalScrollbackBudget *budget = TERMINAL_SCROLLBACK_BUDGET (object);
+  GSList                   *lp;
+
+  if (budget->rebalance_id != 0)
+    g_source_remove (budget->rebalance_id);
+
+  terminal_timer_wheel_cancel (&budget->check_timer);
+  terminal_timer_wheel_cancel (&budget->pressure_timer);
+
+#if GLIB_CHECK_VERSION (2, 64, 0)
+  if (budget->monitor != NULL)
+    {
+      g_signal_handlers_disconnect_by_func (G_OBJECT (budget->monitor),
+                                            G_CALLBACK (terminal_scrollback_budget_low_memory), budget);
+      g_object_unref (G_OBJECT (budget->monitor));
+    }
+#endif
+
+  g_signal_handlers_disconnect_by_func (G_OBJECT (budget->preferences),
+                                        G_CALLBACK (terminal_scrollback_budget_notify), budget);
+  g_object_unref (G_OBJECT (budget->preferences));
+
+  for (lp = budget->tabs; lp != NULL; lp = lp->next)
+    g_slice_free (TerminalScrollbackTab, lp->data);
+  g_slist_free (budget->tabs);
+
+  (*G_OBJECT_CLASS (terminal_scrollback_budget_parent_class)->finalize) (object);
+}
+
+
+
+static void
+terminal_scrollback_budget_notify (TerminalScrollbackBudget *budget,
+                                   GParamSpec               *pspec)
+{
+  terminal_return_if_fail (TERMINAL_IS_SCROLLBACK_BUDGET (budget));
+
+  g_object_get (G_OBJECT (budget->preferences), "misc-scrollback-budget", &budget->lines, NULL);
+  terminal_scrollback_budget_schedule (budget);
+}
+
+
+
+static void
+terminal_scrollback_budget_rebalance (TerminalScrollbackBudget *budget)
+{
+  TerminalScrollbackTab    *tab;
+  TerminalScreenStatistics  stats;
+  GSList                   *lp;
+  gint64                    now;
+  gboolean                  visible;
+  gboolean                  idle;
+  gboolean                  changed;
+  glong                     used;
+  gdouble                   remaining, pass_remaining;
+  gdouble                   share;
+  guint                     weights = 0;
+
+  /* nothing to distribute, the tabs use their own settings */
+  if (budget->lines == 0 && budget->pressure == PRESSURE_NONE)
+    {
+      for (lp = budget->tabs; lp != NULL; lp = lp->next)
+        terminal_screen_set_scrollback_budget (((TerminalScrollbackTab *) lp->data)->screen, -1);
+      terminal_timer_wheel_cancel (&budget->check_timer);
+      return;
+    }
+
+  now = g_get_monotonic_time ();
+
+  /* the share of each tab and the most it can use */
+  for (lp = budget->tabs; lp != NULL; lp = lp->next)
+    {
+      tab = lp->data;
+
+      visible = gtk_widget_get_mapped (GTK_WIDGET (tab->screen));
+      if (visible)
+        tab->last_seen = now;
+
+      terminal_screen_get_statistics (tab->screen, &stats);
+      idle = !visible && (stats.last_output == 0 || now - stats.last_output > IDLE_TIME);
+
+      if (visible)
+        tab->weight = 4;
+      else if (now - tab->last_seen < RECENT_TIME)
+        tab->weight = 2;
+      else
+        tab->weight = 1;
+
+      tab->cap = terminal_screen_get_scrollback_lines (tab->screen);
+      if (tab->cap < 0)
+        tab->cap = G_MAXLONG;
+
+      /* idle tabs keep what they have, the rest goes to busy tabs */
+      if (idle)
+        {
+          used = terminal_screen_get_scrollback_used (tab->screen);
+          tab->cap = MIN (tab->cap, MAX (used, MIN_LINES));
+        }
+
+      /* on low memory, shrink background tabs first */
+      if ((budget->pressure >= PRESSURE_LOW && idle)
+          || (budget->pressure >= PRESSURE_MEDIUM && !visible))
+        tab->cap = MIN (tab->cap, MIN_LINES);
+      else if (budget->pressure >= PRESSURE_CRITICAL)
+        tab->cap = MIN (tab->cap, 10 * MIN_LINES);
+
+      tab->done = FALSE;
+    }
+
+  /* hand out the budget by weight; tabs that need less than their
+   * share get what they need and the rest is shared again */
+  remaining = budget->lines > 0 ? (gdouble) budget->lines : (gdouble) G_MAXLONG;
+  do
+    {
+      changed = FALSE;
+      weights = 0;
+      for (lp = budget->tabs; lp != NULL; lp = lp->next)
+        if (!((TerminalScrollbackTab *) lp->data)->done)
+          weights += ((TerminalScrollbackTab *) lp->data)->weight;
+
+      if (weights == 0)
+        break;
+
+      pass_remaining = remaining;
+      for (lp = budget->tabs; lp != NULL; lp = lp->next)
+        {
+          tab = lp->data;
+          if (!tab->done && tab->cap <= pass_remaining * tab->weight / weights)
+            {
+              tab->limit = tab->cap;
+              tab->done = TRUE;
+              remaining -= tab->cap;
+              changed = TRUE;
+            }
+        }
+    }
+  while (changed);
+
+  for (lp = budget->tabs; lp != NULL; lp = lp->next)
+    {
+      tab = lp->data;
+      if (!tab->done)
+        {
+          /* without a budget, only the memory pressure limits tabs */
+          share = remaining * tab->weight / weights;
+          tab->limit = budget->lines > 0 ? MAX ((glong) share, MIN_LINES) : G_MAXLONG;
+        }
+
+      terminal_screen_set_scrollback_budget (tab->screen, tab->limit == G_MAXLONG ? -1 : tab->limit);
+    }
+
+  /* background tabs become idle over time */
+  if (budget->tabs != NULL && !terminal_timer_wheel_is_scheduled (&budget->check_timer))
+    terminal_timer_wheel_schedule (&budget->check_timer, CHECK_INTERVAL,
+                                   terminal_scrollback_budget_check, budget);
+}
+
+
+
+static gboolean
+terminal_scrollback_budget_idle (gpointer user_data)
+{
+  TerminalScrollbackBudget *budget = TERMINAL_SCROLLBACK_BUDGET (user_data);
+
+  budget->rebalance_id = 0;
+  terminal_scrollback_budget_rebalance (budget);
+
+  return FALSE;
+}
+
+
+
+static void
+terminal_scrollback_budget_check (TerminalTimerWheelEntry *entry,
+                                  gpointer                 user_data)
+{
+  terminal_scrollback_budget_rebalance (TERMINAL_SCROLLBACK_BUDGET (user_data));
+}
+
+
+
+static void
+terminal_scrollback_budget_pressure_ended (TerminalTimerWheelEntry *entry,
+                                           gpointer                 user_data)
+{
+  TerminalScrollbackBudget *budget = TERMINAL_SCROLLBACK_BUDGET (user_data);
+
+  /* lines dropped under pressure are gone, but the tabs can grow again */
+  budget->pressure = PRESSURE_NONE;
+  terminal_scrollback_budget_schedule (budget);
+}
+
+
+
+#if GLIB_CHECK_VERSION (2, 64, 0)
+static void
+terminal_scrollback_budget_low_memory (GMemoryMonitor             *monitor,
+                                       GMemoryMonitorWarningLevel  level,
+                                       TerminalScrollbackBudget   *budget)
+{
+  TerminalScrollbackPressure pressure;
+
+  terminal_return_if_fail (TERMINAL_IS_SCROLLBACK_BUDGET (budget));
+
+  if (level >= G_MEMORY_MONITOR_WARNING_LEVEL_CRITICAL)
+    pressure = PRESSURE_CRITICAL;
+  else if (level >= G_MEMORY_MONITOR_WARNING_LEVEL_MEDIUM)
+    pressure = PRESSURE_MEDIUM;
+  else
+    pressure = PRESSURE_LOW;
+
+  terminal_timer_wheel_schedule (&budget->pressure_timer, PRESSURE_TIME,
+                                 terminal_scrollback_budget_pressure_ended, budget);
+
+  if (pressure <= budget->pressure)
+    return;
+
+  /* release memory now, not in an idle */
+  budget->pressure = pressure;
+  terminal_scrollback_budget_rebalance (budget);
+}
+#endif
+
+
+
+/**
+ * terminal_scrollback_budget_get:
+ *
+ * Return value : The #TerminalScrollbackBudget of the application.
+ *                Release with g_object_unref() when no longer used.
+ **/
+TerminalScrollbackBudget *
+terminal_scrollback_budget_get (void)
+{
+  static TerminalScrollbackBudget *budget = NULL;
+
+  if (G_UNLIKELY (budget == NULL))
+    {
+      budget = g_object_new (TERMINAL_TYPE_SCROLLBACK_BUDGET, NULL);
+      g_object_add_weak_pointer (G_OBJECT (budget), (gpointer) &budget);
+    }
+  else
+    {
+      g_object_ref (G_OBJECT (budget));
+    }
+
+  return budget;
+}
+
+
+
+/**
+ * terminal_scrollback_budget_add:
+ * @budget : A #TerminalScrollbackBudget.
+ * @screen : A #TerminalScreen.
+ *
+ * Includes the scrollback of @screen in the budget, until
+ * terminal_scrollback_budget_remove() is called.
+ **/
+void
+terminal_scrollback_budget_add (TerminalScrollbackBudget *budget,
+                                TerminalScreen           *screen)
+{
+  TerminalScrollbackTab *tab;
+
+  terminal_return_if_fail (TERMINAL_IS_SCROLLBACK_BUDGET (budget));
+  terminal_return_if_fail (TERMINAL_IS_SCREEN (screen));
+
+  tab = g_slice_new0 (TerminalScrollbackTab);
+  tab->screen = screen;
+  tab->last_seen = g_get_monotonic_time ();
+  budget->tabs = g_slist_prepend (budget->tabs, tab);
+
+  /* switching tabs changes the shares */
+  g_signal_connect_swapped (G_OBJECT (screen), "map",
+                            G_CALLBACK (terminal_scrollback_budget_schedule), budget);
+
+  terminal_scrollback_budget_schedule (budget);
+}
+
+
+
+/**
+ * terminal_scrollback_budget_remove:
+ * @budget : A #TerminalScrollbackBudget.
+ * @screen : A #TerminalScreen.
+ **/
+void
+terminal_scrollback_budget_remove (TerminalScrollbackBudget *budget,
+                                   TerminalScreen           *screen)
+{
+  GSList *lp;
+
+  terminal_return_if_fail (TERMINAL_IS_SCROLLBACK_BUDGET (budget));
+  terminal_return_if_fail (TERMINAL_IS_SCREEN (screen));
+
+  for (lp = budget->tabs; lp != NULL; lp = lp->next)
+    if (((TerminalScrollbackTab *) lp->data)->screen == screen)
+      {
+        g_signal_handlers_disconnect_by_func (G_OBJECT (screen),
+                                              G_CALLBACK (terminal_scrollback_budget_schedule), budget);
+        g_slice_free (TerminalScrollbackTab, lp->data);
+        budget->tabs = g_slist_delete_link (budget->tabs, lp);
+        break;
+      }
+
+  /* the freed lines go to the other tabs */
+  terminal_scrollback_budget_schedule (budget);
+}
+
+
+
+/**
+ * terminal_scrollback_budget_schedule:
+ * @budget : A #TerminalScrollbackBudget.
+ *
+ * Distributes the budget again from an idle, after tabs were added,
+ * removed, switched or changed their scrollback setting.
+ **/
+void
+terminal_scrollback_budget_schedule (TerminalScrollbackBudget *budget)
+{
+  terminal_return_if_fail (TERMINAL_IS_SCROLLBACK_BUDGET (budget));
+
+  if (budget->rebalance_id == 0)
+    budget->rebalance_id = g_idle_add_full (G_PRIORITY_LOW, terminal_scrollback_budget_idle,
+                                            budget, NULL);
+}
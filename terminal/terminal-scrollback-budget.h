@@ -0,0 +1,47 @@
+/*-
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TERMINAL_SCROLLBACK_BUDGET_H
+#define TERMINAL_SCROLLBACK_BUDGET_H
+
+#include <terminal/terminal-screen.h>
+
+G_BEGIN_DECLS
+
+#define TERMINAL_TYPE_SCROLLBACK_BUDGET            (terminal_scrollback_budget_get_type ())
+#define TERMINAL_SCROLLBACK_BUDGET(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), TERMINAL_TYPE_SCROLLBACK_BUDGET, TerminalScrollbackBudget))
+#define TERMINAL_SCROLLBACK_BUDGET_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass), TERMINAL_TYPE_SCROLLBACK_BUDGET, TerminalScrollbackBudgetClass))
+#define TERMINAL_IS_SCROLLBACK_BUDGET(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), TERMINAL_TYPE_SCROLLBACK_BUDGET))
+#define TERMINAL_IS_SCROLLBACK_BUDGET_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), TERMINAL_TYPE_SCROLLBACK_BUDGET))
+#define TERMINAL_SCROLLBACK_BUDGET_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), TERMINAL_TYPE_SCROLLBACK_BUDGET, TerminalScrollbackBudgetClass))
+
+typedef struct _TerminalScrollbackBudgetClass TerminalScrollbackBudgetClass;
+typedef struct _TerminalScrollbackBudget      TerminalScrollbackBudget;
+
+GType                     terminal_scrollback_budget_get_type (void) G_GNUC_CONST;
+
+TerminalScrollbackBudget *terminal_scrollback_budget_get      (void);
+
+void                      terminal_scrollback_budget_add      (TerminalScrollbackBudget *budget,
+                                                               TerminalScreen           *screen);
+
+void                      terminal_scrollback_budget_remove   (TerminalScrollbackBudget *budget,
+                                                               TerminalScreen           *screen);
+
+void                      terminal_scrollback_budget_schedule (TerminalScrollbackBudget *budget);
+
+G_END_DECLS
+
+#endif /* !TERMINAL_SCROLLBACK_BUDGET_H */
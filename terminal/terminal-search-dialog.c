@@ -38,6 +38,7 @@ static void terminal_search_dialog_entry_icon_release (GtkWidget            *ent
                                                        GtkEntryIconPosition  icon_pos);
 static void terminal_search_dialog_entry_changed      (GtkWidget            *entry,
                                                        TerminalSearchDialog *dialog);
+static void terminal_search_dialog_highlight_toggled  (TerminalSearchDialog *dialog);
 
 
 struct _TerminalSearchDialogClass
@@ -60,6 +61,9 @@ struct _TerminalSearchDialog
   GtkWidget *match_regex;
   GtkWidget *match_word;
   GtkWidget *wrap_around;
+  GtkWidget *highlight;
+
+  GtkWidget *status;
 };
 
 
@@ -141,6 +145,16 @@ terminal_search_dialog_init (TerminalSearchDialog *dialog)
   g_signal_connect_swapped (G_OBJECT (dialog->wrap_around), "toggled",
       G_CALLBACK (terminal_search_dialog_clear_gregex), dialog);
 
+  dialog->highlight = gtk_check_button_new_with_mnemonic (_("_Highlight all matches"));
+  gtk_box_pack_start (GTK_BOX (vbox), dialog->highlight, FALSE, FALSE, 0);
+  g_signal_connect_swapped (G_OBJECT (dialog->highlight), "toggled",
+      G_CALLBACK (terminal_search_dialog_highlight_toggled), dialog);
+
+  /* position of the current match and number of matches */
+  dialog->status = gtk_label_new (NULL);
+  gtk_widget_set_halign (dialog->status, GTK_ALIGN_START);
+  gtk_box_pack_start (GTK_BOX (vbox), dialog->status, FALSE, FALSE, 0);
+
   terminal_search_dialog_entry_changed (dialog->entry, dialog);
 }
 
@@ -189,6 +203,7 @@ terminal_search_dialog_entry_changed (GtkWidget            *entry,
   has_text = IS_STRING (text);
 
   terminal_search_dialog_clear_gregex (dialog);
+  gtk_label_set_text (GTK_LABEL (dialog->status), NULL);
 
   gtk_widget_set_sensitive (dialog->button_prev, has_text);
   gtk_widget_set_sensitive (dialog->button_next, has_text);
@@ -199,6 +214,15 @@ terminal_search_dialog_entry_changed (GtkWidget            *entry,
 
 
 
+static void
+terminal_search_dialog_highlight_toggled (TerminalSearchDialog *dialog)
+{
+  /* the window applies it to the active tab */
+  gtk_dialog_response (GTK_DIALOG (dialog), TERMINAL_RESPONSE_SEARCH_HIGHLIGHT);
+}
+
+
+
 GtkWidget *
 terminal_search_dialog_new (GtkWindow *parent)
 {
@@ -219,16 +243,42 @@ terminal_search_dialog_get_wrap_around (TerminalSearchDialog *dialog)
 
 
 
+gboolean
+terminal_search_dialog_get_highlight (TerminalSearchDialog *dialog)
+{
+  terminal_return_val_if_fail (TERMINAL_IS_SEARCH_DIALOG (dialog), FALSE);
+  return gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (dialog->highlight));
+}
+
+
+
+void
+terminal_search_dialog_set_status (TerminalSearchDialog *dialog,
+                                   const gchar          *status)
+{
+  terminal_return_if_fail (TERMINAL_IS_SEARCH_DIALOG (dialog));
+  gtk_label_set_text (GTK_LABEL (dialog->status), status);
+}
+
+
+
+/**
+ * terminal_search_dialog_get_regex:
+ * @dialog : A #TerminalSearchDialog.
+ * @error  : Return location for errors or %NULL.
+ *
+ * The expression is matched against single rows by the terminal
+ * screen, see terminal_screen_search_set_gregex().
+ *
+ * Return value : The #GRegex of the search or %NULL if there is no
+ *                pattern.
+ **/
 GRegex *
 terminal_search_dialog_get_regex (TerminalSearchDialog  *dialog,
                                   GError               **error)
 {
   const gchar        *pattern;
-#if VTE_CHECK_VERSION (0, 45, 90)
-  guint32             flags = PCRE2_UTF | PCRE2_NO_UTF_CHECK | PCRE2_MULTILINE;
-#else
   GRegexCompileFlags  flags = G_REGEX_OPTIMIZE;
-#endif
   gchar              *pattern_escaped = NULL;
   gchar              *word_regex = NULL;
   GRegex             *regex;
@@ -246,20 +296,9 @@ terminal_search_dialog_get_regex (TerminalSearchDialog  *dialog,
     return NULL;
 
   if (!gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (dialog->match_case)))
-#if VTE_CHECK_VERSION (0, 45, 90)
-    flags |= PCRE2_CASELESS;
-#else
     flags |= G_REGEX_CASELESS;
-#endif
 
-  if (gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (dialog->match_regex)))
-    {
-/* MULTILINE flag is always used for pcre2 */
-#if !VTE_CHECK_VERSION (0, 45, 90)
-      flags |= G_REGEX_MULTILINE;
-#endif
-    }
-  else
+  if (!gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (dialog->match_regex)))
     {
       pattern_escaped = g_regex_escape_string (pattern, -1);
       pattern = pattern_escaped;
@@ -271,11 +310,7 @@ terminal_search_dialog_get_regex (TerminalSearchDialog  *dialog,
       pattern = word_regex;
     }
 
-#if VTE_CHECK_VERSION (0, 45, 90)
-  regex = vte_regex_new_for_search (pattern, -1, flags, error);
-#else
   regex = g_regex_new (pattern, flags, 0, error);
-#endif
 
   g_free (pattern_escaped);
   g_free (word_regex);
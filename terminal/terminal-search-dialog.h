@@ -35,7 +35,8 @@ typedef struct _TerminalSearchDialogClass TerminalSearchDialogClass;
 enum
 {
   TERMINAL_RESPONSE_SEARCH_NEXT,
-  TERMINAL_RESPONSE_SEARCH_PREV
+  TERMINAL_RESPONSE_SEARCH_PREV,
+  TERMINAL_RESPONSE_SEARCH_HIGHLIGHT
 };
 
 GType      terminal_search_dialog_get_type        (void) G_GNUC_CONST;
@@ -44,6 +45,11 @@ GtkWidget *terminal_search_dialog_new             (GtkWindow             *parent
 
 gboolean   terminal_search_dialog_get_wrap_around (TerminalSearchDialog  *dialog);
 
+gboolean   terminal_search_dialog_get_highlight   (TerminalSearchDialog  *dialog);
+
+void       terminal_search_dialog_set_status      (TerminalSearchDialog  *dialog,
+                                                   const gchar           *status);
+
 GRegex    *terminal_search_dialog_get_regex       (TerminalSearchDialog  *dialog,
                                                    GError               **error);
 
@@ -0,0 +1,501 @@
+/*-
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include <terminal/terminal-search-index.h>
+#include <terminal/terminal-private.h>
+
+/* trimmed blocks are removed from the posting lists in batches */
+#define TRIM_BLOCKS (256)
+
+#define BLOCK_OF_ROW(row) ((guint32) ((row) / TERMINAL_SEARCH_INDEX_BLOCK_ROWS))
+
+/* three bytes of casefolded utf-8, never 0 since the text has no nul bytes */
+#define TRIGRAM(p) (GUINT_TO_POINTER (((guint) (guchar) (p)[0] << 16) \
+                                      | ((guint) (guchar) (p)[1] << 8) \
+                                      | (guint) (guchar) (p)[2]))
+
+
+
+static void     terminal_search_index_posting_free (gpointer     data);
+static gboolean terminal_search_index_literals     (const gchar *pattern,
+                                                    GPtrArray   *runs);
+
+
+
+/**
+ * TerminalSearchIndex:
+ *
+ * Trigram index of the scrollback of a screen. Rows are added at the
+ * end as they scroll out of the visible area and trimmed at the start
+ * with the scrollback. For each trigram of the casefolded text the index
+ * keeps the ascending list of blocks it occurs in, so a search only has
+ * to run the regular expression on the rows of blocks that contain all
+ * trigrams of the literal parts of the pattern.
+ **/
+struct _TerminalSearchIndex
+{
+  /* trigram -> GArray of guint32 block numbers */
+  GHashTable *trigrams;
+
+  /* indexed rows, [first_row, end_row) */
+  glong       first_row;
+  glong       end_row;
+
+  /* the posting lists hold no blocks before this one */
+  guint32     trimmed_block;
+};
+
+
+
+static void
+terminal_search_index_posting_free (gpointer data)
+{
+  g_array_free (data, TRUE);
+}
+
+
+
+static void
+terminal_search_index_run_end (GString   *run,
+                               GPtrArray *runs)
+{
+  if (run->len > 0)
+    {
+      g_ptr_array_add (runs, g_utf8_casefold (run->str, run->len));
+      g_string_truncate (run, 0);
+    }
+}
+
+
+
+static void
+terminal_search_index_run_drop_last (GString *run)
+{
+  const gchar *last;
+
+  /* the last character is optional */
+  last = g_utf8_find_prev_char (run->str, run->str + run->len);
+  if (last != NULL)
+    g_string_truncate (run, last - run->str);
+}
+
+
+
+/* collects runs of characters every match of @pattern contains, returns
+ * FALSE for patterns that are too complex to tell */
+static gboolean
+terminal_search_index_literals (const gchar *pattern,
+                                GPtrArray   *runs)
+{
+  GString     *run;
+  const gchar *p, *next;
+  gint         depth = 0;
+  gboolean     in_class = FALSE;
+  gboolean     result = TRUE;
+
+  run = g_string_new (NULL);
+
+  for (p = pattern; result && *p != '\0'; p = next)
+    {
+      next = g_utf8_next_char (p);
+
+      if (in_class)
+        {
+          /* skip character classes */
+          if (*p == '\\' && p[1] != '\0')
+            next = g_utf8_next_char (p + 1);
+          else if (*p == ']')
+            in_class = FALSE;
+          continue;
+        }
+
+      switch (*p)
+        {
+        case '\\':
+          if (p[1] == '\0')
+            {
+              result = FALSE;
+            }
+          else if (g_ascii_isalnum (p[1]))
+            {
+              /* escapes with arguments could be taken for literals */
+              if (strchr ("xcgkopPNQE0123456789", p[1]) != NULL)
+                result = FALSE;
+
+              /* \b, \d, \w and friends */
+              terminal_search_index_run_end (run, runs);
+              next = p + 2;
+            }
+          else
+            {
+              /* escaped punctuation */
+              next = g_utf8_next_char (p + 1);
+              if (depth == 0)
+                g_string_append_len (run, p + 1, next - (p + 1));
+            }
+          break;
+
+        case '[':
+          terminal_search_index_run_end (run, runs);
+          in_class = TRUE;
+          if (*next == '^')
+            next++;
+          if (*next == ']')
+            next++;
+          break;
+
+        case '(':
+          /* look-arounds and inline options change the meaning */
+          if (p[1] == '?')
+            result = FALSE;
+          terminal_search_index_run_end (run, runs);
+          depth++;
+          break;
+
+        case ')':
+          terminal_search_index_run_end (run, runs);
+          depth--;
+          break;
+
+        case '|':
+          /* alternatives make every literal optional */
+          result = FALSE;
+          break;
+
+        case '*':
+        case '?':
+          terminal_search_index_run_drop_last (run);
+          terminal_search_index_run_end (run, runs);
+          break;
+
+        case '{':
+          terminal_search_index_run_drop_last (run);
+          terminal_search_index_run_end (run, runs);
+          next = strchr (p, '}');
+          next = next != NULL ? next + 1 : p + strlen (p);
+          break;
+
+        case '+':
+        case '.':
+        case '^':
+        case '$':
+          terminal_search_index_run_end (run, runs);
+          break;
+
+        default:
+          /* groups may be repeated or optional */
+          if (depth == 0)
+            g_string_append_len (run, p, next - p);
+          break;
+        }
+    }
+
+  terminal_search_index_run_end (run, runs);
+  g_string_free (run, TRUE);
+
+  return result;
+}
+
+
+
+static gint
+terminal_search_index_compare_length (gconstpointer a,
+                                      gconstpointer b)
+{
+  return (gint) (*(GArray **) a)->len - (gint) (*(GArray **) b)->len;
+}
+
+
+
+static gboolean
+terminal_search_index_contains (GArray  *blocks,
+                                guint32  block)
+{
+  guint lo = 0, hi = blocks->len, mid;
+
+  while (lo < hi)
+    {
+      mid = (lo + hi) / 2;
+      if (g_array_index (blocks, guint32, mid) < block)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return lo < blocks->len && g_array_index (blocks, guint32, lo) == block;
+}
+
+
+
+/**
+ * terminal_search_index_new:
+ *
+ * Return value : An empty #TerminalSearchIndex.
+ **/
+TerminalSearchIndex *
+terminal_search_index_new (void)
+{
+  TerminalSearchIndex *index;
+
+  index = g_slice_new0 (TerminalSearchIndex);
+  index->trigrams = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                           NULL, terminal_search_index_posting_free);
+
+  return index;
+}
+
+
+
+void
+terminal_search_index_free (TerminalSearchIndex *index)
+{
+  terminal_return_if_fail (index != NULL);
+
+  g_hash_table_destroy (index->trigrams);
+  g_slice_free (TerminalSearchIndex, index);
+}
+
+
+
+/**
+ * terminal_search_index_reset:
+ * @index : A #TerminalSearchIndex.
+ * @row   : The row added next.
+ *
+ * Empties @index, for when the rows of the terminal are renumbered.
+ **/
+void
+terminal_search_index_reset (TerminalSearchIndex *index,
+                             glong                row)
+{
+  terminal_return_if_fail (index != NULL);
+
+  g_hash_table_remove_all (index->trigrams);
+  index->first_row = index->end_row = MAX (row, 0);
+  index->trimmed_block = BLOCK_OF_ROW (index->first_row);
+}
+
+
+
+glong
+terminal_search_index_get_first_row (TerminalSearchIndex *index)
+{
+  terminal_return_val_if_fail (index != NULL, 0);
+  return index->first_row;
+}
+
+
+
+glong
+terminal_search_index_get_end_row (TerminalSearchIndex *index)
+{
+  terminal_return_val_if_fail (index != NULL, 0);
+  return index->end_row;
+}
+
+
+
+/**
+ * terminal_search_index_add_row:
+ * @index : A #TerminalSearchIndex.
+ * @text  : Text of the row.
+ *
+ * Adds @text as the row terminal_search_index_get_end_row().
+ **/
+void
+terminal_search_index_add_row (TerminalSearchIndex *index,
+                               const gchar         *text)
+{
+  gchar   *folded;
+  gchar   *p;
+  GArray  *blocks;
+  guint32  block;
+  gpointer trigram;
+
+  terminal_return_if_fail (index != NULL);
+
+  block = BLOCK_OF_ROW (index->end_row++);
+
+  folded = g_utf8_casefold (text, -1);
+  for (p = folded; p[0] != '\0' && p[1] != '\0' && p[2] != '\0'; p++)
+    {
+      /* matches are searched per row */
+      if (G_UNLIKELY (p[0] == '\n' || p[1] == '\n' || p[2] == '\n'))
+        continue;
+
+      trigram = TRIGRAM (p);
+      blocks = g_hash_table_lookup (index->trigrams, trigram);
+      if (G_UNLIKELY (blocks == NULL))
+        {
+          blocks = g_array_sized_new (FALSE, FALSE, sizeof (guint32), 4);
+          g_hash_table_insert (index->trigrams, trigram, blocks);
+        }
+
+      /* a block is listed once */
+      if (blocks->len == 0 || g_array_index (blocks, guint32, blocks->len - 1) != block)
+        g_array_append_val (blocks, block);
+    }
+  g_free (folded);
+}
+
+
+
+/**
+ * terminal_search_index_trim:
+ * @index     : A #TerminalSearchIndex.
+ * @first_row : The first row that still exists.
+ *
+ * Forgets the rows before @first_row.
+ **/
+void
+terminal_search_index_trim (TerminalSearchIndex *index,
+                            glong                first_row)
+{
+  GHashTableIter  iter;
+  GArray         *blocks;
+  guint32         first_block;
+  guint           n;
+
+  terminal_return_if_fail (index != NULL);
+
+  if (first_row <= index->first_row)
+    return;
+
+  if (first_row >= index->end_row)
+    {
+      terminal_search_index_reset (index, first_row);
+      return;
+    }
+
+  index->first_row = first_row;
+
+  /* lookups skip the old blocks, remove them once in a while */
+  first_block = BLOCK_OF_ROW (first_row);
+  if (first_block - index->trimmed_block < TRIM_BLOCKS)
+    return;
+
+  g_hash_table_iter_init (&iter, index->trigrams);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer) &blocks))
+    {
+      for (n = 0; n < blocks->len && g_array_index (blocks, guint32, n) < first_block; n++);
+
+      if (n == blocks->len)
+        g_hash_table_iter_remove (&iter);
+      else if (n > 0)
+        g_array_remove_range (blocks, 0, n);
+    }
+
+  index->trimmed_block = first_block;
+}
+
+
+
+/**
+ * terminal_search_index_lookup:
+ * @index   : A #TerminalSearchIndex.
+ * @pattern : A regular expression.
+ *
+ * Finds the blocks of rows that can contain a match of @pattern. Rows
+ * outside the indexed range are not covered.
+ *
+ * Return value : Ascending array of guint32 block numbers, free with
+ *                g_array_free(), or %NULL if @pattern has no literal
+ *                parts long enough to use the index.
+ **/
+GArray *
+terminal_search_index_lookup (TerminalSearchIndex *index,
+                              const gchar         *pattern)
+{
+  GPtrArray   *runs;
+  GPtrArray   *postings;
+  GHashTable  *seen;
+  GArray      *blocks;
+  GArray      *result = NULL;
+  const gchar *p;
+  gpointer     trigram;
+  guint32      first_block;
+  guint32      block;
+  guint        n, i;
+
+  terminal_return_val_if_fail (index != NULL, NULL);
+  terminal_return_val_if_fail (pattern != NULL, NULL);
+
+  runs = g_ptr_array_new_with_free_func (g_free);
+  if (!terminal_search_index_literals (pattern, runs))
+    {
+      g_ptr_array_free (runs, TRUE);
+      return NULL;
+    }
+
+  /* the posting list of each distinct trigram */
+  postings = g_ptr_array_new ();
+  seen = g_hash_table_new (g_direct_hash, g_direct_equal);
+  for (n = 0; n < runs->len; n++)
+    for (p = g_ptr_array_index (runs, n); p[0] != '\0' && p[1] != '\0' && p[2] != '\0'; p++)
+      {
+        trigram = TRIGRAM (p);
+        if (g_hash_table_contains (seen, trigram))
+          continue;
+        g_hash_table_add (seen, trigram);
+
+        blocks = g_hash_table_lookup (index->trigrams, trigram);
+        if (blocks == NULL)
+          {
+            /* this trigram was never seen, nothing can match */
+            result = g_array_new (FALSE, FALSE, sizeof (guint32));
+            goto done;
+          }
+
+        g_ptr_array_add (postings, blocks);
+      }
+
+  if (postings->len == 0)
+    goto done;
+
+  /* start with the rarest trigram, keep the blocks the others have too */
+  g_ptr_array_sort (postings, terminal_search_index_compare_length);
+
+  first_block = BLOCK_OF_ROW (index->first_row);
+  blocks = g_ptr_array_index (postings, 0);
+  result = g_array_sized_new (FALSE, FALSE, sizeof (guint32), blocks->len);
+  for (n = 0; n < blocks->len; n++)
+    {
+      block = g_array_index (blocks, guint32, n);
+      if (block < first_block)
+        continue;
+
+      for (i = 1; i < postings->len; i++)
+        if (!terminal_search_index_contains (g_ptr_array_index (postings, i), block))
+          break;
+
+      if (i == postings->len)
+        g_array_append_val (result, block);
+    }
+
+done:
+  g_hash_table_destroy (seen);
+  g_ptr_array_free (postings, TRUE);
+  g_ptr_array_free (runs, TRUE);
+
+  return result;
+}
@@ -0,0 +1,50 @@
+/*-
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TERMINAL_SEARCH_INDEX_H
+#define TERMINAL_SEARCH_INDEX_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* rows per block, the index knows in which blocks a trigram occurs */
+#define TERMINAL_SEARCH_INDEX_BLOCK_ROWS (16)
+
+typedef struct _TerminalSearchIndex TerminalSearchIndex;
+
+TerminalSearchIndex *terminal_search_index_new           (void);
+
+void                 terminal_search_index_free          (TerminalSearchIndex *index);
+
+void                 terminal_search_index_reset         (TerminalSearchIndex *index,
+                                                          glong                row);
+
+glong                terminal_search_index_get_first_row (TerminalSearchIndex *index);
+
+glong                terminal_search_index_get_end_row   (TerminalSearchIndex *index);
+
+void                 terminal_search_index_add_row       (TerminalSearchIndex *index,
+                                                          const gchar         *text);
+
+void                 terminal_search_index_trim          (TerminalSearchIndex *index,
+                                                          glong                first_row);
+
+GArray              *terminal_search_index_lookup        (TerminalSearchIndex *index,
+                                                          const gchar         *pattern);
+
+G_END_DECLS
+
+#endif /* !TERMINAL_SEARCH_INDEX_H */
@@ -0,0 +1,576 @@
+/*-
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_SIGNAL_H
+#include <signal.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include <terminal/terminal-shell-pool.h>
+#include <terminal/terminal-preferences.h>
+#include <terminal/terminal-screen.h>
+#include <terminal/terminal-spawn-helper.h>
+#include <terminal/terminal-private.h>
+
+typedef struct _TerminalShellPoolEntry TerminalShellPoolEntry;
+
+
+
+static void     terminal_shell_pool_finalize      (GObject                *object);
+static void     terminal_shell_pool_notify        (TerminalShellPool      *pool,
+                                                   GParamSpec             *pspec);
+static void     terminal_shell_pool_update_size   (TerminalShellPool      *pool);
+static guint    terminal_shell_pool_count         (TerminalShellPool      *pool,
+                                                   const gchar            *directory);
+static void     terminal_shell_pool_set_directory (TerminalShellPool      *pool,
+                                                   const gchar            *directory);
+static void     terminal_shell_pool_discard       (TerminalShellPool      *pool,
+                                                   const gchar            *keep_directory,
+                                                   guint                   keep_count);
+static void     terminal_shell_pool_hang_up       (TerminalShellPool      *pool,
+                                                   GList                  *link);
+static void     terminal_shell_pool_schedule      (TerminalShellPool      *pool);
+static gboolean terminal_shell_pool_fill          (gpointer                user_data);
+static void     terminal_shell_pool_fill_destroy  (gpointer                user_data);
+static gboolean terminal_shell_pool_spawn         (TerminalShellPool      *pool,
+                                                   GError                **error);
+static void     terminal_shell_pool_spawned       (VtePty                 *pty,
+                                                   GPid                    pid,
+                                                   GError                 *error,
+                                                   gpointer                user_data);
+static void     terminal_shell_pool_child_exited  (GPid                    pid,
+                                                   gint                    status,
+                                                   gpointer                user_data);
+
+
+
+struct _TerminalShellPoolClass
+{
+  GObjectClass parent_class;
+};
+
+struct _TerminalShellPool
+{
+  GObject              parent_instance;
+  TerminalPreferences *preferences;
+
+  /* idle shells and the ones the spawn helper is starting, oldest first */
+  GQueue               entries;
+  guint                size;
+
+  /* the directory new shells are started in, this is the
+   * directory of the last tab that asked for a shell */
+  gchar               *directory;
+
+  /* shells to keep ready in directory: all of the pool after a tab
+   * used one from there, only one after a tab found none, so tabs
+   * that all open in other directories do not spawn unused shells */
+  guint                target;
+
+  guint                fill_id;
+
+  /* spawning failed, do not retry until something changed */
+  guint                spawn_failed : 1;
+};
+
+struct _TerminalShellPoolEntry
+{
+  /* NULL once the entry is no longer in the pool, the
+   * child watch frees the entry when the shell exits */
+  TerminalShellPool   *pool;
+
+  VtePty              *pty;
+  GPid                 pid;
+  gchar               *directory;
+};
+
+
+
+/* preferences that change the shell or the environment of the children */
+static const gchar *invalidate_properties[] =
+{
+  "command-login-shell",
+  "run-custom-command",
+  "custom-command",
+  "use-default-working-dir",
+  "default-working-dir",
+};
+
+
+
+G_DEFINE_TYPE (TerminalShellPool, terminal_shell_pool, G_TYPE_OBJECT)
+
+
+
+static void
+terminal_shell_pool_class_init (TerminalShellPoolClass *klass)
+{
+  GObjectClass *gobject_class;
+
+  gobject_class = G_OBJECT_CLASS (klass);
+  gobject_class->finalize = terminal_shell_pool_finalize;
+}
+
+
+
+static void
+terminal_shell_pool_init (TerminalShellPool *pool)
+{
+  gboolean  use_default_dir;
+  gchar    *default_dir;
+
+  g_queue_init (&pool->entries);
+
+  pool->preferences = terminal_preferences_get ();
+  g_object_get (G_OBJECT (pool->preferences),
+                "use-default-working-dir", &use_default_dir,
+                "default-working-dir", &default_dir,
+                NULL);
+  terminal_shell_pool_update_size (pool);
+  g_signal_connect_swapped (G_OBJECT (pool->preferences), "notify",
+                            G_CALLBACK (terminal_shell_pool_notify), pool);
+
+  /* new windows start in the default or in our own directory */
+  if (use_default_dir && IS_STRING (default_dir))
+    pool->directory = default_dir;
+  else
+    {
+      pool->directory = g_get_current_dir ();
+      g_free (default_dir);
+    }
+
+  terminal_shell_pool_schedule (pool);
+}
+
+
+
+static void
+terminal_shell_pool_finalize (GObject *object)
+{
+  TerminalShellPool *pool = TERMINAL_SHELL_POOL (object);
+
+  if (G_UNLIKELY (pool->fill_id != 0))
+    g_source_remove (pool->fill_id);
+
+  g_signal_handlers_disconnect_by_func (G_OBJECT (pool->preferences),
+                                        G_CALLBACK (terminal_shell_pool_notify), pool);
+  g_object_unref (G_OBJECT (pool->preferences));
+
+  /* hang up the idle shells */
+  terminal_shell_pool_discard (pool, NULL, 0);
+
+  g_free (pool->directory);
+
+  (*G_OBJECT_CLASS (terminal_shell_pool_parent_class)->finalize) (object);
+}
+
+
+
+static void
+terminal_shell_pool_notify (TerminalShellPool *pool,
+                            GParamSpec        *pspec)
+{
+  guint n;
+
+  terminal_return_if_fail (TERMINAL_IS_SHELL_POOL (pool));
+
+  if (strcmp (pspec->name, "misc-shell-pool-size") == 0)
+    {
+      terminal_shell_pool_update_size (pool);
+      terminal_shell_pool_discard (pool, pool->directory, pool->size);
+      terminal_shell_pool_schedule (pool);
+      return;
+    }
+
+  for (n = 0; n < G_N_ELEMENTS (invalidate_properties); n++)
+    if (strcmp (pspec->name, invalidate_properties[n]) == 0)
+      {
+        terminal_shell_pool_invalidate (pool);
+        return;
+      }
+}
+
+
+
+static void
+terminal_shell_pool_update_size (TerminalShellPool *pool)
+{
+  g_object_get (G_OBJECT (pool->preferences), "misc-shell-pool-size", &pool->size, NULL);
+  pool->target = pool->size;
+}
+
+
+
+static guint
+terminal_shell_pool_count (TerminalShellPool *pool,
+                           const gchar       *directory)
+{
+  GList *li;
+  guint  n = 0;
+
+  for (li = pool->entries.head; li != NULL; li = li->next)
+    if (strcmp (((TerminalShellPoolEntry *) li->data)->directory, directory) == 0)
+      n++;
+
+  return n;
+}
+
+
+
+static void
+terminal_shell_pool_set_directory (TerminalShellPool *pool,
+                                   const gchar       *directory)
+{
+  if (g_strcmp0 (pool->directory, directory) == 0)
+    return;
+
+  /* shells for the old directory stay until their room is needed */
+  g_free (pool->directory);
+  pool->directory = g_strdup (directory);
+  pool->spawn_failed = FALSE;
+}
+
+
+
+static void
+terminal_shell_pool_discard (TerminalShellPool *pool,
+                             const gchar       *keep_directory,
+                             guint              keep_count)
+{
+  TerminalShellPoolEntry *entry;
+  GList                  *li, *lnext;
+  guint                   kept = 0;
+
+  for (li = pool->entries.head; li != NULL; li = lnext)
+    {
+      lnext = li->next;
+      entry = li->data;
+
+      if (keep_directory != NULL
+          && kept < keep_count
+          && strcmp (entry->directory, keep_directory) == 0)
+        {
+          kept++;
+          continue;
+        }
+
+      terminal_shell_pool_hang_up (pool, li);
+    }
+}
+
+
+
+static void
+terminal_shell_pool_hang_up (TerminalShellPool *pool,
+                             GList             *link)
+{
+  TerminalShellPoolEntry *entry = link->data;
+
+  /* the child watch releases the entry once the shell is gone, a
+   * shell that is still starting is hung up when it was spawned */
+  g_queue_delete_link (&pool->entries, link);
+  entry->pool = NULL;
+  if (entry->pid > 0)
+    kill (entry->pid, SIGHUP);
+}
+
+
+
+static void
+terminal_shell_pool_schedule (TerminalShellPool *pool)
+{
+  if (pool->fill_id == 0
+      && !pool->spawn_failed
+      && terminal_shell_pool_count (pool, pool->directory) < pool->target)
+    {
+      pool->fill_id = g_idle_add_full (G_PRIORITY_LOW, terminal_shell_pool_fill,
+                                       pool, terminal_shell_pool_fill_destroy);
+    }
+}
+
+
+
+static gboolean
+terminal_shell_pool_fill (gpointer user_data)
+{
+  TerminalShellPool      *pool = TERMINAL_SHELL_POOL (user_data);
+  GList                  *li;
+  GError                 *error = NULL;
+
+  if (terminal_shell_pool_count (pool, pool->directory) >= pool->target)
+    return FALSE;
+
+  /* make room by hanging up the oldest shell of another directory */
+  if (pool->entries.length >= pool->size)
+    {
+      for (li = pool->entries.head; li != NULL; li = li->next)
+        if (strcmp (((TerminalShellPoolEntry *) li->data)->directory, pool->directory) != 0)
+          break;
+
+      if (li == NULL)
+        return FALSE;
+
+      terminal_shell_pool_hang_up (pool, li);
+    }
+
+  /* request one shell per iteration, the spawn helper forks them */
+  if (!terminal_shell_pool_spawn (pool, &error))
+    {
+#ifdef G_ENABLE_DEBUG
+      g_debug ("Failed to spawn a shell for the pool: %s", error->message);
+#endif
+      g_error_free (error);
+      pool->spawn_failed = TRUE;
+      return FALSE;
+    }
+
+  return terminal_shell_pool_count (pool, pool->directory) < pool->target;
+}
+
+
+
+static void
+terminal_shell_pool_fill_destroy (gpointer user_data)
+{
+  TERMINAL_SHELL_POOL (user_data)->fill_id = 0;
+}
+
+
+
+static gboolean
+terminal_shell_pool_spawn (TerminalShellPool  *pool,
+                           GError            **error)
+{
+  TerminalShellPoolEntry *entry;
+  VtePty                 *pty;
+  gchar                  *command;
+  gchar                 **argv;
+  gchar                 **env;
+  gboolean                succeed;
+
+  if (!terminal_screen_get_shell_command (pool->preferences, &command, &argv, error))
+    return FALSE;
+
+  pty = vte_pty_new_sync (VTE_PTY_DEFAULT, NULL, error);
+  if (G_UNLIKELY (pty == NULL))
+    {
+      g_strfreev (argv);
+      g_free (command);
+      return FALSE;
+    }
+
+  /* same environment as a tab, except for the window specific variables */
+  env = terminal_screen_get_shell_environment (pool->directory);
+
+  entry = g_slice_new0 (TerminalShellPoolEntry);
+  entry->pool = pool;
+  entry->pty = pty;
+  entry->directory = g_strdup (pool->directory);
+
+  /* only through the spawn helper, forking the server in the main
+   * loop is what the pool is there to avoid */
+  succeed = terminal_spawn_helper_spawn_pty_async (pty, pool->directory, command, argv, env,
+                                                   terminal_shell_pool_child_exited,
+                                                   terminal_shell_pool_spawned, entry);
+
+  g_strfreev (argv);
+  terminal_screen_free_environment (env);
+  g_free (command);
+
+  if (G_UNLIKELY (!succeed))
+    {
+      g_set_error_literal (error, G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED,
+                           "The spawn helper is not running");
+      g_object_unref (G_OBJECT (pty));
+      g_free (entry->directory);
+      g_slice_free (TerminalShellPoolEntry, entry);
+      return FALSE;
+    }
+
+  /* counted for the directory while it starts, pid is 0 until then */
+  g_queue_push_tail (&pool->entries, entry);
+
+  return TRUE;
+}
+
+
+
+static void
+terminal_shell_pool_spawned (VtePty   *pty,
+                             GPid      pid,
+                             GError   *error,
+                             gpointer  user_data)
+{
+  TerminalShellPoolEntry *entry = user_data;
+  TerminalShellPool      *pool = entry->pool;
+
+  if (pid > 0)
+    {
+      /* the child watch releases the entry from now on */
+      entry->pid = pid;
+      if (pool == NULL)
+        kill (pid, SIGHUP);
+      return;
+    }
+
+  if (pool != NULL)
+    {
+#ifdef G_ENABLE_DEBUG
+      g_debug ("Failed to spawn a shell for the pool: %s", error->message);
+#endif
+      g_queue_remove (&pool->entries, entry);
+      pool->spawn_failed = TRUE;
+    }
+
+  g_object_unref (G_OBJECT (entry->pty));
+  g_free (entry->directory);
+  g_slice_free (TerminalShellPoolEntry, entry);
+}
+
+
+
+static void
+terminal_shell_pool_child_exited (GPid     pid,
+                                  gint     status,
+                                  gpointer user_data)
+{
+  TerminalShellPoolEntry *entry = user_data;
+  TerminalShellPool      *pool = entry->pool;
+
+  /* an idle shell died on its own, replace it */
+  if (pool != NULL)
+    {
+      g_queue_remove (&pool->entries, entry);
+      terminal_shell_pool_schedule (pool);
+    }
+
+  g_object_unref (G_OBJECT (entry->pty));
+  g_free (entry->directory);
+  g_slice_free (TerminalShellPoolEntry, entry);
+}
+
+
+
+/**
+ * terminal_shell_pool_get:
+ *
+ * Return value : The #TerminalShellPool of the application. Release
+ *                with g_object_unref() when no longer used.
+ **/
+TerminalShellPool *
+terminal_shell_pool_get (void)
+{
+  static TerminalShellPool *pool = NULL;
+
+  if (G_UNLIKELY (pool == NULL))
+    {
+      pool = g_object_new (TERMINAL_TYPE_SHELL_POOL, NULL);
+      g_object_add_weak_pointer (G_OBJECT (pool), (gpointer) &pool);
+    }
+  else
+    {
+      g_object_ref (G_OBJECT (pool));
+    }
+
+  return pool;
+}
+
+
+
+/**
+ * terminal_shell_pool_take:
+ * @pool      : A #TerminalShellPool.
+ * @directory : The working directory of the new tab.
+ * @pty       : Return location for the #VtePty of the shell.
+ * @pid       : Return location for the process id of the shell.
+ *
+ * Takes an idle shell that was started in @directory out of the
+ * pool. The caller owns the reference on @pty and watches @pid with
+ * terminal_spawn_helper_watch(), the shell is a child of the spawn
+ * helper. The pool is refilled in the background.
+ *
+ * Return value: %TRUE if a shell was returned.
+ **/
+gboolean
+terminal_shell_pool_take (TerminalShellPool  *pool,
+                          const gchar        *directory,
+                          VtePty            **pty,
+                          GPid               *pid)
+{
+  TerminalShellPoolEntry *entry = NULL;
+  GList                  *li;
+
+  terminal_return_val_if_fail (TERMINAL_IS_SHELL_POOL (pool), FALSE);
+  terminal_return_val_if_fail (pty != NULL && pid != NULL, FALSE);
+
+  if (pool->size == 0 || directory == NULL)
+    return FALSE;
+
+  /* follow the tab, the next shells are started where it was opened */
+  terminal_shell_pool_set_directory (pool, directory);
+
+  for (li = pool->entries.head; li != NULL; li = li->next)
+    if (((TerminalShellPoolEntry *) li->data)->pid > 0
+        && strcmp (((TerminalShellPoolEntry *) li->data)->directory, directory) == 0)
+      {
+        entry = li->data;
+        g_queue_delete_link (&pool->entries, li);
+        break;
+      }
+
+  /* refill completely only for a directory tabs are opened in again */
+  pool->target = entry != NULL ? pool->size : MIN (pool->size, 1);
+  terminal_shell_pool_schedule (pool);
+
+  if (entry == NULL)
+    return FALSE;
+
+  /* the new owner watches the child from now on */
+  terminal_spawn_helper_unwatch (entry->pid, entry);
+
+  *pty = entry->pty;
+  *pid = entry->pid;
+
+  g_free (entry->directory);
+  g_slice_free (TerminalShellPoolEntry, entry);
+
+  return TRUE;
+}
+
+
+
+/**
+ * terminal_shell_pool_invalidate:
+ * @pool : A #TerminalShellPool.
+ *
+ * Hangs up all idle shells and starts new ones, used when
+ * preferences that affect the shell or its environment changed.
+ **/
+void
+terminal_shell_pool_invalidate (TerminalShellPool *pool)
+{
+  terminal_return_if_fail (TERMINAL_IS_SHELL_POOL (pool));
+
+  terminal_shell_pool_discard (pool, NULL, 0);
+
+  pool->spawn_failed = FALSE;
+  terminal_shell_pool_schedule (pool);
+}
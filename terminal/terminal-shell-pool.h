@@ -0,0 +1,46 @@
+/*-
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TERMINAL_SHELL_POOL_H
+#define TERMINAL_SHELL_POOL_H
+
+#include <vte/vte.h>
+
+G_BEGIN_DECLS
+
+#define TERMINAL_TYPE_SHELL_POOL            (terminal_shell_pool_get_type ())
+#define TERMINAL_SHELL_POOL(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), TERMINAL_TYPE_SHELL_POOL, TerminalShellPool))
+#define TERMINAL_SHELL_POOL_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass), TERMINAL_TYPE_SHELL_POOL, TerminalShellPoolClass))
+#define TERMINAL_IS_SHELL_POOL(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), TERMINAL_TYPE_SHELL_POOL))
+#define TERMINAL_IS_SHELL_POOL_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), TERMINAL_TYPE_SHELL_POOL))
+#define TERMINAL_SHELL_POOL_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), TERMINAL_TYPE_SHELL_POOL, TerminalShellPoolClass))
+
+typedef struct _TerminalShellPoolClass TerminalShellPoolClass;
+typedef struct _TerminalShellPool      TerminalShellPool;
+
+GType              terminal_shell_pool_get_type   (void) G_GNUC_CONST;
+
+TerminalShellPool *terminal_shell_pool_get        (void);
+
+gboolean           terminal_shell_pool_take       (TerminalShellPool  *pool,
+                                                   const gchar        *directory,
+                                                   VtePty            **pty,
+                                                   GPid               *pid);
+
+void               terminal_shell_pool_invalidate (TerminalShellPool  *pool);
+
+G_END_DECLS
+
+#endif /* !TERMINAL_SHELL_POOL_H */
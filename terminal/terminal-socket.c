@@ -0,0 +1,566 @@
+/*-
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The launch socket is a fast path next to the D-Bus service: a client
+ * that finds the abstract socket of a running server hands its arguments
+ * over with a single write, without connecting to the session bus.
+ *
+ * Both the request and the reply are a 32 bit big endian length followed
+ * by a serialized GVariant. The request has the same "(uayaay)" format as
+ * the arguments of the D-Bus Launch method, the reply is "(bis)" with
+ * success, error code and error message. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <gio/gio.h>
+#include <gio/gunixsocketaddress.h>
+
+#include <terminal/terminal-config.h>
+#include <terminal/terminal-gdbus.h>
+#include <terminal/terminal-socket.h>
+#include <terminal/terminal-private.h>
+
+/* the argument list is small, refuse anything bigger than this */
+#define MAX_MESSAGE_SIZE (256 * 1024)
+
+/* same as the timeout of the D-Bus call */
+#define CLIENT_TIMEOUT   (2)
+
+/* a client has to send its message within this many seconds */
+#define READ_TIMEOUT     (5)
+
+/* connections read at the same time, more are closed right away */
+#define MAX_CLIENTS      (16)
+
+
+
+typedef struct _TerminalSocketClient TerminalSocketClient;
+
+
+
+static void terminal_socket_client_read          (TerminalSocketClient *client);
+static void terminal_socket_client_read_finished (GObject              *source,
+                                                  GAsyncResult         *result,
+                                                  gpointer              user_data);
+
+
+
+struct _TerminalSocketClient
+{
+  TerminalApp       *app;
+  GSocketConnection *connection;
+
+  /* cancels the read when the client takes too long */
+  GCancellable      *cancellable;
+  guint              timeout_id;
+
+  /* message size in big endian, followed by the message */
+  guint32            header;
+  gchar             *message;
+  gsize              length;
+  gsize              offset;
+};
+
+
+
+static guint socket_n_clients = 0;
+
+
+
+static GSocketAddress *
+terminal_socket_address (void)
+{
+  GSocketAddress *address;
+  gchar          *display_name;
+  gchar          *name;
+
+  /* one socket per user and display, like the D-Bus checks */
+  display_name = terminal_gdbus_display_name ();
+  name = g_strdup_printf ("%s-%u-%s", TERMINAL_SOCKET_NAME,
+                          (guint) getuid (), display_name);
+  address = g_unix_socket_address_new_with_type (name, -1, G_UNIX_SOCKET_ADDRESS_ABSTRACT);
+  g_free (display_name);
+  g_free (name);
+
+  return address;
+}
+
+
+
+static gboolean
+terminal_socket_uid_matches (GSocket *socket)
+{
+  GCredentials *credentials;
+  gboolean      matches;
+
+  /* the abstract namespace has no file permissions, so check who
+   * is at the other end before trusting it */
+  credentials = g_socket_get_credentials (socket, NULL);
+  if (credentials == NULL)
+    return FALSE;
+
+  matches = g_credentials_get_unix_user (credentials, NULL) == getuid ();
+  g_object_unref (G_OBJECT (credentials));
+
+  return matches;
+}
+
+
+
+static gboolean
+terminal_socket_client_timeout (gpointer user_data)
+{
+  TerminalSocketClient *client = user_data;
+
+  /* the pending read finishes with an error and frees the client */
+  client->timeout_id = 0;
+  g_cancellable_cancel (client->cancellable);
+
+  return FALSE;
+}
+
+
+
+static void
+terminal_socket_client_free (TerminalSocketClient *client)
+{
+  socket_n_clients--;
+
+  if (client->timeout_id != 0)
+    g_source_remove (client->timeout_id);
+  g_object_unref (G_OBJECT (client->cancellable));
+  g_io_stream_close (G_IO_STREAM (client->connection), NULL, NULL);
+  g_object_unref (G_OBJECT (client->connection));
+  g_object_unref (G_OBJECT (client->app));
+  g_free (client->message);
+  g_slice_free (TerminalSocketClient, client);
+}
+
+
+
+static void
+terminal_socket_client_reply (TerminalSocketClient *client,
+                              const GError         *error)
+{
+  GVariant      *reply;
+  GOutputStream *stream;
+  gchar         *buffer;
+  guint32        length;
+
+  reply = g_variant_ref_sink (g_variant_new ("(bis)", error == NULL,
+                                             error != NULL ? error->code : 0,
+                                             error != NULL ? error->message : ""));
+
+  length = g_variant_get_size (reply);
+  buffer = g_malloc (sizeof (length) + length);
+  *((guint32 *) buffer) = GUINT32_TO_BE (length);
+  g_variant_store (reply, buffer + sizeof (length));
+
+  /* the reply is tiny and fits in the socket buffer, so this does
+   * not block on a client that stopped reading */
+  stream = g_io_stream_get_output_stream (G_IO_STREAM (client->connection));
+  g_output_stream_write_all (stream, buffer, sizeof (length) + length, NULL, NULL, NULL);
+
+  g_variant_unref (reply);
+  g_free (buffer);
+}
+
+
+
+static void
+terminal_socket_client_process (TerminalSocketClient *client)
+{
+  GVariant     *message;
+  GError       *error = NULL;
+  guint32       uid;
+  gchar        *display_name = NULL;
+  gchar       **argv = NULL;
+
+  /* the message is not trusted, gvariant validates it while reading */
+  message = g_variant_new_from_data (G_VARIANT_TYPE ("(uayaay)"),
+                                     client->message, client->length,
+                                     FALSE, g_free, client->message);
+  client->message = NULL;
+
+  g_variant_get (g_variant_ref_sink (message), "(u^ay^aay)", &uid, &display_name, &argv);
+  terminal_gdbus_process_launch (client->app, uid, display_name, argv, &error);
+  g_variant_unref (message);
+
+  terminal_socket_client_reply (client, error);
+
+  if (error != NULL)
+    g_error_free (error);
+  g_free (display_name);
+  g_strfreev (argv);
+}
+
+
+
+static void
+terminal_socket_client_read (TerminalSocketClient *client)
+{
+  GInputStream *stream;
+  gchar        *buffer;
+  gsize         size;
+
+  if (client->message == NULL)
+    {
+      buffer = (gchar *) &client->header;
+      size = sizeof (client->header);
+    }
+  else
+    {
+      buffer = client->message;
+      size = client->length;
+    }
+
+  stream = g_io_stream_get_input_stream (G_IO_STREAM (client->connection));
+  g_input_stream_read_async (stream, buffer + client->offset, size - client->offset,
+                             G_PRIORITY_DEFAULT, client->cancellable,
+                             terminal_socket_client_read_finished, client);
+}
+
+
+
+static void
+terminal_socket_client_read_finished (GObject      *source,
+                                      GAsyncResult *result,
+                                      gpointer      user_data)
+{
+  TerminalSocketClient *client = user_data;
+  gssize                n;
+
+  n = g_input_stream_read_finish (G_INPUT_STREAM (source), result, NULL);
+  if (G_UNLIKELY (n <= 0))
+    {
+      /* error or the client hung up */
+      terminal_socket_client_free (client);
+      return;
+    }
+
+  client->offset += n;
+
+  if (client->message == NULL)
+    {
+      if (client->offset < sizeof (client->header))
+        {
+          terminal_socket_client_read (client);
+          return;
+        }
+
+      client->length = GUINT32_FROM_BE (client->header);
+      if (G_UNLIKELY (client->length == 0 || client->length > MAX_MESSAGE_SIZE))
+        {
+          terminal_socket_client_free (client);
+          return;
+        }
+
+      /* continue with the message */
+      client->message = g_malloc (client->length);
+      client->offset = 0;
+      terminal_socket_client_read (client);
+    }
+  else if (client->offset < client->length)
+    {
+      terminal_socket_client_read (client);
+    }
+  else
+    {
+      /* the message is complete, do not cancel while processing it */
+      if (client->timeout_id != 0)
+        {
+          g_source_remove (client->timeout_id);
+          client->timeout_id = 0;
+        }
+
+      terminal_socket_client_process (client);
+      terminal_socket_client_free (client);
+    }
+}
+
+
+
+static gboolean
+terminal_socket_incoming (GSocketService    *service,
+                          GSocketConnection *connection,
+                          GObject           *source_object,
+                          gpointer           user_data)
+{
+  TerminalSocketClient *client;
+
+  terminal_return_val_if_fail (TERMINAL_IS_APP (user_data), FALSE);
+
+  /* only read from our own user and only from a few at a time,
+   * other connections are closed when the service drops them */
+  if (socket_n_clients >= MAX_CLIENTS
+      || !terminal_socket_uid_matches (g_socket_connection_get_socket (connection)))
+    {
+      g_io_stream_close (G_IO_STREAM (connection), NULL, NULL);
+      return TRUE;
+    }
+
+  socket_n_clients++;
+
+  client = g_slice_new0 (TerminalSocketClient);
+  client->app = g_object_ref (G_OBJECT (user_data));
+  client->connection = g_object_ref (G_OBJECT (connection));
+  client->cancellable = g_cancellable_new ();
+  client->timeout_id = g_timeout_add_seconds (READ_TIMEOUT, terminal_socket_client_timeout, client);
+
+  terminal_socket_client_read (client);
+
+  return TRUE;
+}
+
+
+
+static gboolean
+terminal_socket_send_all (GSocket      *socket,
+                          const gchar  *buffer,
+                          gsize         size,
+                          GError      **error)
+{
+  gssize n;
+
+  while (size > 0)
+    {
+      n = g_socket_send (socket, buffer, size, NULL, error);
+      if (n < 0)
+        return FALSE;
+
+      buffer += n;
+      size -= n;
+    }
+
+  return TRUE;
+}
+
+
+
+static gboolean
+terminal_socket_receive_all (GSocket  *socket,
+                             gchar    *buffer,
+                             gsize     size,
+                             GError  **error)
+{
+  gssize n;
+
+  while (size > 0)
+    {
+      n = g_socket_receive (socket, buffer, size, NULL, error);
+      if (n < 0)
+        return FALSE;
+
+      if (n == 0)
+        {
+          g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_CLOSED,
+                               "Connection closed by the terminal service");
+          return FALSE;
+        }
+
+      buffer += n;
+      size -= n;
+    }
+
+  return TRUE;
+}
+
+
+
+/**
+ * terminal_socket_register_service:
+ * @app   : A #TerminalApp.
+ * @error : Return location for errors or %NULL.
+ *
+ * Starts listening on the launch socket, this fails if another
+ * server already owns it.
+ *
+ * Return value : %TRUE on success, %FALSE otherwise.
+ **/
+gboolean
+terminal_socket_register_service (TerminalApp  *app,
+                                  GError      **error)
+{
+  GSocketService *service;
+  GSocketAddress *address;
+  gboolean        succeed;
+
+  terminal_return_val_if_fail (TERMINAL_IS_APP (app), FALSE);
+
+  if (!g_unix_socket_address_abstract_names_supported ())
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                           "Abstract socket names are not supported");
+      return FALSE;
+    }
+
+  service = g_socket_service_new ();
+  address = terminal_socket_address ();
+
+  succeed = g_socket_listener_add_address (G_SOCKET_LISTENER (service), address,
+                                           G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT,
+                                           NULL, NULL, error);
+  if (G_LIKELY (succeed))
+    {
+      g_signal_connect (G_OBJECT (service), "incoming",
+                        G_CALLBACK (terminal_socket_incoming), app);
+      g_socket_service_start (service);
+
+      /* keep the service running as long as the application */
+      g_object_set_data_full (G_OBJECT (app), I_("terminal-socket-service"),
+                              service, g_object_unref);
+    }
+  else
+    {
+      g_object_unref (G_OBJECT (service));
+    }
+
+  g_object_unref (G_OBJECT (address));
+
+  return succeed;
+}
+
+
+
+/**
+ * terminal_socket_invoke_launch:
+ * @argc  : Number of arguments in @argv.
+ * @argv  : The arguments for the server.
+ * @error : Return location for errors or %NULL.
+ *
+ * Hands the arguments over to a server listening on the launch socket.
+ * When there is no such server, it belongs to another user or the
+ * arguments cannot be sent, %FALSE is returned without setting @error,
+ * so the caller can fall back to D-Bus. Once they were sent, the server
+ * may open the windows any time, so a missing reply is reported as
+ * %TERMINAL_ERROR_NO_REPLY instead.
+ *
+ * Return value : %TRUE if the server handled the arguments.
+ **/
+gboolean
+terminal_socket_invoke_launch (gint     argc,
+                               gchar  **argv,
+                               GError **error)
+{
+  GSocketAddress *address;
+  GSocket        *socket;
+  GVariant       *message, *reply = NULL;
+  gchar          *display_name;
+  gchar          *buffer;
+  guint32         length;
+  gboolean        succeed = FALSE;
+  gint            code;
+  const gchar    *text;
+
+  terminal_return_val_if_fail (argc == (gint) g_strv_length (argv), FALSE);
+
+  if (!g_unix_socket_address_abstract_names_supported ())
+    return FALSE;
+
+  socket = g_socket_new (G_SOCKET_FAMILY_UNIX, G_SOCKET_TYPE_STREAM,
+                         G_SOCKET_PROTOCOL_DEFAULT, NULL);
+  if (G_UNLIKELY (socket == NULL))
+    return FALSE;
+
+  /* connecting fails right away if no server is listening */
+  address = terminal_socket_address ();
+  if (!g_socket_connect (socket, address, NULL, NULL))
+    {
+      g_object_unref (G_OBJECT (address));
+      g_object_unref (G_OBJECT (socket));
+      return FALSE;
+    }
+
+  g_object_unref (G_OBJECT (address));
+
+  /* do not hand our arguments to a socket someone else took */
+  if (!terminal_socket_uid_matches (socket))
+    {
+      g_object_unref (G_OBJECT (socket));
+      return FALSE;
+    }
+
+  g_socket_set_timeout (socket, CLIENT_TIMEOUT);
+
+  /* send the header and the message with a single write */
+  display_name = terminal_gdbus_display_name ();
+  message = g_variant_ref_sink (g_variant_new ("(u^ay^aay)", (guint32) getuid (),
+                                               display_name, argv));
+  length = g_variant_get_size (message);
+  buffer = g_malloc (sizeof (length) + length);
+  *((guint32 *) buffer) = GUINT32_TO_BE (length);
+  g_variant_store (message, buffer + sizeof (length));
+  g_variant_unref (message);
+  g_free (display_name);
+
+  if (!terminal_socket_send_all (socket, buffer, sizeof (length) + length, NULL))
+    {
+      /* the server went away, let the caller try D-Bus */
+      g_free (buffer);
+      g_object_unref (G_OBJECT (socket));
+      return FALSE;
+    }
+
+  g_free (buffer);
+
+  /* wait for the reply */
+  if (terminal_socket_receive_all (socket, (gchar *) &length, sizeof (length), NULL))
+    {
+      length = GUINT32_FROM_BE (length);
+      if (G_LIKELY (length > 0 && length <= MAX_MESSAGE_SIZE))
+        {
+          buffer = g_malloc (length);
+          if (terminal_socket_receive_all (socket, buffer, length, NULL))
+            {
+              reply = g_variant_new_from_data (G_VARIANT_TYPE ("(bis)"), buffer, length,
+                                               FALSE, g_free, buffer);
+              g_variant_ref_sink (reply);
+            }
+          else
+            {
+              g_free (buffer);
+            }
+        }
+    }
+
+  if (reply != NULL)
+    {
+      g_variant_get (reply, "(bi&s)", &succeed, &code, &text);
+      if (!succeed)
+        g_set_error_literal (error, TERMINAL_ERROR, code, text);
+      g_variant_unref (reply);
+    }
+  else
+    {
+      g_set_error_literal (error, TERMINAL_ERROR, TERMINAL_ERROR_NO_REPLY,
+                           _("The terminal service did not reply to the request"));
+    }
+
+  g_object_unref (G_OBJECT (socket));
+
+  return succeed;
+}
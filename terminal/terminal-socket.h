@@ -0,0 +1,31 @@
+/*-
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TERMINAL_SOCKET_H
+#define TERMINAL_SOCKET_H
+
+#include <terminal/terminal-app.h>
+
+G_BEGIN_DECLS
+
+gboolean  terminal_socket_register_service  (TerminalApp  *app,
+                                             GError      **error);
+gboolean  terminal_socket_invoke_launch     (gint          argc,
+                                             gchar       **argv,
+                                             GError      **error);
+
+G_END_DECLS
+
+#endif /* !TERMINAL_SOCKET_H */
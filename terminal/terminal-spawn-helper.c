@@ -0,0 +1,1026 @@
+/*-
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The spawn helper is a small process that is forked from the server
+ * before Gtk+ is initialized. Children are forked from the helper, so
+ * the cost of fork() does not grow with the memory of the server, which
+ * is mostly scrollback.
+ *
+ * A request is a header with the payload size and the number of arguments
+ * and environment variables, followed by the working directory, the
+ * command, the arguments and the environment as nul-terminated strings.
+ * The pty master is passed along with the header. The helper replies
+ * once the child executed its command or failed to, and later reports
+ * the exit status of the child, because only the helper can wait for it.
+ * Should the helper die, its children are reported as exited with status
+ * 0 once they are gone.
+ * The server does not wait for the reply, so the requests for all tabs
+ * of a window are in flight at the same time.
+ *
+ * The helper itself only uses plain POSIX calls, it is forked from a
+ * process that may already run GLib threads. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_SIGNAL_H
+#include <signal.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <glib-unix.h>
+#include <libxfce4util/libxfce4util.h>
+
+#include <terminal/terminal-spawn-helper.h>
+#include <terminal/terminal-private.h>
+
+/* the environment can be large, but not this large */
+#define MAX_REQUEST_SIZE (1024 * 1024)
+
+/* how often children are looked for after the helper is gone, in seconds */
+#define ORPHAN_INTERVAL (1)
+
+/* the helper does not want to die on a closed socket either */
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+
+
+typedef struct _HelperRequest HelperRequest;
+typedef struct _HelperReply   HelperReply;
+typedef struct _HelperWatch   HelperWatch;
+typedef struct _HelperPending HelperPending;
+
+
+
+extern char **environ;
+
+
+
+static void     terminal_spawn_helper_run      (gint             fd) G_GNUC_NORETURN;
+static gboolean terminal_spawn_helper_readable (gint             fd,
+                                                GIOCondition     condition,
+                                                gpointer         user_data);
+static void     terminal_spawn_helper_stop     (void);
+static gboolean terminal_spawn_helper_orphans  (gpointer         user_data);
+
+
+
+enum
+{
+  HELPER_SPAWNED,
+  HELPER_EXITED
+};
+
+struct _HelperRequest
+{
+  guint32 size;
+  guint32 argc;
+  guint32 envc;
+};
+
+struct _HelperReply
+{
+  gint32  kind;
+  gint32  pid;
+
+  /* errno if spawning failed, the wait status for exits */
+  gint32  value;
+};
+
+struct _HelperWatch
+{
+  GChildWatchFunc          func;
+  gpointer                 user_data;
+};
+
+struct _HelperPending
+{
+  /* the VteTerminal for callback, the VtePty for pty_callback */
+  GObject                    *object;
+  gchar                      *command;
+  GChildWatchFunc             exited_func;
+  TerminalSpawnHelperFunc     callback;
+  TerminalSpawnHelperPtyFunc  pty_callback;
+  gpointer                    user_data;
+};
+
+
+
+/* server side */
+static gint        helper_fd = -1;
+static GPid        helper_pid = 0;
+static guint       helper_source_id = 0;
+static guint       helper_orphans_id = 0;
+static GHashTable *helper_watches = NULL;
+static GQueue      helper_pending = G_QUEUE_INIT;
+
+/* helper side */
+static gint        helper_sigchld_pipe[2] = { -1, -1 };
+
+
+
+static gboolean
+terminal_spawn_helper_read_all (gint     fd,
+                                gpointer buffer,
+                                gsize    size)
+{
+  gchar  *p = buffer;
+  gssize  n;
+
+  while (size > 0)
+    {
+      n = read (fd, p, size);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return FALSE;
+
+      p += n;
+      size -= n;
+    }
+
+  return TRUE;
+}
+
+
+
+static gboolean
+terminal_spawn_helper_write_all (gint          fd,
+                                 gconstpointer buffer,
+                                 gsize         size)
+{
+  const gchar *p = buffer;
+  gssize       n;
+
+  while (size > 0)
+    {
+      n = send (fd, p, size, SEND_FLAGS);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return FALSE;
+
+      p += n;
+      size -= n;
+    }
+
+  return TRUE;
+}
+
+
+
+static void
+terminal_spawn_helper_set_cloexec (gint fd)
+{
+  fcntl (fd, F_SETFD, fcntl (fd, F_GETFD) | FD_CLOEXEC);
+}
+
+
+
+static void
+terminal_spawn_helper_sigchld (gint signum)
+{
+  gint  saved_errno = errno;
+  gchar c = 0;
+
+  /* wake up the poll() of the helper, it reaps the children */
+  if (write (helper_sigchld_pipe[1], &c, 1) < 0)
+    {
+      /* the pipe is full, the helper wakes up anyway */
+    }
+
+  errno = saved_errno;
+}
+
+
+
+static void G_GNUC_NORETURN
+terminal_spawn_helper_exec (gint          master,
+                            const gchar  *directory,
+                            const gchar  *command,
+                            gchar       **argv,
+                            gchar       **envp,
+                            gint          error_fd)
+{
+  sigset_t     set;
+  const gchar *slave_name;
+  gint         slave;
+  gint         saved_errno;
+
+  /* undo the signal setup of the helper */
+  signal (SIGCHLD, SIG_DFL);
+  signal (SIGPIPE, SIG_DFL);
+  sigemptyset (&set);
+  sigprocmask (SIG_SETMASK, &set, NULL);
+
+  /* new session with the pty as controlling terminal, this is
+   * what vte_pty_child_setup() does for children of the server */
+  if (setsid () < 0)
+    goto failed;
+
+  slave_name = ptsname (master);
+  if (slave_name == NULL)
+    goto failed;
+
+  slave = open (slave_name, O_RDWR);
+  if (slave < 0)
+    goto failed;
+
+#ifdef TIOCSCTTY
+  if (ioctl (slave, TIOCSCTTY, 0) < 0)
+    goto failed;
+#endif
+
+  if (dup2 (slave, STDIN_FILENO) < 0
+      || dup2 (slave, STDOUT_FILENO) < 0
+      || dup2 (slave, STDERR_FILENO) < 0)
+    goto failed;
+
+  if (slave > STDERR_FILENO)
+    close (slave);
+  close (master);
+
+  if (*directory != '\0' && chdir (directory) < 0)
+    goto failed;
+
+  environ = envp;
+  execvp (command, argv);
+
+failed:
+  /* tell the helper why, the pipe is closed on a successful exec */
+  saved_errno = errno;
+  if (write (error_fd, &saved_errno, sizeof (saved_errno)) < 0)
+    {
+      /* nothing we can do */
+    }
+
+  _exit (127);
+}
+
+
+
+static void
+terminal_spawn_helper_reap (gint fd)
+{
+  HelperReply reply;
+  gchar       buffer[64];
+  pid_t       pid;
+  gint        status;
+
+  /* empty the wake up pipe */
+  while (read (helper_sigchld_pipe[0], buffer, sizeof (buffer)) > 0)
+    ;
+
+  while ((pid = waitpid (-1, &status, WNOHANG)) > 0)
+    {
+      reply.kind = HELPER_EXITED;
+      reply.pid = pid;
+      reply.value = status;
+      terminal_spawn_helper_write_all (fd, &reply, sizeof (reply));
+    }
+}
+
+
+
+static gboolean
+terminal_spawn_helper_handle (gint fd)
+{
+  HelperRequest    request;
+  HelperReply      reply;
+  struct msghdr    msg;
+  struct iovec     iov;
+  struct cmsghdr  *cmsg;
+  union
+  {
+    struct cmsghdr hdr;
+    gchar          buf[CMSG_SPACE (sizeof (gint))];
+  }                control;
+  gssize           n;
+  gint             master = -1;
+  gchar           *payload = NULL;
+  gchar           *end;
+  gchar           *p;
+  gchar          **strings = NULL;
+  gchar          **argv = NULL;
+  gchar          **envp = NULL;
+  guint32          i;
+  gint             error_pipe[2];
+  gint             child_errno;
+  pid_t            pid;
+  gboolean         succeed = FALSE;
+
+  memset (&msg, 0, sizeof (msg));
+  iov.iov_base = &request;
+  iov.iov_len = sizeof (request);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof (control.buf);
+
+  do
+    n = recvmsg (fd, &msg, 0);
+  while (n < 0 && errno == EINTR);
+
+  /* the server closed the socket */
+  if (n <= 0)
+    return FALSE;
+
+  for (cmsg = CMSG_FIRSTHDR (&msg); cmsg != NULL; cmsg = CMSG_NXTHDR (&msg, cmsg))
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+      memcpy (&master, CMSG_DATA (cmsg), sizeof (master));
+
+  if (master < 0)
+    goto out;
+  terminal_spawn_helper_set_cloexec (master);
+
+  if ((gsize) n < sizeof (request)
+      && !terminal_spawn_helper_read_all (fd, (gchar *) &request + n, sizeof (request) - n))
+    goto out;
+
+  if (request.size > MAX_REQUEST_SIZE
+      || request.argc == 0
+      || request.argc + request.envc + 2 > request.size)
+    goto out;
+
+  payload = malloc (request.size + 1);
+  strings = malloc ((request.argc + request.envc + 2) * sizeof (gchar *));
+  argv = malloc ((request.argc + 1) * sizeof (gchar *));
+  envp = malloc ((request.envc + 1) * sizeof (gchar *));
+  if (payload == NULL || strings == NULL || argv == NULL || envp == NULL
+      || !terminal_spawn_helper_read_all (fd, payload, request.size))
+    goto out;
+
+  /* directory, command, arguments and environment */
+  payload[request.size] = '\0';
+  end = payload + request.size;
+  for (i = 0, p = payload; i < request.argc + request.envc + 2; i++)
+    {
+      if (p >= end)
+        goto out;
+      strings[i] = p;
+      p += strlen (p) + 1;
+    }
+
+  memcpy (argv, strings + 2, request.argc * sizeof (gchar *));
+  argv[request.argc] = NULL;
+  memcpy (envp, strings + 2 + request.argc, request.envc * sizeof (gchar *));
+  envp[request.envc] = NULL;
+
+  reply.kind = HELPER_SPAWNED;
+  reply.pid = -1;
+
+  if (pipe (error_pipe) < 0)
+    {
+      reply.value = errno;
+    }
+  else
+    {
+      terminal_spawn_helper_set_cloexec (error_pipe[0]);
+      terminal_spawn_helper_set_cloexec (error_pipe[1]);
+
+      pid = fork ();
+      if (pid == 0)
+        terminal_spawn_helper_exec (master, strings[0], strings[1], argv, envp, error_pipe[1]);
+
+      close (error_pipe[1]);
+
+      if (pid < 0)
+        {
+          reply.value = errno;
+        }
+      else if (terminal_spawn_helper_read_all (error_pipe[0], &child_errno, sizeof (child_errno)))
+        {
+          /* the child failed before exec, collect it here so the
+           * exit is not reported to the server */
+          while (waitpid (pid, NULL, 0) < 0 && errno == EINTR)
+            ;
+          reply.value = child_errno;
+        }
+      else
+        {
+          reply.pid = pid;
+          reply.value = 0;
+        }
+
+      close (error_pipe[0]);
+    }
+
+  succeed = terminal_spawn_helper_write_all (fd, &reply, sizeof (reply));
+
+out:
+  if (master >= 0)
+    close (master);
+  free (payload);
+  free (strings);
+  free (argv);
+  free (envp);
+
+  return succeed;
+}
+
+
+
+static void
+terminal_spawn_helper_run (gint fd)
+{
+  struct sigaction action;
+  struct pollfd    fds[2];
+  sigset_t         set;
+  glong            max_fd;
+  gint             n;
+
+  /* drop the descriptors of the server, like the session bus connection */
+  max_fd = sysconf (_SC_OPEN_MAX);
+  if (max_fd < 0 || max_fd > 4096)
+    max_fd = 4096;
+  for (n = STDERR_FILENO + 1; n < max_fd; n++)
+    if (n != fd)
+      close (n);
+
+  terminal_spawn_helper_set_cloexec (fd);
+
+  if (pipe (helper_sigchld_pipe) < 0)
+    _exit (EXIT_FAILURE);
+  for (n = 0; n < 2; n++)
+    {
+      terminal_spawn_helper_set_cloexec (helper_sigchld_pipe[n]);
+      fcntl (helper_sigchld_pipe[n], F_SETFL, fcntl (helper_sigchld_pipe[n], F_GETFL) | O_NONBLOCK);
+    }
+
+  memset (&action, 0, sizeof (action));
+  action.sa_handler = terminal_spawn_helper_sigchld;
+  action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigemptyset (&action.sa_mask);
+  sigaction (SIGCHLD, &action, NULL);
+
+  /* a gone server is noticed on the next read */
+  signal (SIGPIPE, SIG_IGN);
+
+  sigemptyset (&set);
+  sigprocmask (SIG_SETMASK, &set, NULL);
+
+  for (;;)
+    {
+      fds[0].fd = fd;
+      fds[0].events = POLLIN;
+      fds[0].revents = 0;
+      fds[1].fd = helper_sigchld_pipe[0];
+      fds[1].events = POLLIN;
+      fds[1].revents = 0;
+
+      if (poll (fds, G_N_ELEMENTS (fds), -1) < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          break;
+        }
+
+      if ((fds[1].revents & POLLIN) != 0)
+        terminal_spawn_helper_reap (fd);
+
+      if ((fds[0].revents & (POLLIN | POLLHUP | POLLERR)) != 0
+          && !terminal_spawn_helper_handle (fd))
+        break;
+    }
+
+  /* the children keep running, they are attached to the ptys of the server */
+  _exit (EXIT_SUCCESS);
+}
+
+
+
+static void
+terminal_spawn_helper_watch_free (HelperWatch *watch)
+{
+  g_slice_free (HelperWatch, watch);
+}
+
+
+
+static void
+terminal_spawn_helper_dispatch (GPid pid,
+                                gint status)
+{
+  HelperWatch *watch;
+  HelperWatch  copy;
+
+  watch = g_hash_table_lookup (helper_watches, GINT_TO_POINTER (pid));
+  if (G_LIKELY (watch != NULL))
+    {
+      /* the watch is done, the callback may add a new one */
+      copy = *watch;
+      g_hash_table_remove (helper_watches, GINT_TO_POINTER (pid));
+      (*copy.func) (pid, status, copy.user_data);
+    }
+}
+
+
+
+static void
+terminal_spawn_helper_finish (HelperPending *pending,
+                              GPid           pid,
+                              GError        *error)
+{
+  HelperWatch *watch;
+
+  if (pid > 0)
+    {
+      watch = g_slice_new (HelperWatch);
+      watch->func = pending->exited_func;
+      watch->user_data = pending->user_data;
+      g_hash_table_replace (helper_watches, GINT_TO_POINTER (pid), watch);
+    }
+
+  if (pending->callback != NULL)
+    (*pending->callback) (VTE_TERMINAL (pending->object), pid, error, pending->user_data);
+  else
+    (*pending->pty_callback) (VTE_PTY (pending->object), pid, error, pending->user_data);
+
+  g_object_unref (pending->object);
+  g_free (pending->command);
+  g_slice_free (HelperPending, pending);
+}
+
+
+
+static gboolean
+terminal_spawn_helper_readable (gint         fd,
+                                GIOCondition condition,
+                                gpointer     user_data)
+{
+  HelperReply    reply;
+  HelperPending *pending;
+  GError        *error = NULL;
+
+  if (!terminal_spawn_helper_read_all (fd, &reply, sizeof (reply)))
+    {
+      /* the helper is gone, spawn in the server from now on */
+      helper_source_id = 0;
+      terminal_spawn_helper_stop ();
+      return FALSE;
+    }
+
+  if (reply.kind == HELPER_EXITED)
+    {
+      terminal_spawn_helper_dispatch (reply.pid, reply.value);
+    }
+  else
+    {
+      /* the helper handles the requests in order */
+      pending = g_queue_pop_head (&helper_pending);
+      if (G_UNLIKELY (pending == NULL))
+        return TRUE;
+
+      if (reply.pid < 0)
+        {
+          g_set_error (&error, G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED,
+                       _("Failed to execute child process \"%s\": %s"),
+                       pending->command, g_strerror (reply.value));
+        }
+
+      terminal_spawn_helper_finish (pending, reply.pid, error);
+
+      if (error != NULL)
+        g_error_free (error);
+    }
+
+  return TRUE;
+}
+
+
+
+static void
+terminal_spawn_helper_exited (GPid     pid,
+                              gint     status,
+                              gpointer user_data)
+{
+  g_spawn_close_pid (pid);
+
+  if (pid == helper_pid)
+    helper_pid = 0;
+}
+
+
+
+static void
+terminal_spawn_helper_stop (void)
+{
+  HelperPending *pending;
+  GError        *error;
+
+  if (helper_source_id != 0)
+    {
+      g_source_remove (helper_source_id);
+      helper_source_id = 0;
+    }
+
+  if (helper_fd != -1)
+    {
+      close (helper_fd);
+      helper_fd = -1;
+    }
+
+  /* the children keep running, but only the helper could wait for
+   * them, look for them to be gone instead so their tabs are closed */
+  if (helper_orphans_id == 0 && g_hash_table_size (helper_watches) > 0)
+    helper_orphans_id = g_timeout_add_seconds (ORPHAN_INTERVAL, terminal_spawn_helper_orphans, NULL);
+
+  /* fail the requests without a reply */
+  error = g_error_new_literal (G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED,
+                               _("The spawn helper exited unexpectedly"));
+  while ((pending = g_queue_pop_head (&helper_pending)) != NULL)
+    terminal_spawn_helper_finish (pending, -1, error);
+  g_error_free (error);
+}
+
+
+
+static gboolean
+terminal_spawn_helper_orphans (gpointer user_data)
+{
+  GHashTableIter  iter;
+  gpointer        key;
+  GArray         *gone;
+  GPid            pid;
+  guint           n;
+
+  gone = g_array_new (FALSE, FALSE, sizeof (GPid));
+
+  g_hash_table_iter_init (&iter, helper_watches);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      /* the child was reaped by init, EPERM if the pid is reused */
+      pid = GPOINTER_TO_INT (key);
+      if (kill (pid, 0) < 0)
+        g_array_append_val (gone, pid);
+    }
+
+  /* the exit status was lost with the helper */
+  for (n = 0; n < gone->len; n++)
+    terminal_spawn_helper_dispatch (g_array_index (gone, GPid, n), 0);
+  g_array_free (gone, TRUE);
+
+  if (g_hash_table_size (helper_watches) > 0)
+    return TRUE;
+
+  helper_orphans_id = 0;
+  return FALSE;
+}
+
+
+
+/**
+ * terminal_spawn_helper_start:
+ * @error : Return location for errors or %NULL.
+ *
+ * Forks the spawn helper. Call this early, before the process
+ * allocated a lot of memory, Gtk+ is not initialized yet.
+ *
+ * Return value: %TRUE if the helper is running.
+ **/
+gboolean
+terminal_spawn_helper_start (GError **error)
+{
+  gint  fds[2];
+  pid_t pid;
+  gint  saved_errno;
+
+  terminal_return_val_if_fail (helper_fd == -1, FALSE);
+  terminal_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    goto failed;
+
+  pid = fork ();
+  if (pid < 0)
+    {
+      saved_errno = errno;
+      close (fds[0]);
+      close (fds[1]);
+      errno = saved_errno;
+      goto failed;
+    }
+
+  if (pid == 0)
+    {
+      close (fds[0]);
+      terminal_spawn_helper_run (fds[1]);
+    }
+
+  close (fds[1]);
+
+  helper_fd = fds[0];
+  helper_pid = pid;
+  terminal_spawn_helper_set_cloexec (helper_fd);
+
+  if (helper_watches == NULL)
+    {
+      helper_watches = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                              (GDestroyNotify) terminal_spawn_helper_watch_free);
+    }
+
+  helper_source_id = g_unix_fd_add (helper_fd, G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                    terminal_spawn_helper_readable, NULL);
+  g_child_watch_add (helper_pid, terminal_spawn_helper_exited, NULL);
+
+  return TRUE;
+
+failed:
+  g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+               _("Failed to start the spawn helper: %s"), g_strerror (errno));
+  return FALSE;
+}
+
+
+
+/* sends the request for @command in @pty, the helper is stopped if
+ * that fails; the caller queues the #HelperPending on success */
+static gboolean
+terminal_spawn_helper_send (VtePty       *pty,
+                            const gchar  *working_directory,
+                            const gchar  *command,
+                            gchar       **argv,
+                            gchar       **envp)
+{
+  HelperRequest    request;
+  GString         *payload;
+  struct msghdr    msg;
+  struct iovec     iov;
+  struct cmsghdr  *cmsg;
+  union
+  {
+    struct cmsghdr hdr;
+    gchar          buf[CMSG_SPACE (sizeof (gint))];
+  }                control;
+  gint             master;
+  gssize           n;
+  guint            i;
+  gboolean         succeed;
+
+  /* directory, command, arguments and environment, nul-terminated */
+  payload = g_string_sized_new (4096);
+  if (working_directory != NULL)
+    g_string_append (payload, working_directory);
+  g_string_append_c (payload, '\0');
+  g_string_append_len (payload, command, strlen (command) + 1);
+  for (i = 0; argv[i] != NULL; i++)
+    g_string_append_len (payload, argv[i], strlen (argv[i]) + 1);
+  request.argc = i;
+  for (i = 0; envp != NULL && envp[i] != NULL; i++)
+    g_string_append_len (payload, envp[i], strlen (envp[i]) + 1);
+  request.envc = i;
+  request.size = payload->len;
+
+  /* send the header with the pty master attached */
+  master = vte_pty_get_fd (pty);
+  memset (&msg, 0, sizeof (msg));
+  memset (&control, 0, sizeof (control));
+  iov.iov_base = &request;
+  iov.iov_len = sizeof (request);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof (control.buf);
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (gint));
+  memcpy (CMSG_DATA (cmsg), &master, sizeof (gint));
+
+  do
+    n = sendmsg (helper_fd, &msg, SEND_FLAGS);
+  while (n < 0 && errno == EINTR);
+
+  succeed = (n == sizeof (request)
+             && terminal_spawn_helper_write_all (helper_fd, payload->str, payload->len));
+
+  g_string_free (payload, TRUE);
+
+  /* spawn in the server from now on */
+  if (G_UNLIKELY (!succeed))
+    terminal_spawn_helper_stop ();
+
+  return succeed;
+}
+
+
+
+/**
+ * terminal_spawn_helper_spawn_async:
+ * @terminal          : The #VteTerminal for the child.
+ * @pty_flags         : Flags for the new #VtePty.
+ * @working_directory : The directory to start the child in or %NULL.
+ * @command           : The program to execute, searched in $PATH.
+ * @argv              : The argument vector, starting with argv[0].
+ * @envp              : The environment of the child.
+ * @exited_func       : Called with the wait status when the child exited.
+ * @callback          : Called when the child was started or failed to.
+ * @user_data         : User data for @exited_func and @callback.
+ * @error             : Return location for errors or %NULL.
+ *
+ * Starts @command in a new pty of @terminal through the spawn helper.
+ * The pty is attached to @terminal before the request is sent, so the
+ * child starts with the size of @terminal. @callback receives the
+ * process id of the child or the reason it did not start. vte does not
+ * know about the child, its exit is reported through @exited_func
+ * instead of the "child-exited" signal.
+ *
+ * Return value: %TRUE if @callback is going to be called. On %FALSE
+ *               with @error set the pty could not be created, without
+ *               error the helper is not running and the caller should
+ *               spawn the child itself.
+ **/
+gboolean
+terminal_spawn_helper_spawn_async (VteTerminal             *terminal,
+                                   VtePtyFlags              pty_flags,
+                                   const gchar             *working_directory,
+                                   const gchar             *command,
+                                   gchar                  **argv,
+                                   gchar                  **envp,
+                                   GChildWatchFunc          exited_func,
+                                   TerminalSpawnHelperFunc  callback,
+                                   gpointer                 user_data,
+                                   GError                 **error)
+{
+  HelperPending *pending;
+  VtePty        *pty;
+
+  terminal_return_val_if_fail (VTE_IS_TERMINAL (terminal), FALSE);
+  terminal_return_val_if_fail (command != NULL && argv != NULL, FALSE);
+  terminal_return_val_if_fail (exited_func != NULL, FALSE);
+  terminal_return_val_if_fail (callback != NULL, FALSE);
+
+  if (helper_fd == -1)
+    return FALSE;
+
+  pty = vte_terminal_pty_new_sync (terminal, pty_flags, NULL, error);
+  if (G_UNLIKELY (pty == NULL))
+    return FALSE;
+
+  /* the child starts with the size of the terminal, and the terminal
+   * reads the output of the child as soon as it runs */
+  vte_pty_set_size (pty,
+                    vte_terminal_get_row_count (terminal),
+                    vte_terminal_get_column_count (terminal),
+                    NULL);
+  vte_terminal_set_pty (terminal, pty);
+
+  if (G_UNLIKELY (!terminal_spawn_helper_send (pty, working_directory, command, argv, envp)))
+    {
+      vte_terminal_set_pty (terminal, NULL);
+      g_object_unref (G_OBJECT (pty));
+      return FALSE;
+    }
+
+  g_object_unref (G_OBJECT (pty));
+
+  pending = g_slice_new0 (HelperPending);
+  pending->object = g_object_ref (G_OBJECT (terminal));
+  pending->command = g_strdup (command);
+  pending->exited_func = exited_func;
+  pending->callback = callback;
+  pending->user_data = user_data;
+  g_queue_push_tail (&helper_pending, pending);
+
+  return TRUE;
+}
+
+
+
+/**
+ * terminal_spawn_helper_spawn_pty_async:
+ * @pty               : The #VtePty for the child.
+ * @working_directory : The directory to start the child in or %NULL.
+ * @command           : The program to execute, searched in $PATH.
+ * @argv              : The argument vector, starting with argv[0].
+ * @envp              : The environment of the child.
+ * @exited_func       : Called with the wait status when the child exited.
+ * @callback          : Called when the child was started or failed to.
+ * @user_data         : User data for @exited_func and @callback.
+ *
+ * Like terminal_spawn_helper_spawn_async(), but for a child in @pty
+ * that is not attached to a terminal yet.
+ *
+ * Return value: %TRUE if @callback is going to be called, %FALSE if
+ *               the helper is not running.
+ **/
+gboolean
+terminal_spawn_helper_spawn_pty_async (VtePty                      *pty,
+                                       const gchar                 *working_directory,
+                                       const gchar                 *command,
+                                       gchar                      **argv,
+                                       gchar                      **envp,
+                                       GChildWatchFunc              exited_func,
+                                       TerminalSpawnHelperPtyFunc   callback,
+                                       gpointer                     user_data)
+{
+  HelperPending *pending;
+
+  terminal_return_val_if_fail (VTE_IS_PTY (pty), FALSE);
+  terminal_return_val_if_fail (command != NULL && argv != NULL, FALSE);
+  terminal_return_val_if_fail (exited_func != NULL, FALSE);
+  terminal_return_val_if_fail (callback != NULL, FALSE);
+
+  if (helper_fd == -1
+      || !terminal_spawn_helper_send (pty, working_directory, command, argv, envp))
+    return FALSE;
+
+  pending = g_slice_new0 (HelperPending);
+  pending->object = g_object_ref (G_OBJECT (pty));
+  pending->command = g_strdup (command);
+  pending->exited_func = exited_func;
+  pending->pty_callback = callback;
+  pending->user_data = user_data;
+  g_queue_push_tail (&helper_pending, pending);
+
+  return TRUE;
+}
+
+
+
+/**
+ * terminal_spawn_helper_watch:
+ * @child_pid : The process id of a child of the spawn helper.
+ * @func      : Called with the wait status when the child exited.
+ * @user_data : User data for @func.
+ *
+ * Reports the exit of @child_pid to @func, used by the new owner of a
+ * child after the previous owner called terminal_spawn_helper_unwatch().
+ **/
+void
+terminal_spawn_helper_watch (GPid            child_pid,
+                             GChildWatchFunc func,
+                             gpointer        user_data)
+{
+  HelperWatch *watch;
+
+  terminal_return_if_fail (helper_watches != NULL);
+  terminal_return_if_fail (func != NULL);
+
+  watch = g_slice_new (HelperWatch);
+  watch->func = func;
+  watch->user_data = user_data;
+  g_hash_table_replace (helper_watches, GINT_TO_POINTER (child_pid), watch);
+
+  /* the helper may be gone since the child was started */
+  if (helper_fd == -1 && helper_orphans_id == 0)
+    helper_orphans_id = g_timeout_add_seconds (ORPHAN_INTERVAL, terminal_spawn_helper_orphans, NULL);
+}
+
+
+
+/**
+ * terminal_spawn_helper_unwatch:
+ * @child_pid : The process id of a child of the spawn helper.
+ * @user_data : The user data of the watch.
+ *
+ * Stops reporting the exit of @child_pid, if it is watched with
+ * @user_data. Use this when the owner of the child goes away.
+ **/
+void
+terminal_spawn_helper_unwatch (GPid     child_pid,
+                               gpointer user_data)
+{
+  HelperWatch *watch;
+
+  if (helper_watches == NULL)
+    return;
+
+  watch = g_hash_table_lookup (helper_watches, GINT_TO_POINTER (child_pid));
+  if (watch != NULL && watch->user_data == user_data)
+    g_hash_table_remove (helper_watches, GINT_TO_POINTER (child_pid));
+}
@@ -0,0 +1,64 @@
+/*-
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TERMINAL_SPAWN_HELPER_H
+#define TERMINAL_SPAWN_HELPER_H
+
+#include <vte/vte.h>
+
+G_BEGIN_DECLS
+
+typedef void (*TerminalSpawnHelperFunc) (VteTerminal *terminal,
+                                         GPid         pid,
+                                         GError      *error,
+                                         gpointer     user_data);
+
+typedef void (*TerminalSpawnHelperPtyFunc) (VtePty      *pty,
+                                            GPid         pid,
+                                            GError      *error,
+                                            gpointer     user_data);
+
+gboolean terminal_spawn_helper_start           (GError                     **error);
+
+gboolean terminal_spawn_helper_spawn_async     (VteTerminal                 *terminal,
+                                                VtePtyFlags                  pty_flags,
+                                                const gchar                 *working_directory,
+                                                const gchar                 *command,
+                                                gchar                      **argv,
+                                                gchar                      **envp,
+                                                GChildWatchFunc              exited_func,
+                                                TerminalSpawnHelperFunc      callback,
+                                                gpointer                     user_data,
+                                                GError                     **error);
+
+gboolean terminal_spawn_helper_spawn_pty_async (VtePty                      *pty,
+                                                const gchar                 *working_directory,
+                                                const gchar                 *command,
+                                                gchar                      **argv,
+                                                gchar                      **envp,
+                                                GChildWatchFunc              exited_func,
+                                                TerminalSpawnHelperPtyFunc   callback,
+                                                gpointer                     user_data);
+
+void     terminal_spawn_helper_watch           (GPid                         child_pid,
+                                                GChildWatchFunc              func,
+                                                gpointer                     user_data);
+
+void     terminal_spawn_helper_unwatch         (GPid                         child_pid,
+                                                gpointer                     user_data);
+
+G_END_DECLS
+
+#endif /* !TERMINAL_SPAWN_HELPER_H */
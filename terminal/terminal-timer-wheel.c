@@ -0,0 +1,156 @@
+/*-
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <terminal/terminal-timer-wheel.h>
+#include <terminal/terminal-private.h>
+
+/* number of one second slots, must be a power of two; longer
+ * timeouts stay in their slot for more than one turn */
+#define WHEEL_N_SLOTS (64)
+
+
+
+static gboolean terminal_timer_wheel_tick (gpointer user_data);
+
+
+
+static GQueue  wheel_slots[WHEEL_N_SLOTS];
+static guint64 wheel_time = 0;
+static guint   wheel_n_entries = 0;
+static guint   wheel_source_id = 0;
+
+
+
+static gboolean
+terminal_timer_wheel_tick (gpointer user_data)
+{
+  GQueue                   *slot;
+  GQueue                    expired = G_QUEUE_INIT;
+  GList                    *lp, *lnext;
+  TerminalTimerWheelEntry  *entry;
+
+  slot = &wheel_slots[++wheel_time & (WHEEL_N_SLOTS - 1)];
+
+  /* collect the expired entries first, the callbacks may
+   * schedule or cancel other entries of this slot */
+  for (lp = slot->head; lp != NULL; lp = lnext)
+    {
+      lnext = lp->next;
+      entry = lp->data;
+      if (entry->expires <= wheel_time)
+        {
+          g_queue_unlink (slot, lp);
+          g_queue_push_tail_link (&expired, lp);
+          entry->queue = &expired;
+        }
+    }
+
+  while ((lp = g_queue_pop_head_link (&expired)) != NULL)
+    {
+      entry = lp->data;
+      entry->queue = NULL;
+      wheel_n_entries--;
+
+      entry->func (entry, entry->user_data);
+    }
+
+  /* stop ticking until the next entry is scheduled */
+  if (wheel_n_entries == 0)
+    {
+      wheel_source_id = 0;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+
+
+/**
+ * terminal_timer_wheel_schedule:
+ * @entry     : A #TerminalTimerWheelEntry.
+ * @seconds   : Seconds until @func is called.
+ * @func      : Function to call when the entry expires.
+ * @user_data : Data for @func.
+ *
+ * Schedules @entry, moving it if it was already scheduled. All
+ * entries share a single one-second timeout that only runs while
+ * entries are scheduled, so rescheduling is cheap and does not
+ * touch the main loop.
+ **/
+void
+terminal_timer_wheel_schedule (TerminalTimerWheelEntry *entry,
+                               guint                    seconds,
+                               TerminalTimerWheelFunc   func,
+                               gpointer                 user_data)
+{
+  terminal_return_if_fail (entry != NULL);
+  terminal_return_if_fail (func != NULL);
+
+  if (entry->queue != NULL)
+    terminal_timer_wheel_cancel (entry);
+
+  entry->expires = wheel_time + MAX (seconds, 1);
+  entry->func = func;
+  entry->user_data = user_data;
+  entry->link.data = entry;
+  entry->queue = &wheel_slots[entry->expires & (WHEEL_N_SLOTS - 1)];
+  g_queue_push_tail_link (entry->queue, &entry->link);
+  wheel_n_entries++;
+
+  if (wheel_source_id == 0)
+    wheel_source_id = g_timeout_add_seconds (1, terminal_timer_wheel_tick, NULL);
+}
+
+
+
+/**
+ * terminal_timer_wheel_cancel:
+ * @entry : A #TerminalTimerWheelEntry.
+ *
+ * Removes @entry from the wheel, if it was scheduled.
+ **/
+void
+terminal_timer_wheel_cancel (TerminalTimerWheelEntry *entry)
+{
+  terminal_return_if_fail (entry != NULL);
+
+  if (entry->queue == NULL)
+    return;
+
+  g_queue_unlink (entry->queue, &entry->link);
+  entry->queue = NULL;
+  wheel_n_entries--;
+}
+
+
+
+/**
+ * terminal_timer_wheel_is_scheduled:
+ * @entry : A #TerminalTimerWheelEntry.
+ *
+ * Return value: %TRUE if @entry waits to expire.
+ **/
+gboolean
+terminal_timer_wheel_is_scheduled (TerminalTimerWheelEntry *entry)
+{
+  terminal_return_val_if_fail (entry != NULL, FALSE);
+
+  return entry->queue != NULL;
+}
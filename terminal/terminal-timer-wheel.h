@@ -0,0 +1,56 @@
+/*-
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TERMINAL_TIMER_WHEEL_H
+#define TERMINAL_TIMER_WHEEL_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _TerminalTimerWheelEntry TerminalTimerWheelEntry;
+
+typedef void (*TerminalTimerWheelFunc) (TerminalTimerWheelEntry *entry,
+                                        gpointer                 user_data);
+
+/**
+ * TerminalTimerWheelEntry:
+ *
+ * A timeout on the application wide timer wheel. The entry is embedded
+ * in the structure of its owner, so scheduling does not allocate. Zero
+ * it before the first use.
+ **/
+struct _TerminalTimerWheelEntry
+{
+  /*< private >*/
+  GList                   link;
+  GQueue                 *queue;
+  guint64                 expires;
+  TerminalTimerWheelFunc  func;
+  gpointer                user_data;
+};
+
+void     terminal_timer_wheel_schedule     (TerminalTimerWheelEntry *entry,
+                                            guint                    seconds,
+                                            TerminalTimerWheelFunc   func,
+                                            gpointer                 user_data);
+
+void     terminal_timer_wheel_cancel       (TerminalTimerWheelEntry *entry);
+
+gboolean terminal_timer_wheel_is_scheduled (TerminalTimerWheelEntry *entry);
+
+G_END_DECLS
+
+#endif /* !TERMINAL_TIMER_WHEEL_H */
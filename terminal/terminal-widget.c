@@ -401,8 +401,7 @@ terminal_widget_button_press_event (GtkWidget       *widget,
   if (event->type == GDK_BUTTON_PRESS)
     {
       /* check whether to use ctrl-click or middle click to open URI */
-      g_object_get (G_OBJECT (TERMINAL_WIDGET (widget)->preferences),
-                    "misc-middle-click-opens-uri", &middle_click_opens_uri, NULL);
+      middle_click_opens_uri = terminal_preferences_get_snapshot (TERMINAL_WIDGET (widget)->preferences)->misc_middle_click_opens_uri;
 
       if (middle_click_opens_uri
             ? (event->button == 2)
@@ -610,25 +609,21 @@ static gboolean
 terminal_widget_key_press_event (GtkWidget    *widget,
                                  GdkEventKey  *event)
 {
-  GtkAdjustment *adjustment = gtk_scrollable_get_vadjustment (GTK_SCROLLABLE (widget));
-  gboolean       shortcuts_no_menukey;
-  gboolean       shift_arrows_scroll;
-  gdouble        value;
+  GtkAdjustment                     *adjustment = gtk_scrollable_get_vadjustment (GTK_SCROLLABLE (widget));
+  const TerminalPreferencesSnapshot *snapshot;
+  gdouble                            value;
 
   /* determine current settings */
-  g_object_get (G_OBJECT (TERMINAL_WIDGET (widget)->preferences),
-                "shortcuts-no-menukey", &shortcuts_no_menukey,
-                "misc-use-shift-arrows-to-scroll", &shift_arrows_scroll,
-                NULL);
+  snapshot = terminal_preferences_get_snapshot (TERMINAL_WIDGET (widget)->preferences);
 
   /* popup context menu if "Menu" or "<Shift>F10" is pressed */
   if (event->keyval == GDK_KEY_Menu ||
-      (!shortcuts_no_menukey && (event->state & GDK_SHIFT_MASK) != 0 && event->keyval == GDK_KEY_F10))
+      (!snapshot->shortcuts_no_menukey && (event->state & GDK_SHIFT_MASK) != 0 && event->keyval == GDK_KEY_F10))
     {
       terminal_widget_context_menu (TERMINAL_WIDGET (widget), 0, event->time, (GdkEvent *) event);
       return TRUE;
     }
-  else if (G_UNLIKELY (shift_arrows_scroll))
+  else if (G_UNLIKELY (snapshot->misc_use_shift_arrows_to_scroll))
     {
       /* scroll up one line with "<Shift>Up" */
       if ((event->state & GDK_SHIFT_MASK) != 0 && (event->keyval == GDK_KEY_Up || event->keyval == GDK_KEY_KP_Up))
@@ -121,6 +121,8 @@ static void         terminal_window_set_size_force_grid           (TerminalWindo
 static void         terminal_window_update_actions                (TerminalWindow         *window);
 static void         terminal_window_update_slim_tabs              (TerminalWindow         *window);
 static void         terminal_window_update_scroll_on_output       (TerminalWindow         *window);
+static void         terminal_window_search_changed                (TerminalScreen         *screen,
+                                                                   TerminalWindow         *window);
 static void         terminal_window_notebook_page_switched        (GtkNotebook            *notebook,
                                                                    GtkWidget              *page,
                                                                    guint                   page_num,
@@ -271,6 +273,8 @@ struct _TerminalWindowPrivate
 
   guint                tabs_menu_merge_id;
   GSList              *tabs_menu_actions;
+  guint                tabs_menu_freeze_count;
+  guint                tabs_menu_dirty : 1;
 
   TerminalPreferences *preferences;
   GtkWidget           *preferences_dialog;
@@ -1091,6 +1095,9 @@ terminal_window_notebook_page_switched (GtkNotebook     *notebook,
       /* set charset for menu */
       encoding = terminal_screen_get_encoding (window->priv->active);
       terminal_encoding_action_set_charset (window->priv->encoding_action, encoding);
+
+      /* show the search state of the new tab */
+      terminal_window_search_changed (active, window);
     }
 
   /* update actions in the window */
@@ -1122,6 +1129,33 @@ terminal_window_close_tab_request (TerminalScreen *screen,
 
 
 
+static void
+terminal_window_search_changed (TerminalScreen *screen,
+                                TerminalWindow *window)
+{
+  gchar *status = NULL;
+  guint  current, total;
+
+  if (screen != window->priv->active || window->priv->search_dialog == NULL)
+    return;
+
+  if (!terminal_screen_search_has_gregex (screen))
+    status = NULL;
+  else if (!terminal_screen_search_get_count (screen, &current, &total))
+    status = g_strdup (_("Counting matches..."));
+  else if (total == 0)
+    status = g_strdup (_("No matches"));
+  else if (current == 0)
+    status = g_strdup_printf (ngettext ("%u match", "%u matches", total), total);
+  else
+    status = g_strdup_printf (_("%u of %u"), current, total);
+
+  terminal_search_dialog_set_status (TERMINAL_SEARCH_DIALOG (window->priv->search_dialog), status);
+  g_free (status);
+}
+
+
+
 static void
 terminal_window_notebook_page_added (GtkNotebook    *notebook,
                                      GtkWidget      *child,
@@ -1145,6 +1179,8 @@ terminal_window_notebook_page_added (GtkNotebook    *notebook,
       G_CALLBACK (terminal_window_update_actions), window);
   g_signal_connect (G_OBJECT (screen), "close-tab-request",
       G_CALLBACK (terminal_window_close_tab_request), window);
+  g_signal_connect (G_OBJECT (screen), "search-changed",
+      G_CALLBACK (terminal_window_search_changed), window);
   g_signal_connect (G_OBJECT (screen), "drag-data-received",
       G_CALLBACK (terminal_window_notebook_drag_data_received), window);
 
@@ -1197,6 +1233,8 @@ terminal_window_notebook_page_removed (GtkNotebook    *notebook,
       terminal_window_notify_title, window);
   g_signal_handlers_disconnect_by_func (G_OBJECT (child),
       terminal_window_update_actions, window);
+  g_signal_handlers_disconnect_by_func (G_OBJECT (child),
+      terminal_window_search_changed, window);
   g_signal_handlers_disconnect_by_func (G_OBJECT (child),
       terminal_window_notebook_drag_data_received, window);
 
@@ -1562,11 +1600,12 @@ terminal_window_notify_title (TerminalScreen *screen,
 {
   gchar *title;
 
-  /* update window title */
+  /* update window title, the notify may be for the tab title only */
   if (screen == window->priv->active)
     {
       title = terminal_screen_get_title (window->priv->active);
-      gtk_window_set_title (GTK_WINDOW (window), title);
+      if (g_strcmp0 (title, gtk_window_get_title (GTK_WINDOW (window))) != 0)
+        gtk_window_set_title (GTK_WINDOW (window), title);
       g_free (title);
     }
 }
@@ -1608,7 +1647,7 @@ terminal_window_get_working_directory (TerminalWindow *window)
     return default_dir;
 
   if (G_LIKELY (window->priv->active != NULL))
-    return g_strdup (terminal_screen_get_working_directory (window->priv->active));
+    return g_strdup (terminal_screen_resolve_working_directory (window->priv->active));
 
   return NULL;
 }
@@ -1629,7 +1668,10 @@ terminal_window_action_new_tab (GtkAction      *action,
     }
 
   terminal_window_add (window, terminal);
-  terminal_screen_launch_child (terminal);
+
+  /* take over a pre-spawned shell if the pool has one */
+  if (!terminal_screen_launch_pooled_child (terminal))
+    terminal_screen_launch_child (terminal);
 }
 
 
@@ -2176,14 +2218,21 @@ terminal_window_action_search_response (GtkWidget      *dialog,
   terminal_return_if_fail (TERMINAL_IS_SCREEN (window->priv->active));
   terminal_return_if_fail (window->priv->search_dialog == dialog);
 
-  if (response_id == TERMINAL_RESPONSE_SEARCH_NEXT
-      || response_id == TERMINAL_RESPONSE_SEARCH_PREV)
+  if (response_id == TERMINAL_RESPONSE_SEARCH_HIGHLIGHT)
+    {
+      terminal_screen_search_set_highlight_all (window->priv->active,
+          terminal_search_dialog_get_highlight (TERMINAL_SEARCH_DIALOG (dialog)));
+    }
+  else if (response_id == TERMINAL_RESPONSE_SEARCH_NEXT
+           || response_id == TERMINAL_RESPONSE_SEARCH_PREV)
     {
       regex = terminal_search_dialog_get_regex (TERMINAL_SEARCH_DIALOG (dialog), &error);
       if (G_LIKELY (error == NULL))
         {
           wrap_around = terminal_search_dialog_get_wrap_around (TERMINAL_SEARCH_DIALOG (dialog));
           terminal_screen_search_set_gregex (window->priv->active, regex, wrap_around);
+          terminal_screen_search_set_highlight_all (window->priv->active,
+              terminal_search_dialog_get_highlight (TERMINAL_SEARCH_DIALOG (dialog)));
           if (regex != NULL)
             g_regex_unref (regex);
 
@@ -2261,16 +2310,41 @@ terminal_window_action_search_prev (GtkAction      *action,
 
 
 
+static void
+terminal_window_save_contents_done (GObject      *source,
+                                    GAsyncResult *result,
+                                    gpointer      user_data)
+{
+  GtkWidget *window = GTK_WIDGET (user_data);
+  GError    *error = NULL;
+
+  if (!terminal_screen_save_contents_finish (TERMINAL_SCREEN (source), result, &error))
+    {
+      /* stopped from the tab or the tab was closed */
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          xfce_dialog_show_error (gtk_widget_in_destruction (window) ? NULL : GTK_WINDOW (window),
+                                  error, _("Failed to save terminal contents"));
+        }
+      g_error_free (error);
+    }
+
+  g_object_unref (G_OBJECT (window));
+}
+
+
+
 static void
 terminal_window_action_save_contents (GtkAction      *action,
                                       TerminalWindow *window)
 {
-  GtkWidget     *dialog;
-  GFile         *file;
-  GOutputStream *stream;
-  GError        *error = NULL;
-  gchar         *filename_uri;
-  gint           response;
+  GtkWidget          *dialog;
+  GtkWidget          *hbox, *label, *combo, *check;
+  GFile              *file;
+  gchar              *filename_uri;
+  gint                response;
+  TerminalSaveFormat  format;
+  gboolean            compress;
 
   terminal_return_if_fail (window->priv->active != NULL);
 
@@ -2284,7 +2358,23 @@ terminal_window_action_save_contents (GtkAction      *action,
 
   /* save to current working directory */
   gtk_file_chooser_set_current_folder (GTK_FILE_CHOOSER (dialog),
-                                       terminal_screen_get_working_directory (TERMINAL_SCREEN (window->priv->active)));
+                                       terminal_screen_resolve_working_directory (TERMINAL_SCREEN (window->priv->active)));
+
+  /* format and compression of the file */
+  hbox = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, 12);
+  label = gtk_label_new_with_mnemonic (_("_Format:"));
+  gtk_box_pack_start (GTK_BOX (hbox), label, FALSE, FALSE, 0);
+  combo = gtk_combo_box_text_new ();
+  gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (combo), _("Plain text"));
+  gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (combo), _("Text with colors (escape sequences)"));
+  gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (combo), _("HTML"));
+  gtk_combo_box_set_active (GTK_COMBO_BOX (combo), TERMINAL_SAVE_FORMAT_TEXT);
+  gtk_label_set_mnemonic_widget (GTK_LABEL (label), combo);
+  gtk_box_pack_start (GTK_BOX (hbox), combo, FALSE, FALSE, 0);
+  check = gtk_check_button_new_with_mnemonic (_("Co_mpress with gzip"));
+  gtk_box_pack_start (GTK_BOX (hbox), check, FALSE, FALSE, 0);
+  gtk_widget_show_all (hbox);
+  gtk_file_chooser_set_extra_widget (GTK_FILE_CHOOSER (dialog), hbox);
 
   gtk_window_set_transient_for (GTK_WINDOW (dialog), GTK_WINDOW (window));
   gtk_window_set_modal (GTK_WINDOW (dialog), TRUE);
@@ -2300,24 +2390,21 @@ terminal_window_action_save_contents (GtkAction      *action,
     }
 
   filename_uri = gtk_file_chooser_get_uri (GTK_FILE_CHOOSER (dialog));
+  format = gtk_combo_box_get_active (GTK_COMBO_BOX (combo));
+  compress = gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (check));
   gtk_widget_destroy (dialog);
 
-  if (filename_uri == NULL)
-    return;
-
-  file = g_file_new_for_uri (filename_uri);
-  stream = G_OUTPUT_STREAM (g_file_replace (file, NULL, FALSE, G_FILE_CREATE_NONE, NULL, &error));
-  if (stream)
+  if (filename_uri == NULL || window->priv->active == NULL)
     {
-      terminal_screen_save_contents (TERMINAL_SCREEN (window->priv->active), stream, error);
-      g_object_unref (stream);
+      g_free (filename_uri);
+      return;
     }
 
-  if (error)
-    {
-      xfce_dialog_show_error (GTK_WINDOW (window), error, _("Failed to save terminal contents"));
-      g_error_free (error);
-    }
+  /* the tab shows the progress, errors are reported when it is done */
+  file = g_file_new_for_uri (filename_uri);
+  terminal_screen_save_contents_async (window->priv->active, file, format, compress,
+                                       terminal_window_save_contents_done,
+                                       g_object_ref (G_OBJECT (window)));
 
   g_object_unref (file);
   g_free (filename_uri);
@@ -2945,6 +3032,45 @@ terminal_window_get_toolbar_height (TerminalWindow *window)
 
 
 
+/**
+ * terminal_window_freeze_tabs_menu:
+ * @window  : A #TerminalWindow.
+ *
+ * Postpones rebuilding the "Go" menu while a batch of tabs is added,
+ * until terminal_window_thaw_tabs_menu() is called.
+ **/
+void
+terminal_window_freeze_tabs_menu (TerminalWindow *window)
+{
+  terminal_return_if_fail (TERMINAL_IS_WINDOW (window));
+
+  window->priv->tabs_menu_freeze_count++;
+}
+
+
+
+/**
+ * terminal_window_thaw_tabs_menu:
+ * @window  : A #TerminalWindow.
+ **/
+void
+terminal_window_thaw_tabs_menu (TerminalWindow *window)
+{
+  terminal_return_if_fail (TERMINAL_IS_WINDOW (window));
+  terminal_return_if_fail (window->priv->tabs_menu_freeze_count > 0);
+
+  if (--window->priv->tabs_menu_freeze_count == 0
+      && window->priv->tabs_menu_dirty)
+    {
+      terminal_window_rebuild_tabs_menu (window);
+
+      /* select the active tab in the new menu */
+      terminal_window_update_actions (window);
+    }
+}
+
+
+
 /**
  * terminal_window_rebuild_tabs_menu:
  * @window  : A #TerminalWindow.
@@ -2960,6 +3086,15 @@ terminal_window_rebuild_tabs_menu (TerminalWindow *window)
   GSList         *lp;
   GtkAccelKey     key = {0};
 
+  /* rebuild once when thawed */
+  if (window->priv->tabs_menu_freeze_count > 0)
+    {
+      window->priv->tabs_menu_dirty = TRUE;
+      return;
+    }
+
+  window->priv->tabs_menu_dirty = FALSE;
+
   if (window->priv->tabs_menu_merge_id != 0)
     {
       /* remove merge id */
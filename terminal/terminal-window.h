@@ -105,6 +105,10 @@ gint               terminal_window_get_toolbar_height       (TerminalWindow
 
 void               terminal_window_rebuild_tabs_menu        (TerminalWindow     *window);
 
+void               terminal_window_freeze_tabs_menu         (TerminalWindow     *window);
+
+void               terminal_window_thaw_tabs_menu           (TerminalWindow     *window);
+
 void               terminal_window_action_show_menubar      (GtkToggleAction    *action,
                                                              TerminalWindow     *window);
 